@@ -27,13 +27,27 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define __TURINGS_NIGHTMARE_H__
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <vector>
+
+extern "C" {
+#include "crypto/keccak.h"
+}
 
 #define HASH_SIZE 32
 
-#define MEMORY_SIZE 1024 * 1024 * 1 
+typedef std::array<char, HASH_SIZE> TN_Hash;
+
+#define MEMORY_SIZE (1024 * 1024 * 1)
 //#define MEMORY_SIZE 150
 
+#define TN_TREE_CHUNK_SIZE (64 * 1024)
+
+#define TN_LANE_COUNT 4
+#define TN_LANE_SYNC_STEPS (64 * 1024)
+
 #define MIN_CYCLES 1
 #define NRM_CYCLES 2
 #define MAX_CYCLES 4
@@ -61,8 +75,24 @@ typedef struct {
 	uint64_t register_d;
 
 	uint8_t memory[MEMORY_SIZE];
+
+	// Everything past memory is not part of the hashed state
+	uint64_t variant;
 } VM_State;
 
+// Number of leading VM_State bytes covered by the final hash
+#define VM_STATE_HASHED_SIZE offsetof(VM_State, variant)
+
+// Opt-in algorithm versions, TN_VARIANT_ORIGINAL is the default everywhere
+typedef enum {
+	TN_VARIANT_ORIGINAL = 0,
+	TN_VARIANT_AES,          // Scratchpad is an AES expansion of the keccak state of the input
+	TN_VARIANT_TREE,         // Init keccak and final hash run as trees over TN_TREE_CHUNK_SIZE chunks on several threads
+	TN_VARIANT_LANES,        // Memory is split into TN_LANE_COUNT independently executing lanes, synced every TN_LANE_SYNC_STEPS
+	TN_VARIANT_WORDS,        // Instruction set is extended with opcodes working on 64-bit words of memory
+	_TN_VARIANT_LAST
+} TN_Variant;
+
 typedef enum {
 	NOOP = 0,
 	XOR,
@@ -79,10 +109,46 @@ typedef enum {
 	REGD_XOR,
 	CYCLEADD,
 	CYCLESUB,
-	_LAST
+	_LAST,
+
+	// TN_VARIANT_WORDS extension, unaligned little endian 64-bit words wrapping around the end of memory
+	WORD_LOAD = _LAST,
+	WORD_XOR,
+	WORD_ADD,
+	WORD_ROT,
+	WORD_MUL,
+	_LAST_WORDS
 } VM_Instruction;
 
-VM_State *TN_VM_Init(const char *in, const size_t in_len);
+// Incremental TN_VM_Init for inputs of any length, fed in pieces without being held in full
+struct VM_Stream {
+	VM_State *state;
+	keccak_ctx keccak;
+	uint64_t length;
+	std::vector<uint8_t> tree; // TN_VARIANT_TREE chaining values of completed chunks
+};
+
+VM_State *TN_VM_Init(const char *in, const size_t in_len, const TN_Variant variant = TN_VARIANT_ORIGINAL);
+
+// Inputs shorter than MEMORY_SIZE give the same state as TN_VM_Init. Longer inputs (which
+// TN_VM_Init rejects) fill memory with their first MEMORY_SIZE bytes and keccak covers all of it.
+VM_Stream *TN_VM_StreamInit(const TN_Variant variant = TN_VARIANT_ORIGINAL);
+void TN_VM_StreamUpdate(VM_Stream *stream, const char *in, const size_t in_len);
+VM_State *TN_VM_StreamFinal(VM_Stream *stream);
 void TN_VM_Finalize(const VM_State *state, char *out);
 
+// Threads used for TN_VARIANT_TREE hashing, 0 (default) uses all hardware threads
+void TN_SetTreeThreads(const size_t threads);
+// Same for hashes on the calling thread only, 0 (default) follows TN_SetTreeThreads. Workers that
+// already run a hash per core set 1, so a batch doesn't start threads for every tree hash.
+void TN_SetThreadTreeThreads(const size_t threads);
+
+// States TN_VM_Finalize and TN_VM_FinalizeBatch keep for the next TN_VM_Init instead of freeing them,
+// so hashing many inputs doesn't allocate (and fault in) 1 MB for each. 0 (default) frees them.
+void TN_SetStateCache(const size_t states);
+
+// Finalizes N states at once, hashing them grouped by final hash algorithm.
+// out receives N * HASH_SIZE bytes in the order of states, each state is released.
+void TN_VM_FinalizeBatch(const size_t N, VM_State *const *states, char *out);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,20 @@
+#ifndef __TURINGS_NIGHTMARE_DEVICE_H__
+#define __TURINGS_NIGHTMARE_DEVICE_H__
+#pragma once
+
+#include "TuringsNightmare.h"
+
+// A backend that runs batches of states, what DeviceGroup splits work across
+class Device {
+public:
+	virtual ~Device() {}
+
+	virtual const char *name() = 0;
+	virtual void run(const size_t N, VM_State *states) = 0;
+
+	// Runs every state at most max_steps steps, returns whether all finished. All execution state lives in
+	// VM_State, so a state executed for a while on one device can be continued on any other.
+	virtual bool execute(const size_t N, VM_State *states, const uint64_t max_steps) = 0;
+};
+
+#endif
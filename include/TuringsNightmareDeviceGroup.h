@@ -0,0 +1,76 @@
+#ifndef __TURINGS_NIGHTMARE_DEVICE_GROUP_H__
+#define __TURINGS_NIGHTMARE_DEVICE_GROUP_H__
+#pragma once
+
+#include "TuringsNightmare.h"
+#include "TuringsNightmareDevice.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Steps a device runs its states before it can hand some of them over, about half a hash. Shorter slices
+// move stragglers sooner, longer ones cost devices that copy the states in and out (OpenCL) less.
+#define TN_DEVICE_GROUP_SLICE_STEPS (1 << 20)
+
+// Throughput of one device of a DeviceGroup, measured at every slice and kept across batches
+struct DeviceGroupStats {
+	std::string name;
+	double steps_per_second = 0;       // Moving average over the slices, what batches are split by
+	double state_steps_per_second = 0; // Same for a single state, who runs the last few states faster
+	uint64_t hashes = 0;               // States it finished
+	uint64_t steps = 0;
+	uint64_t stolen = 0;               // States it took over from slower devices
+	double seconds = 0;                // Busy time
+
+	double hashesPerSecond() const { return seconds > 0 ? hashes / seconds : 0; }
+};
+
+// Runs batches across several devices at once, e.g. the CPU and an OpenCL device. Each device gets a share of
+// the batch by its measured throughput (hashes take about the same number of steps, so steps/s split them like
+// hashes/s but can be measured at every slice). Devices run their states in slices; one that runs out of work
+// takes over the tail of a device that would finish later, e.g. the last few states of a GPU go to the CPU,
+// which runs a single state much faster.
+class DeviceGroup {
+public:
+	// The devices are not owned and have to outlive the group
+	explicit DeviceGroup(const std::vector<Device*>& devices, const uint64_t slice_steps = TN_DEVICE_GROUP_SLICE_STEPS);
+
+	DeviceGroup(const DeviceGroup&) = delete;
+	DeviceGroup& operator=(const DeviceGroup&) = delete;
+
+	const char *name() { return "Device group"; }
+	// Devices run on a thread each, the first error of any device is rethrown once all stopped
+	void run(const size_t N, VM_State *states);
+
+	std::vector<DeviceGroupStats> stats();
+
+private:
+	struct Member {
+		Device *device;
+		DeviceGroupStats stats;
+
+		// The batch being run: states [first, last) are this device's, the ends are unfinished
+		size_t first = 0, last = 0;
+		size_t unfinished = 0;
+		Member *thief = nullptr; // Idle device waiting for a tail at the end of the current slice
+		bool waiting = false;    // This device is such a thief
+	};
+
+	void worker(Member& member, VM_State *states);
+	void slice(Member& member, VM_State *states);
+	// Where member would take over part of victim's work, the number of its states to take, 0 if that doesn't pay
+	size_t stealCount(const Member& thief, const Member& victim) const;
+	void handOver(Member& victim, VM_State *states);
+	void shrink(Member& member, VM_State *states);
+
+	std::vector<Member> members;
+	const uint64_t slice_steps;
+
+	std::mutex mutex; // Guards members while a batch runs
+	std::condition_variable changed;
+	bool aborted = false;
+};
+
+#endif
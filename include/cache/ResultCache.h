@@ -0,0 +1,74 @@
+#ifndef __TURINGS_NIGHTMARE_RESULT_CACHE_H__
+#define __TURINGS_NIGHTMARE_RESULT_CACHE_H__
+#pragma once
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPUAsync.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Slots looked at for a key, an insert into a full window evicts one of them
+#define TN_CACHE_PROBE 8
+
+struct ResultCacheStats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	uint64_t evictions;
+	size_t capacity;
+};
+
+// Hash results by input, kept in an open addressing table in a memory mapped file so they
+// survive restarts. Keys are the keccak-256 of variant and input, not a weaker fast hash,
+// as crafted collisions would let a miner have a share checked against someone else's result.
+// Lookups are lock-free (entries are seqlocked), inserts are serialized. Only one process
+// can have a cache file open at a time, opening one in use by another throws.
+class ResultCache {
+public:
+	// Creates the file or reuses it if it holds a cache of the same capacity, otherwise it is reset.
+	// The file stays locked (flock on POSIX, no shared writers on Windows) while the cache is open.
+	ResultCache(const std::string& path, size_t capacity = 256 * 1024);
+	~ResultCache();
+
+	ResultCache(const ResultCache&) = delete;
+	ResultCache& operator=(const ResultCache&) = delete;
+
+	bool lookup(const char *input, const size_t size, const TN_Variant variant, TN_Hash& hash);
+	void insert(const char *input, const size_t size, const TN_Variant variant, const TN_Hash& hash);
+	bool lookup(const std::string& input, const TN_Variant variant, TN_Hash& hash) { return lookup(input.data(), input.size(), variant, hash); }
+	void insert(const std::string& input, const TN_Variant variant, const TN_Hash& hash) { insert(input.data(), input.size(), variant, hash); }
+
+	ResultCacheStats stats() const;
+
+private:
+	struct Header;
+	struct Entry;
+
+	static void key(const char *input, const size_t size, const TN_Variant variant, uint8_t *out);
+
+	void map(const std::string& path, size_t size);
+	void unmap();
+
+	Header *header = nullptr;
+	Entry *entries = nullptr;
+	size_t capacity;
+	size_t mapped_size = 0;
+	std::mutex insert_mutex;
+
+#ifdef _WIN32
+	void *file = nullptr;
+	void *mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+// Checks hashes[i] against the TN hash of inputs[i]. Inputs found in cache (may be null) are answered
+// without hashing, the others are hashed on device at the same time and their results added to cache.
+std::vector<bool> TN_VerifyBatch(DeviceCPUAsync& device, const std::vector<std::string>& inputs, const std::vector<TN_Hash>& hashes,
+	ResultCache *cache, const TN_Variant variant = TN_VARIANT_ORIGINAL);
+
+#endif
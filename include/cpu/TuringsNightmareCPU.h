@@ -3,11 +3,42 @@
 #pragma once
 
 #include "TuringsNightmare.h"
+#include "TuringsNightmareDevice.h"
 
-class DeviceCPU {
+#include <atomic>
+
+// Running hashes check their token every TN_CANCEL_CHECK_STEPS steps (a few microseconds)
+#define TN_CANCEL_CHECK_STEPS 256
+
+// Shared by all hashes of one piece of work (e.g. a block template), cancel() stops them all
+class CancelToken {
+public:
+	void cancel() { cancelled_flag.store(true, std::memory_order_relaxed); }
+	bool cancelled() const { return cancelled_flag.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<bool> cancelled_flag{ false };
+};
+
+// Runs at most max_steps steps on the calling thread and returns whether the VM finished. All execution
+// state lives in VM_State, so an unfinished state can be resumed later on any thread, or on another device.
+// TN_VARIANT_LANES keeps lane state outside VM_State and can't be executed in slices.
+bool TN_VM_Execute(VM_State *state, const uint64_t max_steps, const CancelToken *cancel = nullptr);
+
+class DeviceCPU : public Device {
 public:
-	const char *name() { return "CPU"; }
-	void run(const size_t N, VM_State *states);
+	const char *name() override { return "CPU"; }
+	void run(const size_t N, VM_State *states) override;
+
+	// TN_VM_Execute on every state, spread over the hardware threads
+	bool execute(const size_t N, VM_State *states, const uint64_t max_steps) override;
+
+	// Returns false if cancel was triggered before all states finished, the states are then only partly executed
+	bool run(const size_t N, VM_State *states, const CancelToken *cancel);
+
+	// Same result as run for one state, computed on the calling thread (TN_VARIANT_LANES lanes take turns)
+	void runSequential(VM_State *state);
+	bool runSequential(VM_State *state, const CancelToken *cancel);
 };
 
 #endif
\ No newline at end of file
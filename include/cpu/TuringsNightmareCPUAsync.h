@@ -0,0 +1,146 @@
+#ifndef __TURINGS_NIGHTMARE_CPU_ASYNC_H__
+#define __TURINGS_NIGHTMARE_CPU_ASYNC_H__
+#pragma once
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPU.h"
+#include "misc/MPMCQueue.h"
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define TN_HAVE_COROUTINES
+#endif
+#endif
+
+// States of a submitBatch are finalized together once this many finished their run, about a full
+// lane group of each final hash algorithm (see TN_VM_FinalizeBatch)
+#define TN_ASYNC_FINALIZE_GROUP 24
+
+// Init and run on the calling thread, state is set on success, returns the error instead of throwing
+std::exception_ptr TN_RunInput(DeviceCPU& cpu, const char *input, const size_t size, const TN_Variant variant, const CancelToken *cancel, VM_State *&state);
+
+// Init, run and finalize on the calling thread, returns the error instead of throwing
+std::exception_ptr TN_HashInput(DeviceCPU& cpu, const std::string& input, const TN_Variant variant, const CancelToken *cancel, TN_Hash& hash);
+std::exception_ptr TN_HashInput(DeviceCPU& cpu, const char *input, const size_t size, const TN_Variant variant, const CancelToken *cancel, TN_Hash& hash);
+
+// Calls a completion callback, anything it throws is logged and dropped instead of ending the calling worker
+void TN_Complete(const std::function<void(const TN_Hash& hash, std::exception_ptr error)>& callback, const TN_Hash& hash, std::exception_ptr error);
+
+// Hashes inputs on a pool of worker threads (init, run and finalize), every submission completes
+// on its own as soon as its hash is done. Submissions go through a lock-free queue, so submit only
+// waits when queue_size hashes are already pending.
+class DeviceCPUAsync {
+public:
+	// Called on a worker thread, error is null on success
+	typedef std::function<void(const TN_Hash& hash, std::exception_ptr error)> Callback;
+	// Same for input index of a submitBatch
+	typedef std::function<void(size_t index, const TN_Hash& hash, std::exception_ptr error)> BatchCallback;
+
+	// threads 0 uses all hardware threads, queue_size must be a power of two
+	explicit DeviceCPUAsync(size_t threads = 0, size_t queue_size = 1024);
+	// Finishes all submitted hashes before returning
+	~DeviceCPUAsync();
+
+	const char *name() { return "CPU async"; }
+
+	// Invalid inputs or variants throw right away, like TN_VM_Init. Once cancel is triggered the hash is
+	// dropped within TN_CANCEL_CHECK_STEPS steps (or before it starts) and completes with an error.
+	std::future<TN_Hash> submit(const std::string& input, const TN_Variant variant = TN_VARIANT_ORIGINAL,
+		std::shared_ptr<const CancelToken> cancel = nullptr);
+	void submit(const std::string& input, Callback callback, const TN_Variant variant = TN_VARIANT_ORIGINAL,
+		std::shared_ptr<const CancelToken> cancel = nullptr);
+	// Not copied, input has to stay valid until the callback is called
+	void submit(const char *input, const size_t size, Callback callback, const TN_Variant variant = TN_VARIANT_ORIGINAL,
+		std::shared_ptr<const CancelToken> cancel = nullptr);
+
+	// Hashes inputs like submit, every input completes on its own, but the finished states are finalized together
+	// with TN_VM_FinalizeBatch in groups of up to TN_ASYNC_FINALIZE_GROUP. If any input is invalid nothing is submitted.
+	void submitBatch(const std::vector<std::string>& inputs, BatchCallback callback, const TN_Variant variant = TN_VARIANT_ORIGINAL,
+		std::shared_ptr<const CancelToken> cancel = nullptr);
+	// Not copied, the inputs have to stay valid until their callbacks are called
+	void submitBatch(const size_t N, const char *const *inputs, const size_t *sizes, BatchCallback callback,
+		const TN_Variant variant = TN_VARIANT_ORIGINAL, std::shared_ptr<const CancelToken> cancel = nullptr);
+	// Hashes of all inputs once all are done, the first error of any is thrown by get()
+	std::future<std::vector<TN_Hash>> submitBatch(const std::vector<std::string>& inputs, const TN_Variant variant = TN_VARIANT_ORIGINAL,
+		std::shared_ptr<const CancelToken> cancel = nullptr);
+
+	size_t pending() const { return queue.size(); }
+
+#ifdef TN_HAVE_COROUTINES
+	// co_await device.awaitable(input) suspends until the hash is done, the coroutine resumes on the worker thread
+	class Awaitable {
+	public:
+		Awaitable(DeviceCPUAsync& device, const std::string& input, const TN_Variant variant, std::shared_ptr<const CancelToken> cancel)
+			: device(device), input(input), variant(variant), cancel(cancel) {}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) {
+			device.submit(input, [this, handle](const TN_Hash& hash, std::exception_ptr error) {
+				result = hash;
+				this->error = error;
+				handle.resume();
+			}, variant, cancel);
+		}
+		TN_Hash await_resume() {
+			if (error) std::rethrow_exception(error);
+			return result;
+		}
+
+	private:
+		DeviceCPUAsync& device;
+		std::string input;
+		TN_Variant variant;
+		std::shared_ptr<const CancelToken> cancel;
+		TN_Hash result;
+		std::exception_ptr error;
+	};
+
+	Awaitable awaitable(const std::string& input, const TN_Variant variant = TN_VARIANT_ORIGINAL, std::shared_ptr<const CancelToken> cancel = nullptr) {
+		return Awaitable(*this, input, variant, cancel);
+	}
+#endif
+
+private:
+	// Finished states of a submitBatch waiting to be finalized
+	struct Batch {
+		BatchCallback callback;
+		std::mutex mutex;
+		std::vector<VM_State*> states;
+		std::vector<size_t> indices;
+		size_t running; // Submitted inputs not finished yet
+	};
+
+	struct Job {
+		std::string input; // Owned copy, unused when data is set
+		const char *data;
+		size_t size;
+		TN_Variant variant;
+		Callback callback;
+		std::shared_ptr<const CancelToken> cancel;
+		std::shared_ptr<Batch> batch; // Instead of callback
+		size_t index;
+	};
+
+	void validate(const size_t size, const TN_Variant variant);
+	void push(Job& job);
+	void worker();
+	void finish(Job& job, VM_State *state, std::exception_ptr error);
+
+	MPMCQueue<Job> queue;
+	LightweightSemaphore ready;
+	std::atomic<bool> stopping;
+	std::vector<std::thread> workers;
+};
+
+#endif
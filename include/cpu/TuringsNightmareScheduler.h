@@ -0,0 +1,101 @@
+#ifndef __TURINGS_NIGHTMARE_SCHEDULER_H__
+#define __TURINGS_NIGHTMARE_SCHEDULER_H__
+#pragma once
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPUAsync.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Classes are served strictly in order, lower first
+typedef enum {
+	TN_PRIORITY_BLOCK = 0,   // Block candidates
+	TN_PRIORITY_TEMPLATE,    // New template verification
+	TN_PRIORITY_SHARE,       // Routine shares
+	_TN_PRIORITY_LAST
+} TN_Priority;
+
+struct HashSchedulerMetrics {
+	size_t depth[_TN_PRIORITY_LAST];       // Queued items
+	size_t queued_bytes;                   // Input bytes held by the queue
+	uint64_t started[_TN_PRIORITY_LAST];
+	uint64_t wait_total_us[_TN_PRIORITY_LAST];
+	uint64_t wait_max_us[_TN_PRIORITY_LAST];
+	uint64_t rejected;                     // Refused because the queue was full
+	uint64_t expired;                      // Dropped because their deadline passed while queued
+};
+
+// Hashes inputs on a pool of CPU workers in order of priority class. Within a class the sources
+// take turns one item at a time, so a flood from one source can't starve the others, and each
+// source's items run earliest deadline first. Queued items only hold their input, the 1 MB
+// VM_State is allocated when a worker starts on it.
+class HashScheduler {
+public:
+	typedef DeviceCPUAsync::Callback Callback;
+	typedef std::chrono::steady_clock Clock;
+
+	// threads 0 uses all hardware threads, max_items and max_bytes bound what the queue holds
+	HashScheduler(size_t threads = 0, size_t max_items = 4096, size_t max_bytes = 16 * 1024 * 1024);
+	// Finishes all queued items before returning
+	~HashScheduler();
+
+	const char *name() { return "CPU scheduler"; }
+
+	// Returns false (without calling callback) if the queue is full. Items still queued at their deadline,
+	// or cancelled (see DeviceCPUAsync::submit), complete with an error. Invalid inputs or variants throw like TN_VM_Init.
+	// Items past their deadline are dropped by the next submit, which calls their callbacks, or when a worker gets to them.
+	bool submit(const std::string& input, const uint64_t source, const TN_Priority priority, Callback callback,
+		const Clock::time_point deadline = Clock::time_point::max(), const TN_Variant variant = TN_VARIANT_ORIGINAL,
+		std::shared_ptr<const CancelToken> cancel = nullptr);
+
+	HashSchedulerMetrics metrics();
+
+private:
+	struct Item {
+		std::string input;
+		TN_Variant variant;
+		Clock::time_point deadline;
+		Clock::time_point enqueued;
+		uint64_t sequence;
+		Callback callback;
+		std::shared_ptr<const CancelToken> cancel;
+	};
+
+	// Earliest deadline on top, ties in submission order
+	struct LaterDeadline {
+		bool operator()(const Item& a, const Item& b) const {
+			return a.deadline != b.deadline ? a.deadline > b.deadline : a.sequence > b.sequence;
+		}
+	};
+
+	struct PriorityClass {
+		std::unordered_map<uint64_t, std::vector<Item>> sources; // Heaps by LaterDeadline
+		std::deque<uint64_t> turns; // Sources with queued items, next to be served first
+		size_t depth = 0;
+	};
+
+	bool pop(Item& item);
+	// Moves the items past their deadline to expired, called with the mutex held
+	void expire(std::vector<Item>& expired);
+	void worker();
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	PriorityClass classes[_TN_PRIORITY_LAST];
+	size_t max_items, max_bytes;
+	uint64_t sequence = 0;
+	Clock::time_point next_deadline = Clock::time_point::max(); // No queued item expires before
+	bool stopping = false;
+	HashSchedulerMetrics stats = {};
+	std::vector<std::thread> workers;
+};
+
+#endif
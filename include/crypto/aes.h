@@ -0,0 +1,38 @@
+#ifndef _AES_H_
+#define _AES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AES_BLOCK_SIZE 16
+#define AES_EXPAND_ROUNDS 10
+#define AES_EXPAND_TEXT_SIZE (8 * AES_BLOCK_SIZE)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Cryptonight style scratchpad expansion: the 256-bit key is expanded to
+ * ten AES round keys, then eight 16-byte text blocks are repeatedly put
+ * through ten AES rounds (aesenc, no final round) and written out 128
+ * bytes at a time until len bytes have been produced.
+ *
+ * key is 32 bytes, text is AES_EXPAND_TEXT_SIZE bytes.
+ */
+void aes_expand_scratchpad(const uint8_t *key, const uint8_t *text, uint8_t *out, size_t len);
+
+/* Portable implementation, the conformance reference */
+void aes_expand_scratchpad_soft(const uint8_t *key, const uint8_t *text, uint8_t *out, size_t len);
+
+/* Eight block pipelined AES-NI implementation, x86 only, see cpu_features.h */
+void aes_expand_scratchpad_aesni(const uint8_t *key, const uint8_t *text, uint8_t *out, size_t len);
+
+/* The ten round keys used by the expansion (AES-256 key schedule, first 160 bytes) */
+void aes_expand_key(const uint8_t *key, uint8_t *round_keys);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _AES_H_ */
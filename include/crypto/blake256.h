@@ -14,6 +14,10 @@ typedef struct {
   state outer;
 } hmac_state;
 
+/* Single block compression: portable reference and SSE4.1 variant (x86 only) */
+void blake256_compress(state *, const uint8_t *);
+void blake256_compress_sse41(state *, const uint8_t *);
+
 void blake256_init(state *);
 void blake224_init(state *);
 
@@ -26,6 +30,9 @@ void blake224_final(state *, uint8_t *);
 void blake256_hash(uint8_t *, const uint8_t *, uint64_t);
 void blake224_hash(uint8_t *, const uint8_t *, uint64_t);
 
+/* 8-way multi-buffer blake256_hash over messages of equal length, requires AVX2 (x86 only) */
+void blake256_hash_x8(uint8_t *const [8], const uint8_t *const [8], uint64_t);
+
 /* HMAC functions: */
 
 void hmac_blake256_init(hmac_state *, const uint8_t *, uint64_t);
@@ -0,0 +1,34 @@
+#ifndef _CPU_FEATURES_H_
+#define _CPU_FEATURES_H_
+
+/*
+ * Runtime detection of the x86 instruction set extensions used by the
+ * optional SIMD code paths. Every vectorized routine keeps its portable
+ * counterpart and is only selected when the running CPU supports it.
+ */
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TN_X86 1
+#endif
+
+/* Enables an instruction set for a single function without global compiler flags */
+#if defined(TN_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define TN_TARGET(isa)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int tn_cpu_has_ssse3(void);
+int tn_cpu_has_sse41(void);
+int tn_cpu_has_avx2(void);
+int tn_cpu_has_aesni(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CPU_FEATURES_H_ */
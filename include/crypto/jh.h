@@ -19,3 +19,6 @@ typedef unsigned long long DataLength;
 typedef enum {SUCCESS = 0, FAIL = 1, BAD_HASHLEN = 2} HashReturn;
 
 HashReturn jh_hash(int hashbitlen, const BitSequence *data, DataLength databitlen, BitSequence *hashval);
+
+/*4-way multi-buffer jh_hash over messages of equal length, requires AVX2 (x86 only)*/
+HashReturn jh_hash_x4(int hashbitlen, const BitSequence *const data[4], DataLength databitlen, BitSequence *const hashval[4]);
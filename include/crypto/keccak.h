@@ -16,11 +16,24 @@
 #endif
 
 // compute a keccak hash (md) of given byte length from "in"
-int keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen);
+int keccak(const uint8_t *in, size_t inlen, uint8_t *md, int mdlen);
 
 // update the state
 void keccakf(uint64_t st[25], int norounds);
 
-void keccak1600(const uint8_t *in, int inlen, uint8_t *md);
+void keccak1600(const uint8_t *in, size_t inlen, uint8_t *md);
+
+// incremental keccak for input that is not available in one piece
+typedef struct {
+    uint64_t st[25];
+    uint8_t buf[144];
+    size_t buflen;
+    int rsiz;
+    int mdlen;
+} keccak_ctx;
+
+void keccak_init(keccak_ctx *ctx, int mdlen);
+void keccak_update(keccak_ctx *ctx, const uint8_t *in, size_t inlen);
+void keccak_final(keccak_ctx *ctx, uint8_t *md);
 
 #endif
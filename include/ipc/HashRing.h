@@ -0,0 +1,78 @@
+#ifndef __TURINGS_NIGHTMARE_HASH_RING_H__
+#define __TURINGS_NIGHTMARE_HASH_RING_H__
+#pragma once
+
+#include "TuringsNightmare.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+// Busy wait iterations before a side of the ring sleeps on its futex (some microseconds)
+#define TN_RING_SPIN 256
+
+// Hash requests between processes through shared memory (Linux only). The ring lives in a memfd
+// of fixed size slots; a client writes its input straight into a slot, the worker process hashes
+// it in place and writes the hash back into the same slot. Any number of client threads or
+// processes may submit (MPMC like MPMCQueue, with the sequence numbers in shared memory), waiting
+// sides sleep on futexes in the mapping, so no data goes through the kernel.
+//
+// A client that dies between acquire and wait leaves its slot taken, which stalls the ring once
+// it wraps around to it. The worker never trusts the mapping beyond bounds checked input sizes:
+// its dequeue position and stop flag live in this object, not the mapping, so all worker threads
+// of a ring share one HashRing and a client scribbling over the mapping can't stop or spin them.
+class HashRing {
+public:
+	// New ring in a sealed memfd, slots is a power of two, slot_size the largest input in bytes
+	HashRing(size_t slots, size_t slot_size);
+	// Maps a ring created by another process, takes ownership of fd
+	explicit HashRing(int fd);
+	// Receives the ring memfd from a worker process (tn-ringd) listening on a "unix:/path" address
+	static std::unique_ptr<HashRing> connect(const std::string& address);
+	~HashRing();
+
+	HashRing(const HashRing&) = delete;
+	HashRing& operator=(const HashRing&) = delete;
+
+	int handle() const { return fd; }
+	size_t slots() const { return slot_count; }
+	size_t slotSize() const { return slot_size; }
+
+	// Client side. acquire claims the next slot (waiting while the ring is full) and returns a ticket,
+	// buffer points to slotSize() bytes to write the input into. submit hands it to the workers, wait
+	// copies out the hash and frees the slot. wait throws if the worker could not hash the input.
+	uint64_t acquire(char *&buffer);
+	void submit(uint64_t ticket, size_t size, const TN_Variant variant = TN_VARIANT_ORIGINAL);
+	void wait(uint64_t ticket, TN_Hash& hash);
+
+	// acquire, copy input, submit and wait
+	TN_Hash hash(const char *input, size_t size, const TN_Variant variant = TN_VARIANT_ORIGINAL);
+
+	// Worker side. take blocks until a request is ready and returns false once stop was called, input
+	// stays valid until complete. Sizes and variants come from the client and are checked by take.
+	bool take(uint64_t& ticket, const char *&input, size_t& size, TN_Variant& variant);
+	void complete(uint64_t ticket, const TN_Hash *hash); // null hash reports an error
+
+	// Wakes all workers blocked in take, they return false from then on
+	void stop();
+
+private:
+	struct Header;
+	struct Slot;
+
+	void map(size_t size);
+	Slot *slot(uint64_t ticket) const;
+
+	int fd = -1;
+	void *mapping = nullptr;
+	size_t mapped_size = 0;
+	Header *header = nullptr;
+	char *slot_base = nullptr;
+	size_t slot_count = 0, slot_size = 0, slot_stride = 0;
+
+	// Worker side only
+	std::atomic<uint64_t> dequeue_pos{ 0 };
+	std::atomic<bool> stopped{ false };
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef __MPMC_QUEUE_H__
+#define __MPMC_QUEUE_H__
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+// Bounded lock-free multi-producer multi-consumer queue (D. Vyukov's design).
+// Every cell carries a sequence number telling producers and consumers whose turn it is,
+// so each side only contends on its own position counter.
+template<typename T>
+class MPMCQueue {
+public:
+	explicit MPMCQueue(size_t capacity) : mask(capacity - 1), cells(new Cell[capacity]) {
+		if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+			throw std::runtime_error("MPMCQueue capacity must be a power of two.");
+		}
+		for (size_t i = 0; i < capacity; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	MPMCQueue(const MPMCQueue&) = delete;
+	MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+	// Returns false if the queue is full, value is left untouched then
+	bool try_push(T& value) {
+		Cell *cell;
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->value = std::move(value);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false if the queue is empty, or the oldest item is still being written
+	bool try_pop(T& value) {
+		Cell *cell;
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		value = std::move(cell->value);
+		cell->value = T();
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Approximate, only meant for metrics
+	size_t size() const {
+		size_t enqueued = enqueue_pos.load(std::memory_order_relaxed);
+		size_t dequeued = dequeue_pos.load(std::memory_order_relaxed);
+		return enqueued > dequeued ? enqueued - dequeued : 0;
+	}
+
+	size_t capacity() const { return mask + 1; }
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	// Producer and consumer positions on separate cache lines
+	alignas(64) const size_t mask;
+	const std::unique_ptr<Cell[]> cells;
+	alignas(64) std::atomic<size_t> enqueue_pos;
+	alignas(64) std::atomic<size_t> dequeue_pos;
+};
+
+// Counting semaphore that only takes the mutex when a thread actually has to sleep or be woken
+class LightweightSemaphore {
+public:
+	void post() {
+		if (count.fetch_add(1, std::memory_order_release) < 0) {
+			std::lock_guard<std::mutex> lock(mutex);
+			wakeups++;
+			cv.notify_one();
+		}
+	}
+
+	void wait() {
+		if (count.fetch_sub(1, std::memory_order_acquire) > 0) return;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return wakeups > 0; });
+		wakeups--;
+	}
+
+private:
+	std::atomic<long> count{ 0 };
+	std::mutex mutex;
+	std::condition_variable cv;
+	long wakeups = 0;
+};
+
+#endif
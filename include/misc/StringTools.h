@@ -46,6 +46,10 @@ void toHex(const void* data, size_t size, std::string& text); // Appends hex rep
 std::string toHex(const std::vector<uint8_t>& data); // Returns hex representation of 'data', does not throw
 void toHex(const std::vector<uint8_t>& data, std::string& text); // Appends hex representation of 'data' to 'text', does not throw
 
+// Buffer versions, vectorized with SSSE3/AVX2 when the CPU supports it, do not allocate
+void toHex(const void* data, size_t size, char* text); // Writes 2 * 'size' hex characters of ('data', 'size') to 'text', does not throw
+bool fromHex(const char* text, size_t size, void* data); // Writes 'size' / 2 values of hex ('text', 'size') to 'data', returns false on odd size or invalid character, does not throw
+
 template<class T>
 std::string podToHex(const T& s) {
   return toHex(&s, sizeof(s));
@@ -110,6 +114,21 @@ bool saveStringToFile(const std::string& filepath, const std::string& buf);
 
 
 std::string base64Decode(std::string const& encoded_string);
+size_t base64DecodedSize(size_t size); // Returns the largest size base64 text of 'size' characters can decode to, does not throw
+bool base64Decode(const char* text, size_t size, void* data, size_t& dataSize); // Writes values of base64 ('text', 'size') to 'data', padding optional, assigns actual data size to 'dataSize', returns false on error, does not throw
+
+// Implementations behind the buffer versions, picked once at runtime. The SSSE3 and AVX2 ones are
+// only built for x86 and must not be called unless crypto/cpu_features.h reports the extension.
+// The base64 ones take unpadded text with 'size' % 4 != 1 and write 'size' * 3 / 4 values.
+void toHexPortable(const uint8_t* data, size_t size, char* text);
+bool fromHexPortable(const char* text, size_t size, uint8_t* data);
+bool base64DecodePortable(const char* text, size_t size, uint8_t* data);
+void toHexSsse3(const uint8_t* data, size_t size, char* text);
+bool fromHexSsse3(const char* text, size_t size, uint8_t* data);
+bool base64DecodeSsse3(const char* text, size_t size, uint8_t* data);
+void toHexAvx2(const uint8_t* data, size_t size, char* text);
+bool fromHexAvx2(const char* text, size_t size, uint8_t* data);
+bool base64DecodeAvx2(const char* text, size_t size, uint8_t* data);
 
 std::string ipAddressToString(uint32_t ip);
 bool parseIpAddressAndPort(uint32_t& ip, uint32_t& port, const std::string& addr);
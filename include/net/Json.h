@@ -0,0 +1,72 @@
+#ifndef __TN_JSON_H__
+#define __TN_JSON_H__
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Minimal JSON document for the line based protocols (JSON-RPC, stratum). Objects keep their
+// member order, numbers are doubles (integers up to 2^53 round trip exactly).
+class JsonValue {
+public:
+	enum Type { NIL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+
+	typedef std::vector<JsonValue> Array;
+	typedef std::vector<std::pair<std::string, JsonValue>> Object;
+
+	JsonValue() : type(NIL) {}
+	JsonValue(bool value) : type(BOOL), boolean(value) {}
+	JsonValue(double value) : type(NUMBER), number(value) {}
+	JsonValue(int value) : type(NUMBER), number(value) {}
+	JsonValue(int64_t value) : type(NUMBER), number((double)value) {}
+	JsonValue(uint64_t value) : type(NUMBER), number((double)value) {}
+	JsonValue(const char *value) : type(STRING), string(value) {}
+	JsonValue(const std::string& value) : type(STRING), string(value) {}
+	JsonValue(const Array& value) : type(ARRAY), array(value) {}
+	JsonValue(const Object& value) : type(OBJECT), members(value) {} // Member names must be unique
+
+	static JsonValue object() { JsonValue v; v.type = OBJECT; return v; }
+	static JsonValue parse(const std::string& text); // Throws on error
+
+	std::string dump() const;
+
+	Type getType() const { return type; }
+	bool isNull() const { return type == NIL; }
+	bool isBool() const { return type == BOOL; }
+	bool isNumber() const { return type == NUMBER; }
+	bool isString() const { return type == STRING; }
+	bool isArray() const { return type == ARRAY; }
+	bool isObject() const { return type == OBJECT; }
+
+	// Accessors throw if the value has another type
+	bool asBool() const;
+	double asNumber() const;
+	uint64_t asUInt() const;
+	const std::string& asString() const;
+	const Array& asArray() const;
+	const Object& asObject() const;
+
+	// Object member or array element, a null value if missing (does not throw)
+	const JsonValue& operator[](const std::string& key) const;
+	const JsonValue& operator[](size_t index) const;
+	bool has(const std::string& key) const;
+	size_t size() const;
+
+	// Builders, the value becomes an object or array if it was null
+	JsonValue& set(const std::string& key, const JsonValue& value);
+	JsonValue& push(const JsonValue& value);
+
+private:
+	void dump(std::string& out) const;
+
+	Type type;
+	bool boolean = false;
+	double number = 0;
+	std::string string;
+	Array array;
+	Object members;
+};
+
+#endif
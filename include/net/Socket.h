@@ -0,0 +1,55 @@
+#ifndef __TN_SOCKET_H__
+#define __TN_SOCKET_H__
+#pragma once
+
+#include <string>
+
+// POSIX stream sockets for the tools. Addresses are "host:port" for TCP or "unix:/path" for Unix
+// domain sockets. All functions throw std::runtime_error on failure.
+
+#define TN_ACCEPT_EXHAUSTED -2
+#define TN_ACCEPT_BACKOFF_MS 100
+// Longest line a LineSocket receives by default, stratum and JSON-RPC messages are far shorter
+#define TN_LINE_MAX (1024 * 1024)
+
+int TN_Listen(const std::string& address, int backlog = 128);
+int TN_Connect(const std::string& address);
+// -1 if no connection is pending on a non-blocking listener, TN_ACCEPT_EXHAUSTED if the process or system
+// ran out of descriptors or buffers (errno tells which). The connection stays pending and the listener readable,
+// so callers back off for TN_ACCEPT_BACKOFF_MS instead of polling it right away.
+int TN_Accept(int listener);
+void TN_SetNonBlocking(int fd);
+void TN_CloseSocket(int fd);
+
+// Passes an open file descriptor over a connected Unix socket (SCM_RIGHTS)
+void TN_SendFd(int socket, int fd);
+int TN_ReceiveFd(int socket);
+
+// Blocking newline delimited messages over a connected socket, as used by JSON-RPC and stratum
+class LineSocket {
+public:
+	explicit LineSocket(int fd, const size_t max_line = TN_LINE_MAX) : fd(fd), max_line(max_line) {}
+	explicit LineSocket(const std::string& address, const size_t max_line = TN_LINE_MAX);
+	~LineSocket();
+
+	LineSocket(const LineSocket&) = delete;
+	LineSocket& operator=(const LineSocket&) = delete;
+
+	// Appends the newline
+	void send(const std::string& line);
+	// Returns false on orderly shutdown by the peer, throws once a line grows past max_line bytes
+	bool receive(std::string& line);
+
+	// Unblocks a receive in progress on another thread
+	void shutdown();
+
+	int handle() const { return fd; }
+
+private:
+	int fd;
+	const size_t max_line;
+	std::string buffer;
+	size_t scanned = 0; // Bytes of buffer known not to hold a newline
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __TN_STRATUM_H__
+#define __TN_STRATUM_H__
+#pragma once
+
+#include "TuringsNightmare.h"
+
+#include <cstdint>
+#include <string>
+
+// CryptoNote style stratum, shared by tn-miner and tn-mockpool. A job is a hashing blob with a
+// 4 byte little endian nonce at TN_STRATUM_NONCE_OFFSET and a target. Shares are compared on the
+// last 8 bytes of the hash read as a little endian number.
+#define TN_STRATUM_NONCE_OFFSET 39
+
+// Target hex as sent by pools, 8 characters (compact 32-bit) or 16 (full 64-bit), throws on error
+uint64_t TN_StratumTarget(const std::string& hex);
+// Compact target hex for a share difficulty
+std::string TN_StratumTargetHex(uint64_t difficulty);
+bool TN_StratumMeetsTarget(const TN_Hash& hash, uint64_t target);
+
+// Blob with nonce written at TN_STRATUM_NONCE_OFFSET, throws if the blob is too short
+std::string TN_StratumBlob(const std::string& blob, uint32_t nonce);
+std::string TN_StratumNonceHex(uint32_t nonce);
+uint32_t TN_StratumNonce(const std::string& hex); // Throws on error
+
+#endif
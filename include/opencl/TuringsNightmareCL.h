@@ -28,26 +28,123 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
 #include "TuringsNightmare.h"
+#include "TuringsNightmareDevice.h"
+
+#include <string>
+#include <vector>
 
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
 
-class DeviceCL {
+// How the kernel program was made ready by the last init
+struct DeviceCLProgramLoad {
+	bool cached = false;          // Binary came from the on-disk cache
+	double milliseconds = 0;      // Time it took now
+	double build_milliseconds = 0; // Time building it from source took, when it was cached, or now
+	std::string path;             // Cache file, empty if caching is off
+};
+
+// How runRegrouped orders the work-items between bursts
+enum TN_CLRegroup {
+	TN_CL_REGROUP_NONE = 0, // Original order, the baseline
+	TN_CL_REGROUP_OPCODE,   // Sorted by next opcode
+	TN_CL_REGROUP_CLASS     // Sorted by the class of the next opcode, e.g. all register XORs together
+};
+
+// Lane efficiency of a runRegrouped, modeled on a SIMD device running every distinct opcode of a wavefront in turn
+struct DeviceCLRegroupStats {
+	size_t width = 0;                 // Work-items per wavefront
+	std::vector<uint64_t> steps;      // VM steps run, by step of the burst
+	std::vector<uint64_t> lane_steps; // Lane steps spent on them, width per distinct opcode (or class) of a wavefront
+	double milliseconds = 0;
+
+	// Steps run per lane step spent, over the first steps_into_burst steps of the bursts, 0 for all of them
+	double efficiency(size_t steps_into_burst = 0) const;
+};
+
+// Batches are run in chunks through this many slots, each with its own command queue, device buffer
+// and pinned host buffer, so one chunk is uploaded and read back while the kernel of another runs
+#define TN_CL_SLOTS 2
+
+class DeviceCL : public Device {
 public:
+	// Uses the first available GPU, or with TN_OPENCL_DEVICE=cpu (e.g. POCL) or all, the first device of that type.
+	// The built program is cached in TN_OPENCL_CACHE (default ~/.cache/turingsnightmare, off disables it)
+	// and later loaded from there unless the device, driver, build options or kernel source changed.
 	DeviceCL();
+	~DeviceCL();
 
-	const char *name() { return "OpenCL"; }
-	void run(const size_t N, VM_State *states);
+	DeviceCL(const DeviceCL&) = delete;
+	DeviceCL& operator=(const DeviceCL&) = delete;
+
+	const char *name() override { return "OpenCL"; }
+	void run(const size_t N, VM_State *states) override;
+
+	// Runs every state at most max_steps steps, returns whether all finished. States can move between
+	// this and TN_VM_Execute on the CPU at any step.
+	bool execute(const size_t N, VM_State *states, const uint64_t max_steps) override;
+
+	// Hashes N inputs like TN_Hash, with init and finalize on the device too: only the inputs are uploaded
+	// and only the N * HASH_SIZE digests read back into out, the states never leave the device.
+	void hash(const size_t N, const char *const *inputs, const size_t *sizes, const TN_Variant variant, char *out);
+
+	// Runs the states like run(), in bursts of burst_steps steps. Before each burst the states are sorted by their
+	// next opcode or its class, finished ones last, so the work-items of a wavefront mostly take the same case. Every
+	// step's opcodes are recorded for the lane efficiency of wavefronts of width work-items (0 for the device's
+	// preferred work-group size multiple). Meant for measuring, a burst is three launches and costs a trace write per step.
+	DeviceCLRegroupStats runRegrouped(const size_t N, VM_State *states, const TN_CLRegroup regroup, const uint64_t burst_steps,
+		size_t width = 0);
+
+	// Most states one launch handles, from the device memory
+	size_t chunkCapacity() const { return capacity; }
+
+	const DeviceCLProgramLoad& programLoad() const { return program_load; }
 
 private:
+	struct Slot {
+		cl::CommandQueue queue;
+		cl::Buffer states;
+		cl::Buffer pinned;      // Host staging, mapped for as long as it lives, only made for execute
+		VM_State *host = nullptr;
+		size_t size = 0;        // States the buffers hold
+		cl::Event done;         // Readback of the chunk in flight
+		size_t first = 0;       // Chunk in flight, none if count is 0
+		size_t count = 0;
+
+		// hash: the packed inputs with the offsets of each, and the digests
+		cl::Buffer inputs;
+		cl::Buffer offsets;
+		cl::Buffer digests;
+		size_t input_bytes = 0;
+		std::vector<char> packed;        // Host side of inputs and offsets, kept until the chunk is done
+		std::vector<cl_ulong> bounds;
+	};
+
 	void init(cl::Device dev);
+	void buildProgram(const std::string& params);
+	bool loadProgram(const std::string& key, const std::string& params);
+	void saveProgram(const std::string& key);
+	// Buffers for count states, staged adds the pinned host buffer
+	void reserve(Slot& slot, size_t count, bool staged);
+	void release(Slot& slot);
+	// Waits for the chunk in flight and copies it back into states, if given
+	void collect(Slot& slot, VM_State *states);
+	// After an error, nothing may still write into host memory when the next call reuses it
+	void drain();
 
 private:
 	cl::Device device;
 	cl::Context context;
 	cl::Kernel kernel;
-	cl::CommandQueue queue;
+	cl::Kernel init_kernel;
+	cl::Kernel finalize_kernel;
+	cl::Kernel regroup_kernel;
+	cl::Kernel burst_kernel;
+	cl::Kernel lane_stats_kernel;
 	cl::Program program;
+	Slot slots[TN_CL_SLOTS];
+	size_t capacity = 1;
+	DeviceCLProgramLoad program_load;
 };
 
 #endif
\ No newline at end of file
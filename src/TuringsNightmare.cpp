@@ -25,41 +25,258 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #include "TuringsNightmare.h"
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 extern "C" {
+#include "crypto/aes.h"
+#include "crypto/cpu_features.h"
 #include "crypto/jh.h"
 #include "crypto/blake256.h"
 #include "crypto/groestl.h"
-#include "crypto/keccak.h"
 }
 
-VM_State *TN_VM_Init(const char *in, const size_t in_len) {
-	if (in_len == 0 || in_len >= MEMORY_SIZE) {
-		throw std::runtime_error("Invalid TN input size.");
+static std::atomic<size_t> tree_threads(0);
+static thread_local size_t thread_tree_threads = 0;
+
+void TN_SetTreeThreads(const size_t threads) {
+	tree_threads = threads;
+}
+
+void TN_SetThreadTreeThreads(const size_t threads) {
+	thread_tree_threads = threads;
+}
+
+// Finalized states kept for TN_VM_Alloc instead of freed, up to state_cache_size. The mutex is
+// not touched while the cache is off, so a process forking during a hash can't copy it locked.
+static std::mutex state_cache_mutex;
+static std::vector<VM_State*> state_cache;
+static std::atomic<size_t> state_cache_size{ 0 };
+
+void TN_SetStateCache(const size_t states) {
+	std::lock_guard<std::mutex> lock(state_cache_mutex);
+	state_cache_size = states;
+	for (; state_cache.size() > states; state_cache.pop_back()) delete state_cache.back();
+}
+
+static void TN_VM_Release(VM_State *state) {
+	if (state_cache_size) {
+		std::lock_guard<std::mutex> lock(state_cache_mutex);
+		if (state_cache.size() < state_cache_size) {
+			state_cache.push_back(state);
+			return;
+		}
 	}
+	delete state;
+}
+
+// Hashes the fixed size chunks of data on up to tree_threads (or the thread's own) threads, appending one HASH_SIZE chaining value per chunk
+template<typename Leaf>
+static void TN_TreeLeaves(const uint8_t *data, const size_t len, Leaf leaf, std::vector<uint8_t>& cvs) {
+	const size_t chunks = (len + TN_TREE_CHUNK_SIZE - 1) / TN_TREE_CHUNK_SIZE;
+	const size_t base = cvs.size();
+	cvs.resize(base + chunks * HASH_SIZE);
+
+	size_t threads = thread_tree_threads ? thread_tree_threads : tree_threads ? tree_threads.load() : std::thread::hardware_concurrency();
+	threads = std::max<size_t>(1, std::min(threads, chunks));
+
+	auto work = [&](size_t first) {
+		for (size_t c = first; c < chunks; c += threads) {
+			size_t offset = c * TN_TREE_CHUNK_SIZE;
+			leaf(data + offset, std::min<size_t>(TN_TREE_CHUNK_SIZE, len - offset), cvs.data() + base + c * HASH_SIZE);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (size_t t = 1; t < threads; ++t) workers.emplace_back(work, t);
+	work(0);
+	for (auto &w : workers) w.join();
+}
 
-	VM_State *state = new VM_State;
-	memset(state, 0, sizeof(VM_State) - MEMORY_SIZE);
+// Root node input is all chaining values followed by the 64-bit little endian total length
+static void TN_TreeAppendLength(std::vector<uint8_t>& cvs, const uint64_t len) {
+	for (size_t i = 0; i < sizeof(uint64_t); ++i) cvs.push_back((uint8_t)(len >> (8 * i)));
+}
+
+// The result does not depend on the number of threads
+template<typename Leaf, typename Root>
+static void TN_TreeHash(const uint8_t *data, const size_t len, Leaf leaf, Root root) {
+	std::vector<uint8_t> node;
+	TN_TreeLeaves(data, len, leaf, node);
+	TN_TreeAppendLength(node, len);
+	root(node.data(), node.size());
+}
+
+static void TN_TreeKeccakLeaf(const uint8_t *chunk, size_t len, uint8_t *cv) {
+	keccak(chunk, len, cv, HASH_SIZE);
+}
+
+// New state with everything but memory set up
+static VM_State *TN_VM_Alloc(const TN_Variant variant) {
+	if (variant >= _TN_VARIANT_LAST) {
+		throw std::runtime_error("Invalid TN variant.");
+	}
+
+	VM_State *state = nullptr;
+	if (state_cache_size) {
+		std::lock_guard<std::mutex> lock(state_cache_mutex);
+		if (!state_cache.empty()) {
+			state = state_cache.back();
+			state_cache.pop_back();
+		}
+	}
+	if (!state) state = new VM_State;
+	memset(state, 0, offsetof(VM_State, memory));
 
 	state->memory_size = MEMORY_SIZE;
 	state->step_limit_max = state->memory_size * MAX_CYCLES;
 	state->step_limit_min = state->memory_size * MIN_CYCLES;
 	state->step_limit = state->memory_size * NRM_CYCLES;
+	state->variant = variant;
+
+	return state;
+}
+
+VM_State *TN_VM_Init(const char *in, const size_t in_len, const TN_Variant variant) {
+	if (in_len == 0 || in_len >= MEMORY_SIZE) {
+		throw std::runtime_error("Invalid TN input size.");
+	}
+
+	VM_State *state = TN_VM_Alloc(variant);
+
+	if (variant == TN_VARIANT_AES) {
+		// Keccak state of the input keys the expansion, like cryptonight: key from bytes 0-31, text from 64-191
+		keccak1600((const uint8_t*)in, in_len, state->hs.b);
+		aes_expand_scratchpad(state->hs.b, state->hs.b + 64, state->memory, MEMORY_SIZE);
+		return state;
+	}
 
-	// Copy input to memory (TODO: Blow up with AES? Somehow mess with?)
+	// Copy input to memory
 	size_t blocks = MEMORY_SIZE / in_len;
 	for (size_t i = 0; i < blocks; ++i) memcpy(state->memory + i * in_len, in, in_len);
 	size_t filled = blocks * in_len;
 	if (filled < MEMORY_SIZE) memcpy(state->memory + filled, in, MEMORY_SIZE - filled);
 
+	if (variant == TN_VARIANT_TREE) {
+		TN_TreeHash(state->memory, MEMORY_SIZE, TN_TreeKeccakLeaf,
+			[state](const uint8_t *node, size_t len) { keccak1600(node, len, state->hs.b); });
+		return state;
+	}
+
 	// Keccak state (TODO: Use for blow up? Do rounds on data?)
 	keccak1600(state->memory, MEMORY_SIZE, state->hs.b);
 
 	return state;
 }
 
+VM_Stream *TN_VM_StreamInit(const TN_Variant variant) {
+	VM_Stream *stream = new VM_Stream;
+	stream->state = TN_VM_Alloc(variant);
+	stream->length = 0;
+	keccak_init(&stream->keccak, sizeof(hash_state));
+
+	return stream;
+}
+
+void TN_VM_StreamUpdate(VM_Stream *stream, const char *in, const size_t in_len) {
+	const uint8_t *data = (const uint8_t*)in;
+	size_t len = in_len;
+
+	if (stream->state->variant == TN_VARIANT_AES) {
+		// Only the keccak state depends on the input
+		keccak_update(&stream->keccak, data, len);
+		stream->length += len;
+		return;
+	}
+
+	// Memory holds the first MEMORY_SIZE bytes, once full it is absorbed and the rest goes straight to keccak
+	if (stream->length < MEMORY_SIZE) {
+		size_t fill = MEMORY_SIZE - stream->length < len ? MEMORY_SIZE - (size_t)stream->length : len;
+		memcpy(stream->state->memory + stream->length, data, fill);
+		stream->length += fill;
+		data += fill;
+		len -= fill;
+
+		if (stream->length < MEMORY_SIZE) return;
+
+		if (stream->state->variant == TN_VARIANT_TREE) {
+			// Whole chunks of memory become leaves at once, the remainder starts the next leaf
+			const size_t whole = MEMORY_SIZE / TN_TREE_CHUNK_SIZE * TN_TREE_CHUNK_SIZE;
+			TN_TreeLeaves(stream->state->memory, whole, TN_TreeKeccakLeaf, stream->tree);
+			keccak_init(&stream->keccak, HASH_SIZE);
+			keccak_update(&stream->keccak, stream->state->memory + whole, MEMORY_SIZE - whole);
+		} else {
+			keccak_update(&stream->keccak, stream->state->memory, MEMORY_SIZE);
+		}
+	}
+
+	if (stream->state->variant == TN_VARIANT_TREE) {
+		while (len > 0) {
+			size_t fill = std::min<size_t>(len, TN_TREE_CHUNK_SIZE - stream->length % TN_TREE_CHUNK_SIZE);
+			keccak_update(&stream->keccak, data, fill);
+			stream->length += fill;
+			data += fill;
+			len -= fill;
+
+			if (stream->length % TN_TREE_CHUNK_SIZE == 0) {
+				stream->tree.resize(stream->tree.size() + HASH_SIZE);
+				keccak_final(&stream->keccak, stream->tree.data() + stream->tree.size() - HASH_SIZE);
+				keccak_init(&stream->keccak, HASH_SIZE);
+			}
+		}
+		return;
+	}
+
+	keccak_update(&stream->keccak, data, len);
+	stream->length += len;
+}
+
+VM_State *TN_VM_StreamFinal(VM_Stream *stream) {
+	VM_State *state = stream->state;
+	uint64_t length = stream->length;
+
+	if (length == 0) {
+		delete state;
+		delete stream;
+		throw std::runtime_error("Invalid TN input size.");
+	}
+
+	if (state->variant == TN_VARIANT_AES) {
+		keccak_final(&stream->keccak, state->hs.b);
+		aes_expand_scratchpad(state->hs.b, state->hs.b + 64, state->memory, MEMORY_SIZE);
+	} else if (length < MEMORY_SIZE) {
+		// Short input, repeat it in place exactly like TN_VM_Init
+		size_t in_len = (size_t)length;
+		for (size_t filled = in_len; filled < MEMORY_SIZE; filled += in_len) {
+			memcpy(state->memory + filled, state->memory, in_len < MEMORY_SIZE - filled ? in_len : MEMORY_SIZE - filled);
+		}
+
+		if (state->variant == TN_VARIANT_TREE) {
+			TN_TreeHash(state->memory, MEMORY_SIZE, TN_TreeKeccakLeaf,
+				[state](const uint8_t *node, size_t len) { keccak1600(node, len, state->hs.b); });
+		} else {
+			keccak1600(state->memory, MEMORY_SIZE, state->hs.b);
+		}
+	} else if (state->variant == TN_VARIANT_TREE) {
+		if (length % TN_TREE_CHUNK_SIZE) {
+			stream->tree.resize(stream->tree.size() + HASH_SIZE);
+			keccak_final(&stream->keccak, stream->tree.data() + stream->tree.size() - HASH_SIZE);
+		}
+		TN_TreeAppendLength(stream->tree, length);
+		keccak1600(stream->tree.data(), stream->tree.size(), state->hs.b);
+	} else {
+		keccak_final(&stream->keccak, state->hs.b);
+	}
+
+	delete stream;
+	return state;
+}
+
 template<typename T>
 inline T TN_GetEntangledType(const VM_State& state) {
 	return (T)(state.step_counter ^ state.register_a ^ state.register_b ^ state.register_c ^ state.register_d ^ state.hs.w[state.step_counter % 25] ^ state.hs.b[state.step_counter % 200] ^ state.step_limit ^ state.input_size);
@@ -67,23 +284,97 @@ inline T TN_GetEntangledType(const VM_State& state) {
 
 #define ENTANGLED_UINT8 TN_GetEntangledType<uint8_t>(state)
 
-inline void TN_FinalHash(const VM_State& state, const uint8_t* data, const size_t data_len, uint8_t* out) {
-	switch (ENTANGLED_UINT8 % 3) {
-	case 0:
+typedef enum {
+	FINAL_JH = 0,
+	FINAL_BLAKE,
+	FINAL_GROESTL,
+	_FINAL_LAST
+} TN_FinalAlgorithm;
+
+inline TN_FinalAlgorithm TN_GetFinalAlgorithm(const VM_State& state) {
+	return (TN_FinalAlgorithm)(ENTANGLED_UINT8 % _FINAL_LAST);
+}
+
+inline void TN_FinalHash(const TN_FinalAlgorithm algorithm, const uint8_t* data, const size_t data_len, uint8_t* out) {
+	switch (algorithm) {
+	case FINAL_JH:
 		jh_hash(HASH_SIZE * 8, data, 8 * data_len, (uint8_t*)out);
 		break;
-	case 1:
+	case FINAL_BLAKE:
 		blake256_hash((uint8_t*)out, data, data_len);
 		break;
-	case 2:
+	case FINAL_GROESTL:
 		groestl(data, (data_len * 8), (uint8_t*)out);
 		break;
+	default:
+		throw std::runtime_error("Invalid final hash algorithm.");
+	}
+}
+
+// Hash serialized state for end result
+static void TN_VM_Hash(const VM_State& state, uint8_t *out) {
+	const TN_FinalAlgorithm algorithm = TN_GetFinalAlgorithm(state);
+
+	if (state.variant == TN_VARIANT_TREE) {
+		auto hash = [algorithm](const uint8_t *data, size_t len, uint8_t *digest) { TN_FinalHash(algorithm, data, len, digest); };
+		TN_TreeHash((const uint8_t*)&state, VM_STATE_HASHED_SIZE, hash, [&](const uint8_t *node, size_t len) { hash(node, len, out); });
+		return;
 	}
+
+	TN_FinalHash(algorithm, (const uint8_t*)&state, VM_STATE_HASHED_SIZE, out);
 }
 
 void TN_VM_Finalize(const VM_State *state, char *out) {
-	// Hash serialized state for end result
-	TN_FinalHash(*state, (uint8_t*)state, sizeof(VM_State), (uint8_t*)out);
+	TN_VM_Hash(*state, (uint8_t*)out);
 
-	delete state;
-}
\ No newline at end of file
+	TN_VM_Release((VM_State*)state);
+}
+
+void TN_VM_FinalizeBatch(const size_t N, VM_State *const *states, char *out) {
+	std::vector<size_t> buckets[_FINAL_LAST];
+	for (size_t i = 0; i < N; ++i) {
+		// Tree hashing is already parallel within the state
+		if (states[i]->variant == TN_VARIANT_TREE) TN_VM_Hash(*states[i], (uint8_t*)out + i * HASH_SIZE);
+		else buckets[TN_GetFinalAlgorithm(*states[i])].push_back(i);
+	}
+
+	// Serialized states all have the same length, so each bucket can be hashed in lanes
+	size_t lanes[_FINAL_LAST] = { 0 };
+#ifdef TN_X86
+	if (tn_cpu_has_avx2()) {
+		const std::vector<size_t>& jh = buckets[FINAL_JH];
+		for (; lanes[FINAL_JH] + 4 <= jh.size(); lanes[FINAL_JH] += 4) {
+			const uint8_t *data[4];
+			uint8_t *hash[4];
+			for (size_t k = 0; k < 4; ++k) {
+				size_t i = jh[lanes[FINAL_JH] + k];
+				data[k] = (const uint8_t*)states[i];
+				hash[k] = (uint8_t*)out + i * HASH_SIZE;
+			}
+			jh_hash_x4(HASH_SIZE * 8, data, 8 * VM_STATE_HASHED_SIZE, hash);
+		}
+
+		const std::vector<size_t>& blake = buckets[FINAL_BLAKE];
+		for (; lanes[FINAL_BLAKE] + 8 <= blake.size(); lanes[FINAL_BLAKE] += 8) {
+			const uint8_t *data[8];
+			uint8_t *hash[8];
+			for (size_t k = 0; k < 8; ++k) {
+				size_t i = blake[lanes[FINAL_BLAKE] + k];
+				data[k] = (const uint8_t*)states[i];
+				hash[k] = (uint8_t*)out + i * HASH_SIZE;
+			}
+			blake256_hash_x8(hash, data, VM_STATE_HASHED_SIZE);
+		}
+	}
+#endif
+
+	// Leftovers (and Groestl) one at a time
+	for (size_t a = 0; a < _FINAL_LAST; ++a) {
+		for (size_t k = lanes[a]; k < buckets[a].size(); ++k) {
+			size_t i = buckets[a][k];
+			TN_VM_Hash(*states[i], (uint8_t*)out + i * HASH_SIZE);
+		}
+	}
+
+	for (size_t i = 0; i < N; ++i) TN_VM_Release(states[i]);
+}
@@ -0,0 +1,210 @@
+#include "TuringsNightmareDeviceGroup.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+// Weight of the latest slice in the moving averages
+static const double TN_GROUP_RATE_WEIGHT = 0.5;
+// Taking over states waits for the victim's slice to end and may copy them around, so it has to gain this much
+static const double TN_GROUP_STEAL_GAIN = 0.9;
+
+static bool TN_Finished(const VM_State& state) {
+	return state.step_counter > state.step_limit;
+}
+
+static bool TN_Measured(const DeviceGroupStats& stats) {
+	return stats.steps_per_second > 0 && stats.state_steps_per_second > 0;
+}
+
+// Time count states take on a device, per step each has left: a state can't run faster than state_rate,
+// and once the device runs more than it does in parallel they share its throughput
+static double TN_FinishTime(const DeviceGroupStats& stats, const DeviceGroupStats& fallback, size_t count) {
+	if (count == 0) return 0;
+	const DeviceGroupStats& s = TN_Measured(stats) ? stats : fallback;
+	if (!TN_Measured(s)) return (double)count;
+	return std::max(count / s.steps_per_second, 1 / s.state_steps_per_second);
+}
+
+DeviceGroup::DeviceGroup(const std::vector<Device*>& devices, const uint64_t slice_steps) : slice_steps(slice_steps) {
+	if (devices.empty()) throw std::runtime_error("A device group needs at least one device.");
+	if (slice_steps == 0) throw std::runtime_error("Device group slices need at least one step.");
+	for (auto device : devices) {
+		Member member;
+		member.device = device;
+		member.stats.name = device->name();
+		members.push_back(member);
+	}
+}
+
+void DeviceGroup::run(const size_t N, VM_State *states) {
+	for (size_t i = 0; i < N; ++i) {
+		if (states[i].variant == TN_VARIANT_LANES) throw std::runtime_error("TN_VARIANT_LANES can't be executed in slices.");
+	}
+
+	// Until every device was measured they get the same share, then each next state goes where it finishes first.
+	// Every device gets at least one state when there are enough, so its rate stays current; if that was a bad
+	// place for it, it's taken over after a slice.
+	std::vector<size_t> counts(members.size(), 0);
+	bool measured = true;
+	for (auto &m : members) measured &= TN_Measured(m.stats);
+	for (size_t i = 0; i < N; ++i) {
+		size_t best = i % members.size();
+		if (measured && (i >= members.size() || N < members.size())) {
+			for (size_t d = 0; d < members.size(); ++d) {
+				if (TN_FinishTime(members[d].stats, members[d].stats, counts[d] + 1) < TN_FinishTime(members[best].stats, members[best].stats, counts[best] + 1)) best = d;
+			}
+		}
+		counts[best]++;
+	}
+
+	size_t first = 0;
+	for (size_t d = 0; d < members.size(); ++d) {
+		Member& m = members[d];
+		m.first = first;
+		m.last = first += counts[d];
+		m.unfinished = 0;
+		for (size_t i = m.first; i < m.last; ++i) m.unfinished += !TN_Finished(states[i]);
+		m.thief = nullptr;
+		m.waiting = false;
+		shrink(m, states);
+	}
+	aborted = false;
+
+	std::exception_ptr error;
+	std::vector<std::thread> threads;
+	for (auto &m : members) {
+		threads.emplace_back([&](Member *member) {
+			try {
+				worker(*member, states);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error) error = std::current_exception();
+				aborted = true;
+				changed.notify_all();
+			}
+		}, &m);
+	}
+	for (auto &t : threads) t.join();
+
+	if (error) std::rethrow_exception(error);
+}
+
+void DeviceGroup::worker(Member& member, VM_State *states) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!aborted) {
+		if (member.first < member.last) {
+			// Only this thread changes its own range while it has one, thieves wait for the end of the slice
+			lock.unlock();
+			slice(member, states);
+			lock.lock();
+			if (member.thief) handOver(member, states);
+			changed.notify_all();
+			continue;
+		}
+
+		// Out of work, take over part of the device that would finish last
+		Member *victim = nullptr;
+		bool busy = false;
+		for (auto &m : members) {
+			if (&m == &member || m.first == m.last) continue;
+			busy = true;
+			if (m.thief) continue;
+			if (stealCount(member, m) && (!victim ||
+				TN_FinishTime(m.stats, member.stats, m.unfinished) > TN_FinishTime(victim->stats, member.stats, victim->unfinished))) {
+				victim = &m;
+			}
+		}
+		if (!busy) break;
+		if (!victim) {
+			changed.wait(lock);
+			continue;
+		}
+
+		victim->thief = &member;
+		member.waiting = true;
+		changed.wait(lock, [&] { return !member.waiting || aborted; });
+	}
+	changed.notify_all();
+}
+
+void DeviceGroup::slice(Member& member, VM_State *states) {
+	size_t first = member.first, last = member.last;
+	uint64_t before = 0, after = 0;
+	for (size_t i = first; i < last; ++i) before += states[i].step_counter;
+
+	auto start = std::chrono::steady_clock::now();
+	member.device->execute(last - first, states + first, slice_steps);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t unfinished = 0;
+	for (size_t i = first; i < last; ++i) {
+		after += states[i].step_counter;
+		unfinished += !TN_Finished(states[i]);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	DeviceGroupStats& s = member.stats;
+	s.hashes += member.unfinished - unfinished;
+	s.steps += after - before;
+	s.seconds += seconds;
+	if (seconds > 0 && after > before) {
+		double rate = (after - before) / seconds, state_rate = rate / member.unfinished;
+		s.steps_per_second = s.steps_per_second > 0 ? s.steps_per_second + TN_GROUP_RATE_WEIGHT * (rate - s.steps_per_second) : rate;
+		s.state_steps_per_second = s.state_steps_per_second > 0 ?
+			s.state_steps_per_second + TN_GROUP_RATE_WEIGHT * (state_rate - s.state_steps_per_second) : state_rate;
+	}
+	member.unfinished = unfinished;
+	shrink(member, states);
+}
+
+size_t DeviceGroup::stealCount(const Member& thief, const Member& victim) const {
+	// Unmeasured devices are taken to be like the other one
+	const DeviceGroupStats& t = TN_Measured(thief.stats) ? thief.stats : victim.stats;
+	const DeviceGroupStats& v = TN_Measured(victim.stats) ? victim.stats : t;
+
+	double alone = TN_FinishTime(v, t, victim.unfinished), best = alone;
+	size_t count = 0;
+	for (size_t k = 1; k <= victim.unfinished; ++k) {
+		double time = std::max(TN_FinishTime(v, t, victim.unfinished - k), TN_FinishTime(t, v, k));
+		if (time < best) {
+			best = time;
+			count = k;
+		}
+	}
+	return best < TN_GROUP_STEAL_GAIN * alone ? count : 0;
+}
+
+void DeviceGroup::handOver(Member& victim, VM_State *states) {
+	Member& thief = *victim.thief;
+	victim.thief = nullptr;
+
+	// Decided again on what the slice just measured, the last unfinished states go
+	size_t count = stealCount(thief, victim);
+	thief.first = thief.last = victim.last;
+	if (count) {
+		size_t split = victim.last;
+		for (size_t taken = 0; taken < count;) taken += !TN_Finished(states[--split]);
+		thief.first = split;
+		thief.unfinished = count;
+		thief.stats.stolen += count;
+		victim.last = split;
+		victim.unfinished -= count;
+		shrink(victim, states);
+	}
+	thief.waiting = false;
+}
+
+void DeviceGroup::shrink(Member& member, VM_State *states) {
+	while (member.first < member.last && TN_Finished(states[member.first])) member.first++;
+	while (member.last > member.first && TN_Finished(states[member.last - 1])) member.last--;
+}
+
+std::vector<DeviceGroupStats> DeviceGroup::stats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<DeviceGroupStats> result;
+	for (auto &m : members) result.push_back(m.stats);
+	return result;
+}
@@ -0,0 +1,278 @@
+#include "cache/ResultCache.h"
+
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define TN_CACHE_MAGIC 0x45484341434e5400ULL // "\0TNCACHE"
+#define TN_CACHE_FORMAT 1
+#define TN_CACHE_KEY_WORDS 4
+#define TN_CACHE_WORDS (TN_CACHE_KEY_WORDS + HASH_SIZE / 8)
+
+struct ResultCache::Header {
+	uint64_t magic;
+	uint64_t format;
+	uint64_t capacity;
+	std::atomic<uint64_t> hand;
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> inserts;
+	std::atomic<uint64_t> evictions;
+};
+
+// Key and hash are stored as relaxed atomic words so racing reads are well defined, version tells
+// whether they belong together: 0 is an empty slot, odd means a write is in progress
+struct ResultCache::Entry {
+	std::atomic<uint64_t> version;
+	std::atomic<uint64_t> referenced;
+	std::atomic<uint64_t> words[TN_CACHE_WORDS];
+};
+
+ResultCache::ResultCache(const std::string& path, size_t capacity) : capacity(capacity) {
+	if (capacity < TN_CACHE_PROBE) {
+		throw std::runtime_error("Result cache capacity too small.");
+	}
+
+	map(path, sizeof(Header) + capacity * sizeof(Entry));
+	entries = (Entry*)(header + 1);
+
+	if (header->magic != TN_CACHE_MAGIC || header->format != TN_CACHE_FORMAT || header->capacity != capacity) {
+		memset((void*)header, 0, mapped_size);
+		header->format = TN_CACHE_FORMAT;
+		header->capacity = capacity;
+		header->magic = TN_CACHE_MAGIC;
+	}
+
+	// Entries left half written by a previous process are dropped
+	for (size_t i = 0; i < capacity; ++i) {
+		if (entries[i].version.load(std::memory_order_relaxed) & 1) entries[i].version.store(0, std::memory_order_relaxed);
+	}
+}
+
+ResultCache::~ResultCache() {
+	unmap();
+}
+
+#ifdef _WIN32
+
+void ResultCache::map(const std::string& path, size_t size) {
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		file = nullptr;
+		throw std::runtime_error("Could not open result cache file.");
+	}
+
+	LARGE_INTEGER current, wanted;
+	wanted.QuadPart = (LONGLONG)size;
+	if (!GetFileSizeEx(file, &current) || current.QuadPart != wanted.QuadPart) {
+		if (!SetFilePointerEx(file, wanted, NULL, FILE_BEGIN) || !SetEndOfFile(file)) {
+			unmap();
+			throw std::runtime_error("Could not size result cache file.");
+		}
+	}
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(wanted.QuadPart >> 32), (DWORD)wanted.QuadPart, NULL);
+	if (!mapping) {
+		unmap();
+		throw std::runtime_error("Could not map result cache file.");
+	}
+
+	header = (Header*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!header) {
+		unmap();
+		throw std::runtime_error("Could not map result cache file.");
+	}
+	mapped_size = size;
+}
+
+void ResultCache::unmap() {
+	if (header) UnmapViewOfFile(header);
+	if (mapping) CloseHandle(mapping);
+	if (file) CloseHandle(file);
+	header = nullptr;
+	mapping = file = nullptr;
+}
+
+#else
+
+void ResultCache::map(const std::string& path, size_t size) {
+	fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		throw std::runtime_error("Could not open result cache file.");
+	}
+	// Held until the file is closed, a second process would tear entries the first is writing
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		int error = errno;
+		unmap();
+		throw std::runtime_error(error == EWOULDBLOCK ? "Result cache file " + path + " is in use by another process." :
+			"Could not lock result cache file.");
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+		// Truncating first zero fills the whole file
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+			unmap();
+			throw std::runtime_error("Could not size result cache file.");
+		}
+	}
+
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		unmap();
+		throw std::runtime_error("Could not map result cache file.");
+	}
+	header = (Header*)p;
+	mapped_size = size;
+}
+
+void ResultCache::unmap() {
+	if (header) munmap(header, mapped_size);
+	if (fd >= 0) close(fd);
+	header = nullptr;
+	fd = -1;
+}
+
+#endif
+
+void ResultCache::key(const char *input, const size_t size, const TN_Variant variant, uint8_t *out) {
+	keccak_ctx ctx;
+	uint64_t v = variant;
+	keccak_init(&ctx, TN_CACHE_KEY_WORDS * 8);
+	keccak_update(&ctx, (const uint8_t*)&v, sizeof(v));
+	keccak_update(&ctx, (const uint8_t*)input, size);
+	keccak_final(&ctx, out);
+}
+
+bool ResultCache::lookup(const char *input, const size_t size, const TN_Variant variant, TN_Hash& hash) {
+	uint64_t k[TN_CACHE_KEY_WORDS];
+	key(input, size, variant, (uint8_t*)k);
+
+	for (size_t p = 0; p < TN_CACHE_PROBE; ++p) {
+		Entry& e = entries[(k[0] + p) % capacity];
+		uint64_t words[TN_CACHE_WORDS];
+		uint64_t version;
+
+		do {
+			version = e.version.load(std::memory_order_acquire);
+			for (size_t i = 0; i < TN_CACHE_WORDS; ++i) words[i] = e.words[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+		} while (version & 1 || e.version.load(std::memory_order_relaxed) != version);
+
+		if (version == 0 || memcmp(words, k, sizeof(k)) != 0) continue;
+
+		memcpy(hash.data(), words + TN_CACHE_KEY_WORDS, HASH_SIZE);
+		if (!e.referenced.load(std::memory_order_relaxed)) e.referenced.store(1, std::memory_order_relaxed);
+		header->hits.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	header->misses.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+void ResultCache::insert(const char *input, const size_t size, const TN_Variant variant, const TN_Hash& hash) {
+	uint64_t words[TN_CACHE_WORDS];
+	key(input, size, variant, (uint8_t*)words);
+	memcpy(words + TN_CACHE_KEY_WORDS, hash.data(), HASH_SIZE);
+
+	std::lock_guard<std::mutex> lock(insert_mutex);
+
+	// Existing entry for the key, else the first empty slot in the window
+	Entry *slot = nullptr;
+	for (size_t p = 0; p < TN_CACHE_PROBE; ++p) {
+		Entry& e = entries[(words[0] + p) % capacity];
+		uint64_t version = e.version.load(std::memory_order_relaxed);
+		if (version == 0) {
+			if (!slot) slot = &e;
+			continue;
+		}
+		bool same = true;
+		for (size_t i = 0; i < TN_CACHE_KEY_WORDS; ++i) same &= e.words[i].load(std::memory_order_relaxed) == words[i];
+		if (same) {
+			slot = &e;
+			break;
+		}
+	}
+
+	// Window full: clock sweep, recently hit entries get a second chance
+	if (!slot) {
+		for (uint64_t hand = header->hand.fetch_add(1, std::memory_order_relaxed); ; ++hand) {
+			Entry& e = entries[(words[0] + hand % TN_CACHE_PROBE) % capacity];
+			if (e.referenced.load(std::memory_order_relaxed)) {
+				e.referenced.store(0, std::memory_order_relaxed);
+			} else {
+				slot = &e;
+				break;
+			}
+		}
+		header->evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint64_t version = slot->version.load(std::memory_order_relaxed);
+	slot->version.store(version + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for (size_t i = 0; i < TN_CACHE_WORDS; ++i) slot->words[i].store(words[i], std::memory_order_relaxed);
+	slot->referenced.store(0, std::memory_order_relaxed);
+	slot->version.store(version + 2, std::memory_order_release);
+
+	header->inserts.fetch_add(1, std::memory_order_relaxed);
+}
+
+ResultCacheStats ResultCache::stats() const {
+	ResultCacheStats s;
+	s.hits = header->hits.load(std::memory_order_relaxed);
+	s.misses = header->misses.load(std::memory_order_relaxed);
+	s.inserts = header->inserts.load(std::memory_order_relaxed);
+	s.evictions = header->evictions.load(std::memory_order_relaxed);
+	s.capacity = capacity;
+	return s;
+}
+
+std::vector<bool> TN_VerifyBatch(DeviceCPUAsync& device, const std::vector<std::string>& inputs, const std::vector<TN_Hash>& hashes,
+	ResultCache *cache, const TN_Variant variant) {
+	if (inputs.size() != hashes.size()) {
+		throw std::runtime_error("TN_VerifyBatch needs one hash per input.");
+	}
+
+	std::vector<bool> valid(inputs.size());
+	std::vector<TN_Hash> results(inputs.size());
+	std::unordered_map<std::string, size_t> first; // Duplicates within the batch are hashed once
+	std::vector<size_t> source(inputs.size());
+	std::vector<size_t> missed; // Hashed, finalized together
+	std::vector<std::string> missedInputs;
+
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		source[i] = i;
+		if (cache && cache->lookup(inputs[i], variant, results[i])) continue;
+
+		auto seen = first.emplace(inputs[i], i);
+		if (seen.second) {
+			missed.push_back(i);
+			missedInputs.push_back(inputs[i]);
+		} else {
+			source[i] = seen.first->second;
+		}
+	}
+
+	std::vector<TN_Hash> hashed = device.submitBatch(missedInputs, variant).get();
+	for (size_t k = 0; k < missed.size(); ++k) {
+		results[missed[k]] = hashed[k];
+		if (cache) cache->insert(inputs[missed[k]], variant, hashed[k]);
+	}
+
+	for (size_t i = 0; i < inputs.size(); ++i) valid[i] = results[source[i]] == hashes[i];
+	return valid;
+}
@@ -1,13 +1,40 @@
 #include "cpu/TuringsNightmareCPU.h"
 
 // TODO: cleanup utility dependencies
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <stdexcept>
 #include <vector>
 #include <thread>
 
-template<typename T>
-inline T TN_GetEntangledType(const VM_State& state) {
+// Execution state of one TN_VARIANT_LANES lane, a VM over its own slice of memory.
+// Instructions are templates so they run on this and VM_State alike.
+struct VM_Lane {
+	uint64_t instruction_ptr;
+	uint64_t step_counter;
+	uint64_t step_limit;
+
+	uint64_t step_limit_max;
+	uint64_t step_limit_min;
+
+	uint64_t input_size;
+	uint64_t memory_size;
+	hash_state hs;
+
+	uint64_t register_a;
+	uint64_t register_b;
+	uint64_t register_c;
+	uint64_t register_d;
+
+	uint8_t *memory;
+};
+
+template<typename T, typename State>
+inline T TN_GetEntangledType(const State& state) {
 	return (T)(state.step_counter ^ state.register_a ^ state.register_b ^ state.register_c ^ state.register_d ^ state.hs.w[state.step_counter % 25] ^ state.hs.b[state.step_counter % 200] ^ state.step_limit ^ state.input_size);
 }
 
@@ -15,7 +42,8 @@ inline T TN_GetEntangledType(const VM_State& state) {
 #define ENTANGLED_UINT32 TN_GetEntangledType<uint32_t>(state)
 #define ENTANGLED_UINT64 TN_GetEntangledType<uint64_t>(state)
 
-inline uint8_t& TN_AtRelPos(VM_State& state, int position) {
+template<typename State>
+inline uint8_t& TN_AtRelPos(State& state, int position) {
 	size_t pos = state.instruction_ptr + position;
 	if (pos >= state.memory_size) pos %= state.memory_size;
 	return state.memory[pos];
@@ -23,7 +51,38 @@ inline uint8_t& TN_AtRelPos(VM_State& state, int position) {
 
 #define MEM(relpos) TN_AtRelPos(state, relpos)
 
-inline void TN_AdjustCycleLimit(VM_State& state, int change) {
+// Words are little endian like the rest of the hashing code, the memcpy path assumes a little endian host
+template<typename State>
+inline uint64_t TN_LoadWord(const State& state, int position) {
+	size_t pos = (state.instruction_ptr + position) % state.memory_size;
+	uint64_t word = 0;
+	if (pos + 8 <= state.memory_size) {
+		memcpy(&word, state.memory + pos, 8);
+	} else {
+		for (size_t i = 0; i < 8; ++i) word |= (uint64_t)state.memory[(pos + i) % state.memory_size] << (8 * i);
+	}
+	return word;
+}
+
+template<typename State>
+inline void TN_StoreWord(State& state, int position, uint64_t word) {
+	size_t pos = (state.instruction_ptr + position) % state.memory_size;
+	if (pos + 8 <= state.memory_size) {
+		memcpy(state.memory + pos, &word, 8);
+	} else {
+		for (size_t i = 0; i < 8; ++i) state.memory[(pos + i) % state.memory_size] = (uint8_t)(word >> (8 * i));
+	}
+}
+
+#define WORD(relpos) TN_LoadWord(state, relpos)
+#define SETWORD(relpos, word) TN_StoreWord(state, relpos, word)
+
+inline uint64_t TN_RotateLeft(uint64_t x, unsigned n) {
+	return (x << n) | (x >> (64 - n));
+}
+
+template<typename State>
+inline void TN_AdjustCycleLimit(State& state, int change) {
 	state.step_limit += change;
 
 	if (state.step_limit < state.step_limit_min) state.step_limit = state.step_limit_min;
@@ -32,7 +91,8 @@ inline void TN_AdjustCycleLimit(VM_State& state, int change) {
 
 #define MODCYCLES(change) TN_AdjustCycleLimit(state, change)
 
-inline void TN_ParseInstruction(VM_State& state, VM_Instruction inst) {
+template<typename State>
+inline void TN_ParseInstruction(State& state, VM_Instruction inst) {
 	switch (inst) {
 	case XOR:
 		MEM(0) ^= MEM(MEM(MEM(-1)));
@@ -83,25 +143,248 @@ inline void TN_ParseInstruction(VM_State& state, VM_Instruction inst) {
 	case CYCLESUB:
 		MODCYCLES(-1 * ENTANGLED_UINT8);
 		break;
+	case WORD_LOAD:
+		state.register_a = TN_RotateLeft(state.register_a, 8) ^ WORD(MEM(1));
+		break;
+	case WORD_XOR:
+		SETWORD(0, WORD(0) ^ WORD(MEM(1) + 8) ^ state.register_b);
+		break;
+	case WORD_ADD:
+		SETWORD(0, WORD(0) + WORD(MEM(1) + 8) + state.register_c);
+		break;
+	case WORD_ROT:
+		SETWORD(0, TN_RotateLeft(WORD(0), ENTANGLED_UINT8 % 63 + 1) ^ state.register_d);
+		break;
+	case WORD_MUL:
+		SETWORD(0, WORD(0) * (WORD(MEM(1) + 8) | 1));
+		break;
 	case NOOP:
+	default:
 		break;
 	}
 }
 
-inline VM_Instruction TN_GetInstruction(const VM_State& state) {
-	return (VM_Instruction)((state.memory[state.instruction_ptr] ^ ENTANGLED_UINT64) % _LAST);
+// Last is the instruction set size, a constant so the modulo stays cheap on the hot path
+template<VM_Instruction Last, typename State>
+inline VM_Instruction TN_GetInstruction(const State& state) {
+	return (VM_Instruction)((state.memory[state.instruction_ptr] ^ ENTANGLED_UINT64) % Last);
+}
+
+template<VM_Instruction Last = _LAST, typename State>
+inline void TN_Step(State& state) {
+	VM_Instruction inst = TN_GetInstruction<Last>(state);
+	TN_ParseInstruction(state, inst);
+	state.instruction_ptr = (state.instruction_ptr + 1) % state.memory_size;
+}
+
+// Lanes start from the shared keccak state with their own registers and a slice of memory and limits
+static void TN_LanesInit(VM_State& state, VM_Lane *lanes) {
+	for (size_t l = 0; l < TN_LANE_COUNT; ++l) {
+		VM_Lane& lane = lanes[l];
+		lane.instruction_ptr = 0;
+		lane.step_counter = 0;
+		lane.input_size = state.input_size;
+		lane.memory_size = state.memory_size / TN_LANE_COUNT;
+		lane.step_limit = state.step_limit / TN_LANE_COUNT;
+		lane.step_limit_max = state.step_limit_max / TN_LANE_COUNT;
+		lane.step_limit_min = state.step_limit_min / TN_LANE_COUNT;
+		lane.hs = state.hs;
+		lane.register_a = state.register_a ^ state.hs.w[l * 4 + 0];
+		lane.register_b = state.register_b ^ state.hs.w[l * 4 + 1];
+		lane.register_c = state.register_c ^ state.hs.w[l * 4 + 2];
+		lane.register_d = state.register_d ^ state.hs.w[l * 4 + 3];
+		lane.memory = state.memory + l * lane.memory_size;
+	}
+}
+
+// Sync point: every lane mixes in the registers of the next lane as they were before the sync
+static void TN_LanesSync(VM_Lane *lanes) {
+	VM_Lane next[TN_LANE_COUNT];
+	for (size_t l = 0; l < TN_LANE_COUNT; ++l) next[l] = lanes[(l + 1) % TN_LANE_COUNT];
+
+	for (size_t l = 0; l < TN_LANE_COUNT; ++l) {
+		lanes[l].register_a ^= next[l].register_b;
+		lanes[l].register_b ^= next[l].register_c;
+		lanes[l].register_c ^= next[l].register_d;
+		lanes[l].register_d ^= next[l].register_a;
+	}
+}
+
+static bool TN_LanesFinished(const VM_Lane *lanes) {
+	for (size_t l = 0; l < TN_LANE_COUNT; ++l) {
+		if (lanes[l].step_counter <= lanes[l].step_limit) return false;
+	}
+	return true;
+}
+
+// Folds the lanes back into the state so the final hash covers them
+static void TN_LanesFold(VM_State& state, const VM_Lane *lanes) {
+	state.instruction_ptr = 0;
+	state.step_counter = 0;
+	state.step_limit = 0;
+	for (size_t l = 0; l < TN_LANE_COUNT; ++l) {
+		const VM_Lane& lane = lanes[l];
+		state.instruction_ptr ^= l * lane.memory_size + lane.instruction_ptr;
+		state.step_counter += lane.step_counter;
+		state.step_limit += lane.step_limit;
+		state.register_a ^= lane.register_a;
+		state.register_b ^= lane.register_b;
+		state.register_c ^= lane.register_c;
+		state.register_d ^= lane.register_d;
+	}
+}
+
+// Runs until the VM finishes or reaches step end, cancel (may be null) is checked every TN_CANCEL_CHECK_STEPS steps.
+// Returns false if it stopped because of cancel.
+template<VM_Instruction Last = _LAST, typename State>
+static bool TN_RunUntil(State& state, const uint64_t end, const CancelToken *cancel) {
+	while (state.step_counter <= state.step_limit && state.step_counter < end) {
+		if (cancel && cancel->cancelled()) return false;
+		uint64_t check = cancel ? std::min(end, state.step_counter + TN_CANCEL_CHECK_STEPS) : end;
+		for (; state.step_counter <= state.step_limit && state.step_counter < check; state.step_counter++) {
+			TN_Step<Last>(state);
+		}
+	}
+	return true;
+}
+
+// Blocks until all threads arrived, the last one to arrive runs the completion before releasing the others
+class LaneBarrier {
+public:
+	explicit LaneBarrier(size_t count) : count(count) {}
+
+	template<typename Completion>
+	void wait(Completion completion) {
+		std::unique_lock<std::mutex> lock(mutex);
+		size_t current = generation;
+		if (++arrived == count) {
+			completion();
+			arrived = 0;
+			generation++;
+			cv.notify_all();
+		} else {
+			cv.wait(lock, [&] { return current != generation; });
+		}
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable cv;
+	size_t count;
+	size_t arrived = 0;
+	size_t generation = 0;
+};
+
+static bool TN_RunLanes(VM_State *state, const CancelToken *cancel) {
+	VM_Lane lanes[TN_LANE_COUNT];
+	TN_LanesInit(*state, lanes);
+
+	LaneBarrier barrier(TN_LANE_COUNT);
+	bool finished = false, cancelled = false;
+
+	std::vector<std::thread> threads;
+	for (size_t l = 0; l < TN_LANE_COUNT; ++l) {
+		threads.emplace_back([&](VM_Lane *lane) {
+			for (uint64_t sync = TN_LANE_SYNC_STEPS; ; sync += TN_LANE_SYNC_STEPS) {
+				TN_RunUntil(*lane, sync, cancel);
+				barrier.wait([&] {
+					finished = TN_LanesFinished(lanes);
+					cancelled = !finished && cancel && cancel->cancelled();
+					if (!finished && !cancelled) TN_LanesSync(lanes);
+				});
+				if (finished || cancelled) break;
+			}
+		}, lanes + l);
+	}
+	for (auto &t : threads) t.join();
+
+	if (cancelled) return false;
+	TN_LanesFold(*state, lanes);
+	return true;
+}
+
+// Same result as TN_RunLanes, the lanes take turns on the calling thread
+static bool TN_RunLanesSequential(VM_State *state, const CancelToken *cancel) {
+	VM_Lane lanes[TN_LANE_COUNT];
+	TN_LanesInit(*state, lanes);
+
+	for (uint64_t sync = TN_LANE_SYNC_STEPS; ; sync += TN_LANE_SYNC_STEPS) {
+		for (size_t l = 0; l < TN_LANE_COUNT; ++l) {
+			if (!TN_RunUntil(lanes[l], sync, cancel)) return false;
+		}
+		if (TN_LanesFinished(lanes)) break;
+		TN_LanesSync(lanes);
+	}
+
+	TN_LanesFold(*state, lanes);
+	return true;
+}
+
+static bool TN_Run(VM_State *state, const CancelToken *cancel) {
+	if (state->variant == TN_VARIANT_WORDS) return TN_RunUntil<_LAST_WORDS>(*state, UINT64_MAX, cancel);
+	return TN_RunUntil(*state, UINT64_MAX, cancel);
+}
+
+bool TN_VM_Execute(VM_State *state, const uint64_t max_steps, const CancelToken *cancel) {
+	if (state->variant == TN_VARIANT_LANES) {
+		throw std::runtime_error("TN_VARIANT_LANES can't be executed in slices.");
+	}
+
+	uint64_t end = max_steps > UINT64_MAX - state->step_counter ? UINT64_MAX : state->step_counter + max_steps;
+	if (state->variant == TN_VARIANT_WORDS) TN_RunUntil<_LAST_WORDS>(*state, end, cancel);
+	else TN_RunUntil(*state, end, cancel);
+
+	return state->step_counter > state->step_limit;
 }
 
 void DeviceCPU::run(const size_t N, VM_State *states) {
+	run(N, states, nullptr);
+}
+
+bool DeviceCPU::run(const size_t N, VM_State *states, const CancelToken *cancel) {
+	// A thread per state already, lanes only get threads of their own while there are cores left for them
+	bool parallel_lanes = N < std::max(1u, std::thread::hardware_concurrency());
+
+	std::atomic<bool> completed(true);
 	std::vector<std::thread> threads;
 	for (size_t i = 0; i < N; ++i) {
-		threads.emplace_back([](VM_State *state) {
-			for (; state->step_counter <= state->step_limit; state->step_counter++) {
-				VM_Instruction inst = TN_GetInstruction(*state);
-				TN_ParseInstruction(*state, inst);
-				state->instruction_ptr = (state->instruction_ptr + 1) % state->memory_size;
-			}
+		threads.emplace_back([&](VM_State *state) {
+			bool done;
+			if (state->variant != TN_VARIANT_LANES) done = TN_Run(state, cancel);
+			else done = parallel_lanes ? TN_RunLanes(state, cancel) : TN_RunLanesSequential(state, cancel);
+			if (!done) completed = false;
 		}, states + i);
 	}
 	for (auto &t : threads) t.join();
-}
\ No newline at end of file
+	return completed;
+}
+
+bool DeviceCPU::execute(const size_t N, VM_State *states, const uint64_t max_steps) {
+	// Checked here, TN_VM_Execute throwing on a worker thread would terminate the process
+	for (size_t i = 0; i < N; ++i) {
+		if (states[i].variant == TN_VARIANT_LANES) throw std::runtime_error("TN_VARIANT_LANES can't be executed in slices.");
+	}
+
+	std::atomic<size_t> next(0);
+	std::atomic<bool> completed(true);
+	std::vector<std::thread> threads;
+	size_t count = std::min<size_t>(N, std::max(1u, std::thread::hardware_concurrency()));
+	for (size_t t = 0; t < count; ++t) {
+		threads.emplace_back([&] {
+			for (size_t i; (i = next++) < N;) {
+				if (!TN_VM_Execute(states + i, max_steps)) completed = false;
+			}
+		});
+	}
+	for (auto &t : threads) t.join();
+	return completed;
+}
+
+void DeviceCPU::runSequential(VM_State *state) {
+	runSequential(state, nullptr);
+}
+
+bool DeviceCPU::runSequential(VM_State *state, const CancelToken *cancel) {
+	if (state->variant != TN_VARIANT_LANES) return TN_Run(state, cancel);
+	return TN_RunLanesSequential(state, cancel);
+}
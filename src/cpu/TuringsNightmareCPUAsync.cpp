@@ -0,0 +1,218 @@
+#include "cpu/TuringsNightmareCPUAsync.h"
+#include "cpu/TuringsNightmareCPU.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+// Callbacks run on the workers, an exception escaping one would terminate the process
+template<typename F>
+static void TN_RunCallback(F&& call) {
+	try {
+		call();
+	} catch (std::exception& e) {
+		std::cerr << "TN async callback failed: " << e.what() << std::endl;
+	} catch (...) {
+		std::cerr << "TN async callback failed" << std::endl;
+	}
+}
+
+DeviceCPUAsync::DeviceCPUAsync(size_t threads, size_t queue_size) : queue(queue_size), stopping(false) {
+	if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (size_t i = 0; i < threads; ++i) workers.emplace_back(&DeviceCPUAsync::worker, this);
+}
+
+DeviceCPUAsync::~DeviceCPUAsync() {
+	stopping = true;
+	// One extra wakeup per worker, a worker that wakes to an empty queue exits
+	for (size_t i = 0; i < workers.size(); ++i) ready.post();
+	for (auto &t : workers) t.join();
+}
+
+std::future<TN_Hash> DeviceCPUAsync::submit(const std::string& input, const TN_Variant variant, std::shared_ptr<const CancelToken> cancel) {
+	auto promise = std::make_shared<std::promise<TN_Hash>>();
+	std::future<TN_Hash> future = promise->get_future();
+
+	submit(input, [promise](const TN_Hash& hash, std::exception_ptr error) {
+		if (error) promise->set_exception(error);
+		else promise->set_value(hash);
+	}, variant, cancel);
+
+	return future;
+}
+
+void DeviceCPUAsync::submit(const std::string& input, Callback callback, const TN_Variant variant, std::shared_ptr<const CancelToken> cancel) {
+	Job job{ input, nullptr, input.length(), variant, std::move(callback), std::move(cancel), nullptr, 0 };
+	push(job);
+}
+
+void DeviceCPUAsync::submit(const char *input, const size_t size, Callback callback, const TN_Variant variant, std::shared_ptr<const CancelToken> cancel) {
+	Job job{ std::string(), input, size, variant, std::move(callback), std::move(cancel), nullptr, 0 };
+	push(job);
+}
+
+std::future<std::vector<TN_Hash>> DeviceCPUAsync::submitBatch(const std::vector<std::string>& inputs, const TN_Variant variant,
+	std::shared_ptr<const CancelToken> cancel) {
+	struct Results {
+		std::mutex mutex;
+		std::vector<TN_Hash> hashes;
+		std::exception_ptr error;
+		size_t left;
+		std::promise<std::vector<TN_Hash>> promise;
+	};
+	auto results = std::make_shared<Results>();
+	results->hashes.resize(inputs.size());
+	results->left = inputs.size();
+	std::future<std::vector<TN_Hash>> future = results->promise.get_future();
+	if (inputs.empty()) {
+		results->promise.set_value(std::vector<TN_Hash>());
+		return future;
+	}
+
+	submitBatch(inputs, [results](size_t index, const TN_Hash& hash, std::exception_ptr error) {
+		std::lock_guard<std::mutex> lock(results->mutex);
+		results->hashes[index] = hash;
+		if (error && !results->error) results->error = error;
+		if (--results->left) return;
+		if (results->error) results->promise.set_exception(results->error);
+		else results->promise.set_value(std::move(results->hashes));
+	}, variant, cancel);
+
+	return future;
+}
+
+void DeviceCPUAsync::submitBatch(const std::vector<std::string>& inputs, BatchCallback callback, const TN_Variant variant,
+	std::shared_ptr<const CancelToken> cancel) {
+	for (auto &input : inputs) validate(input.length(), variant);
+
+	auto batch = std::make_shared<Batch>();
+	batch->callback = std::move(callback);
+	batch->running = inputs.size();
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		Job job{ inputs[i], nullptr, inputs[i].length(), variant, nullptr, cancel, batch, i };
+		push(job);
+	}
+}
+
+void DeviceCPUAsync::submitBatch(const size_t N, const char *const *inputs, const size_t *sizes, BatchCallback callback,
+	const TN_Variant variant, std::shared_ptr<const CancelToken> cancel) {
+	for (size_t i = 0; i < N; ++i) validate(sizes[i], variant);
+
+	auto batch = std::make_shared<Batch>();
+	batch->callback = std::move(callback);
+	batch->running = N;
+	for (size_t i = 0; i < N; ++i) {
+		Job job{ std::string(), inputs[i], sizes[i], variant, nullptr, cancel, batch, i };
+		push(job);
+	}
+}
+
+void DeviceCPUAsync::validate(const size_t size, const TN_Variant variant) {
+	if (size == 0 || size >= MEMORY_SIZE) {
+		throw std::runtime_error("Invalid TN input size.");
+	}
+	if (variant >= _TN_VARIANT_LAST) {
+		throw std::runtime_error("Invalid TN variant.");
+	}
+}
+
+void DeviceCPUAsync::push(Job& job) {
+	validate(job.size, job.variant);
+
+	while (!queue.try_push(job)) std::this_thread::yield();
+	ready.post();
+}
+
+void TN_Complete(const std::function<void(const TN_Hash& hash, std::exception_ptr error)>& callback, const TN_Hash& hash, std::exception_ptr error) {
+	TN_RunCallback([&] { callback(hash, error); });
+}
+
+std::exception_ptr TN_HashInput(DeviceCPU& cpu, const std::string& input, const TN_Variant variant, const CancelToken *cancel, TN_Hash& hash) {
+	return TN_HashInput(cpu, input.c_str(), input.length(), variant, cancel, hash);
+}
+
+std::exception_ptr TN_RunInput(DeviceCPU& cpu, const char *input, const size_t size, const TN_Variant variant, const CancelToken *cancel, VM_State *&state) {
+	try {
+		if (cancel && cancel->cancelled()) throw std::runtime_error("TN hash cancelled.");
+
+		state = TN_VM_Init(input, size, variant);
+		if (!cpu.runSequential(state, cancel)) {
+			// Free the scratchpad right away for the work replacing this one
+			delete state;
+			state = nullptr;
+			throw std::runtime_error("TN hash cancelled.");
+		}
+	} catch (...) {
+		return std::current_exception();
+	}
+	return nullptr;
+}
+
+std::exception_ptr TN_HashInput(DeviceCPU& cpu, const char *input, const size_t size, const TN_Variant variant, const CancelToken *cancel, TN_Hash& hash) {
+	VM_State *state = nullptr;
+	std::exception_ptr error = TN_RunInput(cpu, input, size, variant, cancel, state);
+	if (!error) TN_VM_Finalize(state, hash.data());
+	return error;
+}
+
+void DeviceCPUAsync::worker() {
+	DeviceCPU cpu;
+	// The pool already runs a hash per thread
+	TN_SetThreadTreeThreads(1);
+
+	for (;;) {
+		ready.wait();
+
+		Job job;
+		while (!queue.try_pop(job)) {
+			// Every wakeup belongs to a pushed job until stopping, which only starts after the last push
+			if (stopping) return;
+			std::this_thread::yield();
+		}
+
+		const char *input = job.data ? job.data : job.input.data();
+		if (job.batch) {
+			VM_State *state = nullptr;
+			std::exception_ptr error = TN_RunInput(cpu, input, job.size, job.variant, job.cancel.get(), state);
+			finish(job, state, error);
+			continue;
+		}
+
+		TN_Hash hash = {};
+		std::exception_ptr error = TN_HashInput(cpu, input, job.size, job.variant, job.cancel.get(), hash);
+		TN_Complete(job.callback, hash, error);
+	}
+}
+
+void DeviceCPUAsync::finish(Job& job, VM_State *state, std::exception_ptr error) {
+	Batch& batch = *job.batch;
+	std::vector<VM_State*> states;
+	std::vector<size_t> indices;
+	{
+		std::lock_guard<std::mutex> lock(batch.mutex);
+		batch.running--;
+		if (state) {
+			batch.states.push_back(state);
+			batch.indices.push_back(job.index);
+		}
+		// The last one to finish takes the rest
+		if (batch.states.size() >= TN_ASYNC_FINALIZE_GROUP || batch.running == 0) {
+			states.swap(batch.states);
+			indices.swap(batch.indices);
+		}
+	}
+
+	if (error) TN_RunCallback([&] { batch.callback(job.index, TN_Hash(), error); });
+	if (states.empty()) return;
+
+	std::vector<char> out(states.size() * HASH_SIZE);
+	TN_VM_FinalizeBatch(states.size(), states.data(), out.data());
+	for (size_t k = 0; k < states.size(); ++k) {
+		TN_Hash hash;
+		memcpy(hash.data(), out.data() + k * HASH_SIZE, HASH_SIZE);
+		TN_RunCallback([&] { batch.callback(indices[k], hash, nullptr); });
+	}
+}
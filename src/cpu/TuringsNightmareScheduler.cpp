@@ -0,0 +1,169 @@
+#include "cpu/TuringsNightmareScheduler.h"
+#include "cpu/TuringsNightmareCPU.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+HashScheduler::HashScheduler(size_t threads, size_t max_items, size_t max_bytes) : max_items(max_items), max_bytes(max_bytes) {
+	if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (size_t i = 0; i < threads; ++i) workers.emplace_back(&HashScheduler::worker, this);
+}
+
+HashScheduler::~HashScheduler() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	cv.notify_all();
+	for (auto &t : workers) t.join();
+}
+
+bool HashScheduler::submit(const std::string& input, const uint64_t source, const TN_Priority priority, Callback callback,
+	const Clock::time_point deadline, const TN_Variant variant, std::shared_ptr<const CancelToken> cancel) {
+	if (input.empty() || input.length() >= MEMORY_SIZE) {
+		throw std::runtime_error("Invalid TN input size.");
+	}
+	if (variant >= _TN_VARIANT_LAST) {
+		throw std::runtime_error("Invalid TN variant.");
+	}
+	if (priority >= _TN_PRIORITY_LAST) {
+		throw std::runtime_error("Invalid TN priority.");
+	}
+
+	std::vector<Item> expired;
+	bool queued = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// Expired items make room before anything is turned away
+		expire(expired);
+
+		size_t depth = 0;
+		for (auto &c : classes) depth += c.depth;
+		if (depth >= max_items || stats.queued_bytes + input.length() > max_bytes) {
+			stats.rejected++;
+		} else {
+			PriorityClass& c = classes[priority];
+			auto& queue = c.sources[source];
+			if (queue.empty()) c.turns.push_back(source);
+			queue.push_back(Item{ input, variant, deadline, Clock::now(), sequence++, std::move(callback), std::move(cancel) });
+			std::push_heap(queue.begin(), queue.end(), LaterDeadline());
+
+			c.depth++;
+			stats.queued_bytes += input.length();
+			next_deadline = std::min(next_deadline, deadline);
+			queued = true;
+		}
+	}
+	if (queued) cv.notify_one();
+
+	for (auto &item : expired) {
+		TN_Complete(item.callback, TN_Hash(), std::make_exception_ptr(std::runtime_error("TN hash deadline expired.")));
+	}
+
+	return queued;
+}
+
+void HashScheduler::expire(std::vector<Item>& expired) {
+	Clock::time_point now = Clock::now();
+	if (now <= next_deadline) return;
+
+	// Each source's heap has its earliest deadline on top
+	next_deadline = Clock::time_point::max();
+	for (auto &c : classes) {
+		for (auto queue = c.sources.begin(); queue != c.sources.end();) {
+			auto& heap = queue->second;
+			while (!heap.empty() && now > heap.front().deadline) {
+				std::pop_heap(heap.begin(), heap.end(), LaterDeadline());
+				stats.queued_bytes -= heap.back().input.length();
+				stats.expired++;
+				c.depth--;
+				expired.push_back(std::move(heap.back()));
+				heap.pop_back();
+			}
+
+			if (heap.empty()) {
+				uint64_t source = queue->first;
+				c.turns.erase(std::remove(c.turns.begin(), c.turns.end(), source), c.turns.end());
+				queue = c.sources.erase(queue);
+			} else {
+				next_deadline = std::min(next_deadline, heap.front().deadline);
+				++queue;
+			}
+		}
+	}
+}
+
+HashSchedulerMetrics HashScheduler::metrics() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	HashSchedulerMetrics m = stats;
+	for (size_t p = 0; p < _TN_PRIORITY_LAST; ++p) m.depth[p] = classes[p].depth;
+	return m;
+}
+
+// Takes the next item, called with the mutex held and at least one item queued
+bool HashScheduler::pop(Item& item) {
+	for (size_t p = 0; p < _TN_PRIORITY_LAST; ++p) {
+		PriorityClass& c = classes[p];
+		if (c.turns.empty()) continue;
+
+		uint64_t source = c.turns.front();
+		c.turns.pop_front();
+
+		auto queue = c.sources.find(source);
+		std::pop_heap(queue->second.begin(), queue->second.end(), LaterDeadline());
+		item = std::move(queue->second.back());
+		queue->second.pop_back();
+		if (queue->second.empty()) c.sources.erase(queue);
+		else c.turns.push_back(source);
+
+		c.depth--;
+		stats.queued_bytes -= item.input.length();
+
+		Clock::time_point now = Clock::now();
+		if (now > item.deadline) {
+			stats.expired++;
+			return false;
+		}
+
+		uint64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(now - item.enqueued).count();
+		stats.started[p]++;
+		stats.wait_total_us[p] += wait;
+		stats.wait_max_us[p] = std::max(stats.wait_max_us[p], wait);
+		return true;
+	}
+	throw std::logic_error("HashScheduler::pop called on an empty queue.");
+}
+
+void HashScheduler::worker() {
+	DeviceCPU cpu;
+	TN_SetThreadTreeThreads(1);
+
+	for (;;) {
+		Item item;
+		bool live;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this] {
+				for (auto &c : classes) if (c.depth) return true;
+				return stopping;
+			});
+
+			bool empty = true;
+			for (auto &c : classes) if (c.depth) empty = false;
+			if (empty) return;
+
+			live = pop(item);
+		}
+
+		TN_Hash hash = {};
+		std::exception_ptr error;
+		if (!live) {
+			error = std::make_exception_ptr(std::runtime_error("TN hash deadline expired."));
+		} else {
+			error = TN_HashInput(cpu, item.input, item.variant, item.cancel.get(), hash);
+		}
+		TN_Complete(item.callback, hash, error);
+	}
+}
@@ -0,0 +1,142 @@
+/*
+ * AES round based scratchpad expansion.
+ *
+ * Only the AES round function (equivalent to the aesenc instruction) and
+ * the AES-256 key schedule are needed, decryption is never used.
+ */
+
+#include <string.h>
+#include "crypto/aes.h"
+#include "crypto/cpu_features.h"
+
+#ifdef TN_X86
+#include <wmmintrin.h>
+#endif
+
+static const uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+#define XTIME(x) ((uint8_t)(((x) << 1) ^ (((x) & 0x80) ? 0x1b : 0x00)))
+
+void aes_expand_key(const uint8_t *key, uint8_t *round_keys) {
+    uint8_t rcon = 0x01, t[4];
+    int i, j;
+
+    memcpy(round_keys, key, 32);
+    for (i = 8; i < AES_EXPAND_ROUNDS * 4; ++i) {
+        memcpy(t, round_keys + (i - 1) * 4, 4);
+        if (i % 8 == 0) {
+            uint8_t first = t[0];
+            t[0] = sbox[t[1]] ^ rcon;
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[first];
+            rcon = XTIME(rcon);
+        } else if (i % 8 == 4) {
+            for (j = 0; j < 4; ++j) t[j] = sbox[t[j]];
+        }
+        for (j = 0; j < 4; ++j) round_keys[i * 4 + j] = round_keys[(i - 8) * 4 + j] ^ t[j];
+    }
+}
+
+/* One AES encryption round, same result as aesenc */
+static void aes_round(uint8_t *s, const uint8_t *k) {
+    uint8_t t[16];
+    int r, c;
+
+    /* SubBytes and ShiftRows, byte r + 4c is row r of column c */
+    for (c = 0; c < 4; ++c)
+        for (r = 0; r < 4; ++r)
+            t[r + 4 * c] = sbox[s[r + 4 * ((c + r) & 3)]];
+
+    /* MixColumns and AddRoundKey */
+    for (c = 0; c < 4; ++c) {
+        uint8_t *a = t + 4 * c;
+        uint8_t all = a[0] ^ a[1] ^ a[2] ^ a[3];
+        s[4 * c + 0] = a[0] ^ all ^ XTIME(a[0] ^ a[1]) ^ k[4 * c + 0];
+        s[4 * c + 1] = a[1] ^ all ^ XTIME(a[1] ^ a[2]) ^ k[4 * c + 1];
+        s[4 * c + 2] = a[2] ^ all ^ XTIME(a[2] ^ a[3]) ^ k[4 * c + 2];
+        s[4 * c + 3] = a[3] ^ all ^ XTIME(a[3] ^ a[0]) ^ k[4 * c + 3];
+    }
+}
+
+void aes_expand_scratchpad_soft(const uint8_t *key, const uint8_t *text, uint8_t *out, size_t len) {
+    uint8_t round_keys[AES_EXPAND_ROUNDS * AES_BLOCK_SIZE];
+    uint8_t blocks[AES_EXPAND_TEXT_SIZE];
+    size_t offset;
+    int b, r;
+
+    aes_expand_key(key, round_keys);
+    memcpy(blocks, text, sizeof(blocks));
+
+    for (offset = 0; offset < len; offset += sizeof(blocks)) {
+        for (b = 0; b < 8; ++b)
+            for (r = 0; r < AES_EXPAND_ROUNDS; ++r)
+                aes_round(blocks + b * AES_BLOCK_SIZE, round_keys + r * AES_BLOCK_SIZE);
+        memcpy(out + offset, blocks, len - offset < sizeof(blocks) ? len - offset : sizeof(blocks));
+    }
+}
+
+#ifdef TN_X86
+
+TN_TARGET("aes")
+void aes_expand_scratchpad_aesni(const uint8_t *key, const uint8_t *text, uint8_t *out, size_t len) {
+    uint8_t round_keys[AES_EXPAND_ROUNDS * AES_BLOCK_SIZE];
+    __m128i k[AES_EXPAND_ROUNDS], x[8];
+    size_t offset;
+    int b, r;
+
+    aes_expand_key(key, round_keys);
+    for (r = 0; r < AES_EXPAND_ROUNDS; ++r) k[r] = _mm_loadu_si128((const __m128i *) (round_keys + r * AES_BLOCK_SIZE));
+    for (b = 0; b < 8; ++b) x[b] = _mm_loadu_si128((const __m128i *) (text + b * AES_BLOCK_SIZE));
+
+    for (offset = 0; offset < len; offset += AES_EXPAND_TEXT_SIZE) {
+        /* Eight independent blocks keep the AES unit pipeline full */
+        for (r = 0; r < AES_EXPAND_ROUNDS; ++r) {
+            x[0] = _mm_aesenc_si128(x[0], k[r]);
+            x[1] = _mm_aesenc_si128(x[1], k[r]);
+            x[2] = _mm_aesenc_si128(x[2], k[r]);
+            x[3] = _mm_aesenc_si128(x[3], k[r]);
+            x[4] = _mm_aesenc_si128(x[4], k[r]);
+            x[5] = _mm_aesenc_si128(x[5], k[r]);
+            x[6] = _mm_aesenc_si128(x[6], k[r]);
+            x[7] = _mm_aesenc_si128(x[7], k[r]);
+        }
+
+        if (len - offset >= AES_EXPAND_TEXT_SIZE) {
+            for (b = 0; b < 8; ++b) _mm_storeu_si128((__m128i *) (out + offset + b * AES_BLOCK_SIZE), x[b]);
+        } else {
+            uint8_t tail[AES_EXPAND_TEXT_SIZE];
+            for (b = 0; b < 8; ++b) _mm_storeu_si128((__m128i *) (tail + b * AES_BLOCK_SIZE), x[b]);
+            memcpy(out + offset, tail, len - offset);
+        }
+    }
+}
+
+#endif /* TN_X86 */
+
+void aes_expand_scratchpad(const uint8_t *key, const uint8_t *text, uint8_t *out, size_t len) {
+#ifdef TN_X86
+    if (tn_cpu_has_aesni()) {
+        aes_expand_scratchpad_aesni(key, text, out, len);
+        return;
+    }
+#endif
+    aes_expand_scratchpad_soft(key, text, out, len);
+}
@@ -12,6 +12,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "crypto/blake256.h"
+#include "crypto/cpu_features.h"
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif
 
 #define U8TO32(p) \
     (((uint32_t)((p)[0]) << 24) | ((uint32_t)((p)[1]) << 16) |    \
@@ -97,6 +102,34 @@ void blake256_compress(state *S, const uint8_t *block) {
     for (i = 0; i < 8;  ++i) S->h[i] ^= S->s[i % 4];
 }
 
+typedef void (*blake256_compress_fn)(state *, const uint8_t *);
+
+static blake256_compress_fn blake256_compress_detect(void) {
+#ifdef TN_X86
+    if (tn_cpu_has_sse41()) return blake256_compress_sse41;
+#endif
+    return blake256_compress;
+}
+
+/* Compression used by update, the fastest supported variant. Detected on first use, threads racing
+   there all store the same pointer, atomically. Without C11 atomics it is detected on every update. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+static _Atomic(blake256_compress_fn) blake256_compress_cached = NULL;
+
+static blake256_compress_fn blake256_compress_impl(void) {
+    blake256_compress_fn compress = atomic_load_explicit(&blake256_compress_cached, memory_order_relaxed);
+    if (!compress) {
+        compress = blake256_compress_detect();
+        atomic_store_explicit(&blake256_compress_cached, compress, memory_order_relaxed);
+    }
+    return compress;
+}
+#else
+static blake256_compress_fn blake256_compress_impl(void) {
+    return blake256_compress_detect();
+}
+#endif
+
 void blake256_init(state *S) {
     S->h[0] = 0x6A09E667;
     S->h[1] = 0xBB67AE85;
@@ -125,6 +158,7 @@ void blake224_init(state *S) {
 
 // datalen = number of bits
 void blake256_update(state *S, const uint8_t *data, uint64_t datalen) {
+    blake256_compress_fn compress = blake256_compress_impl();
     int left = S->buflen >> 3;
     int fill = 64 - left;
 
@@ -132,7 +166,7 @@ void blake256_update(state *S, const uint8_t *data, uint64_t datalen) {
         memcpy((void *) (S->buf + left), (void *) data, fill);
         S->t[0] += 512;
         if (S->t[0] == 0) S->t[1]++;
-        blake256_compress(S, S->buf);
+        compress(S, S->buf);
         data += fill;
         datalen -= (fill << 3);
         left = 0;
@@ -141,7 +175,7 @@ void blake256_update(state *S, const uint8_t *data, uint64_t datalen) {
     while (datalen >= 512) {
         S->t[0] += 512;
         if (S->t[0] == 0) S->t[1]++;
-        blake256_compress(S, data);
+        compress(S, data);
         data += 64;
         datalen -= 512;
     }
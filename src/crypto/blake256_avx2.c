@@ -0,0 +1,132 @@
+/*
+ * AVX2 multi-buffer BLAKE-256.
+ *
+ * Hashes eight equal length messages at once, one message per 32-bit
+ * lane: every state word v[i] and message word m[i] is a vector holding
+ * that word for all eight messages. Only whole blocks are processed in
+ * lanes, the padded tail of each message is finished by the scalar code
+ * so the digests are identical to blake256_hash.
+ */
+
+#include "crypto/cpu_features.h"
+
+#ifdef TN_X86
+
+#include <stdint.h>
+#include <immintrin.h>
+#include "crypto/blake256.h"
+
+extern const uint8_t sigma[][16];
+extern const uint32_t cst[16];
+
+#define ADD(a, b) _mm256_add_epi32((a), (b))
+#define XOR(a, b) _mm256_xor_si256((a), (b))
+#define ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define ROTR16(x) _mm256_shuffle_epi8((x), rot16)
+#define ROTR8(x) _mm256_shuffle_epi8((x), rot8)
+
+#define G8(a, b, c, d, e)                                                          \
+    v[a] = ADD(ADD(v[a], XOR(m[sigma[r][e]], _mm256_set1_epi32(cst[sigma[r][e + 1]]))), v[b]); \
+    v[d] = ROTR16(XOR(v[d], v[a]));                                                \
+    v[c] = ADD(v[c], v[d]);                                                        \
+    v[b] = ROTR(XOR(v[b], v[c]), 12);                                              \
+    v[a] = ADD(ADD(v[a], XOR(m[sigma[r][e + 1]], _mm256_set1_epi32(cst[sigma[r][e]]))), v[b]); \
+    v[d] = ROTR8(XOR(v[d], v[a]));                                                 \
+    v[c] = ADD(v[c], v[d]);                                                        \
+    v[b] = ROTR(XOR(v[b], v[c]), 7);
+
+/* Loads eight consecutive big endian words from each lane and transposes them to word vectors */
+TN_TARGET("avx2")
+static void load_words_x8(__m256i *w, const uint8_t *const in[8], uint64_t offset) {
+    const __m256i bswap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i r[8], t[8], u[8];
+    int k;
+
+    for (k = 0; k < 8; ++k) {
+        r[k] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (in[k] + offset)), bswap);
+    }
+
+    for (k = 0; k < 8; k += 2) {
+        t[k]     = _mm256_unpacklo_epi32(r[k], r[k + 1]);
+        t[k + 1] = _mm256_unpackhi_epi32(r[k], r[k + 1]);
+    }
+
+    for (k = 0; k < 8; k += 4) {
+        u[k]     = _mm256_unpacklo_epi64(t[k],     t[k + 2]);
+        u[k + 1] = _mm256_unpackhi_epi64(t[k],     t[k + 2]);
+        u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+        u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+    }
+
+    for (k = 0; k < 4; ++k) {
+        w[k]     = _mm256_permute2x128_si256(u[k], u[k + 4], 0x20);
+        w[k + 4] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x31);
+    }
+}
+
+TN_TARGET("avx2")
+static void blake256_compress_x8(__m256i *h, const uint8_t *const in[8], uint64_t offset, uint32_t t0, uint32_t t1) {
+    const __m256i rot16 = _mm256_setr_epi8(
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(
+        1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+        1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    __m256i v[16], m[16];
+    int i, r;
+
+    load_words_x8(m, in, offset);
+    load_words_x8(m + 8, in, offset + 32);
+
+    for (i = 0; i < 8; ++i) v[i] = h[i];
+    for (i = 0; i < 4; ++i) v[i + 8] = _mm256_set1_epi32(cst[i]);
+    v[12] = _mm256_set1_epi32(cst[4] ^ t0);
+    v[13] = _mm256_set1_epi32(cst[5] ^ t0);
+    v[14] = _mm256_set1_epi32(cst[6] ^ t1);
+    v[15] = _mm256_set1_epi32(cst[7] ^ t1);
+
+    for (r = 0; r < 14; ++r) {
+        G8(0, 4,  8, 12,  0);
+        G8(1, 5,  9, 13,  2);
+        G8(2, 6, 10, 14,  4);
+        G8(3, 7, 11, 15,  6);
+        G8(3, 4,  9, 14, 14);
+        G8(2, 7,  8, 13, 12);
+        G8(0, 5, 10, 15,  8);
+        G8(1, 6, 11, 12, 10);
+    }
+
+    /* Salt is always zero for blake256_hash */
+    for (i = 0; i < 8; ++i) h[i] = XOR(h[i], XOR(v[i], v[i + 8]));
+}
+
+TN_TARGET("avx2")
+void blake256_hash_x8(uint8_t *const out[8], const uint8_t *const in[8], uint64_t inlen) {
+    uint64_t blocks = inlen / 64, b;
+    uint32_t words[8][8];
+    __m256i h[8];
+    state S;
+    int i, k;
+
+    blake256_init(&S);
+    for (i = 0; i < 8; ++i) h[i] = _mm256_set1_epi32(S.h[i]);
+
+    for (b = 0; b < blocks; ++b) {
+        S.t[0] += 512;
+        if (S.t[0] == 0) S.t[1]++;
+        blake256_compress_x8(h, in, b * 64, S.t[0], S.t[1]);
+    }
+
+    for (i = 0; i < 8; ++i) _mm256_storeu_si256((__m256i *) words[i], h[i]);
+
+    for (k = 0; k < 8; ++k) {
+        state L = S;
+        for (i = 0; i < 8; ++i) L.h[i] = words[i][k];
+        blake256_update(&L, in[k] + blocks * 64, (inlen - blocks * 64) * 8);
+        blake256_final(&L, out[k]);
+    }
+}
+
+#endif /* TN_X86 */
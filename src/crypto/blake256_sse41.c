@@ -0,0 +1,91 @@
+/*
+ * SSE4.1 BLAKE-256 compression.
+ *
+ * The 4x4 state matrix is held as four row vectors so the four column
+ * G functions, and after rotating rows 2-4 the four diagonal ones, run
+ * in parallel lanes. Produces exactly the same chaining value as the
+ * portable blake256_compress, which remains the reference.
+ */
+
+#include "crypto/cpu_features.h"
+
+#ifdef TN_X86
+
+#include <stdint.h>
+#include <smmintrin.h>
+#include <tmmintrin.h>
+#include "crypto/blake256.h"
+
+extern const uint8_t sigma[][16];
+extern const uint32_t cst[16];
+
+#define ROT16(x) _mm_shuffle_epi8((x), _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13))
+#define ROT8(x)  _mm_shuffle_epi8((x), _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12))
+#define ROT12(x) _mm_or_si128(_mm_srli_epi32((x), 12), _mm_slli_epi32((x), 20))
+#define ROT7(x)  _mm_or_si128(_mm_srli_epi32((x), 7), _mm_slli_epi32((x), 25))
+
+/* Message words for four G functions, e selects sigma[r][e], [e+2], [e+4], [e+6] */
+#define MSG(e, f) _mm_insert_epi32(_mm_insert_epi32(_mm_insert_epi32(_mm_cvtsi32_si128( \
+    (int)(m[s[(e)]]     ^ cst[s[(f)]])),                                                \
+    (int)(m[s[(e) + 2]] ^ cst[s[(f) + 2]]), 1),                                         \
+    (int)(m[s[(e) + 4]] ^ cst[s[(f) + 4]]), 2),                                         \
+    (int)(m[s[(e) + 6]] ^ cst[s[(f) + 6]]), 3)
+
+#define G4(e)                                                     \
+    row1 = _mm_add_epi32(_mm_add_epi32(row1, MSG(e, e + 1)), row2); \
+    row4 = ROT16(_mm_xor_si128(row4, row1));                      \
+    row3 = _mm_add_epi32(row3, row4);                             \
+    row2 = ROT12(_mm_xor_si128(row2, row3));                      \
+    row1 = _mm_add_epi32(_mm_add_epi32(row1, MSG(e + 1, e)), row2); \
+    row4 = ROT8(_mm_xor_si128(row4, row1));                       \
+    row3 = _mm_add_epi32(row3, row4);                             \
+    row2 = ROT7(_mm_xor_si128(row2, row3));
+
+TN_TARGET("sse4.1")
+void blake256_compress_sse41(state *S, const uint8_t *block) {
+    const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    uint32_t m[16];
+    const uint8_t *s;
+    __m128i row1, row2, row3, row4, h1, h2, salt;
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+        __m128i w = _mm_loadu_si128((const __m128i *) (block + i * 16));
+        _mm_storeu_si128((__m128i *) (m + i * 4), _mm_shuffle_epi8(w, bswap));
+    }
+
+    h1 = row1 = _mm_loadu_si128((const __m128i *) S->h);
+    h2 = row2 = _mm_loadu_si128((const __m128i *) (S->h + 4));
+    salt = _mm_loadu_si128((const __m128i *) S->s);
+    row3 = _mm_xor_si128(salt, _mm_setr_epi32(0x243F6A88, 0x85A308D3, 0x13198A2E, 0x03707344));
+    row4 = _mm_setr_epi32(0xA4093822, 0x299F31D0, 0x082EFA98, 0xEC4E6C89);
+
+    if (S->nullt == 0) {
+        row4 = _mm_xor_si128(row4, _mm_setr_epi32(S->t[0], S->t[0], S->t[1], S->t[1]));
+    }
+
+    for (i = 0; i < 14; ++i) {
+        s = sigma[i];
+
+        /* Columns: G(0,4,8,12) G(1,5,9,13) G(2,6,10,14) G(3,7,11,15) */
+        G4(0);
+
+        /* Diagonals: G(0,5,10,15) G(1,6,11,12) G(2,7,8,13) G(3,4,9,14) */
+        row2 = _mm_shuffle_epi32(row2, _MM_SHUFFLE(0, 3, 2, 1));
+        row3 = _mm_shuffle_epi32(row3, _MM_SHUFFLE(1, 0, 3, 2));
+        row4 = _mm_shuffle_epi32(row4, _MM_SHUFFLE(2, 1, 0, 3));
+
+        G4(8);
+
+        row2 = _mm_shuffle_epi32(row2, _MM_SHUFFLE(2, 1, 0, 3));
+        row3 = _mm_shuffle_epi32(row3, _MM_SHUFFLE(1, 0, 3, 2));
+        row4 = _mm_shuffle_epi32(row4, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+
+    h1 = _mm_xor_si128(h1, _mm_xor_si128(_mm_xor_si128(row1, row3), salt));
+    h2 = _mm_xor_si128(h2, _mm_xor_si128(_mm_xor_si128(row2, row4), salt));
+    _mm_storeu_si128((__m128i *) S->h, h1);
+    _mm_storeu_si128((__m128i *) (S->h + 4), h2);
+}
+
+#endif /* TN_X86 */
@@ -0,0 +1,37 @@
+#include "crypto/cpu_features.h"
+
+#if defined(TN_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+
+static int cpuid_bit(int leaf, int reg, int bit) {
+    int info[4];
+    __cpuidex(info, leaf, 0);
+    return (info[reg] >> bit) & 1;
+}
+
+static int os_saves_ymm(void) {
+    /* OSXSAVE set and XCR0 enables both XMM and YMM state */
+    return cpuid_bit(1, 2, 27) && (_xgetbv(0) & 6) == 6;
+}
+
+int tn_cpu_has_ssse3(void) { return cpuid_bit(1, 2, 9); }
+int tn_cpu_has_sse41(void) { return cpuid_bit(1, 2, 19); }
+int tn_cpu_has_avx2(void)  { return os_saves_ymm() && cpuid_bit(7, 1, 5); }
+int tn_cpu_has_aesni(void) { return cpuid_bit(1, 2, 25); }
+
+#elif defined(TN_X86) && (defined(__GNUC__) || defined(__clang__))
+
+int tn_cpu_has_ssse3(void) { return __builtin_cpu_supports("ssse3"); }
+int tn_cpu_has_sse41(void) { return __builtin_cpu_supports("sse4.1"); }
+int tn_cpu_has_avx2(void)  { return __builtin_cpu_supports("avx2"); }
+int tn_cpu_has_aesni(void) { return __builtin_cpu_supports("aes"); }
+
+#else
+
+int tn_cpu_has_ssse3(void) { return 0; }
+int tn_cpu_has_sse41(void) { return 0; }
+int tn_cpu_has_avx2(void)  { return 0; }
+int tn_cpu_has_aesni(void) { return 0; }
+
+#endif
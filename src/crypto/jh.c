@@ -14,13 +14,26 @@
 */
 
 #include "crypto/jh.h"
+#include "crypto/cpu_features.h"
 
 #include <stdint.h>
 #include <string.h>
 
+#ifdef TN_X86
+#include <immintrin.h>
+#endif
+
 /*typedef unsigned long long uint64;*/
 typedef uint64_t uint64;
 
+/*64-bit word at p; a byte array read through a uint64 pointer breaks strict aliasing (and may be unaligned)*/
+static inline uint64 jh_load64(const unsigned char *p)
+{
+      uint64 v;
+      memcpy(&v, p, sizeof(v));
+      return v;
+}
+
 /*define data alignment for different C compilers*/
 #if defined(__GNUC__)
       #define DATA_ALIGN16(x) x __attribute__ ((aligned(16)))
@@ -157,49 +170,49 @@ static void E8(hashState *state)
       for (roundnumber = 0; roundnumber < 42; roundnumber = roundnumber+7) {
             /*round 7*roundnumber+0: Sbox, MDS and Swapping layers*/
             for (i = 0; i < 2; i++) {
-                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],((uint64*)E8_bitslice_roundconstant[roundnumber+0])[i],((uint64*)E8_bitslice_roundconstant[roundnumber+0])[i+2] );
+                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],jh_load64(E8_bitslice_roundconstant[roundnumber+0] + 8*(i)),jh_load64(E8_bitslice_roundconstant[roundnumber+0] + 8*(i+2)) );
                   L(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i]);
                   SWAP1(state->x[1][i]); SWAP1(state->x[3][i]); SWAP1(state->x[5][i]); SWAP1(state->x[7][i]);
             }
 
             /*round 7*roundnumber+1: Sbox, MDS and Swapping layers*/
             for (i = 0; i < 2; i++) {
-                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],((uint64*)E8_bitslice_roundconstant[roundnumber+1])[i],((uint64*)E8_bitslice_roundconstant[roundnumber+1])[i+2] );
+                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],jh_load64(E8_bitslice_roundconstant[roundnumber+1] + 8*(i)),jh_load64(E8_bitslice_roundconstant[roundnumber+1] + 8*(i+2)) );
                   L(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i]);
                   SWAP2(state->x[1][i]); SWAP2(state->x[3][i]); SWAP2(state->x[5][i]); SWAP2(state->x[7][i]);
             }
 
             /*round 7*roundnumber+2: Sbox, MDS and Swapping layers*/
             for (i = 0; i < 2; i++) {
-                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],((uint64*)E8_bitslice_roundconstant[roundnumber+2])[i],((uint64*)E8_bitslice_roundconstant[roundnumber+2])[i+2] );
+                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],jh_load64(E8_bitslice_roundconstant[roundnumber+2] + 8*(i)),jh_load64(E8_bitslice_roundconstant[roundnumber+2] + 8*(i+2)) );
                   L(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i]);
                   SWAP4(state->x[1][i]); SWAP4(state->x[3][i]); SWAP4(state->x[5][i]); SWAP4(state->x[7][i]);
             }
 
             /*round 7*roundnumber+3: Sbox, MDS and Swapping layers*/
             for (i = 0; i < 2; i++) {
-                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],((uint64*)E8_bitslice_roundconstant[roundnumber+3])[i],((uint64*)E8_bitslice_roundconstant[roundnumber+3])[i+2] );
+                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],jh_load64(E8_bitslice_roundconstant[roundnumber+3] + 8*(i)),jh_load64(E8_bitslice_roundconstant[roundnumber+3] + 8*(i+2)) );
                   L(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i]);
                   SWAP8(state->x[1][i]); SWAP8(state->x[3][i]); SWAP8(state->x[5][i]); SWAP8(state->x[7][i]);
             }
 
             /*round 7*roundnumber+4: Sbox, MDS and Swapping layers*/
             for (i = 0; i < 2; i++) {
-                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],((uint64*)E8_bitslice_roundconstant[roundnumber+4])[i],((uint64*)E8_bitslice_roundconstant[roundnumber+4])[i+2] );
+                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],jh_load64(E8_bitslice_roundconstant[roundnumber+4] + 8*(i)),jh_load64(E8_bitslice_roundconstant[roundnumber+4] + 8*(i+2)) );
                   L(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i]);
                   SWAP16(state->x[1][i]); SWAP16(state->x[3][i]); SWAP16(state->x[5][i]); SWAP16(state->x[7][i]);
             }
 
             /*round 7*roundnumber+5: Sbox, MDS and Swapping layers*/
             for (i = 0; i < 2; i++) {
-                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],((uint64*)E8_bitslice_roundconstant[roundnumber+5])[i],((uint64*)E8_bitslice_roundconstant[roundnumber+5])[i+2] );
+                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],jh_load64(E8_bitslice_roundconstant[roundnumber+5] + 8*(i)),jh_load64(E8_bitslice_roundconstant[roundnumber+5] + 8*(i+2)) );
                   L(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i]);
                   SWAP32(state->x[1][i]); SWAP32(state->x[3][i]); SWAP32(state->x[5][i]); SWAP32(state->x[7][i]);
             }
 
             /*round 7*roundnumber+6: Sbox and MDS layers*/
             for (i = 0; i < 2; i++) {
-                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],((uint64*)E8_bitslice_roundconstant[roundnumber+6])[i],((uint64*)E8_bitslice_roundconstant[roundnumber+6])[i+2] );
+                  SS(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i],jh_load64(E8_bitslice_roundconstant[roundnumber+6] + 8*(i)),jh_load64(E8_bitslice_roundconstant[roundnumber+6] + 8*(i+2)) );
                   L(state->x[0][i],state->x[2][i],state->x[4][i],state->x[6][i],state->x[1][i],state->x[3][i],state->x[5][i],state->x[7][i]);
             }
             /*round 7*roundnumber+6: swapping layer*/
@@ -216,13 +229,13 @@ static void F8(hashState *state)
       uint64  i;
 
       /*xor the 512-bit message with the fist half of the 1024-bit hash state*/
-      for (i = 0; i < 8; i++)  state->x[i >> 1][i & 1] ^= ((uint64*)state->buffer)[i];
+      for (i = 0; i < 8; i++)  state->x[i >> 1][i & 1] ^= jh_load64(state->buffer + 8*i);
 
       /*the bijective function E8 */
       E8(state);
 
       /*xor the 512-bit message with the second half of the 1024-bit hash state*/
-      for (i = 0; i < 8; i++)  state->x[(8+i) >> 1][(8+i) & 1] ^= ((uint64*)state->buffer)[i];
+      for (i = 0; i < 8; i++)  state->x[(8+i) >> 1][(8+i) & 1] ^= jh_load64(state->buffer + 8*i);
 }
 
 /*before hashing a message, initialize the hash state as H0 */
@@ -365,3 +378,137 @@ HashReturn jh_hash(int hashbitlen, const BitSequence *data,DataLength databitlen
       else
             return(BAD_HASHLEN);
 }
+
+#ifdef TN_X86
+
+/*4-way multi-buffer JH with AVX2: each 64-bit word of the bitslice state holds the same word of four messages*/
+
+#define XOR4(a,b)    _mm256_xor_si256((a),(b))
+#define AND4(a,b)    _mm256_and_si256((a),(b))
+#define ANDN4(a,b)   _mm256_andnot_si256((a),(b))   /* (~a) & b */
+#define OR4(a,b)     _mm256_or_si256((a),(b))
+#define NOT4(a)      _mm256_xor_si256((a),_mm256_set1_epi64x(-1))
+
+#define SWAPN4(x,n,m) (x) = OR4(_mm256_slli_epi64(AND4((x),_mm256_set1_epi64x((long long)(m))),n), _mm256_srli_epi64(ANDN4(_mm256_set1_epi64x((long long)(m)),(x)),n));
+#define SWAP1_4(x)   SWAPN4(x,1,0x5555555555555555ULL)
+#define SWAP2_4(x)   SWAPN4(x,2,0x3333333333333333ULL)
+#define SWAP4_4(x)   SWAPN4(x,4,0x0f0f0f0f0f0f0f0fULL)
+#define SWAP8_4(x)   SWAPN4(x,8,0x00ff00ff00ff00ffULL)
+#define SWAP16_4(x)  SWAPN4(x,16,0x0000ffff0000ffffULL)
+#define SWAP32_4(x)  (x) = _mm256_shuffle_epi32((x),0xb1);
+
+#define L4(m0,m1,m2,m3,m4,m5,m6,m7) \
+      (m4) = XOR4((m4),(m1));        \
+      (m5) = XOR4((m5),(m2));        \
+      (m6) = XOR4((m6),XOR4((m0),(m3))); \
+      (m7) = XOR4((m7),(m0));        \
+      (m0) = XOR4((m0),(m5));        \
+      (m1) = XOR4((m1),(m6));        \
+      (m2) = XOR4((m2),XOR4((m4),(m7))); \
+      (m3) = XOR4((m3),(m4));
+
+#define SS4(m0,m1,m2,m3,m4,m5,m6,m7,cc0,cc1)   \
+      m3  = NOT4(m3);                        \
+      m7  = NOT4(m7);                        \
+      m0 = XOR4(m0, ANDN4(m2,cc0));          \
+      m4 = XOR4(m4, ANDN4(m6,cc1));          \
+      temp0 = XOR4(cc0, AND4(m0,m1));        \
+      temp1 = XOR4(cc1, AND4(m4,m5));        \
+      m0 = XOR4(m0, AND4(m2,m3));            \
+      m4 = XOR4(m4, AND4(m6,m7));            \
+      m3 = XOR4(m3, ANDN4(m1,m2));           \
+      m7 = XOR4(m7, ANDN4(m5,m6));           \
+      m1 = XOR4(m1, AND4(m0,m2));            \
+      m5 = XOR4(m5, AND4(m4,m6));            \
+      m2 = XOR4(m2, ANDN4(m3,m0));           \
+      m6 = XOR4(m6, ANDN4(m7,m4));           \
+      m0 = XOR4(m0, OR4(m1,m3));             \
+      m4 = XOR4(m4, OR4(m5,m7));             \
+      m3 = XOR4(m3, AND4(m1,m2));            \
+      m7 = XOR4(m7, AND4(m5,m6));            \
+      m1 = XOR4(m1, AND4(temp0,m0));         \
+      m5 = XOR4(m5, AND4(temp1,m4));         \
+      m2 = XOR4(m2, temp0);                  \
+      m6 = XOR4(m6, temp1);
+
+#define ROUND4(r,SWAP)                                                                   \
+      for (i = 0; i < 2; i++) {                                                          \
+            cc0 = _mm256_set1_epi64x((long long)jh_load64(E8_bitslice_roundconstant[r] + 8*(i)));   \
+            cc1 = _mm256_set1_epi64x((long long)jh_load64(E8_bitslice_roundconstant[r] + 8*(i+2))); \
+            SS4(x[0][i],x[2][i],x[4][i],x[6][i],x[1][i],x[3][i],x[5][i],x[7][i],cc0,cc1);   \
+            L4(x[0][i],x[2][i],x[4][i],x[6][i],x[1][i],x[3][i],x[5][i],x[7][i]);            \
+            SWAP(x[1][i]) SWAP(x[3][i]) SWAP(x[5][i]) SWAP(x[7][i])                         \
+      }
+
+#define NOSWAP4(x)
+
+TN_TARGET("avx2")
+static void E8_x4(__m256i x[8][2])
+{
+      __m256i temp0, temp1, cc0, cc1, t;
+      int i, roundnumber;
+
+      for (roundnumber = 0; roundnumber < 42; roundnumber = roundnumber+7) {
+            ROUND4(roundnumber+0, SWAP1_4)
+            ROUND4(roundnumber+1, SWAP2_4)
+            ROUND4(roundnumber+2, SWAP4_4)
+            ROUND4(roundnumber+3, SWAP8_4)
+            ROUND4(roundnumber+4, SWAP16_4)
+            ROUND4(roundnumber+5, SWAP32_4)
+            ROUND4(roundnumber+6, NOSWAP4)
+            for (i = 1; i < 8; i = i+2) {
+                  t = x[i][0]; x[i][0] = x[i][1]; x[i][1] = t;
+            }
+      }
+}
+
+/* hash four messages of equal length,
+   only whole 512-bit blocks run in lanes, each message is padded and finished by the scalar Update/Final
+*/
+TN_TARGET("avx2")
+HashReturn jh_hash_x4(int hashbitlen, const BitSequence *const data[4], DataLength databitlen, BitSequence *const hashval[4])
+{
+      hashState state;
+      __m256i x[8][2], m[8];
+      uint64 words[8][2][4];
+      DataLength blocks = databitlen >> 9, b;
+      int i, j, k;
+
+      if ( hashbitlen != 224 && hashbitlen != 256 && hashbitlen != 384 && hashbitlen != 512 )
+            return(BAD_HASHLEN);
+
+      Init(&state, hashbitlen);
+      for (i = 0; i < 8; i++)
+            for (j = 0; j < 2; j++)
+                  x[i][j] = _mm256_set1_epi64x((long long)state.x[i][j]);
+
+      for (b = 0; b < blocks; b++) {
+            for (i = 0; i < 8; i++) {
+                  uint64 w[4];
+                  for (k = 0; k < 4; k++) memcpy(&w[k], data[k] + b * 64 + i * 8, 8);
+                  m[i] = _mm256_setr_epi64x((long long)w[0], (long long)w[1], (long long)w[2], (long long)w[3]);
+            }
+            for (i = 0; i < 8; i++) x[i >> 1][i & 1] = XOR4(x[i >> 1][i & 1], m[i]);
+            E8_x4(x);
+            for (i = 0; i < 8; i++) x[(8+i) >> 1][(8+i) & 1] = XOR4(x[(8+i) >> 1][(8+i) & 1], m[i]);
+      }
+
+      for (i = 0; i < 8; i++)
+            for (j = 0; j < 2; j++)
+                  _mm256_storeu_si256((__m256i*)words[i][j], x[i][j]);
+
+      for (k = 0; k < 4; k++) {
+            hashState lane = state;
+            for (i = 0; i < 8; i++)
+                  for (j = 0; j < 2; j++)
+                        lane.x[i][j] = words[i][j][k];
+            lane.databitlen = blocks << 9;
+            lane.datasize_in_buffer = 0;
+            Update(&lane, data[k] + (blocks << 6), databitlen - (blocks << 9));
+            Final(&lane, hashval[k]);
+      }
+
+      return(SUCCESS);
+}
+
+#endif /* TN_X86 */
@@ -75,10 +75,11 @@ void keccakf(uint64_t st[25], int rounds)
 // compute a keccak hash (md) of given byte length from "in"
 typedef uint64_t state_t[25];
 
-int keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen)
+int keccak(const uint8_t *in, size_t inlen, uint8_t *md, int mdlen)
 {
     state_t st;
     uint8_t temp[144];
+    uint64_t w;
     int i, rsiz, rsizw;
 
     rsiz = sizeof(state_t) == mdlen ? HASH_DATA_AREA : 200 - 2 * mdlen;
@@ -86,9 +87,11 @@ int keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen)
     
     memset(st, 0, sizeof(st));
 
-    for ( ; inlen >= rsiz; inlen -= rsiz, in += rsiz) {
-        for (i = 0; i < rsizw; i++)
-            st[i] ^= ((uint64_t *) in)[i];
+    for ( ; inlen >= (size_t)rsiz; inlen -= rsiz, in += rsiz) {
+        for (i = 0; i < rsizw; i++) {
+            memcpy(&w, in + i * 8, 8);
+            st[i] ^= w;
+        }
         keccakf(st, KECCAK_ROUNDS);
     }
     
@@ -98,8 +101,10 @@ int keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen)
     memset(temp + inlen, 0, rsiz - inlen);
     temp[rsiz - 1] |= 0x80;
 
-    for (i = 0; i < rsizw; i++)
-        st[i] ^= ((uint64_t *) temp)[i];
+    for (i = 0; i < rsizw; i++) {
+        memcpy(&w, temp + i * 8, 8);
+        st[i] ^= w;
+    }
 
     keccakf(st, KECCAK_ROUNDS);
 
@@ -108,7 +113,62 @@ int keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen)
     return 0;
 }
 
-void keccak1600(const uint8_t *in, int inlen, uint8_t *md)
+void keccak1600(const uint8_t *in, size_t inlen, uint8_t *md)
 {
     keccak(in, inlen, md, sizeof(state_t));
 }
+
+// incremental version of keccak(), same padding and output
+
+void keccak_init(keccak_ctx *ctx, int mdlen)
+{
+    memset(ctx->st, 0, sizeof(ctx->st));
+    ctx->rsiz = sizeof(state_t) == mdlen ? HASH_DATA_AREA : 200 - 2 * mdlen;
+    ctx->mdlen = mdlen;
+    ctx->buflen = 0;
+}
+
+static void keccak_absorb(keccak_ctx *ctx, const uint8_t *block)
+{
+    uint64_t w;
+    int i;
+
+    for (i = 0; i < ctx->rsiz / 8; i++) {
+        memcpy(&w, block + i * 8, 8);
+        ctx->st[i] ^= w;
+    }
+    keccakf(ctx->st, KECCAK_ROUNDS);
+}
+
+void keccak_update(keccak_ctx *ctx, const uint8_t *in, size_t inlen)
+{
+    size_t rsiz = ctx->rsiz;
+
+    if (ctx->buflen > 0) {
+        size_t fill = rsiz - ctx->buflen < inlen ? rsiz - ctx->buflen : inlen;
+        memcpy(ctx->buf + ctx->buflen, in, fill);
+        ctx->buflen += fill;
+        in += fill;
+        inlen -= fill;
+        if (ctx->buflen < rsiz) return;
+        keccak_absorb(ctx, ctx->buf);
+        ctx->buflen = 0;
+    }
+
+    // whole blocks are absorbed straight from the input
+    for ( ; inlen >= rsiz; inlen -= rsiz, in += rsiz)
+        keccak_absorb(ctx, in);
+
+    memcpy(ctx->buf, in, inlen);
+    ctx->buflen = inlen;
+}
+
+void keccak_final(keccak_ctx *ctx, uint8_t *md)
+{
+    ctx->buf[ctx->buflen++] = 1;
+    memset(ctx->buf + ctx->buflen, 0, ctx->rsiz - ctx->buflen);
+    ctx->buf[ctx->rsiz - 1] |= 0x80;
+    keccak_absorb(ctx, ctx->buf);
+
+    memcpy(md, ctx->st, ctx->mdlen);
+}
@@ -26,6 +26,7 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "cuda/TuringsNightmareCUDA.h"
 
 #include <cstring>
+#include <stdexcept>
 
 // TODO: cleanup utility dependencies
 #include <chrono>
@@ -128,6 +129,11 @@ void TN_VM_Execute_CUDA(VM_State *mem) {
 }
 
 void DeviceCUDA::run(const size_t N, VM_State *states) {
+	for (size_t i = 0; i < N; ++i) {
+		if (states[i].variant == TN_VARIANT_LANES) throw std::runtime_error("CUDA device does not support TN_VARIANT_LANES.");
+		if (states[i].variant == TN_VARIANT_WORDS) throw std::runtime_error("CUDA device does not support TN_VARIANT_WORDS.");
+	}
+
 	VM_State *buf;
 	cudaMalloc((void**)&buf, sizeof(VM_State) * N);
 	cudaMemcpy(buf, states, sizeof(VM_State) * N, cudaMemcpyHostToDevice);
@@ -0,0 +1,296 @@
+#include "ipc/HashRing.h"
+#include "net/Socket.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TN_RING_PAUSE() _mm_pause()
+#else
+#define TN_RING_PAUSE()
+#endif
+
+#define TN_RING_MAGIC 0x474e495248534e54ull // "TNSHRING"
+
+// Slot state, the client sleeps on it while its request is hashed
+enum : uint32_t {
+	TN_SLOT_PENDING = 0,
+	TN_SLOT_SLEEPING,
+	TN_SLOT_DONE,
+	TN_SLOT_FAILED
+};
+
+struct HashRing::Header {
+	uint64_t magic;
+	uint64_t slots;
+	uint64_t slot_size;
+
+	// Only clients claim slots, the worker side keeps its position (and stop flag) in its own memory
+	alignas(64) std::atomic<uint64_t> enqueue_pos;
+
+	// Bumped on every submit (and stop), idle workers sleep on it
+	alignas(64) std::atomic<uint32_t> requests;
+	std::atomic<uint32_t> workers_sleeping;
+
+	// Bumped whenever a slot is freed, clients sleep on it while the ring is full
+	alignas(64) std::atomic<uint32_t> releases;
+	std::atomic<uint32_t> clients_sleeping;
+};
+
+struct HashRing::Slot {
+	std::atomic<uint64_t> sequence;
+	std::atomic<uint32_t> state;
+	uint32_t size;
+	uint32_t variant;
+	char hash[HASH_SIZE];
+	// slot_size input bytes follow
+};
+
+// Shared between processes, so only address free (lock-free) atomics work
+static_assert(sizeof(std::atomic<uint32_t>) == 4 && sizeof(std::atomic<uint64_t>) == 8, "Atomics must be lock-free");
+
+// Spinning only pays off when the other side runs on another core
+static const unsigned spin_limit = std::thread::hardware_concurrency() > 1 ? TN_RING_SPIN : 0;
+
+static size_t TN_RoundUp(size_t n) {
+	return (n + 63) & ~(size_t)63;
+}
+
+// Not FUTEX_PRIVATE_FLAG, the waiters are in other processes
+static void TN_FutexWait(std::atomic<uint32_t> *word, uint32_t value) {
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, value, nullptr, nullptr, 0);
+}
+
+static void TN_FutexWake(std::atomic<uint32_t> *word, int count) {
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
+
+HashRing::HashRing(size_t slots, size_t slot_size) : slot_count(slots), slot_size(slot_size) {
+	if (slots < 2 || (slots & (slots - 1)) != 0) throw std::runtime_error("HashRing slot count must be a power of two.");
+	if (slot_size == 0 || slot_size >= MEMORY_SIZE) throw std::runtime_error("HashRing slot size must be below MEMORY_SIZE.");
+
+	slot_stride = TN_RoundUp(sizeof(Slot)) + TN_RoundUp(slot_size);
+	size_t size = TN_RoundUp(sizeof(Header)) + slots * slot_stride;
+
+	fd = memfd_create("tn-hash-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) throw std::runtime_error(std::string("Could not create hash ring: ") + strerror(errno));
+
+	// Sealed, so a client can't shrink the file and fault the worker on access
+	if (ftruncate(fd, size) != 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+		std::runtime_error error(std::string("Could not size hash ring: ") + strerror(errno));
+		close(fd);
+		throw error;
+	}
+	map(size);
+
+	new (header) Header();
+	header->slots = slots;
+	header->slot_size = slot_size;
+	for (size_t i = 0; i < slots; ++i) {
+		Slot *s = new (slot(i)) Slot();
+		s->sequence.store(i, std::memory_order_relaxed);
+		s->state.store(TN_SLOT_DONE, std::memory_order_relaxed);
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = TN_RING_MAGIC;
+}
+
+HashRing::HashRing(int fd) : fd(fd) {
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+		close(fd);
+		throw std::runtime_error("Not a hash ring.");
+	}
+	map(st.st_size);
+
+	slot_count = header->slots;
+	slot_size = header->slot_size;
+	slot_stride = TN_RoundUp(sizeof(Slot)) + TN_RoundUp(slot_size);
+	if (header->magic != TN_RING_MAGIC || slot_count < 2 || (slot_count & (slot_count - 1)) != 0 || slot_size >= MEMORY_SIZE ||
+		TN_RoundUp(sizeof(Header)) + slot_count * slot_stride != (size_t)st.st_size) {
+		munmap(mapping, mapped_size);
+		close(fd);
+		throw std::runtime_error("Not a hash ring.");
+	}
+}
+
+std::unique_ptr<HashRing> HashRing::connect(const std::string& address) {
+	int socket = TN_Connect(address);
+	int fd;
+	try {
+		fd = TN_ReceiveFd(socket);
+	} catch (...) {
+		TN_CloseSocket(socket);
+		throw;
+	}
+	TN_CloseSocket(socket);
+	return std::unique_ptr<HashRing>(new HashRing(fd));
+}
+
+HashRing::~HashRing() {
+	munmap(mapping, mapped_size);
+	close(fd);
+}
+
+void HashRing::map(size_t size) {
+	mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		std::runtime_error error(std::string("Could not map hash ring: ") + strerror(errno));
+		close(fd);
+		throw error;
+	}
+	mapped_size = size;
+	header = (Header*)mapping;
+	slot_base = (char*)mapping + TN_RoundUp(sizeof(Header));
+}
+
+HashRing::Slot *HashRing::slot(uint64_t ticket) const {
+	return (Slot*)(slot_base + (ticket & (slot_count - 1)) * slot_stride);
+}
+
+uint64_t HashRing::acquire(char *&buffer) {
+	uint64_t pos = header->enqueue_pos.load(std::memory_order_relaxed);
+	for (unsigned spins = 0;;) {
+		uint32_t releases = header->releases.load();
+		Slot *s = slot(pos);
+		int64_t diff = (int64_t)(s->sequence.load(std::memory_order_acquire) - pos);
+
+		if (diff == 0) {
+			if (header->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			continue;
+		}
+		if (diff < 0) {
+			// Full, the slot is still waiting for the client of the previous round
+			if (++spins < spin_limit) {
+				TN_RING_PAUSE();
+			} else {
+				header->clients_sleeping++;
+				TN_FutexWait(&header->releases, releases);
+				header->clients_sleeping--;
+			}
+		}
+		pos = header->enqueue_pos.load(std::memory_order_relaxed);
+	}
+
+	buffer = (char*)slot(pos) + TN_RoundUp(sizeof(Slot));
+	return pos;
+}
+
+void HashRing::submit(uint64_t ticket, size_t size, const TN_Variant variant) {
+	Slot *s = slot(ticket);
+	s->size = (uint32_t)std::min<size_t>(size, UINT32_MAX);
+	s->variant = variant;
+	s->state.store(TN_SLOT_PENDING, std::memory_order_relaxed);
+	s->sequence.store(ticket + 1, std::memory_order_release);
+
+	header->requests++;
+	if (header->workers_sleeping.load()) TN_FutexWake(&header->requests, 1);
+}
+
+void HashRing::wait(uint64_t ticket, TN_Hash& hash) {
+	Slot *s = slot(ticket);
+	uint32_t state = s->state.load(std::memory_order_acquire);
+	for (unsigned spins = 0; state < TN_SLOT_DONE && spins < spin_limit; ++spins) {
+		TN_RING_PAUSE();
+		state = s->state.load(std::memory_order_acquire);
+	}
+	while (state < TN_SLOT_DONE) {
+		// Tell the worker to wake us, unless it finished meanwhile
+		if (state == TN_SLOT_PENDING && !s->state.compare_exchange_strong(state, TN_SLOT_SLEEPING, std::memory_order_acquire)) continue;
+		TN_FutexWait(&s->state, TN_SLOT_SLEEPING);
+		state = s->state.load(std::memory_order_acquire);
+	}
+	if (state == TN_SLOT_DONE) memcpy(hash.data(), s->hash, HASH_SIZE);
+
+	s->sequence.store(ticket + slot_count, std::memory_order_release);
+	header->releases++;
+	if (header->clients_sleeping.load()) TN_FutexWake(&header->releases, INT_MAX);
+
+	if (state != TN_SLOT_DONE) throw std::runtime_error("Hash ring worker could not hash the input.");
+}
+
+TN_Hash HashRing::hash(const char *input, size_t size, const TN_Variant variant) {
+	if (size > slot_size) throw std::runtime_error("Input is larger than a hash ring slot.");
+
+	char *buffer;
+	uint64_t ticket = acquire(buffer);
+	memcpy(buffer, input, size);
+	submit(ticket, size, variant);
+
+	TN_Hash result;
+	wait(ticket, result);
+	return result;
+}
+
+bool HashRing::take(uint64_t& ticket, const char *&input, size_t& size, TN_Variant& variant) {
+	for (;;) {
+		uint64_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for (unsigned spins = 0;;) {
+			if (stopped.load()) return false;
+
+			uint32_t requests = header->requests.load();
+			Slot *s = slot(pos);
+			int64_t diff = (int64_t)(s->sequence.load(std::memory_order_acquire) - (pos + 1));
+
+			if (diff == 0) {
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+				continue;
+			}
+			if (diff < 0) {
+				if (++spins < spin_limit) {
+					TN_RING_PAUSE();
+				} else {
+					header->workers_sleeping++;
+					TN_FutexWait(&header->requests, requests);
+					header->workers_sleeping--;
+				}
+			} else if (dequeue_pos.load(std::memory_order_relaxed) == pos) {
+				// Ahead while no other worker took the slot, only a client can have written that, skip it instead of spinning
+				dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed);
+			}
+			pos = dequeue_pos.load(std::memory_order_relaxed);
+		}
+
+		// Read once, the client could still change them
+		Slot *s = slot(pos);
+		uint32_t request_size = s->size, request_variant = s->variant;
+		if (request_size > slot_size || request_variant >= _TN_VARIANT_LAST) {
+			complete(pos, nullptr);
+			continue;
+		}
+
+		ticket = pos;
+		input = (const char*)s + TN_RoundUp(sizeof(Slot));
+		size = request_size;
+		variant = (TN_Variant)request_variant;
+		return true;
+	}
+}
+
+void HashRing::complete(uint64_t ticket, const TN_Hash *hash) {
+	Slot *s = slot(ticket);
+	if (hash) memcpy(s->hash, hash->data(), HASH_SIZE);
+	if (s->state.exchange(hash ? TN_SLOT_DONE : TN_SLOT_FAILED, std::memory_order_acq_rel) == TN_SLOT_SLEEPING) {
+		TN_FutexWake(&s->state, 1);
+	}
+}
+
+void HashRing::stop() {
+	stopped = true;
+	header->requests++;
+	TN_FutexWake(&header->requests, INT_MAX);
+}
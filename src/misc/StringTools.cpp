@@ -16,6 +16,7 @@
 // along with Bytecoin.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "misc/StringTools.h"
+#include "crypto/cpu_features.h"
 #include <fstream>
 #include <iomanip>
 
@@ -42,6 +43,48 @@ const uint8_t characterValues[256] = {
   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
 };
 
+const uint8_t base64Values[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+struct Codecs {
+  void (*toHex)(const uint8_t*, size_t, char*);
+  bool (*fromHex)(const char*, size_t, uint8_t*);
+  bool (*base64Decode)(const char*, size_t, uint8_t*);
+};
+
+const Codecs& codecs() {
+  static const Codecs selected = [] {
+#ifdef TN_X86
+    if (tn_cpu_has_avx2()) {
+      return Codecs{ toHexAvx2, fromHexAvx2, base64DecodeAvx2 };
+    }
+
+    if (tn_cpu_has_ssse3()) {
+      return Codecs{ toHexSsse3, fromHexSsse3, base64DecodeSsse3 };
+    }
+#endif
+    return Codecs{ toHexPortable, fromHexPortable, base64DecodePortable };
+  }();
+
+  return selected;
+}
+
 }
 
 std::string asString(const void* data, size_t size) {
@@ -84,8 +127,8 @@ size_t fromHex(const std::string& text, void* data, size_t bufferSize) {
     throw std::runtime_error("fromHex: invalid buffer size");
   }
 
-  for (size_t i = 0; i < text.size() >> 1; ++i) {
-    static_cast<uint8_t*>(data)[i] = fromHex(text[i << 1]) << 4 | fromHex(text[(i << 1) + 1]);
+  if (!fromHex(text.data(), text.size(), data)) {
+    throw std::runtime_error("fromHex: invalid character");
   }
 
   return text.size() >> 1;
@@ -100,18 +143,8 @@ bool fromHex(const std::string& text, void* data, size_t bufferSize, size_t& siz
     return false;
   }
 
-  for (size_t i = 0; i < text.size() >> 1; ++i) {
-    uint8_t value1;
-    if (!fromHex(text[i << 1], value1)) {
-      return false;
-    }
-
-    uint8_t value2;
-    if (!fromHex(text[(i << 1) + 1], value2)) {
-      return false;
-    }
-
-    static_cast<uint8_t*>(data)[i] = value1 << 4 | value2;
+  if (!fromHex(text.data(), text.size(), data)) {
+    return false;
   }
 
   size = text.size() >> 1;
@@ -124,8 +157,8 @@ std::vector<uint8_t> fromHex(const std::string& text) {
   }
 
   std::vector<uint8_t> data(text.size() >> 1);
-  for (size_t i = 0; i < data.size(); ++i) {
-    data[i] = fromHex(text[i << 1]) << 4 | fromHex(text[(i << 1) + 1]);
+  if (!fromHex(text.data(), text.size(), data.data())) {
+    throw std::runtime_error("fromHex: invalid character");
   }
 
   return data;
@@ -136,57 +169,68 @@ bool fromHex(const std::string& text, std::vector<uint8_t>& data) {
     return false;
   }
 
-  for (size_t i = 0; i < text.size() >> 1; ++i) {
-    uint8_t value1;
-    if (!fromHex(text[i << 1], value1)) {
-      return false;
-    }
-
-    uint8_t value2;
-    if (!fromHex(text[(i << 1) + 1], value2)) {
-      return false;
-    }
-
-    data.push_back(value1 << 4 | value2);
+  size_t offset = data.size();
+  data.resize(offset + (text.size() >> 1));
+  if (!fromHex(text.data(), text.size(), data.data() + offset)) {
+    data.resize(offset);
+    return false;
   }
 
   return true;
 }
 
-std::string toHex(const void* data, size_t size) {
-  std::string text;
-  for (size_t i = 0; i < size; ++i) {
-    text += "0123456789abcdef"[static_cast<const uint8_t*>(data)[i] >> 4];
-    text += "0123456789abcdef"[static_cast<const uint8_t*>(data)[i] & 15];
+bool fromHex(const char* text, size_t size, void* data) {
+  if ((size & 1) != 0) {
+    return false;
   }
 
+  return codecs().fromHex(text, size, static_cast<uint8_t*>(data));
+}
+
+std::string toHex(const void* data, size_t size) {
+  std::string text(size << 1, '\0');
+  toHex(data, size, &text[0]);
   return text;
 }
 
 void toHex(const void* data, size_t size, std::string& text) {
-  for (size_t i = 0; i < size; ++i) {
-    text += "0123456789abcdef"[static_cast<const uint8_t*>(data)[i] >> 4];
-    text += "0123456789abcdef"[static_cast<const uint8_t*>(data)[i] & 15];
-  }
+  size_t offset = text.size();
+  text.resize(offset + (size << 1));
+  toHex(data, size, &text[offset]);
 }
 
 std::string toHex(const std::vector<uint8_t>& data) {
-  std::string text;
-  for (size_t i = 0; i < data.size(); ++i) {
-    text += "0123456789abcdef"[data[i] >> 4];
-    text += "0123456789abcdef"[data[i] & 15];
-  }
-
-  return text;
+  return toHex(data.data(), data.size());
 }
 
 void toHex(const std::vector<uint8_t>& data, std::string& text) {
-  for (size_t i = 0; i < data.size(); ++i) {
-    text += "0123456789abcdef"[data[i] >> 4];
-    text += "0123456789abcdef"[data[i] & 15];
+  toHex(data.data(), data.size(), text);
+}
+
+void toHex(const void* data, size_t size, char* text) {
+  codecs().toHex(static_cast<const uint8_t*>(data), size, text);
+}
+
+void toHexPortable(const uint8_t* data, size_t size, char* text) {
+  for (size_t i = 0; i < size; ++i) {
+    text[i << 1] = "0123456789abcdef"[data[i] >> 4];
+    text[(i << 1) + 1] = "0123456789abcdef"[data[i] & 15];
   }
 }
 
+bool fromHexPortable(const char* text, size_t size, uint8_t* data) {
+  // Invalid characters map to 0xff, checked once at the end
+  uint8_t invalid = 0;
+  for (size_t i = 0; i < size >> 1; ++i) {
+    uint8_t value1 = characterValues[static_cast<unsigned char>(text[i << 1])];
+    uint8_t value2 = characterValues[static_cast<unsigned char>(text[(i << 1) + 1])];
+    invalid |= value1 | value2;
+    data[i] = value1 << 4 | value2;
+  }
+
+  return invalid <= 0x0f;
+}
+
 std::string extract(std::string& text, char delimiter) {
   size_t delimiterPosition = text.find(delimiter);
   std::string subText;
@@ -201,70 +245,85 @@ std::string extract(std::string& text, char delimiter) {
 }
 
 std::string extract(const std::string& text, char delimiter, size_t& offset) {
+  size_t start = offset;
   size_t delimiterPosition = text.find(delimiter, offset);
   if (delimiterPosition != std::string::npos) {
     offset = delimiterPosition + 1;
-    return text.substr(offset, delimiterPosition);
+    return text.substr(start, delimiterPosition - start);
   } else {
     offset = text.size();
-    return text.substr(offset);
+    return text.substr(start);
   }
 }
 
-namespace {
+std::string base64Decode(std::string const& encoded_string) {
+  // Decodes up to the first padding or invalid character, a single dangling character is dropped
+  size_t size = 0;
+  while (size < encoded_string.size() && base64Values[static_cast<unsigned char>(encoded_string[size])] < 64) {
+    ++size;
+  }
 
-static const std::string base64chars =
-  "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-  "abcdefghijklmnopqrstuvwxyz"
-  "0123456789+/";
+  if ((size & 3) == 1) {
+    --size;
+  }
 
-bool is_base64(unsigned char c) {
-  return (isalnum(c) || (c == '+') || (c == '/'));
+  std::string ret(size * 3 / 4, '\0');
+  codecs().base64Decode(encoded_string.data(), size, reinterpret_cast<uint8_t*>(&ret[0]));
+  return ret;
 }
 
+size_t base64DecodedSize(size_t size) {
+  return size / 4 * 3 + ((size & 3) > 1 ? (size & 3) - 1 : 0);
 }
 
-std::string base64Decode(std::string const& encoded_string) {
-  size_t in_len = encoded_string.size();
-  size_t i = 0;
-  size_t j = 0;
-  size_t in_ = 0;
-  unsigned char char_array_4[4], char_array_3[3];
-  std::string ret;
-
-  while (in_len-- && (encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-    char_array_4[i++] = encoded_string[in_]; in_++;
-    if (i == 4) {
-      for (i = 0; i <4; i++)
-        char_array_4[i] = (unsigned char)base64chars.find(char_array_4[i]);
-
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-      for (i = 0; (i < 3); i++)
-        ret += char_array_3[i];
-      i = 0;
+bool base64Decode(const char* text, size_t size, void* data, size_t& dataSize) {
+  // Padding only completes the last quad
+  if (size != 0 && (size & 3) == 0 && text[size - 1] == '=') {
+    --size;
+    if (text[size - 1] == '=') {
+      --size;
     }
   }
 
-  if (i) {
-    for (j = i; j <4; j++)
-      char_array_4[j] = 0;
+  if ((size & 3) == 1) {
+    return false;
+  }
 
-    for (j = 0; j <4; j++)
-      char_array_4[j] = (unsigned char)base64chars.find(char_array_4[j]);
+  if (!codecs().base64Decode(text, size, static_cast<uint8_t*>(data))) {
+    return false;
+  }
 
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+  dataSize = size * 3 / 4;
+  return true;
+}
+
+bool base64DecodePortable(const char* text, size_t size, uint8_t* data) {
+  // Invalid characters map to 0xff, checked once at the end
+  uint8_t invalid = 0;
+  auto value = [&](size_t i) {
+    uint8_t v = base64Values[static_cast<unsigned char>(text[i])];
+    invalid |= v;
+    return v;
+  };
 
-    for (j = 0; (j < i - 1); j++) ret += char_array_3[j];
+  size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    uint32_t quad = value(i) << 18 | value(i + 1) << 12 | value(i + 2) << 6 | value(i + 3);
+    *data++ = static_cast<uint8_t>(quad >> 16);
+    *data++ = static_cast<uint8_t>(quad >> 8);
+    *data++ = static_cast<uint8_t>(quad);
   }
 
-  return ret;
-}
+  if (size - i >= 2) {
+    uint32_t quad = value(i) << 18 | value(i + 1) << 12 | (size - i == 3 ? value(i + 2) << 6 : 0);
+    *data++ = static_cast<uint8_t>(quad >> 16);
+    if (size - i == 3) {
+      *data++ = static_cast<uint8_t>(quad >> 8);
+    }
+  }
 
+  return invalid < 64;
+}
 
 bool loadFileToString(const std::string& filepath, std::string& buf) {
   try {
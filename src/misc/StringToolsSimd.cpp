@@ -0,0 +1,187 @@
+// SSSE3 and AVX2 hex and base64 codecs behind the StringTools buffer versions.
+//
+// Every block is validated in registers and only the result of the whole call is reported, the
+// tail shorter than a block goes through the portable version. Output is exactly the same as the
+// portable versions, which remain the reference (see TestStringToolsSanity in test.cpp).
+
+#include "misc/StringTools.h"
+#include "crypto/cpu_features.h"
+
+#ifdef TN_X86
+
+#include <immintrin.h>
+
+namespace StringTools {
+
+namespace {
+
+// Hex digit values of 16 characters, 'valid' is cleared if any of them is not a hex digit
+TN_TARGET("ssse3")
+inline __m128i hexValues(__m128i text, __m128i& valid) {
+  // Digits and, after folding to lower case, letters as unsigned offsets that must stay in range
+  __m128i digit = _mm_sub_epi8(text, _mm_set1_epi8('0'));
+  __m128i letter = _mm_sub_epi8(_mm_or_si128(text, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+  __m128i isLetter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+  valid = _mm_and_si128(valid, _mm_or_si128(isDigit, isLetter));
+  return _mm_or_si128(_mm_and_si128(isDigit, digit), _mm_and_si128(isLetter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+TN_TARGET("avx2")
+inline __m256i hexValues(__m256i text, __m256i& valid) {
+  __m256i digit = _mm256_sub_epi8(text, _mm256_set1_epi8('0'));
+  __m256i letter = _mm256_sub_epi8(_mm256_or_si256(text, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+  __m256i isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+  __m256i isLetter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter);
+  valid = _mm256_and_si256(valid, _mm256_or_si256(isDigit, isLetter));
+  return _mm256_or_si256(_mm256_and_si256(isDigit, digit), _mm256_and_si256(isLetter, _mm256_add_epi8(letter, _mm256_set1_epi8(10))));
+}
+
+// Base64 values of 16 characters by nibble lookups, 'valid' is cleared if any of them is not in the
+// alphabet. Each lower nibble has the bit set of the upper nibbles it is not valid with, so a
+// character is valid exactly when its two lookups share no bit. The upper nibble then picks the
+// offset from the character to its value, '/' shares it with '+' and is moved to its own.
+TN_TARGET("ssse3")
+inline __m128i base64Values(__m128i text, __m128i& valid) {
+  const __m128i lowerBits = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i upperBits = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i offsets = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+
+  __m128i upper = _mm_and_si128(_mm_srli_epi32(text, 4), _mm_set1_epi8(0x0f));
+  __m128i lower = _mm_and_si128(text, _mm_set1_epi8(0x0f));
+  __m128i invalid = _mm_and_si128(_mm_shuffle_epi8(lowerBits, lower), _mm_shuffle_epi8(upperBits, upper));
+  valid = _mm_and_si128(valid, _mm_cmpeq_epi8(invalid, _mm_setzero_si128()));
+
+  __m128i slash = _mm_cmpeq_epi8(text, _mm_set1_epi8('/'));
+  return _mm_add_epi8(text, _mm_shuffle_epi8(offsets, _mm_add_epi8(slash, upper)));
+}
+
+TN_TARGET("avx2")
+inline __m256i base64Values(__m256i text, __m256i& valid) {
+  const __m256i lowerBits = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m256i upperBits = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i offsets = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+
+  __m256i upper = _mm256_and_si256(_mm256_srli_epi32(text, 4), _mm256_set1_epi8(0x0f));
+  __m256i lower = _mm256_and_si256(text, _mm256_set1_epi8(0x0f));
+  __m256i invalid = _mm256_and_si256(_mm256_shuffle_epi8(lowerBits, lower), _mm256_shuffle_epi8(upperBits, upper));
+  valid = _mm256_and_si256(valid, _mm256_cmpeq_epi8(invalid, _mm256_setzero_si256()));
+
+  __m256i slash = _mm256_cmpeq_epi8(text, _mm256_set1_epi8('/'));
+  return _mm256_add_epi8(text, _mm256_shuffle_epi8(offsets, _mm256_add_epi8(slash, upper)));
+}
+
+}
+
+TN_TARGET("ssse3")
+void toHexSsse3(const uint8_t* data, size_t size, char* text) {
+  const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+  const __m128i mask = _mm_set1_epi8(0x0f);
+
+  for (; size >= 16; size -= 16, data += 16, text += 32) {
+    __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    __m128i upper = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(values, 4), mask));
+    __m128i lower = _mm_shuffle_epi8(digits, _mm_and_si128(values, mask));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(text), _mm_unpacklo_epi8(upper, lower));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(text + 16), _mm_unpackhi_epi8(upper, lower));
+  }
+
+  toHexPortable(data, size, text);
+}
+
+TN_TARGET("ssse3")
+bool fromHexSsse3(const char* text, size_t size, uint8_t* data) {
+  __m128i valid = _mm_set1_epi8(-1);
+
+  for (; size >= 32; size -= 32, text += 32, data += 16) {
+    __m128i values1 = hexValues(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text)), valid);
+    __m128i values2 = hexValues(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text + 16)), valid);
+    // Pairs of values to value1 * 16 + value2 in 16 bits, then narrowed back to bytes
+    __m128i pairs1 = _mm_maddubs_epi16(values1, _mm_set1_epi16(0x0110));
+    __m128i pairs2 = _mm_maddubs_epi16(values2, _mm_set1_epi16(0x0110));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data), _mm_packus_epi16(pairs1, pairs2));
+  }
+
+  return _mm_movemask_epi8(valid) == 0xffff && fromHexPortable(text, size, data);
+}
+
+TN_TARGET("ssse3")
+bool base64DecodeSsse3(const char* text, size_t size, uint8_t* data) {
+  // Every 16 characters store 16 bytes for 12 values, so one more block has to follow
+  const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  __m128i valid = _mm_set1_epi8(-1);
+
+  for (; size >= 32; size -= 16, text += 16, data += 12) {
+    __m128i values = base64Values(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text)), valid);
+    // 6 bit values to 12 bits per pair, to 24 bits per quad, then to big endian byte order
+    __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data), _mm_shuffle_epi8(quads, order));
+  }
+
+  return _mm_movemask_epi8(valid) == 0xffff && base64DecodePortable(text, size, data);
+}
+
+TN_TARGET("avx2")
+void toHexAvx2(const uint8_t* data, size_t size, char* text) {
+  const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+
+  for (; size >= 32; size -= 32, data += 32, text += 64) {
+    __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    __m256i upper = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(values, 4), mask));
+    __m256i lower = _mm256_shuffle_epi8(digits, _mm256_and_si256(values, mask));
+    // Unpacking works within 128 bit lanes, the lane halves are put back in order
+    __m256i first = _mm256_unpacklo_epi8(upper, lower);
+    __m256i second = _mm256_unpackhi_epi8(upper, lower);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(text), _mm256_permute2x128_si256(first, second, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(text + 32), _mm256_permute2x128_si256(first, second, 0x31));
+  }
+
+  toHexSsse3(data, size, text);
+}
+
+TN_TARGET("avx2")
+bool fromHexAvx2(const char* text, size_t size, uint8_t* data) {
+  __m256i valid = _mm256_set1_epi8(-1);
+
+  for (; size >= 64; size -= 64, text += 64, data += 32) {
+    __m256i values1 = hexValues(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text)), valid);
+    __m256i values2 = hexValues(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + 32)), valid);
+    __m256i pairs1 = _mm256_maddubs_epi16(values1, _mm256_set1_epi16(0x0110));
+    __m256i pairs2 = _mm256_maddubs_epi16(values2, _mm256_set1_epi16(0x0110));
+    // Packing interleaves the 64 bit halves of both lanes
+    __m256i packed = _mm256_packus_epi16(pairs1, pairs2);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data), _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+
+  return _mm256_movemask_epi8(valid) == -1 && fromHexSsse3(text, size, data);
+}
+
+TN_TARGET("avx2")
+bool base64DecodeAvx2(const char* text, size_t size, uint8_t* data) {
+  // Every 32 characters store 32 bytes for 24 values, so one more block has to follow
+  const __m256i order = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  __m256i valid = _mm256_set1_epi8(-1);
+
+  for (; size >= 64; size -= 32, text += 32, data += 24) {
+    __m256i values = base64Values(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text)), valid);
+    __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+    // 12 values per lane, moved together
+    __m256i ordered = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(quads, order), lanes);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data), ordered);
+  }
+
+  return _mm256_movemask_epi8(valid) == -1 && base64DecodeSsse3(text, size, data);
+}
+
+}
+
+#endif
@@ -0,0 +1,359 @@
+#include "net/Json.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+class Parser {
+public:
+	explicit Parser(const std::string& text) : text(text) {}
+
+	JsonValue document() {
+		JsonValue v = value(0);
+		whitespace();
+		if (pos != text.size()) fail("trailing characters");
+		return v;
+	}
+
+private:
+	static const size_t max_depth = 64;
+
+	[[noreturn]] void fail(const char *what) {
+		throw std::runtime_error(std::string("JSON parse error: ") + what + " at offset " + std::to_string(pos));
+	}
+
+	void whitespace() {
+		while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) pos++;
+	}
+
+	bool consume(char c) {
+		whitespace();
+		if (pos < text.size() && text[pos] == c) {
+			pos++;
+			return true;
+		}
+		return false;
+	}
+
+	void expect(char c) {
+		if (!consume(c)) fail("unexpected character");
+	}
+
+	bool literal(const char *word) {
+		size_t len = strlen(word);
+		if (text.compare(pos, len, word) != 0) return false;
+		pos += len;
+		return true;
+	}
+
+	JsonValue value(size_t depth) {
+		if (depth > max_depth) fail("nesting too deep");
+		whitespace();
+		if (pos >= text.size()) fail("unexpected end");
+
+		char c = text[pos];
+		if (c == '{') return object(depth);
+		if (c == '[') return array(depth);
+		if (c == '"') return JsonValue(string());
+		if (literal("true")) return JsonValue(true);
+		if (literal("false")) return JsonValue(false);
+		if (literal("null")) return JsonValue();
+		return number();
+	}
+
+	JsonValue object(size_t depth) {
+		// Indexed by name, a repeated member replaces the earlier value in place like set() but without its linear scan
+		JsonValue::Object members;
+		std::unordered_map<std::string, size_t> index;
+		expect('{');
+		if (consume('}')) return JsonValue(members);
+		do {
+			whitespace();
+			if (pos >= text.size() || text[pos] != '"') fail("expected member name");
+			std::string key = string();
+			expect(':');
+			JsonValue member = value(depth + 1);
+
+			auto found = index.find(key);
+			if (found != index.end()) {
+				members[found->second].second = std::move(member);
+			} else {
+				index.emplace(key, members.size());
+				members.emplace_back(std::move(key), std::move(member));
+			}
+		} while (consume(','));
+		expect('}');
+		return JsonValue(members);
+	}
+
+	JsonValue array(size_t depth) {
+		JsonValue v = JsonValue(JsonValue::Array());
+		expect('[');
+		if (consume(']')) return v;
+		do {
+			v.push(value(depth + 1));
+		} while (consume(','));
+		expect(']');
+		return v;
+	}
+
+	static void utf8(std::string& out, uint32_t cp) {
+		if (cp < 0x80) {
+			out += (char)cp;
+		} else if (cp < 0x800) {
+			out += (char)(0xc0 | (cp >> 6));
+			out += (char)(0x80 | (cp & 0x3f));
+		} else if (cp < 0x10000) {
+			out += (char)(0xe0 | (cp >> 12));
+			out += (char)(0x80 | ((cp >> 6) & 0x3f));
+			out += (char)(0x80 | (cp & 0x3f));
+		} else {
+			out += (char)(0xf0 | (cp >> 18));
+			out += (char)(0x80 | ((cp >> 12) & 0x3f));
+			out += (char)(0x80 | ((cp >> 6) & 0x3f));
+			out += (char)(0x80 | (cp & 0x3f));
+		}
+	}
+
+	uint32_t hex4() {
+		if (pos + 4 > text.size()) fail("bad unicode escape");
+		uint32_t cp = 0;
+		for (size_t i = 0; i < 4; ++i) {
+			char c = text[pos++];
+			cp <<= 4;
+			if (c >= '0' && c <= '9') cp |= c - '0';
+			else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+			else fail("bad unicode escape");
+		}
+		return cp;
+	}
+
+	std::string string() {
+		std::string out;
+		pos++; // Opening quote
+		for (;;) {
+			if (pos >= text.size()) fail("unterminated string");
+			char c = text[pos++];
+			if (c == '"') return out;
+			if ((unsigned char)c < 0x20) fail("control character in string");
+			if (c != '\\') {
+				out += c;
+				continue;
+			}
+
+			if (pos >= text.size()) fail("unterminated string");
+			switch (text[pos++]) {
+			case '"': out += '"'; break;
+			case '\\': out += '\\'; break;
+			case '/': out += '/'; break;
+			case 'b': out += '\b'; break;
+			case 'f': out += '\f'; break;
+			case 'n': out += '\n'; break;
+			case 'r': out += '\r'; break;
+			case 't': out += '\t'; break;
+			case 'u': {
+				uint32_t cp = hex4();
+				if (cp >= 0xd800 && cp < 0xdc00 && text.compare(pos, 2, "\\u") == 0) {
+					pos += 2;
+					uint32_t low = hex4();
+					if (low < 0xdc00 || low >= 0xe000) fail("bad surrogate pair");
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+				}
+				utf8(out, cp);
+				break;
+			}
+			default:
+				fail("bad escape");
+			}
+		}
+	}
+
+	bool digits() {
+		size_t start = pos;
+		while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9') pos++;
+		return pos > start;
+	}
+
+	// Only the JSON grammar, strtod alone would also take nan, inf, hex floats and leading '+'
+	JsonValue number() {
+		size_t start = pos;
+		if (pos < text.size() && text[pos] == '-') pos++;
+		if (pos < text.size() && text[pos] == '0') pos++;
+		else if (!digits()) fail("unexpected character");
+		if (pos < text.size() && text[pos] == '.') {
+			pos++;
+			if (!digits()) fail("bad number");
+		}
+		if (pos < text.size() && (text[pos] == 'e' || text[pos] == 'E')) {
+			pos++;
+			if (pos < text.size() && (text[pos] == '+' || text[pos] == '-')) pos++;
+			if (!digits()) fail("bad number");
+		}
+
+		double v = strtod(text.substr(start, pos - start).c_str(), nullptr);
+		if (!std::isfinite(v)) fail("number out of range");
+		return JsonValue(v);
+	}
+
+	const std::string& text;
+	size_t pos = 0;
+};
+
+const JsonValue null_value;
+
+}
+
+JsonValue JsonValue::parse(const std::string& text) {
+	return Parser(text).document();
+}
+
+std::string JsonValue::dump() const {
+	std::string out;
+	dump(out);
+	return out;
+}
+
+static void dumpString(const std::string& s, std::string& out) {
+	out += '"';
+	for (char c : s) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if ((unsigned char)c < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				out += buf;
+			} else {
+				out += c;
+			}
+		}
+	}
+	out += '"';
+}
+
+void JsonValue::dump(std::string& out) const {
+	switch (type) {
+	case NIL:
+		out += "null";
+		break;
+	case BOOL:
+		out += boolean ? "true" : "false";
+		break;
+	case NUMBER: {
+		char buf[32];
+		if (!std::isfinite(number)) snprintf(buf, sizeof(buf), "null");
+		else if (number == std::floor(number) && std::fabs(number) < 9007199254740992.0) snprintf(buf, sizeof(buf), "%lld", (long long)number);
+		else snprintf(buf, sizeof(buf), "%.17g", number);
+		out += buf;
+		break;
+	}
+	case STRING:
+		dumpString(string, out);
+		break;
+	case ARRAY:
+		out += '[';
+		for (size_t i = 0; i < array.size(); ++i) {
+			if (i) out += ',';
+			array[i].dump(out);
+		}
+		out += ']';
+		break;
+	case OBJECT:
+		out += '{';
+		for (size_t i = 0; i < members.size(); ++i) {
+			if (i) out += ',';
+			dumpString(members[i].first, out);
+			out += ':';
+			members[i].second.dump(out);
+		}
+		out += '}';
+		break;
+	}
+}
+
+bool JsonValue::asBool() const {
+	if (type != BOOL) throw std::runtime_error("JSON value is not a bool");
+	return boolean;
+}
+
+double JsonValue::asNumber() const {
+	if (type != NUMBER) throw std::runtime_error("JSON value is not a number");
+	return number;
+}
+
+uint64_t JsonValue::asUInt() const {
+	// 2^64 and above (and NaN) don't fit, casting them is undefined
+	if (type != NUMBER || !(number >= 0 && number < 18446744073709551616.0) || number != std::floor(number)) {
+		throw std::runtime_error("JSON value is not an unsigned integer");
+	}
+	return (uint64_t)number;
+}
+
+const std::string& JsonValue::asString() const {
+	if (type != STRING) throw std::runtime_error("JSON value is not a string");
+	return string;
+}
+
+const JsonValue::Array& JsonValue::asArray() const {
+	if (type != ARRAY) throw std::runtime_error("JSON value is not an array");
+	return array;
+}
+
+const JsonValue::Object& JsonValue::asObject() const {
+	if (type != OBJECT) throw std::runtime_error("JSON value is not an object");
+	return members;
+}
+
+const JsonValue& JsonValue::operator[](const std::string& key) const {
+	if (type == OBJECT) {
+		for (auto &m : members) if (m.first == key) return m.second;
+	}
+	return null_value;
+}
+
+const JsonValue& JsonValue::operator[](size_t index) const {
+	if (type == ARRAY && index < array.size()) return array[index];
+	return null_value;
+}
+
+bool JsonValue::has(const std::string& key) const {
+	if (type != OBJECT) return false;
+	for (auto &m : members) if (m.first == key) return true;
+	return false;
+}
+
+size_t JsonValue::size() const {
+	if (type == ARRAY) return array.size();
+	if (type == OBJECT) return members.size();
+	return 0;
+}
+
+JsonValue& JsonValue::set(const std::string& key, const JsonValue& value) {
+	if (type == NIL) type = OBJECT;
+	if (type != OBJECT) throw std::runtime_error("JSON value is not an object");
+	for (auto &m : members) {
+		if (m.first == key) {
+			m.second = value;
+			return *this;
+		}
+	}
+	members.emplace_back(key, value);
+	return *this;
+}
+
+JsonValue& JsonValue::push(const JsonValue& value) {
+	if (type == NIL) type = ARRAY;
+	if (type != ARRAY) throw std::runtime_error("JSON value is not an array");
+	array.push_back(value);
+	return *this;
+}
@@ -0,0 +1,243 @@
+#include "net/Socket.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const char unix_prefix[] = "unix:";
+
+static bool TN_IsUnixAddress(const std::string& address) {
+	return address.compare(0, sizeof(unix_prefix) - 1, unix_prefix) == 0;
+}
+
+static sockaddr_un TN_UnixAddress(const std::string& address) {
+	std::string path = address.substr(sizeof(unix_prefix) - 1);
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || path.length() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("Invalid Unix socket path: " + path);
+	}
+	memcpy(addr.sun_path, path.c_str(), path.length());
+	return addr;
+}
+
+static addrinfo *TN_Resolve(const std::string& address, bool passive) {
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos) {
+		throw std::runtime_error("Address must be host:port or unix:/path: " + address);
+	}
+	std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+	if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+
+	addrinfo hints, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (passive) hints.ai_flags = AI_PASSIVE;
+
+	int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+	if (err != 0) {
+		throw std::runtime_error("Could not resolve " + address + ": " + gai_strerror(err));
+	}
+	return result;
+}
+
+static std::runtime_error TN_SocketError(const std::string& what, const std::string& address) {
+	return std::runtime_error(what + " " + address + ": " + strerror(errno));
+}
+
+int TN_Listen(const std::string& address, int backlog) {
+	if (TN_IsUnixAddress(address)) {
+		sockaddr_un addr = TN_UnixAddress(address);
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) throw TN_SocketError("Could not create socket for", address);
+
+		unlink(addr.sun_path); // Left behind by an earlier run
+		if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, backlog) != 0) {
+			std::runtime_error error = TN_SocketError("Could not listen on", address);
+			close(fd);
+			throw error;
+		}
+		return fd;
+	}
+
+	addrinfo *result = TN_Resolve(address, true);
+	int fd = -1;
+	for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) continue;
+
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, backlog) == 0) break;
+
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+
+	if (fd < 0) throw TN_SocketError("Could not listen on", address);
+	return fd;
+}
+
+int TN_Connect(const std::string& address) {
+	if (TN_IsUnixAddress(address)) {
+		sockaddr_un addr = TN_UnixAddress(address);
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) throw TN_SocketError("Could not create socket for", address);
+
+		if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+			std::runtime_error error = TN_SocketError("Could not connect to", address);
+			close(fd);
+			throw error;
+		}
+		return fd;
+	}
+
+	addrinfo *result = TN_Resolve(address, false);
+	int fd = -1;
+	for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+
+	if (fd < 0) throw TN_SocketError("Could not connect to", address);
+
+	// Small request/response messages, don't wait to coalesce them
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+int TN_Accept(int listener) {
+	int fd = accept(listener, nullptr, nullptr);
+	if (fd < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) return -1;
+		if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) return TN_ACCEPT_EXHAUSTED;
+		throw TN_SocketError("Could not accept on", "listener");
+	}
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Fails harmlessly on Unix sockets
+	return fd;
+}
+
+void TN_SetNonBlocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		throw TN_SocketError("Could not make non-blocking", "socket");
+	}
+}
+
+void TN_CloseSocket(int fd) {
+	if (fd >= 0) close(fd);
+}
+
+void TN_SendFd(int socket, int fd) {
+	char byte = 0;
+	iovec iov = { &byte, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(socket, &msg, MSG_NOSIGNAL) != 1) throw TN_SocketError("Could not send descriptor on", "socket");
+}
+
+int TN_ReceiveFd(int socket) {
+	char byte;
+	iovec iov = { &byte, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t n;
+	while ((n = recvmsg(socket, &msg, 0)) < 0 && errno == EINTR) {}
+	if (n < 0) throw TN_SocketError("Could not receive descriptor on", "socket");
+
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (n == 0 || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		throw std::runtime_error("Peer did not send a descriptor.");
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+LineSocket::LineSocket(const std::string& address, const size_t max_line) : fd(TN_Connect(address)), max_line(max_line) {
+}
+
+LineSocket::~LineSocket() {
+	TN_CloseSocket(fd);
+}
+
+void LineSocket::send(const std::string& line) {
+	std::string data = line + "\n";
+	for (size_t sent = 0; sent < data.size();) {
+		ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			throw TN_SocketError("Could not send on", "socket");
+		}
+		sent += n;
+	}
+}
+
+bool LineSocket::receive(std::string& line) {
+	for (;;) {
+		size_t newline = buffer.find('\n', scanned);
+		if (newline != std::string::npos) {
+			line = buffer.substr(0, newline);
+			buffer.erase(0, newline + 1);
+			scanned = 0;
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			return true;
+		}
+		// Only what arrives next is searched, and a peer never sending a newline can't grow the buffer forever
+		scanned = buffer.size();
+		if (scanned > max_line) throw std::runtime_error("Line longer than " + std::to_string(max_line) + " bytes received.");
+
+		char chunk[4096];
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n == 0) return false;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			throw TN_SocketError("Could not receive on", "socket");
+		}
+		buffer.append(chunk, n);
+	}
+}
+
+void LineSocket::shutdown() {
+	::shutdown(fd, SHUT_RDWR);
+}
@@ -0,0 +1,59 @@
+#include "net/Stratum.h"
+#include "misc/StringTools.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+static uint64_t TN_ReadLE(const uint8_t *data, size_t size) {
+	uint64_t value = 0;
+	for (size_t i = size; i-- > 0;) value = (value << 8) | data[i];
+	return value;
+}
+
+static std::string TN_WriteLE(uint64_t value, size_t size) {
+	uint8_t data[8];
+	for (size_t i = 0; i < size; ++i) data[i] = (uint8_t)(value >> (8 * i));
+	return StringTools::toHex(data, size);
+}
+
+uint64_t TN_StratumTarget(const std::string& hex) {
+	uint8_t data[8];
+	size_t size;
+	if ((hex.size() != 8 && hex.size() != 16) || !StringTools::fromHex(hex, data, sizeof(data), size)) {
+		throw std::runtime_error("Invalid stratum target: " + hex);
+	}
+
+	uint64_t target = TN_ReadLE(data, size);
+	if (size == 8) return target;
+
+	// Compact targets are 0xFFFFFFFF / difficulty, widen to the same difficulty on 64 bits
+	if (target == 0) throw std::runtime_error("Invalid stratum target: " + hex);
+	return UINT64_MAX / (0xFFFFFFFFull / target);
+}
+
+std::string TN_StratumTargetHex(uint64_t difficulty) {
+	if (difficulty == 0) difficulty = 1;
+	return TN_WriteLE(std::max<uint64_t>(1, 0xFFFFFFFFull / difficulty), 4);
+}
+
+bool TN_StratumMeetsTarget(const TN_Hash& hash, uint64_t target) {
+	return TN_ReadLE((const uint8_t*)hash.data() + HASH_SIZE - 8, 8) < target;
+}
+
+std::string TN_StratumBlob(const std::string& blob, uint32_t nonce) {
+	if (blob.size() < TN_STRATUM_NONCE_OFFSET + 4) throw std::runtime_error("Stratum blob too short for a nonce.");
+	std::string out = blob;
+	for (size_t i = 0; i < 4; ++i) out[TN_STRATUM_NONCE_OFFSET + i] = (char)(nonce >> (8 * i));
+	return out;
+}
+
+std::string TN_StratumNonceHex(uint32_t nonce) {
+	return TN_WriteLE(nonce, 4);
+}
+
+uint32_t TN_StratumNonce(const std::string& hex) {
+	uint8_t data[4];
+	size_t size;
+	if (hex.size() != 8 || !StringTools::fromHex(hex, data, sizeof(data), size)) throw std::runtime_error("Invalid stratum nonce: " + hex);
+	return (uint32_t)TN_ReadLE(data, 4);
+}
@@ -24,10 +24,33 @@ OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
 WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 #include "opencl/TuringsNightmareCL.h"
+#include "misc/StringTools.h"
+
+extern "C" {
+#include "crypto/blake256.h"
+}
 
 // TODO: cleanup utility dependencies
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// First line of a program cache file, followed by the key, the build time and the binary
+#define TN_CL_CACHE_MAGIC "TN OpenCL program cache 1"
+
+// Hash functions, in TuringsNightmareCLCrypto.cpp
+extern const char *crypto_source;
 
 // TODO: somehow make opencl use state and instruction enum from common
 const char *source = R"===(
@@ -52,6 +75,8 @@ typedef struct {
 	ulong register_d;
 
 	uchar memory[MEMORY_SIZE];
+
+	ulong variant;
 } VM_State;
 
 #define ENTANGLED_UINT8 (uchar)(state->step_counter ^ state->register_a ^ state->register_b ^ state->register_c ^ state->register_d ^ state->hs.w[state->step_counter % 25] ^ state->hs.b[state->step_counter % 200] ^ state->step_limit ^ state->input_size)
@@ -66,6 +91,21 @@ inline uchar* TN_AtRelPos(VM_State *state, int position) {
 
 #define MEM(relpos) *TN_AtRelPos(state, relpos)
 
+inline ulong TN_LoadWord(VM_State *state, int position) {
+	ulong pos = (state->instruction_ptr + position) % state->memory_size;
+	ulong word = 0;
+	for (uint i = 0; i < 8; ++i) word |= (ulong)state->memory[(pos + i) % state->memory_size] << (8 * i);
+	return word;
+}
+
+inline void TN_StoreWord(VM_State *state, int position, ulong word) {
+	ulong pos = (state->instruction_ptr + position) % state->memory_size;
+	for (uint i = 0; i < 8; ++i) state->memory[(pos + i) % state->memory_size] = (uchar)(word >> (8 * i));
+}
+
+#define WORD(relpos) TN_LoadWord(state, relpos)
+#define SETWORD(relpos, word) TN_StoreWord(state, relpos, word)
+
 inline void TN_AdjustCycleLimit(VM_State *state, int change) {
 	state->step_limit += change;
 
@@ -91,7 +131,14 @@ typedef enum {
 	REGD_XOR,
 	CYCLEADD,
 	CYCLESUB,
-	_LAST
+	_LAST,
+
+	WORD_LOAD = _LAST,
+	WORD_XOR,
+	WORD_ADD,
+	WORD_ROT,
+	WORD_MUL,
+	_LAST_WORDS
 } VM_Instruction;
 
 inline void TN_ParseInstruction(VM_State *state, VM_Instruction inst) {
@@ -145,6 +192,21 @@ inline void TN_ParseInstruction(VM_State *state, VM_Instruction inst) {
 	case CYCLESUB:
 		MODCYCLES(-1 * ENTANGLED_UINT8);
 		break;
+	case WORD_LOAD:
+		state->register_a = rotate(state->register_a, (ulong)8) ^ WORD(MEM(1));
+		break;
+	case WORD_XOR:
+		SETWORD(0, WORD(0) ^ WORD(MEM(1) + 8) ^ state->register_b);
+		break;
+	case WORD_ADD:
+		SETWORD(0, WORD(0) + WORD(MEM(1) + 8) + state->register_c);
+		break;
+	case WORD_ROT:
+		SETWORD(0, rotate(WORD(0), (ulong)(ENTANGLED_UINT8 % 63 + 1)) ^ state->register_d);
+		break;
+	case WORD_MUL:
+		SETWORD(0, WORD(0) * (WORD(MEM(1) + 8) | 1));
+		break;
 	default:
 	case NOOP:
 		break;
@@ -152,20 +214,216 @@ inline void TN_ParseInstruction(VM_State *state, VM_Instruction inst) {
 }
 
 VM_Instruction TN_GetInstruction(VM_State *state) {
+	if (state->variant == TN_VARIANT_WORDS) return (VM_Instruction)((state->memory[state->instruction_ptr] ^ ENTANGLED_UINT64) % _LAST_WORDS);
 	return (VM_Instruction)((state->memory[state->instruction_ptr] ^ ENTANGLED_UINT64) % _LAST);
 }
 
-kernel void Turings_Nightmare(global VM_State *mem) {
+kernel void Turings_Nightmare(global VM_State *mem, ulong max_steps) {
 	global VM_State *state = &mem[get_global_id(0)];
-	for (; state->step_counter <= state->step_limit; state->step_counter++) {
+	for (ulong steps = 0; state->step_counter <= state->step_limit && steps < max_steps; state->step_counter++, steps++) {
 		VM_Instruction inst = TN_GetInstruction(state);
 		TN_ParseInstruction(state, inst);
 		state->instruction_ptr = (state->instruction_ptr + 1) % state->memory_size;
 	}
 }
+
+// Init and finalize as on the host, so a batch only uploads the inputs and reads back the digests
+
+#define FINAL_JH 0
+#define FINAL_BLAKE 1
+#define FINAL_GROESTL 2
+#define TREE_KECCAK 3
+
+#define TN_TREE_NODE_MAX ((VM_STATE_HASHED_SIZE + TN_TREE_CHUNK_SIZE - 1) / TN_TREE_CHUNK_SIZE * HASH_SIZE + 8)
+
+void TN_FinalHash(uint algorithm, const uchar *data, ulong len, uchar *out) {
+	switch (algorithm) {
+	case FINAL_JH:
+		TN_JH256(data, len, out);
+		break;
+	case FINAL_BLAKE:
+		TN_Blake256(data, len, out);
+		break;
+	case FINAL_GROESTL:
+		TN_Groestl256(data, len, out);
+		break;
+	case TREE_KECCAK:
+		TN_Keccak(data, len, out, HASH_SIZE);
+		break;
+	}
+}
+
+// Root node input of TN_TreeHash: the chaining values of the chunks and the 64-bit little endian length, returns its size
+ulong TN_TreeNode(uint leaf, const uchar *data, ulong len, uchar *node) {
+	ulong size = 0;
+	for (ulong offset = 0; offset < len; offset += TN_TREE_CHUNK_SIZE, size += HASH_SIZE) {
+		TN_FinalHash(leaf, data + offset, min((ulong)TN_TREE_CHUNK_SIZE, len - offset), node + size);
+	}
+	for (uint i = 0; i < 8; ++i) node[size++] = (uchar)(len >> (8 * i));
+	return size;
+}
+
+// TN_VM_Init of input i, which is inputs from offsets[i] to offsets[i + 1]
+kernel void TN_Init(global VM_State *mem, global const uchar *inputs, global const ulong *offsets, ulong variant) {
+	global VM_State *state = &mem[get_global_id(0)];
+	global const uchar *in = inputs + offsets[get_global_id(0)];
+	ulong in_len = offsets[get_global_id(0) + 1] - offsets[get_global_id(0)];
+
+	state->instruction_ptr = 0;
+	state->step_counter = 0;
+	state->memory_size = MEMORY_SIZE;
+	state->step_limit_max = state->memory_size * MAX_CYCLES;
+	state->step_limit_min = state->memory_size * MIN_CYCLES;
+	state->step_limit = state->memory_size * NRM_CYCLES;
+	state->input_size = 0;
+	state->register_a = 0;
+	state->register_b = 0;
+	state->register_c = 0;
+	state->register_d = 0;
+	state->variant = variant;
+
+	if (variant == TN_VARIANT_AES) {
+		TN_Keccak(in, in_len, state->hs.b, 200);
+		TN_AESExpand(state->hs.b, state->hs.b + 64, state->memory, MEMORY_SIZE);
+		return;
+	}
+
+	// Input repeated, the last copy cut off
+	for (ulong i = 0, j = 0; i < MEMORY_SIZE; ++i) {
+		state->memory[i] = in[j];
+		if (++j == in_len) j = 0;
+	}
+
+	if (variant == TN_VARIANT_TREE) {
+		uchar node[TN_TREE_NODE_MAX];
+		TN_Keccak(node, TN_TreeNode(TREE_KECCAK, state->memory, MEMORY_SIZE, node), state->hs.b, 200);
+		return;
+	}
+
+	TN_Keccak(state->memory, MEMORY_SIZE, state->hs.b, 200);
+}
+
+// TN_VM_Finalize into HASH_SIZE bytes of digests per state
+kernel void TN_Finalize(global const VM_State *mem, global uchar *digests) {
+	global const VM_State *state = &mem[get_global_id(0)];
+	global const uchar *data = (global const uchar*)state;
+	global uchar *out = digests + get_global_id(0) * HASH_SIZE;
+	uint algorithm = ENTANGLED_UINT8 % 3;
+
+	if (state->variant == TN_VARIANT_TREE) {
+		uchar node[TN_TREE_NODE_MAX];
+		TN_FinalHash(algorithm, node, TN_TreeNode(algorithm, data, VM_STATE_HASHED_SIZE, node), out);
+		return;
+	}
+
+	TN_FinalHash(algorithm, data, VM_STATE_HASHED_SIZE, out);
+}
+
+// Regrouped execution: short bursts, between them the states are sorted so neighbouring work-items take the same case
+
+#define TN_OPCODE_FINISHED 0xff
+
+// Cases with the same shape of code
+uint TN_OpcodeClass(VM_Instruction inst) {
+	switch (inst) {
+	case XOR: case XOR2: case XOR3: case DIV: case ADD: case SUB:
+		return 1;
+	case INSTPTR: case JUMP:
+		return 2;
+	case REGA_XOR: case REGB_XOR: case REGC_XOR: case REGD_XOR:
+		return 3;
+	case CYCLEADD: case CYCLESUB:
+		return 4;
+	case WORD_LOAD: case WORD_XOR: case WORD_ADD: case WORD_ROT: case WORD_MUL:
+		return 5;
+	default:
+		return 0;
+	}
+}
+
+uint TN_RegroupKey(global VM_State *state, ulong mode) {
+	if (state->step_counter > state->step_limit) return _LAST_WORDS;
+	VM_Instruction inst = TN_GetInstruction(state);
+	return mode == TN_CL_REGROUP_CLASS ? TN_OpcodeClass(inst) : (uint)inst;
+}
+
+// One work-item: counting sort of the n state indices into order by key, finished states last. active[0] is the
+// work-items the burst has to run (all of them in the original order), active[1] the states not finished yet.
+kernel void TN_Regroup(global VM_State *mem, ulong n, ulong mode, global uint *order, global uint *active) {
+	uint counts[_LAST_WORDS + 1];
+	for (uint k = 0; k <= _LAST_WORDS; ++k) counts[k] = 0;
+	for (ulong i = 0; i < n; ++i) counts[TN_RegroupKey(&mem[i], mode)]++;
+	uint unfinished = n - counts[_LAST_WORDS];
+
+	if (mode != TN_CL_REGROUP_OPCODE && mode != TN_CL_REGROUP_CLASS) {
+		for (ulong i = 0; i < n; ++i) order[i] = i;
+		active[0] = n;
+		active[1] = unfinished;
+		return;
+	}
+
+	for (uint k = 0, next = 0; k <= _LAST_WORDS; ++k) {
+		uint count = counts[k];
+		counts[k] = next;
+		next += count;
+	}
+	for (ulong i = 0; i < n; ++i) order[counts[TN_RegroupKey(&mem[i], mode)]++] = i;
+	active[0] = unfinished;
+	active[1] = unfinished;
+}
+
+// Work-item g runs state order[g] for up to steps steps, as Turings_Nightmare does, and records the opcode of each
+// step in trace[step * n + g], TN_OPCODE_FINISHED when it had nothing to run
+kernel void TN_Burst(global VM_State *mem, global const uint *order, global const uint *active, ulong steps, global uchar *trace) {
+	ulong g = get_global_id(0), n = get_global_size(0);
+	global VM_State *state = &mem[order[g]];
+	bool running = g < active[0];
+
+	for (ulong s = 0; s < steps; ++s) {
+		uchar opcode = TN_OPCODE_FINISHED;
+		if (running && state->step_counter <= state->step_limit) {
+			VM_Instruction inst = TN_GetInstruction(state);
+			TN_ParseInstruction(state, inst);
+			state->instruction_ptr = (state->instruction_ptr + 1) % state->memory_size;
+			state->step_counter++;
+			opcode = (uchar)inst;
+		}
+		trace[s * n + g] = opcode;
+	}
+}
+
+// Work-item s adds up step s of the burst: the VM steps run, and the lane steps a SIMD device with wavefronts of
+// width work-items spends on them when it runs every distinct case of a wavefront one after the other. Sorted by
+// class, a class is one case, as the code for it would be shared.
+kernel void TN_LaneStats(global const uchar *trace, ulong n, ulong width, ulong mode, global ulong *stats) {
+	ulong s = get_global_id(0);
+	ulong steps = 0, lane_steps = 0;
+
+	for (ulong first = 0; first < n; first += width) {
+		uint cases = 0;
+		for (ulong g = first; g < min(first + width, n); ++g) {
+			uchar opcode = trace[s * n + g];
+			if (opcode == TN_OPCODE_FINISHED) continue;
+			cases |= 1u << (mode == TN_CL_REGROUP_CLASS ? TN_OpcodeClass((VM_Instruction)opcode) : opcode);
+			steps++;
+		}
+		lane_steps += popcount(cases) * width;
+	}
+
+	stats[2 * s] += steps;
+	stats[2 * s + 1] += lane_steps;
+}
 )===";
 
 DeviceCL::DeviceCL() {
+	cl_device_type type = CL_DEVICE_TYPE_GPU;
+	if (const char *env = getenv("TN_OPENCL_DEVICE")) {
+		std::string wanted = env;
+		if (wanted == "cpu") type = CL_DEVICE_TYPE_CPU;
+		else if (wanted == "all") type = CL_DEVICE_TYPE_ALL;
+		else if (wanted != "gpu") throw std::runtime_error("TN_OPENCL_DEVICE must be gpu, cpu or all.");
+	}
+
 	std::vector<cl::Platform> platform;
 	cl::Platform::get(&platform);
 
@@ -176,7 +434,12 @@ DeviceCL::DeviceCL() {
 	for (auto p = platform.begin(); p != platform.end(); p++) {
 		std::vector<cl::Device> pldev;
 
-		p->getDevices(CL_DEVICE_TYPE_GPU, &pldev);
+		// Platforms without a device of the type throw CL_DEVICE_NOT_FOUND
+		try {
+			p->getDevices(type, &pldev);
+		} catch (cl::Error&) {
+			continue;
+		}
 
 		for (auto d = pldev.begin(); d != pldev.end(); d++) {
 			if (!d->getInfo<CL_DEVICE_AVAILABLE>()) continue;
@@ -189,25 +452,399 @@ DeviceCL::DeviceCL() {
 	throw std::runtime_error("No OpenCL device found.");
 }
 
+DeviceCL::~DeviceCL() {
+	for (auto &slot : slots) {
+		try {
+			release(slot);
+		} catch (cl::Error&) {
+			// Nothing left to do about it
+		}
+	}
+}
+
 void DeviceCL::init(cl::Device dev) {
 	device = dev;
 	context = cl::Context(device);
 
-	queue = cl::CommandQueue(context, device);
-	program = cl::Program(context, cl::Program::Sources(1, std::make_pair(source, strlen(source))));
+	for (auto &slot : slots) slot.queue = cl::CommandQueue(context, device);
+
+	std::string params = std::string("-cl-std=CL2.0 -DMEMORY_SIZE=") + std::to_string(MEMORY_SIZE)
+		+ " -DHASH_SIZE=" + std::to_string(HASH_SIZE)
+		+ " -DVM_STATE_HASHED_SIZE=" + std::to_string(VM_STATE_HASHED_SIZE)
+		+ " -DTN_TREE_CHUNK_SIZE=" + std::to_string(TN_TREE_CHUNK_SIZE)
+		+ " -DMIN_CYCLES=" + std::to_string(MIN_CYCLES)
+		+ " -DNRM_CYCLES=" + std::to_string(NRM_CYCLES)
+		+ " -DMAX_CYCLES=" + std::to_string(MAX_CYCLES)
+		+ " -DTN_VARIANT_AES=" + std::to_string(TN_VARIANT_AES)
+		+ " -DTN_VARIANT_TREE=" + std::to_string(TN_VARIANT_TREE)
+		+ " -DTN_VARIANT_WORDS=" + std::to_string(TN_VARIANT_WORDS)
+		+ " -DTN_CL_REGROUP_OPCODE=" + std::to_string(TN_CL_REGROUP_OPCODE)
+		+ " -DTN_CL_REGROUP_CLASS=" + std::to_string(TN_CL_REGROUP_CLASS);
+	buildProgram(params);
+
+	kernel = cl::Kernel(program, "Turings_Nightmare");
+	init_kernel = cl::Kernel(program, "TN_Init");
+	finalize_kernel = cl::Kernel(program, "TN_Finalize");
+	regroup_kernel = cl::Kernel(program, "TN_Regroup");
+	burst_kernel = cl::Kernel(program, "TN_Burst");
+	lane_stats_kernel = cl::Kernel(program, "TN_LaneStats");
+
+	// Every slot's buffer has to fit in one allocation, and all of them in device memory with room to spare
+	cl_ulong max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	cl_ulong usable = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 4 * 3 / TN_CL_SLOTS;
+	capacity = std::max<size_t>(1, (size_t)(std::min(max_alloc, usable) / sizeof(VM_State)));
+}
+
+// Existing directories are fine, failures show when the cache file can't be written
+static void TN_MakeDirectory(const std::string& path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+static std::string TN_CLCacheDirectory() {
+	std::string dir;
+	if (const char *env = getenv("TN_OPENCL_CACHE")) {
+		if (std::string(env) == "off") return std::string();
+		dir = env;
+	} else {
+#ifdef _WIN32
+		const char *base = getenv("LOCALAPPDATA");
+		if (!base) return std::string();
+		dir = std::string(base) + "\\TuringsNightmare";
+#else
+		std::string base;
+		if (const char *xdg = getenv("XDG_CACHE_HOME")) base = xdg;
+		else if (const char *home = getenv("HOME")) base = std::string(home) + "/.cache";
+		else return std::string();
+		TN_MakeDirectory(base);
+		dir = base + "/turingsnightmare";
+#endif
+	}
+	TN_MakeDirectory(dir);
+	return dir;
+}
+
+static std::string TN_Blake256Hex(const std::string& text) {
+	uint8_t hash[32];
+	blake256_hash(hash, (const uint8_t*)text.data(), text.size());
+	return StringTools::toHex(hash, sizeof(hash));
+}
+
+void DeviceCL::buildProgram(const std::string& params) {
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = [&] { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); };
+
+	// Anything that changes the binary is part of the key
+	std::string key = "device=" + device.getInfo<CL_DEVICE_NAME>()
+		+ ";vendor=" + device.getInfo<CL_DEVICE_VENDOR>()
+		+ ";version=" + device.getInfo<CL_DEVICE_VERSION>()
+		+ ";driver=" + device.getInfo<CL_DRIVER_VERSION>()
+		+ ";options=" + params
+		+ ";source=" + TN_Blake256Hex(std::string(crypto_source) + source);
+
+	program_load = DeviceCLProgramLoad();
+	std::string dir = TN_CLCacheDirectory();
+	if (!dir.empty()) {
+		program_load.path = dir + "/tn-" + TN_Blake256Hex(key).substr(0, 32) + ".bin";
+		if (loadProgram(key, params)) {
+			program_load.cached = true;
+			program_load.milliseconds = elapsed();
+			return;
+		}
+	}
 
-	std::string params = std::string("-cl-std=CL2.0 -DMEMORY_SIZE=") + std::to_string(MEMORY_SIZE);
+	// The hash functions come first, the kernels use them
+	cl::Program::Sources sources;
+	sources.push_back(std::make_pair(crypto_source, strlen(crypto_source)));
+	sources.push_back(std::make_pair(source, strlen(source)));
+	program = cl::Program(context, sources);
 	program.build(params.c_str());
+	program_load.milliseconds = program_load.build_milliseconds = elapsed();
 
-	kernel = cl::Kernel(program, "Turings_Nightmare");
+	if (!program_load.path.empty()) saveProgram(key);
+}
+
+bool DeviceCL::loadProgram(const std::string& key, const std::string& params) {
+	std::ifstream file(program_load.path, std::ios::binary);
+	if (!file) return false;
+
+	std::string magic, stored, build;
+	if (!std::getline(file, magic) || magic != TN_CL_CACHE_MAGIC || !std::getline(file, stored) || stored != key ||
+		!std::getline(file, build)) {
+		return false;
+	}
+	std::string binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (binary.empty()) return false;
+
+	// A binary the driver rejects (e.g. from a driver that kept its version string) is rebuilt
+	try {
+		std::vector<cl::Device> devices(1, device);
+		program = cl::Program(context, devices, cl::Program::Binaries(1, std::make_pair((const void*)binary.data(), binary.size())));
+		program.build(devices, params.c_str());
+	} catch (cl::Error&) {
+		return false;
+	}
+
+	program_load.build_milliseconds = StringTools::fromString<double>(build);
+	return true;
+}
+
+void DeviceCL::saveProgram(const std::string& key) {
+	std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+	if (sizes.size() != 1 || sizes[0] == 0) return;
+
+	// Through the C API, cl.hpp does not allocate the binaries it returns
+	std::string binary(sizes[0], '\0');
+	unsigned char *data = (unsigned char*)&binary[0];
+	if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(data), &data, nullptr) != CL_SUCCESS) return;
+
+	// Written aside and renamed, so concurrently starting workers never load half a file
+	std::string temporary = program_load.path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+	{
+		std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+		file << TN_CL_CACHE_MAGIC << "\n" << key << "\n" << program_load.build_milliseconds << "\n";
+		file.write(binary.data(), binary.size());
+		if (!file) {
+			file.close();
+			std::remove(temporary.c_str());
+			return;
+		}
+	}
+#ifdef _WIN32
+	std::remove(program_load.path.c_str());
+#endif
+	if (std::rename(temporary.c_str(), program_load.path.c_str()) != 0) std::remove(temporary.c_str());
+}
+
+void DeviceCL::reserve(Slot& slot, size_t count, bool staged) {
+	if (slot.size >= count && (slot.host || !staged)) return;
+	release(slot);
+
+	size_t bytes = count * sizeof(VM_State);
+	slot.states = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+	slot.offsets = cl::Buffer(context, CL_MEM_READ_ONLY, (count + 1) * sizeof(cl_ulong));
+	slot.digests = cl::Buffer(context, CL_MEM_WRITE_ONLY, count * HASH_SIZE);
+	if (staged) {
+		slot.pinned = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes);
+		slot.host = (VM_State*)slot.queue.enqueueMapBuffer(slot.pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, bytes);
+	}
+	slot.size = count;
+}
+
+void DeviceCL::release(Slot& slot) {
+	if (slot.size == 0) return;
+
+	slot.queue.finish();
+	if (slot.host) {
+		slot.queue.enqueueUnmapMemObject(slot.pinned, slot.host);
+		slot.queue.finish();
+		slot.host = nullptr;
+	}
+	slot.size = 0;
+	slot.count = 0;
+	slot.states = cl::Buffer();
+	slot.pinned = cl::Buffer();
+	slot.offsets = cl::Buffer();
+	slot.digests = cl::Buffer();
+}
+
+void DeviceCL::collect(Slot& slot, VM_State *states) {
+	if (slot.count == 0) return;
+
+	slot.done.wait();
+	if (states) memcpy(states + slot.first, slot.host, slot.count * sizeof(VM_State));
+	slot.count = 0;
+}
+
+void DeviceCL::drain() {
+	for (auto &slot : slots) {
+		slot.queue.finish();
+		slot.count = 0;
+	}
 }
 
 void DeviceCL::run(const size_t N, VM_State *states) {
-	cl::Buffer buf(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(VM_State) * N, states);
+	execute(N, states, UINT64_MAX);
+}
+
+bool DeviceCL::execute(const size_t N, VM_State *states, const uint64_t max_steps) {
+	for (size_t i = 0; i < N; ++i) {
+		if (states[i].variant == TN_VARIANT_LANES) throw std::runtime_error("OpenCL device does not support TN_VARIANT_LANES.");
+	}
+
+	// At least two chunks whenever there are two states, else nothing overlaps
+	size_t chunk = std::min(capacity, std::max<size_t>(1, (N + TN_CL_SLOTS - 1) / TN_CL_SLOTS));
+	kernel.setArg(1, (cl_ulong)max_steps);
+
+	try {
+		for (size_t first = 0, c = 0; first < N; first += chunk, ++c) {
+			Slot& slot = slots[c % TN_CL_SLOTS];
+			collect(slot, states);
+			reserve(slot, chunk, true);
+
+			// Upload, run and read back in order on the slot's queue, the other slots' queues run meanwhile
+			slot.first = first;
+			slot.count = std::min(chunk, N - first);
+			size_t bytes = slot.count * sizeof(VM_State);
+			memcpy(slot.host, states + first, bytes);
+
+			slot.queue.enqueueWriteBuffer(slot.states, CL_FALSE, 0, bytes, slot.host);
+			kernel.setArg(0, slot.states);
+			slot.queue.enqueueNDRangeKernel(kernel, cl::NullRange, slot.count, cl::NullRange);
+			slot.queue.enqueueReadBuffer(slot.states, CL_FALSE, 0, bytes, slot.host, nullptr, &slot.done);
+			slot.queue.flush();
+		}
+
+		for (auto &slot : slots) collect(slot, states);
+	} catch (...) {
+		drain();
+		throw;
+	}
+
+	for (size_t i = 0; i < N; ++i) {
+		if (states[i].step_counter <= states[i].step_limit) return false;
+	}
+	return true;
+}
 
-	kernel.setArg(0, buf);
+void DeviceCL::hash(const size_t N, const char *const *inputs, const size_t *sizes, const TN_Variant variant, char *out) {
+	if (variant >= _TN_VARIANT_LAST) throw std::runtime_error("Invalid TN variant.");
+	if (variant == TN_VARIANT_LANES) throw std::runtime_error("OpenCL device does not support TN_VARIANT_LANES.");
+	for (size_t i = 0; i < N; ++i) {
+		if (sizes[i] == 0 || sizes[i] >= MEMORY_SIZE) throw std::runtime_error("Invalid TN input size.");
+	}
 
-	queue.enqueueNDRangeKernel(kernel, cl::NullRange, N, cl::NullRange);
-	queue.finish();
-	queue.enqueueReadBuffer(buf, CL_TRUE, 0, sizeof(VM_State) * N, (void*)states);
-}
\ No newline at end of file
+	size_t chunk = std::min(capacity, std::max<size_t>(1, (N + TN_CL_SLOTS - 1) / TN_CL_SLOTS));
+	init_kernel.setArg(3, (cl_ulong)variant);
+	kernel.setArg(1, (cl_ulong)UINT64_MAX);
+
+	try {
+		for (size_t first = 0, c = 0; first < N; first += chunk, ++c) {
+			Slot& slot = slots[c % TN_CL_SLOTS];
+			collect(slot, nullptr);
+			reserve(slot, chunk, false);
+
+			slot.first = first;
+			slot.count = std::min(chunk, N - first);
+			slot.packed.clear();
+			slot.bounds.resize(slot.count + 1);
+			for (size_t i = 0; i < slot.count; ++i) {
+				slot.bounds[i] = slot.packed.size();
+				slot.packed.insert(slot.packed.end(), inputs[first + i], inputs[first + i] + sizes[first + i]);
+			}
+			slot.bounds[slot.count] = slot.packed.size();
+			if (slot.input_bytes < slot.packed.size()) {
+				slot.inputs = cl::Buffer(context, CL_MEM_READ_ONLY, slot.packed.size());
+				slot.input_bytes = slot.packed.size();
+			}
+
+			// Inputs up, init, run and finalize in place, digests down
+			slot.queue.enqueueWriteBuffer(slot.inputs, CL_FALSE, 0, slot.packed.size(), slot.packed.data());
+			slot.queue.enqueueWriteBuffer(slot.offsets, CL_FALSE, 0, slot.bounds.size() * sizeof(cl_ulong), slot.bounds.data());
+
+			init_kernel.setArg(0, slot.states);
+			init_kernel.setArg(1, slot.inputs);
+			init_kernel.setArg(2, slot.offsets);
+			slot.queue.enqueueNDRangeKernel(init_kernel, cl::NullRange, slot.count, cl::NullRange);
+
+			kernel.setArg(0, slot.states);
+			slot.queue.enqueueNDRangeKernel(kernel, cl::NullRange, slot.count, cl::NullRange);
+
+			finalize_kernel.setArg(0, slot.states);
+			finalize_kernel.setArg(1, slot.digests);
+			slot.queue.enqueueNDRangeKernel(finalize_kernel, cl::NullRange, slot.count, cl::NullRange);
+
+			slot.queue.enqueueReadBuffer(slot.digests, CL_FALSE, 0, slot.count * HASH_SIZE, out + first * HASH_SIZE, nullptr, &slot.done);
+			slot.queue.flush();
+		}
+
+		for (auto &slot : slots) collect(slot, nullptr);
+	} catch (...) {
+		drain();
+		throw;
+	}
+}
+
+double DeviceCLRegroupStats::efficiency(size_t steps_into_burst) const {
+	uint64_t useful = 0, spent = 0;
+	for (size_t s = 0; s < steps.size() && (steps_into_burst == 0 || s < steps_into_burst); ++s) {
+		useful += steps[s];
+		spent += lane_steps[s];
+	}
+	return spent ? (double)useful / spent : 0;
+}
+
+DeviceCLRegroupStats DeviceCL::runRegrouped(const size_t N, VM_State *states, const TN_CLRegroup regroup, const uint64_t burst_steps, size_t width) {
+	if (burst_steps == 0) throw std::runtime_error("Regrouped bursts need at least one step.");
+	for (size_t i = 0; i < N; ++i) {
+		if (states[i].variant == TN_VARIANT_LANES) throw std::runtime_error("OpenCL device does not support TN_VARIANT_LANES.");
+	}
+	if (width == 0) width = std::max<size_t>(1, burst_kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device));
+
+	DeviceCLRegroupStats stats;
+	stats.width = width;
+	stats.steps.assign(burst_steps, 0);
+	stats.lane_steps.assign(burst_steps, 0);
+	auto start = std::chrono::steady_clock::now();
+
+	// Analysis path, one chunk after the other on the first slot's queue. The state count is checked every batch
+	// bursts, often enough to stop soon after the last state finishes, seldom enough not to stall the queue.
+	cl::CommandQueue& queue = slots[0].queue;
+	const size_t chunk = std::min(capacity, std::max<size_t>(N, 1));
+	const uint64_t batch = std::max<uint64_t>(1, (1 << 16) / burst_steps);
+	std::vector<cl_ulong> totals(2 * burst_steps, 0);
+
+	cl::Buffer device_states(context, CL_MEM_READ_WRITE, chunk * sizeof(VM_State));
+	cl::Buffer order(context, CL_MEM_READ_WRITE, chunk * sizeof(cl_uint));
+	cl::Buffer active(context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint));
+	cl::Buffer trace(context, CL_MEM_READ_WRITE, burst_steps * chunk);
+	cl::Buffer lane_stats(context, CL_MEM_READ_WRITE, totals.size() * sizeof(cl_ulong));
+	queue.enqueueWriteBuffer(lane_stats, CL_TRUE, 0, totals.size() * sizeof(cl_ulong), totals.data());
+
+	for (size_t first = 0; first < N; first += chunk) {
+		const size_t count = std::min(chunk, N - first);
+		queue.enqueueWriteBuffer(device_states, CL_FALSE, 0, count * sizeof(VM_State), states + first);
+
+		regroup_kernel.setArg(0, device_states);
+		regroup_kernel.setArg(1, (cl_ulong)count);
+		regroup_kernel.setArg(2, (cl_ulong)regroup);
+		regroup_kernel.setArg(3, order);
+		regroup_kernel.setArg(4, active);
+		burst_kernel.setArg(0, device_states);
+		burst_kernel.setArg(1, order);
+		burst_kernel.setArg(2, active);
+		burst_kernel.setArg(3, (cl_ulong)burst_steps);
+		burst_kernel.setArg(4, trace);
+		lane_stats_kernel.setArg(0, trace);
+		lane_stats_kernel.setArg(1, (cl_ulong)count);
+		lane_stats_kernel.setArg(2, (cl_ulong)width);
+		lane_stats_kernel.setArg(3, (cl_ulong)regroup);
+		lane_stats_kernel.setArg(4, lane_stats);
+
+		for (;;) {
+			for (uint64_t b = 0; b < batch; ++b) {
+				queue.enqueueNDRangeKernel(regroup_kernel, cl::NullRange, 1, cl::NullRange);
+				queue.enqueueNDRangeKernel(burst_kernel, cl::NullRange, count, cl::NullRange);
+				queue.enqueueNDRangeKernel(lane_stats_kernel, cl::NullRange, burst_steps, cl::NullRange);
+			}
+
+			cl_uint remaining[2];
+			queue.enqueueNDRangeKernel(regroup_kernel, cl::NullRange, 1, cl::NullRange);
+			queue.enqueueReadBuffer(active, CL_TRUE, 0, sizeof(remaining), remaining);
+			if (remaining[1] == 0) break;
+		}
+
+		queue.enqueueReadBuffer(device_states, CL_TRUE, 0, count * sizeof(VM_State), states + first);
+	}
+
+	queue.enqueueReadBuffer(lane_stats, CL_TRUE, 0, totals.size() * sizeof(cl_ulong), totals.data());
+	for (size_t s = 0; s < burst_steps; ++s) {
+		stats.steps[s] = totals[2 * s];
+		stats.lane_steps[s] = totals[2 * s + 1];
+	}
+	stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return stats;
+}
@@ -0,0 +1,518 @@
+/*
+Copyright 2018 Interplanetary Broadcast Coin SL
+
+This file is part of Turings Nightmare
+Authors: Fritjof Harms, Markus Behm
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// OpenCL C ports of src/crypto, for init and finalize on the device. Each one is a one-shot hash over a
+// buffer with the same padding and output as the host version, which the OpenCL sanity test compares against.
+// Pointers are generic (OpenCL 2.0), so the same functions hash global state memory and private buffers.
+const char *crypto_source = R"===(
+ulong TN_Load64LE(const uchar *p) {
+	ulong w = 0;
+	for (uint i = 0; i < 8; ++i) w |= (ulong)p[i] << (8 * i);
+	return w;
+}
+
+uint TN_Load32BE(const uchar *p) {
+	return ((uint)p[0] << 24) | ((uint)p[1] << 16) | ((uint)p[2] << 8) | (uint)p[3];
+}
+
+// Keccak, as keccak.c
+
+constant ulong TN_KeccakRoundConstants[24] = {
+	0x0000000000000001UL, 0x0000000000008082UL, 0x800000000000808aUL,
+	0x8000000080008000UL, 0x000000000000808bUL, 0x0000000080000001UL,
+	0x8000000080008081UL, 0x8000000000008009UL, 0x000000000000008aUL,
+	0x0000000000000088UL, 0x0000000080008009UL, 0x000000008000000aUL,
+	0x000000008000808bUL, 0x800000000000008bUL, 0x8000000000008089UL,
+	0x8000000000008003UL, 0x8000000000008002UL, 0x8000000000000080UL,
+	0x000000000000800aUL, 0x800000008000000aUL, 0x8000000080008081UL,
+	0x8000000000008080UL, 0x0000000080000001UL, 0x8000000080008008UL
+};
+
+constant uint TN_KeccakRotations[24] = {
+	1,  3,  6,  10, 15, 21, 28, 36, 45, 55, 2,  14,
+	27, 41, 56, 8,  25, 43, 62, 18, 39, 61, 20, 44
+};
+
+constant uint TN_KeccakPi[24] = {
+	10, 7,  11, 17, 18, 3, 5,  16, 8,  21, 24, 4,
+	15, 23, 19, 13, 12, 2, 20, 14, 22, 9,  6,  1
+};
+
+void TN_Keccakf(ulong *st) {
+	ulong t, bc[5];
+
+	for (uint round = 0; round < 24; ++round) {
+		for (uint i = 0; i < 5; ++i) bc[i] = st[i] ^ st[i + 5] ^ st[i + 10] ^ st[i + 15] ^ st[i + 20];
+		for (uint i = 0; i < 5; ++i) {
+			t = bc[(i + 4) % 5] ^ rotate(bc[(i + 1) % 5], (ulong)1);
+			for (uint j = 0; j < 25; j += 5) st[j + i] ^= t;
+		}
+
+		t = st[1];
+		for (uint i = 0; i < 24; ++i) {
+			uint j = TN_KeccakPi[i];
+			bc[0] = st[j];
+			st[j] = rotate(t, (ulong)TN_KeccakRotations[i]);
+			t = bc[0];
+		}
+
+		for (uint j = 0; j < 25; j += 5) {
+			for (uint i = 0; i < 5; ++i) bc[i] = st[j + i];
+			for (uint i = 0; i < 5; ++i) st[j + i] ^= (~bc[(i + 1) % 5]) & bc[(i + 2) % 5];
+		}
+
+		st[0] ^= TN_KeccakRoundConstants[round];
+	}
+}
+
+// mdlen 200 is keccak1600
+void TN_Keccak(const uchar *in, ulong inlen, uchar *md, uint mdlen) {
+	ulong st[25];
+	uchar last[144];
+	uint rsiz = mdlen == 200 ? 136 : 200 - 2 * mdlen;
+
+	for (uint i = 0; i < 25; ++i) st[i] = 0;
+
+	for (; inlen >= rsiz; inlen -= rsiz, in += rsiz) {
+		for (uint i = 0; i < rsiz / 8; ++i) st[i] ^= TN_Load64LE(in + 8 * i);
+		TN_Keccakf(st);
+	}
+
+	for (uint i = 0; i < rsiz; ++i) last[i] = i < inlen ? in[i] : 0;
+	last[inlen] = 1;
+	last[rsiz - 1] |= 0x80;
+	for (uint i = 0; i < rsiz / 8; ++i) st[i] ^= TN_Load64LE(last + 8 * i);
+	TN_Keccakf(st);
+
+	for (uint i = 0; i < mdlen; ++i) md[i] = (uchar)(st[i / 8] >> (8 * (i % 8)));
+}
+
+// AES scratchpad expansion, as aes.c: AES-256 key schedule, 10 aesenc rounds per 128 byte step
+
+constant uchar TN_AESSbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+#define TN_XTIME(x) ((uchar)(((x) << 1) ^ (((x) & 0x80) ? 0x1b : 0x00)))
+
+void TN_AESExpandKey(const uchar *key, uchar *round_keys) {
+	uchar rcon = 0x01, t[4];
+
+	for (uint i = 0; i < 32; ++i) round_keys[i] = key[i];
+	for (uint i = 8; i < 10 * 4; ++i) {
+		for (uint j = 0; j < 4; ++j) t[j] = round_keys[(i - 1) * 4 + j];
+		if (i % 8 == 0) {
+			uchar first = t[0];
+			t[0] = TN_AESSbox[t[1]] ^ rcon;
+			t[1] = TN_AESSbox[t[2]];
+			t[2] = TN_AESSbox[t[3]];
+			t[3] = TN_AESSbox[first];
+			rcon = TN_XTIME(rcon);
+		} else if (i % 8 == 4) {
+			for (uint j = 0; j < 4; ++j) t[j] = TN_AESSbox[t[j]];
+		}
+		for (uint j = 0; j < 4; ++j) round_keys[i * 4 + j] = round_keys[(i - 8) * 4 + j] ^ t[j];
+	}
+}
+
+void TN_AESRound(uchar *s, const uchar *k) {
+	uchar t[16];
+
+	for (uint c = 0; c < 4; ++c)
+		for (uint r = 0; r < 4; ++r)
+			t[r + 4 * c] = TN_AESSbox[s[r + 4 * ((c + r) & 3)]];
+
+	for (uint c = 0; c < 4; ++c) {
+		uchar *a = t + 4 * c;
+		uchar all = a[0] ^ a[1] ^ a[2] ^ a[3];
+		s[4 * c + 0] = a[0] ^ all ^ TN_XTIME(a[0] ^ a[1]) ^ k[4 * c + 0];
+		s[4 * c + 1] = a[1] ^ all ^ TN_XTIME(a[1] ^ a[2]) ^ k[4 * c + 1];
+		s[4 * c + 2] = a[2] ^ all ^ TN_XTIME(a[2] ^ a[3]) ^ k[4 * c + 2];
+		s[4 * c + 3] = a[3] ^ all ^ TN_XTIME(a[3] ^ a[0]) ^ k[4 * c + 3];
+	}
+}
+
+// key is 32 bytes, text 128
+void TN_AESExpand(const uchar *key, const uchar *text, uchar *out, ulong len) {
+	uchar round_keys[10 * 16];
+	uchar blocks[128];
+
+	TN_AESExpandKey(key, round_keys);
+	for (uint i = 0; i < 128; ++i) blocks[i] = text[i];
+
+	for (ulong offset = 0; offset < len; offset += 128) {
+		for (uint b = 0; b < 8; ++b)
+			for (uint r = 0; r < 10; ++r)
+				TN_AESRound(blocks + b * 16, round_keys + r * 16);
+		for (uint i = 0; i < 128 && offset + i < len; ++i) out[offset + i] = blocks[i];
+	}
+}
+
+// BLAKE-256, as blake256.c
+
+constant uchar TN_BlakeSigma[14][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15},
+	{14,10, 4, 8, 9,15,13, 6, 1,12, 0, 2,11, 7, 5, 3},
+	{11, 8,12, 0, 5, 2,15,13,10,14, 3, 6, 7, 1, 9, 4},
+	{ 7, 9, 3, 1,13,12,11,14, 2, 6, 5,10, 4, 0,15, 8},
+	{ 9, 0, 5, 7, 2, 4,10,15,14, 1,11,12, 6, 8, 3,13},
+	{ 2,12, 6,10, 0,11, 8, 3, 4,13, 7, 5,15,14, 1, 9},
+	{12, 5, 1,15,14,13, 4,10, 0, 7, 6, 3, 9, 2, 8,11},
+	{13,11, 7,14,12, 1, 3, 9, 5, 0,15, 4, 8, 6, 2,10},
+	{ 6,15,14, 9,11, 3, 0, 8,12, 2,13, 7, 1, 4,10, 5},
+	{10, 2, 8, 4, 7, 6, 1, 5,15,11, 9,14, 3,12,13, 0},
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15},
+	{14,10, 4, 8, 9,15,13, 6, 1,12, 0, 2,11, 7, 5, 3},
+	{11, 8,12, 0, 5, 2,15,13,10,14, 3, 6, 7, 1, 9, 4},
+	{ 7, 9, 3, 1,13,12,11,14, 2, 6, 5,10, 4, 0,15, 8}
+};
+
+constant uint TN_BlakeConstants[16] = {
+	0x243F6A88, 0x85A308D3, 0x13198A2E, 0x03707344,
+	0xA4093822, 0x299F31D0, 0x082EFA98, 0xEC4E6C89,
+	0x452821E6, 0x38D01377, 0xBE5466CF, 0x34E90C6C,
+	0xC0AC29B7, 0xC97C50DD, 0x3F84D5B5, 0xB5470917
+};
+
+#define TN_BLAKE_G(a, b, c, d, e) \
+	v[a] += (m[TN_BlakeSigma[i][e]] ^ TN_BlakeConstants[TN_BlakeSigma[i][e + 1]]) + v[b]; \
+	v[d] = rotate(v[d] ^ v[a], 16U); \
+	v[c] += v[d]; \
+	v[b] = rotate(v[b] ^ v[c], 20U); \
+	v[a] += (m[TN_BlakeSigma[i][e + 1]] ^ TN_BlakeConstants[TN_BlakeSigma[i][e]]) + v[b]; \
+	v[d] = rotate(v[d] ^ v[a], 24U); \
+	v[c] += v[d]; \
+	v[b] = rotate(v[b] ^ v[c], 25U);
+
+// counter is the message bits up to and including the block, 0 for a block of only padding
+void TN_BlakeCompress(uint *h, const uchar *block, ulong counter) {
+	uint v[16], m[16];
+
+	for (uint i = 0; i < 16; ++i) m[i] = TN_Load32BE(block + i * 4);
+	for (uint i = 0; i < 8; ++i) v[i] = h[i];
+	for (uint i = 0; i < 8; ++i) v[i + 8] = TN_BlakeConstants[i];
+	v[12] ^= (uint)counter;
+	v[13] ^= (uint)counter;
+	v[14] ^= (uint)(counter >> 32);
+	v[15] ^= (uint)(counter >> 32);
+
+	for (uint i = 0; i < 14; ++i) {
+		TN_BLAKE_G(0, 4,  8, 12,  0);
+		TN_BLAKE_G(1, 5,  9, 13,  2);
+		TN_BLAKE_G(2, 6, 10, 14,  4);
+		TN_BLAKE_G(3, 7, 11, 15,  6);
+		TN_BLAKE_G(3, 4,  9, 14, 14);
+		TN_BLAKE_G(2, 7,  8, 13, 12);
+		TN_BLAKE_G(0, 5, 10, 15,  8);
+		TN_BLAKE_G(1, 6, 11, 12, 10);
+	}
+
+	for (uint i = 0; i < 16; ++i) h[i % 8] ^= v[i];
+}
+
+void TN_Blake256(const uchar *in, ulong inlen, uchar *out) {
+	uint h[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+	uchar block[64];
+	ulong bits = inlen * 8, counter = 0;
+
+	for (; inlen >= 64; inlen -= 64, in += 64) {
+		counter += 512;
+		TN_BlakeCompress(h, in, counter);
+	}
+
+	for (uint i = 0; i < 64; ++i) block[i] = i < inlen ? in[i] : 0;
+	if (inlen == 55) {
+		block[55] = 0x81;
+	} else {
+		block[inlen] = 0x80;
+		if (inlen > 55) {
+			// Length does not fit, it goes into a block of only padding
+			TN_BlakeCompress(h, block, bits);
+			for (uint i = 0; i < 64; ++i) block[i] = 0;
+		}
+		block[55] |= 0x01;
+	}
+	for (uint i = 0; i < 8; ++i) block[56 + i] = (uchar)(bits >> (56 - 8 * i));
+	TN_BlakeCompress(h, block, inlen > 0 && inlen <= 55 ? bits : 0);
+
+	for (uint i = 0; i < 32; ++i) out[i] = (uchar)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+// JH-256, bitslice as jh.c
+
+constant ulong TN_JH256H0[16] = {
+	0xebd3202c41a398ebUL, 0xc145b29c7bbecd92UL, 0xfac7d4609151931cUL, 0x038a507ed6820026UL,
+	0x45b92677269e23a4UL, 0x77941ad4481afbe0UL, 0x7a176b0226abb5cdUL, 0xa82fff0f4224f056UL,
+	0x754d2e7f8996a371UL, 0x62e27df70849141dUL, 0x948f2476f7957627UL, 0x6c29804757b6d587UL,
+	0x6c0d8eac2d275e5cUL, 0x0f7a0557c6508451UL, 0xea12247067d3e47bUL, 0x69d71cd313abe389UL
+};
+
+constant ulong TN_JHRoundConstants[42][4] = {
+	{ 0x67f815dfa2ded572UL, 0x571523b70a15847bUL, 0xf6875a4d90d6ab81UL, 0x402bd1c3c54f9f4eUL },
+	{ 0x9cfa455ce03a98eaUL, 0x9a99b26699d2c503UL, 0x8a53bbf2b4960266UL, 0x31a2db881a1456b5UL },
+	{ 0xdb0e199a5c5aa303UL, 0x1044c1870ab23f40UL, 0x1d959e848019051cUL, 0xdccde75eadeb336fUL },
+	{ 0x416bbf029213ba10UL, 0xd027bbf7156578dcUL, 0x5078aa3739812c0aUL, 0xd3910041d2bf1a3fUL },
+	{ 0x907eccf60d5a2d42UL, 0xce97c0929c9f62ddUL, 0xac442bc70ba75c18UL, 0x23fcc663d665dfd1UL },
+	{ 0x1ab8e09e036c6e97UL, 0xa8ec6c447e450521UL, 0xfa618e5dbb03f1eeUL, 0x97818394b29796fdUL },
+	{ 0x2f3003db37858e4aUL, 0x956a9ffb2d8d672aUL, 0x6c69b8f88173fe8aUL, 0x14427fc04672c78aUL },
+	{ 0xc45ec7bd8f15f4c5UL, 0x80bb118fa76f4475UL, 0xbc88e4aeb775de52UL, 0xf4a3a6981e00b882UL },
+	{ 0x1563a3a9338ff48eUL, 0x89f9b7d524565faaUL, 0xfde05a7c20edf1b6UL, 0x362c42065ae9ca36UL },
+	{ 0x3d98fe4e433529ceUL, 0xa74b9a7374f93a53UL, 0x86814e6f591ff5d0UL, 0x9f5ad8af81ad9d0eUL },
+	{ 0x6a6234ee670605a7UL, 0x2717b96ebe280b8bUL, 0x3f1080c626077447UL, 0x7b487ec66f7ea0e0UL },
+	{ 0xc0a4f84aa50a550dUL, 0x9ef18e979fe7e391UL, 0xd48d605081727686UL, 0x62b0e5f3415a9e7eUL },
+	{ 0x7a205440ec1f9ffcUL, 0x84c9f4ce001ae4e3UL, 0xd895fa9df594d74fUL, 0xa554c324117e2e55UL },
+	{ 0x286efebd2872df5bUL, 0xb2c4a50fe27ff578UL, 0x2ed349eeef7c8905UL, 0x7f5928eb85937e44UL },
+	{ 0x4a3124b337695f70UL, 0x65e4d61df128865eUL, 0xe720b95104771bc7UL, 0x8a87d423e843fe74UL },
+	{ 0xf2947692a3e8297dUL, 0xc1d9309b097acbddUL, 0xe01bdc5bfb301b1dUL, 0xbf829cf24f4924daUL },
+	{ 0xffbf70b431bae7a4UL, 0x48bcf8de0544320dUL, 0x39d3bb5332fcae3bUL, 0xa08b29e0c1c39f45UL },
+	{ 0x0f09aef7fd05c9e5UL, 0x34f1904212347094UL, 0x95ed44e301b771a2UL, 0x4a982f4f368e3be9UL },
+	{ 0x15f66ca0631d4088UL, 0xffaf52874b44c147UL, 0x30c60ae2f14abb7eUL, 0xe68c6eccc5b67046UL },
+	{ 0x00ca4fbd56a4d5a4UL, 0xae183ec84b849ddaUL, 0xadd1643045ce5773UL, 0x67255c1468cea6e8UL },
+	{ 0x16e10ecbf28cdaa3UL, 0x9a99949a5806e933UL, 0x7b846fc220b2601fUL, 0x1885d1a07facced1UL },
+	{ 0xd319dd8da15b5932UL, 0x46b4a5aac01c9a50UL, 0xba6b04e467633d9fUL, 0x7eee560bab19caf6UL },
+	{ 0x742128a9ea79b11fUL, 0xee51363b35f7bde9UL, 0x76d350755aac571dUL, 0x01707da3fec2463aUL },
+	{ 0x42d8a498afc135f7UL, 0x79676b9e20eced78UL, 0xa8db3aea15638341UL, 0x832c83324d3bc3faUL },
+	{ 0xf347271c1f3b40a7UL, 0x9a762db734f04059UL, 0xfd4f21d26c4e3ee7UL, 0xef5957dc398dfdb8UL },
+	{ 0xdaeb492b490c9b8dUL, 0x0d70f36849d7a25bUL, 0x84558d7ad0ae3b7dUL, 0x658ef8e4f0e9a5f5UL },
+	{ 0x533b1036f4a2b8a0UL, 0x5aec3e759e07a80cUL, 0x4f88e85692946891UL, 0x4cbcbaf8555cb05bUL },
+	{ 0x7b9487f3993bbbe3UL, 0x5d1c6b72d6f4da75UL, 0x6db334dc28acae64UL, 0x71db28b850a5346cUL },
+	{ 0x2a518d10f2e261f8UL, 0xfc75dd593364dbe3UL, 0xa23fce43f1bcac1cUL, 0xb043e8023cd1bb67UL },
+	{ 0x75a12988ca5b0a33UL, 0x5c5316b44d19347fUL, 0x1e4d790ec3943b92UL, 0x3fafeeb6d7757479UL },
+	{ 0x21391abef7d4a8eaUL, 0x5127234c097ef45cUL, 0xd23c32ba5324a326UL, 0xadd5a66d4a17a344UL },
+	{ 0x08c9f2afa63e1db5UL, 0x563c6b91983d5983UL, 0x4d608672a17cf84cUL, 0xf6c76e08cc3ee246UL },
+	{ 0x5e76bcb1b333982fUL, 0x2ae6c4efa566d62bUL, 0x36d4c1bee8b6f406UL, 0x6321efbc1582ee74UL },
+	{ 0x69c953f40d4ec1fdUL, 0x26585806c45a7da7UL, 0x16fae0061614c17eUL, 0x3f9d63283daf907eUL },
+	{ 0x0cd29b00e3f2c9d2UL, 0x300cd4b730ceaa5fUL, 0x9832e0f216512a74UL, 0x9af8cee3d830eb0dUL },
+	{ 0x9279f1b57b9ec54bUL, 0xd36886046ee651ffUL, 0x316796e6574d239bUL, 0x05750a17f3a6e6ccUL },
+	{ 0xce6c3213d98176b1UL, 0x62a205f88452173cUL, 0x47154778b3cb2bf4UL, 0x486a9323825446ffUL },
+	{ 0x65655e4e0758df38UL, 0x8e5086fc897cfcf2UL, 0x86ca0bd0442e7031UL, 0x4e477830a20940f0UL },
+	{ 0x8338f7d139eea065UL, 0xbd3a2ce437e95ef7UL, 0x6ff8130126b29721UL, 0xe7de9fefd1ed44a3UL },
+	{ 0xd992257615dfa08bUL, 0xbe42dc12f6f7853cUL, 0x7eb027ab7ceca7d8UL, 0xdea83eaada7d8d53UL },
+	{ 0xd86902bd93ce25aaUL, 0xf908731afd43f65aUL, 0xa5194a17daef5fc0UL, 0x6a21fd4c33664d97UL },
+	{ 0x701541db3198b435UL, 0x9b54cdedbb0f1eeaUL, 0x72409751a163d09aUL, 0xe26f4791bf9d75f6UL }
+};
+
+#define TN_JH_SWAP(x, mask, n) (x) = ((((x) & (mask)) << (n)) | (((x) & ~(mask)) >> (n)))
+
+#define TN_JH_L(m0, m1, m2, m3, m4, m5, m6, m7) \
+	(m4) ^= (m1); \
+	(m5) ^= (m2); \
+	(m6) ^= (m0) ^ (m3); \
+	(m7) ^= (m0); \
+	(m0) ^= (m5); \
+	(m1) ^= (m6); \
+	(m2) ^= (m4) ^ (m7); \
+	(m3) ^= (m4);
+
+#define TN_JH_SS(m0, m1, m2, m3, m4, m5, m6, m7, cc0, cc1) \
+	m3 = ~(m3); \
+	m7 = ~(m7); \
+	m0 ^= ((~(m2)) & (cc0)); \
+	m4 ^= ((~(m6)) & (cc1)); \
+	temp0 = (cc0) ^ ((m0) & (m1)); \
+	temp1 = (cc1) ^ ((m4) & (m5)); \
+	m0 ^= ((m2) & (m3)); \
+	m4 ^= ((m6) & (m7)); \
+	m3 ^= ((~(m1)) & (m2)); \
+	m7 ^= ((~(m5)) & (m6)); \
+	m1 ^= ((m0) & (m2)); \
+	m5 ^= ((m4) & (m6)); \
+	m2 ^= ((m0) & (~(m3))); \
+	m6 ^= ((m4) & (~(m7))); \
+	m0 ^= ((m1) | (m3)); \
+	m4 ^= ((m5) | (m7)); \
+	m3 ^= ((m1) & (m2)); \
+	m7 ^= ((m5) & (m6)); \
+	m1 ^= (temp0 & (m0)); \
+	m5 ^= (temp1 & (m4)); \
+	m2 ^= temp0; \
+	m6 ^= temp1;
+
+void TN_JHE8(ulong x[8][2]) {
+	ulong temp0, temp1;
+
+	for (uint round = 0; round < 42; ++round) {
+		for (uint i = 0; i < 2; ++i) {
+			TN_JH_SS(x[0][i], x[2][i], x[4][i], x[6][i], x[1][i], x[3][i], x[5][i], x[7][i], TN_JHRoundConstants[round][i], TN_JHRoundConstants[round][i + 2]);
+			TN_JH_L(x[0][i], x[2][i], x[4][i], x[6][i], x[1][i], x[3][i], x[5][i], x[7][i]);
+		}
+
+		// Swapping layer, the seventh round of each group swaps whole words
+		for (uint j = 1; j < 8; j += 2) {
+			for (uint i = 0; i < 2; ++i) {
+				switch (round % 7) {
+				case 0: TN_JH_SWAP(x[j][i], 0x5555555555555555UL, 1); break;
+				case 1: TN_JH_SWAP(x[j][i], 0x3333333333333333UL, 2); break;
+				case 2: TN_JH_SWAP(x[j][i], 0x0f0f0f0f0f0f0f0fUL, 4); break;
+				case 3: TN_JH_SWAP(x[j][i], 0x00ff00ff00ff00ffUL, 8); break;
+				case 4: TN_JH_SWAP(x[j][i], 0x0000ffff0000ffffUL, 16); break;
+				case 5: TN_JH_SWAP(x[j][i], 0x00000000ffffffffUL, 32); break;
+				}
+			}
+			if (round % 7 == 6) {
+				temp0 = x[j][0];
+				x[j][0] = x[j][1];
+				x[j][1] = temp0;
+			}
+		}
+	}
+}
+
+void TN_JHF8(ulong x[8][2], const uchar *block) {
+	ulong m[8];
+
+	for (uint i = 0; i < 8; ++i) m[i] = TN_Load64LE(block + 8 * i);
+	for (uint i = 0; i < 8; ++i) x[i >> 1][i & 1] ^= m[i];
+	TN_JHE8(x);
+	for (uint i = 0; i < 8; ++i) x[(8 + i) >> 1][(8 + i) & 1] ^= m[i];
+}
+
+void TN_JH256(const uchar *in, ulong inlen, uchar *out) {
+	ulong x[8][2];
+	uchar block[64];
+	ulong bits = inlen * 8;
+
+	for (uint i = 0; i < 16; ++i) x[i >> 1][i & 1] = TN_JH256H0[i];
+
+	for (; inlen >= 64; inlen -= 64, in += 64) TN_JHF8(x, in);
+
+	for (uint i = 0; i < 64; ++i) block[i] = i < inlen ? in[i] : 0;
+	block[inlen] = 0x80;
+	if (inlen > 0) {
+		// Partial blocks are padded on their own, the length follows in a block of only padding
+		TN_JHF8(x, block);
+		for (uint i = 0; i < 64; ++i) block[i] = 0;
+	}
+	for (uint i = 0; i < 8; ++i) block[56 + i] = (uchar)(bits >> (56 - 8 * i));
+	TN_JHF8(x, block);
+
+	for (uint i = 0; i < 32; ++i) out[i] = (uchar)(x[6 + i / 16][(i / 8) & 1] >> (8 * (i % 8)));
+}
+
+// Groestl-256 as groestl.c, byte oriented instead of with its tables: columns are 8 consecutive bytes
+
+// Multiplies column by circ(02, 02, 03, 04, 05, 03, 05, 07)
+void TN_GroestlMixColumn(uchar *a) {
+	uchar b[8], x2[8], x4[8];
+
+	for (uint i = 0; i < 8; ++i) {
+		b[i] = a[i];
+		x2[i] = TN_XTIME(a[i]);
+		x4[i] = TN_XTIME(x2[i]);
+	}
+	for (uint i = 0; i < 8; ++i) {
+		a[i] = x2[i] ^ x2[(i + 1) & 7]
+			^ x2[(i + 2) & 7] ^ b[(i + 2) & 7]
+			^ x4[(i + 3) & 7]
+			^ x4[(i + 4) & 7] ^ b[(i + 4) & 7]
+			^ x2[(i + 5) & 7] ^ b[(i + 5) & 7]
+			^ x4[(i + 6) & 7] ^ b[(i + 6) & 7]
+			^ x4[(i + 7) & 7] ^ x2[(i + 7) & 7] ^ b[(i + 7) & 7];
+	}
+}
+
+constant uint TN_GroestlShiftQ[8] = { 1, 3, 5, 7, 0, 2, 4, 6 };
+
+// Ten rounds of P, or of Q with q set
+void TN_GroestlPermute(uchar *x, bool q) {
+	uchar t[64];
+
+	for (uint round = 0; round < 10; ++round) {
+		for (uint c = 0; c < 8; ++c) {
+			if (q) {
+				for (uint r = 0; r < 8; ++r) x[8 * c + r] ^= 0xff;
+				x[8 * c + 7] ^= (uchar)((c << 4) ^ round);
+			} else {
+				x[8 * c] ^= (uchar)((c << 4) ^ round);
+			}
+		}
+
+		// SubBytes and ShiftBytes, row r moves left by r in P, by 1, 3, 5, 7, 0, 2, 4, 6 in Q
+		for (uint c = 0; c < 8; ++c) {
+			for (uint r = 0; r < 8; ++r) {
+				uint shift = q ? TN_GroestlShiftQ[r] : r;
+				t[8 * c + r] = TN_AESSbox[x[8 * ((c + shift) & 7) + r]];
+			}
+		}
+
+		for (uint c = 0; c < 8; ++c) TN_GroestlMixColumn(t + 8 * c);
+		for (uint i = 0; i < 64; ++i) x[i] = t[i];
+	}
+}
+
+// h ^= P(h ^ m) ^ Q(m)
+void TN_GroestlCompress(uchar *h, const uchar *block) {
+	uchar p[64], q[64];
+
+	for (uint i = 0; i < 64; ++i) {
+		q[i] = block[i];
+		p[i] = h[i] ^ block[i];
+	}
+	TN_GroestlPermute(q, true);
+	TN_GroestlPermute(p, false);
+	for (uint i = 0; i < 64; ++i) h[i] ^= p[i] ^ q[i];
+}
+
+void TN_Groestl256(const uchar *in, ulong inlen, uchar *out) {
+	uchar h[64], block[64], p[64];
+	ulong blocks = inlen / 64 + 1;
+
+	for (uint i = 0; i < 64; ++i) h[i] = 0;
+	h[62] = 0x01; // 256 bit output, big endian
+
+	for (; inlen >= 64; inlen -= 64, in += 64) TN_GroestlCompress(h, in);
+
+	for (uint i = 0; i < 64; ++i) block[i] = i < inlen ? in[i] : 0;
+	block[inlen] = 0x80;
+	if (inlen >= 56) {
+		TN_GroestlCompress(h, block);
+		for (uint i = 0; i < 64; ++i) block[i] = 0;
+		blocks++;
+	}
+	for (uint i = 0; i < 8; ++i) block[56 + i] = (uchar)(blocks >> (56 - 8 * i));
+	TN_GroestlCompress(h, block);
+
+	// Output transformation, h ^= P(h), truncated to the last 32 bytes
+	for (uint i = 0; i < 64; ++i) p[i] = h[i];
+	TN_GroestlPermute(p, false);
+	for (uint i = 0; i < 32; ++i) out[i] = h[32 + i] ^ p[32 + i];
+}
+)===";
@@ -0,0 +1,309 @@
+/*
+ * turingsnightmare: CPython bindings.
+ *
+ *   hash(data, variant=0) -> bytes
+ *   hash_batch(inputs, variant=0) -> [bytes]
+ *   verify(data, hash, variant=0) -> bool
+ *   verify_batch(inputs, hashes, variant=0) -> [bool]
+ *
+ * Inputs and hashes are any C contiguous buffer (bytes, bytearray, memoryview, numpy arrays, ...)
+ * and are hashed in place, nothing is copied. The GIL is released while hashing, batches run on a
+ * DeviceCPUAsync pool of all hardware threads shared by every call.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPU.h"
+#include "cpu/TuringsNightmareCPUAsync.h"
+
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+// Buffer views of Python objects, released with the list
+class BufferList {
+public:
+	BufferList() = default;
+	BufferList(const BufferList&) = delete;
+	BufferList& operator=(const BufferList&) = delete;
+
+	~BufferList() {
+		for (auto &b : buffers) PyBuffer_Release(&b);
+	}
+
+	bool add(PyObject *object) {
+		Py_buffer buffer;
+		if (PyObject_GetBuffer(object, &buffer, PyBUF_C_CONTIGUOUS) != 0) return false;
+		buffers.push_back(buffer);
+		return true;
+	}
+
+	// Every item of a sequence (or any iterable)
+	bool addAll(PyObject *sequence) {
+		PyObject *items = PySequence_Fast(sequence, "expected a sequence of buffers");
+		if (!items) return false;
+
+		Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+		buffers.reserve(buffers.size() + count);
+		bool added = true;
+		for (Py_ssize_t i = 0; added && i < count; ++i) added = add(PySequence_Fast_GET_ITEM(items, i));
+		Py_DECREF(items);
+		return added;
+	}
+
+	size_t size() const { return buffers.size(); }
+	const char *data(size_t i) const { return (const char*)buffers[i].buf; }
+	size_t length(size_t i) const { return (size_t)buffers[i].len; }
+
+private:
+	std::vector<Py_buffer> buffers;
+};
+
+// Leaked on purpose, joining the workers while the interpreter shuts down gains nothing
+static std::mutex pool_mutex;
+static DeviceCPUAsync *pool = nullptr;
+
+static DeviceCPUAsync& TN_Pool() {
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	if (!pool) pool = new DeviceCPUAsync();
+	return *pool;
+}
+
+#ifndef _WIN32
+// fork() copies pool_mutex as it is, so it is held across the fork: a thread starting the pool
+// can't leave it locked in the child. A forked child (multiprocessing) has none of the parent's
+// workers and starts a pool of its own.
+static void TN_PoolPrepareFork() {
+	pool_mutex.lock();
+}
+
+static void TN_PoolParentFork() {
+	pool_mutex.unlock();
+}
+
+static void TN_PoolChildFork() {
+	pool = nullptr;
+	pool_mutex.unlock();
+}
+#endif
+
+static bool TN_CheckArguments(const BufferList& inputs, int variant) {
+	if (variant < 0 || variant >= _TN_VARIANT_LAST) {
+		PyErr_Format(PyExc_ValueError, "unknown TN variant %d", variant);
+		return false;
+	}
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		if (inputs.length(i) == 0 || inputs.length(i) >= MEMORY_SIZE) {
+			PyErr_Format(PyExc_ValueError, "input %zu has %zu bytes, TN inputs have 1 to %d", i, inputs.length(i), (int)MEMORY_SIZE - 1);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool TN_CheckHashes(const BufferList& hashes, size_t count) {
+	if (hashes.size() != count) {
+		PyErr_SetString(PyExc_ValueError, "expected one hash per input");
+		return false;
+	}
+	for (size_t i = 0; i < hashes.size(); ++i) {
+		if (hashes.length(i) != HASH_SIZE) {
+			PyErr_Format(PyExc_ValueError, "hash %zu has %zu bytes, expected %d", i, hashes.length(i), HASH_SIZE);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Raises the error of a failed hash, returns null for the caller to pass on
+static PyObject *TN_RaiseHashError(std::exception_ptr error) {
+	try {
+		std::rethrow_exception(error);
+	} catch (std::exception& e) {
+		PyErr_SetString(PyExc_RuntimeError, e.what());
+	} catch (...) {
+		PyErr_SetString(PyExc_RuntimeError, "TN hash failed");
+	}
+	return nullptr;
+}
+
+// Hashes all inputs on the pool, called without the GIL. Returns the first error, if any.
+static std::exception_ptr TN_HashBatch(const BufferList& inputs, TN_Variant variant, std::vector<TN_Hash>& hashes) {
+	struct Batch {
+		std::mutex mutex;
+		std::condition_variable done;
+		size_t remaining;
+		std::exception_ptr error;
+	} batch;
+
+	hashes.resize(inputs.size());
+	batch.remaining = inputs.size();
+	if (batch.remaining == 0) return nullptr;
+
+	std::vector<const char*> data(inputs.size());
+	std::vector<size_t> sizes(inputs.size());
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		data[i] = inputs.data(i);
+		sizes[i] = inputs.length(i);
+	}
+
+	TN_Pool().submitBatch(inputs.size(), data.data(), sizes.data(), [&batch, &hashes](size_t i, const TN_Hash& hash, std::exception_ptr error) {
+		hashes[i] = hash;
+		std::lock_guard<std::mutex> lock(batch.mutex);
+		if (error && !batch.error) batch.error = error;
+		if (--batch.remaining == 0) batch.done.notify_one();
+	}, variant);
+
+	std::unique_lock<std::mutex> lock(batch.mutex);
+	batch.done.wait(lock, [&] { return batch.remaining == 0; });
+	return batch.error;
+}
+
+static PyObject *TN_PyHash(PyObject *, PyObject *args, PyObject *kwargs) {
+	static const char *keywords[] = { "data", "variant", nullptr };
+	PyObject *data;
+	int variant = TN_VARIANT_ORIGINAL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i:hash", (char**)keywords, &data, &variant)) return nullptr;
+
+	BufferList inputs;
+	if (!inputs.add(data) || !TN_CheckArguments(inputs, variant)) return nullptr;
+
+	TN_Hash hash;
+	std::exception_ptr error;
+	Py_BEGIN_ALLOW_THREADS
+	DeviceCPU cpu;
+	error = TN_HashInput(cpu, inputs.data(0), inputs.length(0), (TN_Variant)variant, nullptr, hash);
+	Py_END_ALLOW_THREADS
+	if (error) return TN_RaiseHashError(error);
+
+	return PyBytes_FromStringAndSize(hash.data(), HASH_SIZE);
+}
+
+static PyObject *TN_PyHashBatch(PyObject *, PyObject *args, PyObject *kwargs) {
+	static const char *keywords[] = { "inputs", "variant", nullptr };
+	PyObject *sequence;
+	int variant = TN_VARIANT_ORIGINAL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i:hash_batch", (char**)keywords, &sequence, &variant)) return nullptr;
+
+	BufferList inputs;
+	if (!inputs.addAll(sequence) || !TN_CheckArguments(inputs, variant)) return nullptr;
+
+	std::vector<TN_Hash> hashes;
+	std::exception_ptr error;
+	Py_BEGIN_ALLOW_THREADS
+	error = TN_HashBatch(inputs, (TN_Variant)variant, hashes);
+	Py_END_ALLOW_THREADS
+	if (error) return TN_RaiseHashError(error);
+
+	PyObject *result = PyList_New(hashes.size());
+	if (!result) return nullptr;
+	for (size_t i = 0; i < hashes.size(); ++i) {
+		PyObject *hash = PyBytes_FromStringAndSize(hashes[i].data(), HASH_SIZE);
+		if (!hash) {
+			Py_DECREF(result);
+			return nullptr;
+		}
+		PyList_SET_ITEM(result, i, hash);
+	}
+	return result;
+}
+
+static PyObject *TN_PyVerify(PyObject *, PyObject *args, PyObject *kwargs) {
+	static const char *keywords[] = { "data", "hash", "variant", nullptr };
+	PyObject *data, *expected;
+	int variant = TN_VARIANT_ORIGINAL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i:verify", (char**)keywords, &data, &expected, &variant)) return nullptr;
+
+	BufferList inputs, hashes;
+	if (!inputs.add(data) || !hashes.add(expected) || !TN_CheckArguments(inputs, variant) || !TN_CheckHashes(hashes, 1)) return nullptr;
+
+	TN_Hash hash;
+	std::exception_ptr error;
+	Py_BEGIN_ALLOW_THREADS
+	DeviceCPU cpu;
+	error = TN_HashInput(cpu, inputs.data(0), inputs.length(0), (TN_Variant)variant, nullptr, hash);
+	Py_END_ALLOW_THREADS
+	if (error) return TN_RaiseHashError(error);
+
+	return PyBool_FromLong(memcmp(hash.data(), hashes.data(0), HASH_SIZE) == 0);
+}
+
+static PyObject *TN_PyVerifyBatch(PyObject *, PyObject *args, PyObject *kwargs) {
+	static const char *keywords[] = { "inputs", "hashes", "variant", nullptr };
+	PyObject *inputSequence, *hashSequence;
+	int variant = TN_VARIANT_ORIGINAL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i:verify_batch", (char**)keywords, &inputSequence, &hashSequence, &variant)) return nullptr;
+
+	BufferList inputs, expected;
+	if (!inputs.addAll(inputSequence) || !expected.addAll(hashSequence) || !TN_CheckArguments(inputs, variant) ||
+		!TN_CheckHashes(expected, inputs.size())) {
+		return nullptr;
+	}
+
+	std::vector<TN_Hash> hashes;
+	std::exception_ptr error;
+	Py_BEGIN_ALLOW_THREADS
+	error = TN_HashBatch(inputs, (TN_Variant)variant, hashes);
+	Py_END_ALLOW_THREADS
+	if (error) return TN_RaiseHashError(error);
+
+	PyObject *result = PyList_New(hashes.size());
+	if (!result) return nullptr;
+	for (size_t i = 0; i < hashes.size(); ++i) {
+		PyList_SET_ITEM(result, i, PyBool_FromLong(memcmp(hashes[i].data(), expected.data(i), HASH_SIZE) == 0));
+	}
+	return result;
+}
+
+static PyMethodDef TN_PyMethods[] = {
+	{ "hash", (PyCFunction)(void(*)(void))TN_PyHash, METH_VARARGS | METH_KEYWORDS,
+		"hash(data, variant=0) -> bytes\n\nTN hash of a buffer, computed on the calling thread without the GIL." },
+	{ "hash_batch", (PyCFunction)(void(*)(void))TN_PyHashBatch, METH_VARARGS | METH_KEYWORDS,
+		"hash_batch(inputs, variant=0) -> list of bytes\n\nTN hashes of a sequence of buffers, computed on the native thread pool without the GIL." },
+	{ "verify", (PyCFunction)(void(*)(void))TN_PyVerify, METH_VARARGS | METH_KEYWORDS,
+		"verify(data, hash, variant=0) -> bool\n\nWhether hash is the TN hash of data." },
+	{ "verify_batch", (PyCFunction)(void(*)(void))TN_PyVerifyBatch, METH_VARARGS | METH_KEYWORDS,
+		"verify_batch(inputs, hashes, variant=0) -> list of bool\n\nWhether hashes[i] is the TN hash of inputs[i], computed like hash_batch." },
+	{ nullptr, nullptr, 0, nullptr }
+};
+
+static struct PyModuleDef TN_PyModule = {
+	PyModuleDef_HEAD_INIT,
+	"turingsnightmare",
+	"Turings Nightmare proof of work hashing",
+	-1,
+	TN_PyMethods,
+	nullptr, nullptr, nullptr, nullptr
+};
+
+PyMODINIT_FUNC PyInit_turingsnightmare(void) {
+	PyObject *module = PyModule_Create(&TN_PyModule);
+	if (!module) return nullptr;
+
+#ifndef _WIN32
+	static bool fork_handlers = false;
+	if (!fork_handlers) {
+		pthread_atfork(TN_PoolPrepareFork, TN_PoolParentFork, TN_PoolChildFork);
+		fork_handlers = true;
+	}
+#endif
+
+	PyModule_AddIntConstant(module, "HASH_SIZE", HASH_SIZE);
+	PyModule_AddIntConstant(module, "MAX_INPUT_SIZE", MEMORY_SIZE - 1);
+	PyModule_AddIntConstant(module, "VARIANT_ORIGINAL", TN_VARIANT_ORIGINAL);
+	PyModule_AddIntConstant(module, "VARIANT_AES", TN_VARIANT_AES);
+	PyModule_AddIntConstant(module, "VARIANT_TREE", TN_VARIANT_TREE);
+	PyModule_AddIntConstant(module, "VARIANT_LANES", TN_VARIANT_LANES);
+	PyModule_AddIntConstant(module, "VARIANT_WORDS", TN_VARIANT_WORDS);
+	return module;
+}
@@ -0,0 +1,133 @@
+"""Sanity checks of the turingsnightmare module, run by CTest with the build directory on PYTHONPATH."""
+
+import os
+import sys
+import threading
+import time
+
+import turingsnightmare as tn
+
+failed = False
+
+
+def check(name, test):
+    global failed
+    print("Sanity checking %s... " % name, end="", flush=True)
+    try:
+        test()
+        print("Sane")
+    except Exception as e:
+        failed = True
+        print("FAILED!!! %r" % e)
+
+
+def raises(error, call, *args):
+    try:
+        call(*args)
+    except error:
+        return
+    raise AssertionError("%s%r did not raise %s" % (call.__name__, args, error.__name__))
+
+
+data = b"Turings Nightmare"
+expected = tn.hash(data)
+
+
+def test_buffers():
+    assert len(expected) == tn.HASH_SIZE
+    assert tn.hash(bytearray(data)) == expected
+    assert tn.hash(memoryview(data)) == expected
+    assert tn.hash(memoryview(b"xx" + data)[2:]) == expected
+    assert tn.hash(data, tn.VARIANT_AES) != expected
+
+
+def test_batch():
+    inputs = [data, bytearray(data), memoryview(data), b"a"]
+    hashes = tn.hash_batch(inputs)
+    assert hashes == [expected, expected, expected, tn.hash(b"a")]
+    assert tn.hash_batch([]) == []
+    assert tn.hash_batch([data], variant=tn.VARIANT_TREE) == [tn.hash(data, tn.VARIANT_TREE)]
+
+
+def test_verify():
+    assert tn.verify(data, expected)
+    assert tn.verify(bytearray(data), bytearray(expected))
+    assert not tn.verify(b"a", expected)
+    wrong = bytearray(expected)
+    wrong[0] ^= 1
+    assert tn.verify_batch([data, memoryview(data), bytearray(data)], [expected, memoryview(expected), wrong]) == [True, True, False]
+
+
+def test_errors():
+    raises(ValueError, tn.hash, b"")
+    raises(ValueError, tn.hash, bytes(tn.MAX_INPUT_SIZE + 1))
+    raises(ValueError, tn.hash, data, -1)
+    raises(ValueError, tn.hash, data, tn.VARIANT_WORDS + 1)
+    raises(TypeError, tn.hash, "text")
+    raises(BufferError, tn.hash, memoryview(b"abcdef")[::2])
+    raises(ValueError, tn.hash_batch, [data, b""])
+    raises(TypeError, tn.hash_batch, [data, 1])
+    raises(TypeError, tn.hash_batch, 1)
+    raises(ValueError, tn.verify, data, expected[1:])
+    raises(ValueError, tn.verify_batch, [data, data], [expected])
+    raises(ValueError, tn.verify_batch, [data], [b"short"])
+
+
+def test_fork():
+    # Keep another thread starting batches while forking, a child must not inherit a held pool lock
+    stop = threading.Event()
+
+    def batches():
+        while not stop.is_set():
+            tn.hash_batch([b"b"])
+
+    thread = threading.Thread(target=batches)
+    thread.start()
+    try:
+        for _ in range(2):
+            pid = os.fork()
+            if pid == 0:
+                os._exit(0 if tn.hash_batch([data]) == [expected] else 1)
+
+            deadline = time.monotonic() + 60
+            while True:
+                done, status = os.waitpid(pid, os.WNOHANG)
+                if done:
+                    break
+                if time.monotonic() > deadline:
+                    os.kill(pid, 9)
+                    os.waitpid(pid, 0)
+                    raise AssertionError("forked child hung")
+                time.sleep(0.05)
+            assert os.WIFEXITED(status) and os.WEXITSTATUS(status) == 0, "forked child failed"
+    finally:
+        stop.set()
+        thread.join()
+
+
+def test_throughput():
+    count = 2 * (os.cpu_count() or 1)
+    inputs = [os.urandom(76) for _ in range(count)]
+
+    start = time.monotonic()
+    hashes = [tn.hash(x) for x in inputs]
+    sequential = time.monotonic() - start
+
+    start = time.monotonic()
+    assert tn.hash_batch(inputs) == hashes
+    batch = time.monotonic() - start
+
+    print("%.1f hashes/s sequential, %.1f hashes/s batched... " % (count / sequential, count / batch), end="")
+    # The pool runs on all hardware threads, at worst it is as fast as one
+    assert batch < sequential * 1.5, "hash_batch slower than hashing one by one"
+
+
+check("buffer types", test_buffers)
+check("hash_batch", test_batch)
+check("verify and verify_batch", test_verify)
+check("argument errors", test_errors)
+if hasattr(os, "fork"):
+    check("hash_batch in a forked child", test_fork)
+check("hash_batch throughput", test_throughput)
+
+sys.exit(1 if failed else 0)
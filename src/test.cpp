@@ -28,12 +28,25 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "misc/StringTools.h"
 
 #include "TuringsNightmare.h"
+#include "TuringsNightmareDeviceGroup.h"
 #include "cpu/TuringsNightmareCPU.h"
+#include "cpu/TuringsNightmareCPUAsync.h"
+#include "cpu/TuringsNightmareScheduler.h"
+#include "cache/ResultCache.h"
 #include "opencl/TuringsNightmareCL.h"
 #include "cuda/TuringsNightmareCUDA.h"
 
 #include <chrono>
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+extern "C" {
+#include "crypto/aes.h"
+#include "crypto/blake256.h"
+#include "crypto/cpu_features.h"
+}
 
 std::string random_string(size_t length)
 {
@@ -51,10 +64,10 @@ std::string random_string(size_t length)
 	return str;
 }
 
-void TestTNSanity(const std::string &input) {
-	VM_State *tnCPU = TN_VM_Init(input.c_str(), input.length());
-	VM_State *tnCUDA = TN_VM_Init(input.c_str(), input.length());
-	VM_State *tnCL = TN_VM_Init(input.c_str(), input.length());
+void TestTNSanity(const std::string &input, const TN_Variant variant = TN_VARIANT_ORIGINAL) {
+	VM_State *tnCPU = TN_VM_Init(input.c_str(), input.length(), variant);
+	VM_State *tnCUDA = TN_VM_Init(input.c_str(), input.length(), variant);
+	VM_State *tnCL = TN_VM_Init(input.c_str(), input.length(), variant);
 
 	char cpuHash[HASH_SIZE], cudaHash[HASH_SIZE], clHash[HASH_SIZE];
 
@@ -81,7 +94,7 @@ void TestTNSanity(const std::string &input) {
 	DeviceCL cl;
 	cl.run(1, tnCL);
 	TN_VM_Finalize(tnCL, clHash);
-	if (strncmp(cpuHash, cudaHash, HASH_SIZE)) {
+	if (strncmp(cpuHash, clHash, HASH_SIZE)) {
 		std::cout << "FAILED!!!" << std::endl;
 	}
 	else {
@@ -89,49 +102,823 @@ void TestTNSanity(const std::string &input) {
 	}
 }
 
-template <typename Device> void TestTNSpeed(const size_t N, const bool divergent, const std::string &input) {
-	Device dev;
+// A batch larger than one launch goes through every pipeline slot
+void TestCLPipelineSanity(const std::string &input) {
+	std::cout << "Sanity checking OpenCL pipeline... ";
+	std::cout.flush();
 
+	DeviceCL cl;
+	const size_t N = TN_CL_SLOTS * 2 + 1;
 	VM_State *base = TN_VM_Init(input.c_str(), input.length());
+	VM_State *cpuStates = new VM_State[N], *clStates = new VM_State[N];
+	for (size_t i = 0; i < N; ++i) {
+		memcpy(cpuStates + i, base, sizeof(VM_State));
+		cpuStates[i].memory[0] ^= i;
+		memcpy(clStates + i, cpuStates + i, sizeof(VM_State));
+	}
+	delete base;
+
+	DeviceCPU().run(N, cpuStates);
+	// Twice, the second run reuses the buffers of the first
+	for (int round = 0; round < 2; ++round) {
+		VM_State *states = new VM_State[N];
+		memcpy(states, clStates, N * sizeof(VM_State));
+		cl.run(N, states);
+
+		bool sane = true;
+		for (size_t i = 0; i < N; ++i) {
+			char cpuHash[HASH_SIZE], clHash[HASH_SIZE];
+			TN_VM_Finalize(new VM_State(cpuStates[i]), cpuHash);
+			TN_VM_Finalize(new VM_State(states[i]), clHash);
+			sane &= memcmp(cpuHash, clHash, HASH_SIZE) == 0;
+		}
+		delete[] states;
+
+		if (!sane) {
+			std::cout << "FAILED!!!" << std::endl;
+			delete[] cpuStates;
+			delete[] clStates;
+			return;
+		}
+	}
+	std::cout << "Sane (" << cl.chunkCapacity() << " states per launch at most)" << std::endl;
+
+	delete[] cpuStates;
+	delete[] clStates;
+}
+
+void TestCLHashSanity(const std::string &input) {
+	std::cout << "Sanity checking OpenCL device init and finalize... ";
+	std::cout.flush();
+
+	DeviceCL cl;
+	// Lengths around the keccak rate and the final hash block sizes
+	std::vector<std::string> inputs = { input, "a", std::string(55, 'b'), std::string(136, 'c'), std::string(1000, 'd') };
+	std::vector<const char*> data;
+	std::vector<size_t> sizes;
+	for (auto &in : inputs) {
+		data.push_back(in.data());
+		sizes.push_back(in.size());
+	}
+
+	const TN_Variant variants[] = { TN_VARIANT_ORIGINAL, TN_VARIANT_AES, TN_VARIANT_TREE, TN_VARIANT_WORDS };
+	for (auto variant : variants) {
+		std::vector<char> clHashes(inputs.size() * HASH_SIZE);
+		cl.hash(inputs.size(), data.data(), sizes.data(), variant, clHashes.data());
+
+		for (size_t i = 0; i < inputs.size(); ++i) {
+			char cpuHash[HASH_SIZE];
+			VM_State *state = TN_VM_Init(data[i], sizes[i], variant);
+			DeviceCPU().run(1, state);
+			TN_VM_Finalize(state, cpuHash);
+
+			if (memcmp(cpuHash, clHashes.data() + i * HASH_SIZE, HASH_SIZE) != 0) {
+				std::cout << "FAILED!!! (variant " << variant << ", " << sizes[i] << " byte input)" << std::endl;
+				return;
+			}
+		}
+	}
+	std::cout << "Sane" << std::endl;
+}
+
+// CPU and OpenCL together, in short slices so states change devices. The second batch is split by what the first measured.
+void TestDeviceGroupSanity(const std::string &input) {
+	std::cout << "Sanity checking CPU + OpenCL device group... ";
+	std::cout.flush();
 
-	VM_State *mem = new VM_State[N];
+	const size_t N = 12;
+	std::vector<VM_State> base(N), cpuStates;
 	for (size_t i = 0; i < N; ++i) {
-		memcpy(mem + i, base, sizeof(VM_State));
-		if (divergent) mem[i].memory[0] ^= i;
+		std::string in = input + std::to_string(i);
+		VM_State *state = TN_VM_Init(in.c_str(), in.length(), i % 2 ? TN_VARIANT_WORDS : TN_VARIANT_ORIGINAL);
+		base[i] = *state;
+		delete state;
 	}
+	cpuStates = base;
+	DeviceCPU().run(N, cpuStates.data());
 
-	auto start = std::chrono::high_resolution_clock::now();
+	DeviceCPU cpu;
+	DeviceCL cl;
+	DeviceGroup group({ &cpu, &cl }, 256 * 1024);
+	for (int round = 0; round < 2; ++round) {
+		std::vector<VM_State> states = base;
+		group.run(N, states.data());
+		if (memcmp(states.data(), cpuStates.data(), N * sizeof(VM_State))) {
+			std::cout << "FAILED!!!" << std::endl;
+			return;
+		}
+	}
+
+	std::cout << "Sane (";
+	std::vector<DeviceGroupStats> stats = group.stats();
+	for (size_t d = 0; d < stats.size(); ++d) {
+		std::cout << (d ? ", " : "") << stats[d].name << " " << stats[d].hashes << " hashes, " << stats[d].stolen << " taken over, "
+			<< stats[d].steps_per_second / 1e6 << " Msteps/s";
+	}
+	std::cout << ")" << std::endl;
+}
+
+// A device slowdown times slower than the one it wraps, it sleeps for the rest after every slice
+class ThrottledDevice : public Device {
+public:
+	ThrottledDevice(Device& device, const unsigned slowdown) : device(device), slowdown(slowdown) {}
+
+	const char *name() { return "Throttled CPU"; }
+
+	void run(const size_t N, VM_State *states) {
+		while (!execute(N, states, 1 << 20));
+	}
 
-	dev.run(N, mem);
+	bool execute(const size_t N, VM_State *states, const uint64_t max_steps) {
+		auto start = std::chrono::steady_clock::now();
+		bool finished = device.execute(N, states, max_steps);
+		std::this_thread::sleep_for((std::chrono::steady_clock::now() - start) * (slowdown - 1));
+		return finished;
+	}
 
-	auto elapsed = std::chrono::high_resolution_clock::now() - start;
-	auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+private:
+	Device& device;
+	const unsigned slowdown;
+};
 
-	std::cout << dev.name() << " running " << N << " instances took " << milliseconds << "ms" << std::endl;
+// Only CPUs, one of them throttled, so the fast one has to take over states of the slow one
+void TestDeviceGroupStealing(const std::string &input) {
+	std::cout << "Sanity checking CPU + throttled CPU device group... ";
 	std::cout.flush();
-	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	const size_t N = 6;
+	std::vector<VM_State> base(N), cpuStates;
+	for (size_t i = 0; i < N; ++i) {
+		std::string in = input + std::to_string(i);
+		VM_State *state = TN_VM_Init(in.c_str(), in.length(), i % 2 ? TN_VARIANT_WORDS : TN_VARIANT_ORIGINAL);
+		base[i] = *state;
+		delete state;
+	}
+	cpuStates = base;
+	DeviceCPU().run(N, cpuStates.data());
+
+	DeviceCPU cpu, slowCPU;
+	ThrottledDevice slow(slowCPU, 8);
+	DeviceGroup group({ &cpu, &slow }, 256 * 1024);
+	std::vector<VM_State> states = base;
+	group.run(N, states.data());
+
+	std::vector<DeviceGroupStats> stats = group.stats();
+	uint64_t stolen = 0;
+	for (auto &s : stats) stolen += s.stolen;
+	if (memcmp(states.data(), cpuStates.data(), N * sizeof(VM_State)) || stolen == 0) {
+		std::cout << "FAILED!!!" << (stolen ? "" : " (nothing taken over)") << std::endl;
+		return;
+	}
+
+	std::cout << "Sane (";
+	for (size_t d = 0; d < stats.size(); ++d) {
+		std::cout << (d ? ", " : "") << stats[d].name << " " << stats[d].hashes << " hashes, " << stats[d].stolen << " taken over";
+	}
+	std::cout << ")" << std::endl;
 }
 
-int main(int argc, char* argv[]) {
-	std::string input = random_string(50);
+void TestBlake256Sanity() {
+	std::cout << "Sanity checking Blake-256 SSE4.1... ";
+	std::cout.flush();
 
-	TestTNSanity(input);
+	if (!tn_cpu_has_sse41()) {
+		std::cout << "Unsupported" << std::endl;
+		return;
+	}
 
-	size_t sizes[] = { 1, 5, 10, 20 };
+	// The portable compression is the oracle for the vectorized one
+	for (int n = 0; n < 10000; ++n) {
+		state ref, sse;
+		uint8_t block[64];
+		for (auto &b : block) b = rand();
+		for (auto &h : ref.h) h = rand() * 2654435761u;
+		for (auto &s : ref.s) s = rand();
+		ref.t[0] = rand();
+		ref.t[1] = rand();
+		ref.nullt = n & 1;
+		ref.buflen = 0;
+		sse = ref;
 
-	std::cout << std::endl << "Running speed tests (no divergence)" << std::endl;
-	for (auto N : sizes) {
-		std::cout << std::endl;
-		TestTNSpeed<DeviceCPU>(N, false, input);
-		TestTNSpeed<DeviceCUDA>(N, false, input);
-		TestTNSpeed<DeviceCL>(N, false, input);
+		blake256_compress(&ref, block);
+		blake256_compress_sse41(&sse, block);
+		if (memcmp(ref.h, sse.h, sizeof(ref.h))) {
+			std::cout << "FAILED!!!" << std::endl;
+			return;
+		}
 	}
+	std::cout << "Sane" << std::endl;
+}
+
+void TestAESSanity() {
+	std::cout << "Sanity checking AES-NI expansion... ";
+	std::cout.flush();
 
-	std::cout << std::endl << "Running speed tests (divergent)" << std::endl;
-	for (auto N : sizes) {
-		std::cout << std::endl;
-		TestTNSpeed<DeviceCPU>(N, true, input);
-		TestTNSpeed<DeviceCUDA>(N, true, input);
-		TestTNSpeed<DeviceCL>(N, true, input);
+	if (!tn_cpu_has_aesni()) {
+		std::cout << "Unsupported" << std::endl;
+		return;
 	}
+
+	uint8_t key[32], text[AES_EXPAND_TEXT_SIZE];
+	for (auto &b : key) b = rand();
+	for (auto &b : text) b = rand();
+
+	// Odd length also covers the partial last chunk
+	std::vector<uint8_t> soft(4096 + 77), ni(4096 + 77);
+	aes_expand_scratchpad_soft(key, text, soft.data(), soft.size());
+	aes_expand_scratchpad_aesni(key, text, ni.data(), ni.size());
+
+	if (soft != ni) {
+		std::cout << "FAILED!!!" << std::endl;
+	} else {
+		std::cout << "Sane" << std::endl;
+	}
+}
+
+// Feeds input in uneven chunks, from single bytes to more than the tree chunk size
+VM_State *stream_chunked(const std::string &input, const TN_Variant variant) {
+	static const size_t chunks[] = { 7, 1, 4095, 70001, 3, 262147, 65536 };
+
+	VM_Stream *stream = TN_VM_StreamInit(variant);
+	for (size_t i = 0, c = 0; i < input.length(); c = (c + 1) % (sizeof(chunks) / sizeof(chunks[0]))) {
+		size_t len = std::min(chunks[c], input.length() - i);
+		TN_VM_StreamUpdate(stream, input.c_str() + i, len);
+		i += len;
+	}
+	return TN_VM_StreamFinal(stream);
+}
+
+void TestStreamSanity(const std::string &input, const TN_Variant variant = TN_VARIANT_ORIGINAL) {
+	std::cout << "Sanity checking streamed init (variant " << variant << ")... ";
+	std::cout.flush();
+
+	bool sane = true;
+	// Around the point where memory is full and keccak takes over, and an input several times that
+	for (size_t length : { input.length(), (size_t)MEMORY_SIZE - 1, (size_t)MEMORY_SIZE, (size_t)MEMORY_SIZE + 1, (size_t)3 * MEMORY_SIZE + 12345 }) {
+		std::string data = length == input.length() ? input : random_string(length);
+
+		// Inputs TN_VM_Init rejects are compared with the whole input streamed at once
+		VM_State *whole;
+		if (length < MEMORY_SIZE) {
+			whole = TN_VM_Init(data.c_str(), data.length(), variant);
+		} else {
+			VM_Stream *stream = TN_VM_StreamInit(variant);
+			TN_VM_StreamUpdate(stream, data.c_str(), data.length());
+			whole = TN_VM_StreamFinal(stream);
+		}
+		VM_State *streamed = stream_chunked(data, variant);
+
+		sane &= !memcmp(whole, streamed, sizeof(VM_State));
+
+		delete whole;
+		delete streamed;
+	}
+
+	std::cout << (sane ? "Sane" : "FAILED!!!") << std::endl;
+}
+
+void TestFinalizeBatchSanity(const std::string &input) {
+	std::cout << "Sanity checking batch finalize... ";
+	std::cout.flush();
+
+	const size_t N = 16;
+	VM_State *single[N], *batch[N];
+	char singleHash[N * HASH_SIZE], batchHash[N * HASH_SIZE];
+
+	DeviceCPU cpu;
+	for (size_t i = 0; i < N; ++i) {
+		std::string variant = input + std::to_string(i);
+		single[i] = TN_VM_Init(variant.c_str(), variant.length());
+		cpu.run(1, single[i]);
+		batch[i] = new VM_State(*single[i]);
+	}
+
+	for (size_t i = 0; i < N; ++i) TN_VM_Finalize(single[i], singleHash + i * HASH_SIZE);
+	TN_VM_FinalizeBatch(N, batch, batchHash);
+
+	if (memcmp(singleHash, batchHash, sizeof(singleHash))) {
+		std::cout << "FAILED!!!" << std::endl;
+	} else {
+		std::cout << "Sane" << std::endl;
+	}
+}
+
+void TestAsyncSanity(const std::string &input) {
+	std::cout << "Sanity checking CPU async... ";
+	std::cout.flush();
+
+	const size_t N = 8;
+	std::vector<TN_Hash> expected(N);
+	for (size_t i = 0; i < N; ++i) {
+		std::string in = input + std::to_string(i);
+		VM_State *state = TN_VM_Init(in.c_str(), in.length());
+		DeviceCPU().run(1, state);
+		TN_VM_Finalize(state, expected[i].data());
+	}
+
+	bool sane = true;
+	{
+		DeviceCPUAsync async;
+		std::vector<std::future<TN_Hash>> futures;
+		std::vector<TN_Hash> callbackHashes(N);
+		std::atomic<size_t> callbacks(0);
+		for (size_t i = 0; i < N; ++i) {
+			std::string in = input + std::to_string(i);
+			if (i % 2) futures.push_back(async.submit(in));
+			else async.submit(in, [&, i](const TN_Hash &hash, std::exception_ptr) { callbackHashes[i] = hash; callbacks++; });
+		}
+		for (size_t i = 1; i < N; i += 2) sane &= futures[i / 2].get() == expected[i];
+		while (callbacks < N / 2) std::this_thread::yield();
+		for (size_t i = 0; i < N; i += 2) sane &= callbackHashes[i] == expected[i];
+	}
+
+	std::cout << (sane ? "Sane" : "FAILED!!!") << std::endl;
+}
+
+#ifdef TN_HAVE_COROUTINES
+// Starts right away and runs to the end on its own, enough to drive an Awaitable
+struct DetachedTask {
+	struct promise_type {
+		DetachedTask get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+DetachedTask AwaitHash(DeviceCPUAsync& async, std::string input, std::shared_ptr<const CancelToken> cancel, std::promise<TN_Hash>& result) {
+	try {
+		result.set_value(co_await async.awaitable(input, TN_VARIANT_ORIGINAL, cancel));
+	} catch (...) {
+		result.set_exception(std::current_exception());
+	}
+}
+#endif
+
+void TestAwaitableSanity(const std::string &input) {
+	std::cout << "Sanity checking CPU async co_await... ";
+	std::cout.flush();
+
+#ifdef TN_HAVE_COROUTINES
+	TN_Hash expected;
+	DeviceCPU cpu;
+	TN_HashInput(cpu, input, TN_VARIANT_ORIGINAL, nullptr, expected);
+
+	auto cancel = std::make_shared<CancelToken>();
+	cancel->cancel();
+
+	bool sane = true;
+	{
+		DeviceCPUAsync async;
+		std::promise<TN_Hash> hashed, cancelled;
+		AwaitHash(async, input, nullptr, hashed);
+		AwaitHash(async, input, cancel, cancelled);
+
+		sane &= hashed.get_future().get() == expected;
+		// The error of a cancelled hash is thrown by co_await
+		try {
+			cancelled.get_future().get();
+			sane = false;
+		} catch (std::exception&) {
+		}
+	}
+
+	std::cout << (sane ? "Sane" : "FAILED!!!") << std::endl;
+#else
+	std::cout << "Unsupported" << std::endl;
+#endif
+}
+
+void TestSchedulerSanity(const std::string &input) {
+	std::cout << "Sanity checking CPU scheduler... ";
+	std::cout.flush();
+
+	std::mutex mutex;
+	std::vector<std::string> order;
+	auto record = [&](const std::string &name) {
+		return [&, name](const TN_Hash &, std::exception_ptr error) {
+			std::lock_guard<std::mutex> lock(mutex);
+			order.push_back(error ? name + " error" : name);
+		};
+	};
+
+	HashSchedulerMetrics metrics;
+	{
+		HashScheduler scheduler(1);
+		scheduler.submit(input, 0, TN_PRIORITY_SHARE, record("busy"));
+		while (scheduler.metrics().started[TN_PRIORITY_SHARE] == 0) std::this_thread::yield();
+
+		// Queued while the only worker is busy
+		scheduler.submit(input + "a1", 1, TN_PRIORITY_SHARE, record("a1"));
+		scheduler.submit(input + "a2", 1, TN_PRIORITY_SHARE, record("a2"));
+		scheduler.submit(input + "a3", 1, TN_PRIORITY_SHARE, record("a3"));
+		scheduler.submit(input + "b1", 2, TN_PRIORITY_SHARE, record("b1"));
+		scheduler.submit(input + "late", 2, TN_PRIORITY_SHARE, record("late"), HashScheduler::Clock::now() - std::chrono::milliseconds(1));
+		// Drops late right away
+		scheduler.submit(input + "block", 3, TN_PRIORITY_BLOCK, record("block"));
+		metrics = scheduler.metrics();
+	}
+
+	const std::vector<std::string> expected = { "late error", "busy", "block", "a1", "b1", "a2", "a3" };
+	std::cout << (order == expected && metrics.depth[TN_PRIORITY_SHARE] == 4 && metrics.expired == 1 ? "Sane" : "FAILED!!!") << std::endl;
+}
+
+void TestResultCacheSanity(const std::string &input) {
+	std::cout << "Sanity checking result cache... ";
+	std::cout.flush();
+
+	const char *path = "tn_test_cache.bin";
+	std::remove(path);
+
+	std::vector<std::string> inputs = { input + "0", input + "1", input + "0", input + "2" };
+	std::vector<TN_Hash> hashes(inputs.size());
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		VM_State *state = TN_VM_Init(inputs[i].c_str(), inputs[i].length());
+		DeviceCPU().run(1, state);
+		TN_VM_Finalize(state, hashes[i].data());
+	}
+	hashes[3][0] ^= 1;
+	const std::vector<bool> expected = { true, true, true, false };
+
+	bool sane = true;
+	{
+		DeviceCPUAsync async;
+		ResultCache cache(path, 64);
+		sane &= TN_VerifyBatch(async, inputs, hashes, &cache) == expected;
+		ResultCacheStats stats = cache.stats();
+		sane &= stats.hits == 0 && stats.inserts == 3;
+
+		// Locked while open
+		bool locked = false;
+		try {
+			ResultCache second(path, 64);
+		} catch (std::runtime_error&) {
+			locked = true;
+		}
+		sane &= locked;
+	}
+	{
+		// Reopened, everything is answered from the file
+		DeviceCPUAsync async;
+		ResultCache cache(path, 64);
+		sane &= TN_VerifyBatch(async, inputs, hashes, &cache) == expected;
+		sane &= cache.stats().hits == inputs.size();
+
+		// Bounded: a full table evicts, and whatever is found is still right
+		TN_Hash fake = {};
+		for (size_t i = 0; i < 1000; ++i) {
+			fake[0] = (char)i;
+			cache.insert(std::to_string(i), TN_VARIANT_ORIGINAL, fake);
+		}
+		for (size_t i = 0; i < 1000; ++i) {
+			TN_Hash found;
+			if (cache.lookup(std::to_string(i), TN_VARIANT_ORIGINAL, found)) sane &= found[0] == (char)i;
+		}
+		sane &= cache.stats().evictions > 0;
+	}
+	std::remove(path);
+
+	std::cout << (sane ? "Sane" : "FAILED!!!") << std::endl;
+}
+
+struct StringCodecs {
+	const char *name;
+	bool supported;
+	void (*toHex)(const uint8_t*, size_t, char*);
+	bool (*fromHex)(const char*, size_t, uint8_t*);
+	bool (*base64Decode)(const char*, size_t, uint8_t*);
+};
+
+std::vector<StringCodecs> AvailableStringCodecs() {
+	std::vector<StringCodecs> codecs = { { "portable", true, StringTools::toHexPortable, StringTools::fromHexPortable, StringTools::base64DecodePortable } };
+#ifdef TN_X86
+	codecs.push_back({ "SSSE3", tn_cpu_has_ssse3() != 0, StringTools::toHexSsse3, StringTools::fromHexSsse3, StringTools::base64DecodeSsse3 });
+	codecs.push_back({ "AVX2", tn_cpu_has_avx2() != 0, StringTools::toHexAvx2, StringTools::fromHexAvx2, StringTools::base64DecodeAvx2 });
+#endif
+	return codecs;
+}
+
+std::string Base64Encode(const std::vector<uint8_t> &data) {
+	const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string text;
+	for (size_t i = 0; i < data.size(); i += 3) {
+		uint32_t quad = data[i] << 16 | (i + 1 < data.size() ? data[i + 1] << 8 : 0) | (i + 2 < data.size() ? data[i + 2] : 0);
+		for (size_t j = 0; j < 4 && j <= data.size() - i; ++j) text += alphabet[(quad >> (18 - 6 * j)) & 63];
+	}
+	return text;
+}
+
+// Round trips every length across the vector block sizes and every byte value at every position
+void TestStringToolsSanity() {
+	const char *hexDigits = "0123456789abcdefABCDEF";
+	const char *base64Alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	for (auto &codecs : AvailableStringCodecs()) {
+		std::cout << "Sanity checking " << codecs.name << " hex and base64 codecs... ";
+		std::cout.flush();
+
+		if (!codecs.supported) {
+			std::cout << "Unsupported" << std::endl;
+			continue;
+		}
+
+		bool sane = true;
+		for (size_t size = 0; size <= 300; ++size) {
+			std::vector<uint8_t> data(size), decoded(size + 1, 0);
+			for (size_t i = 0; i < size; ++i) data[i] = (uint8_t)(size < 256 ? i + size : rand());
+
+			// Upper case hex decodes just the same
+			std::string hex(2 * size, '\0');
+			codecs.toHex(data.data(), size, &hex[0]);
+			sane &= hex == StringTools::toHex(data.data(), size);
+			sane &= codecs.fromHex(hex.data(), hex.size(), decoded.data()) && std::equal(data.begin(), data.end(), decoded.begin());
+			std::transform(hex.begin(), hex.end(), hex.begin(), ::toupper);
+			sane &= codecs.fromHex(hex.data(), hex.size(), decoded.data()) && std::equal(data.begin(), data.end(), decoded.begin());
+
+			// Unpadded, then padded through the dispatching version
+			std::string base64 = Base64Encode(data);
+			std::fill(decoded.begin(), decoded.end(), 0);
+			sane &= codecs.base64Decode(base64.data(), base64.size(), decoded.data()) && std::equal(data.begin(), data.end(), decoded.begin());
+			sane &= decoded[size] == 0;
+			base64.append((4 - base64.size() % 4) % 4, '=');
+			size_t decodedSize = 0;
+			sane &= StringTools::base64Decode(base64.data(), base64.size(), decoded.data(), decodedSize) && decodedSize == size;
+			sane &= decodedSize <= StringTools::base64DecodedSize(base64.size());
+			sane &= StringTools::base64Decode(base64) == std::string(data.begin(), data.end());
+		}
+
+		// Long enough for two full blocks and a tail at every vector width
+		std::vector<uint8_t> out(200);
+		for (size_t position = 0; position < 130; ++position) {
+			for (int c = 0; c < 256; ++c) {
+				std::string hex(130, 'f'), base64(130, 'A');
+				hex[position] = (char)c;
+				base64[position] = (char)c;
+				bool isHex = c && strchr(hexDigits, c), isBase64 = c && strchr(base64Alphabet, c);
+				sane &= codecs.fromHex(hex.data(), hex.size(), out.data()) == isHex;
+				sane &= codecs.base64Decode(base64.data(), base64.size(), out.data()) == isBase64;
+			}
+		}
+
+		std::cout << (sane ? "Sane" : "FAILED!!!") << std::endl;
+	}
+}
+
+void TestTreeLatency(const std::string &input) {
+	// The tree digest must not depend on how many threads hash the leaves
+	char treeHash[HASH_SIZE];
+	bool sane = true;
+
+	for (size_t threads : { 1, 2, 4, 8 }) {
+		TN_SetTreeThreads(threads);
+
+		for (auto variant : { TN_VARIANT_ORIGINAL, TN_VARIANT_TREE }) {
+			char hash[HASH_SIZE];
+			DeviceCPU cpu;
+
+			auto start = std::chrono::high_resolution_clock::now();
+			VM_State *state = TN_VM_Init(input.c_str(), input.length(), variant);
+			auto init = std::chrono::high_resolution_clock::now();
+			cpu.run(1, state);
+			auto run = std::chrono::high_resolution_clock::now();
+			TN_VM_Finalize(state, hash);
+			auto end = std::chrono::high_resolution_clock::now();
+
+			auto us = [](std::chrono::high_resolution_clock::duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+			std::cout << (variant == TN_VARIANT_TREE ? "Tree" : "Original") << " hash with " << threads << " threads took "
+				<< us(end - start) << "us (init " << us(init - start) << "us, finalize " << us(end - run) << "us)" << std::endl;
+
+			if (variant != TN_VARIANT_TREE) continue;
+			if (threads == 1) memcpy(treeHash, hash, HASH_SIZE);
+			else sane &= !memcmp(treeHash, hash, HASH_SIZE);
+		}
+	}
+	TN_SetTreeThreads(0);
+
+	std::cout << "Sanity checking tree hash with 1, 2, 4 and 8 threads... " << (sane ? "Sane" : "FAILED!!!") << std::endl;
+}
+
+void TestLanesLatency(const std::string &input) {
+	DeviceCPU cpu;
+	auto ms = [](std::chrono::high_resolution_clock::duration d) { return std::chrono::duration_cast<std::chrono::milliseconds>(d).count(); };
+
+	VM_State *single = TN_VM_Init(input.c_str(), input.length());
+	auto start = std::chrono::high_resolution_clock::now();
+	cpu.run(1, single);
+	auto singleTime = std::chrono::high_resolution_clock::now() - start;
+	delete single;
+
+	VM_State *lanes = TN_VM_Init(input.c_str(), input.length(), TN_VARIANT_LANES);
+	VM_State *sequential = new VM_State(*lanes);
+	start = std::chrono::high_resolution_clock::now();
+	cpu.run(1, lanes);
+	auto lanesTime = std::chrono::high_resolution_clock::now() - start;
+
+	start = std::chrono::high_resolution_clock::now();
+	cpu.runSequential(sequential);
+	auto sequentialTime = std::chrono::high_resolution_clock::now() - start;
+
+	std::cout << "Single lane execution took " << ms(singleTime) << "ms" << std::endl;
+	std::cout << TN_LANE_COUNT << " lanes on 1 thread took " << ms(sequentialTime) << "ms" << std::endl;
+	std::cout << TN_LANE_COUNT << " lanes on " << TN_LANE_COUNT << " threads took " << ms(lanesTime) << "ms ("
+		<< (double)singleTime.count() / lanesTime.count() << "x speedup, "
+		<< (memcmp(lanes, sequential, sizeof(VM_State)) ? "MISMATCH!!!" : "same result") << ")" << std::endl;
+
+	delete lanes;
+	delete sequential;
+}
+
+void TestCancelLatency(const std::string &input) {
+	DeviceCPU cpu;
+	CancelToken never;
+	auto us = [](std::chrono::high_resolution_clock::duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+
+	VM_State *plain = TN_VM_Init(input.c_str(), input.length());
+	VM_State *checked = new VM_State(*plain);
+	auto start = std::chrono::high_resolution_clock::now();
+	cpu.run(1, plain);
+	auto plainTime = std::chrono::high_resolution_clock::now() - start;
+	start = std::chrono::high_resolution_clock::now();
+	cpu.run(1, checked, &never);
+	auto checkedTime = std::chrono::high_resolution_clock::now() - start;
+	std::cout << "Execution took " << us(plainTime) << "us, with cancel checks " << us(checkedTime) << "us ("
+		<< (memcmp(plain, checked, sizeof(VM_State)) ? "MISMATCH!!!" : "same result") << ")" << std::endl;
+	delete plain;
+	delete checked;
+
+	const size_t N = 4;
+	auto cancel = std::make_shared<CancelToken>();
+	std::vector<std::future<TN_Hash>> futures;
+	{
+		DeviceCPUAsync async(N);
+		for (size_t i = 0; i < N; ++i) futures.push_back(async.submit(input + std::to_string(i), TN_VARIANT_ORIGINAL, cancel));
+		// Past init, which is not interruptible
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+		start = std::chrono::high_resolution_clock::now();
+		cancel->cancel();
+		for (auto &f : futures) f.wait();
+		std::cout << "Cancelling " << N << " in-flight hashes took " << us(std::chrono::high_resolution_clock::now() - start) << "us" << std::endl;
+	}
+}
+
+// The second device loads the program the first one built, unless the cache is off
+void TestCLStartup() {
+	for (int i = 0; i < 2; ++i) {
+		DeviceCL cl;
+		const DeviceCLProgramLoad &load = cl.programLoad();
+		if (load.cached) {
+			std::cout << "OpenCL program loaded from cache in " << load.milliseconds << "ms, building it took " << load.build_milliseconds
+				<< "ms (" << load.build_milliseconds - load.milliseconds << "ms saved)" << std::endl;
+		} else {
+			std::cout << "OpenCL program built in " << load.milliseconds << "ms" << (load.path.empty() ? " (cache off)" : "") << std::endl;
+		}
+	}
+}
+
+// Divergent batch on 32 wide wavefronts, the efficiency right after regrouping is the most a miner could get back
+void TestCLRegroup(const std::string &input) {
+	const size_t N = 128, width = 32;
+	const uint64_t burst = 16;
+
+	std::vector<VM_State> base(N), cpuStates;
+	for (size_t i = 0; i < N; ++i) {
+		std::string in = input + std::to_string(i);
+		VM_State *state = TN_VM_Init(in.c_str(), in.length());
+		base[i] = *state;
+		delete state;
+	}
+	cpuStates = base;
+	DeviceCPU().run(N, cpuStates.data());
+
+	DeviceCL cl;
+	const char *names[] = { "in order", "by opcode", "by opcode class" };
+	for (auto regroup : { TN_CL_REGROUP_NONE, TN_CL_REGROUP_OPCODE, TN_CL_REGROUP_CLASS }) {
+		std::vector<VM_State> states = base;
+		DeviceCLRegroupStats stats = cl.runRegrouped(N, states.data(), regroup, burst, width);
+
+		std::cout << "OpenCL " << N << " states " << names[regroup] << ", " << burst << " step bursts: " << stats.efficiency() * 100
+			<< "% lane efficiency (" << stats.efficiency(1) * 100 << "% on the first step) in " << stats.milliseconds << "ms ("
+			<< (memcmp(states.data(), cpuStates.data(), N * sizeof(VM_State)) ? "MISMATCH!!!" : "same result") << ")" << std::endl;
+	}
+}
+
+// Encoding and decoding 1MB, the sizes of blobs and hashes are dominated by call overhead
+void TestStringToolsSpeed() {
+	const size_t size = 1 << 20;
+	std::vector<uint8_t> data(size), decoded(size);
+	for (auto &b : data) b = rand();
+	std::string hex = StringTools::toHex(data.data(), size), base64 = Base64Encode(data);
+	auto mbs = [](std::chrono::high_resolution_clock::duration d) { return size / std::chrono::duration<double>(d).count() / 1e6; };
+
+	for (auto &codecs : AvailableStringCodecs()) {
+		if (!codecs.supported) continue;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		codecs.toHex(data.data(), size, &hex[0]);
+		auto encoded = std::chrono::high_resolution_clock::now();
+		codecs.fromHex(hex.data(), hex.size(), decoded.data());
+		auto hexDecoded = std::chrono::high_resolution_clock::now();
+		codecs.base64Decode(base64.data(), base64.size(), decoded.data());
+		auto end = std::chrono::high_resolution_clock::now();
+
+		std::cout << codecs.name << " codecs: hex encode " << mbs(encoded - start) << "MB/s, hex decode " << mbs(hexDecoded - encoded)
+			<< "MB/s, base64 decode " << mbs(end - hexDecoded) << "MB/s" << std::endl;
+	}
+}
+
+// Runs a hash in slices, each on a new thread, and reports the per-slice throughput
+void TestSlicedExecution(const std::string &input) {
+	const uint64_t slice = 64 * 1024;
+
+	VM_State *whole = TN_VM_Init(input.c_str(), input.length());
+	VM_State *sliced = new VM_State(*whole);
+	DeviceCPU().run(1, whole);
+
+	double minRate = 1e300, maxRate = 0, totalSeconds = 0;
+	size_t slices = 0;
+	for (bool finished = false; !finished; ++slices) {
+		uint64_t steps = sliced->step_counter;
+		auto start = std::chrono::high_resolution_clock::now();
+		std::thread([&] { finished = TN_VM_Execute(sliced, slice); }).join();
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		double rate = (sliced->step_counter - steps) / seconds / 1e6;
+		if (!finished) {
+			minRate = std::min(minRate, rate);
+			maxRate = std::max(maxRate, rate);
+		}
+		totalSeconds += seconds;
+	}
+
+	std::cout << slices << " slices of " << slice << " steps: " << sliced->step_counter / totalSeconds / 1e6 << " Msteps/s average, "
+		<< minRate << "-" << maxRate << " Msteps/s per slice ("
+		<< (memcmp(whole, sliced, sizeof(VM_State)) ? "MISMATCH!!!" : "same result") << ")" << std::endl;
+
+	delete whole;
+	delete sliced;
+}
+
+// Useful work per step: scratchpad bytes that differ from the initial memory after the run
+void TestWordsWork(const std::string &input) {
+	DeviceCPU cpu;
+
+	for (auto variant : { TN_VARIANT_ORIGINAL, TN_VARIANT_WORDS }) {
+		VM_State *state = TN_VM_Init(input.c_str(), input.length(), variant);
+		std::vector<uint8_t> initial(state->memory, state->memory + MEMORY_SIZE);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		cpu.run(1, state);
+		auto elapsed = std::chrono::high_resolution_clock::now() - start;
+
+		size_t changed = 0;
+		for (size_t i = 0; i < MEMORY_SIZE; ++i) changed += state->memory[i] != initial[i];
+
+		double steps = (double)state->step_counter;
+		std::cout << (variant == TN_VARIANT_WORDS ? "Word" : "Byte") << " instruction set: " << state->step_counter << " steps, "
+			<< std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / steps << "ns/step, "
+			<< changed / steps << " bytes changed/step" << std::endl;
+		delete state;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	std::string input = random_string(50);
+
+	TestTNSanity(input);
+	TestTNSanity(input, TN_VARIANT_AES);
+	TestTNSanity(input, TN_VARIANT_TREE);
+	TestCLPipelineSanity(input);
+	TestCLHashSanity(input);
+	TestDeviceGroupSanity(input);
+	TestDeviceGroupStealing(input);
+	TestBlake256Sanity();
+	TestAESSanity();
+	TestStreamSanity(input);
+	TestStreamSanity(input, TN_VARIANT_AES);
+	TestStreamSanity(input, TN_VARIANT_TREE);
+	TestFinalizeBatchSanity(input);
+	TestAsyncSanity(input);
+	TestAwaitableSanity(input);
+	TestSchedulerSanity(input);
+	TestResultCacheSanity(input);
+	TestStringToolsSanity();
+
+	std::cout << std::endl << "Running single hash latency tests" << std::endl << std::endl;
+	TestTreeLatency(input);
+	std::cout << std::endl;
+	TestLanesLatency(input);
+	std::cout << std::endl;
+	TestWordsWork(input);
+	std::cout << std::endl;
+	TestCancelLatency(input);
+	std::cout << std::endl;
+	TestSlicedExecution(input);
+	std::cout << std::endl;
+	TestCLStartup();
+	std::cout << std::endl;
+	TestCLRegroup(input);
+	std::cout << std::endl;
+	TestStringToolsSpeed();
 }
\ No newline at end of file
@@ -0,0 +1,389 @@
+/*
+ * tn-bench: repeatable benchmarks of the hash and its phases, to compare builds and catch regressions.
+ *
+ * Inputs are derived from --seed and their index only, so every run of every build measures the same
+ * work. Each scenario runs --warmup unmeasured repetitions, then --repeat measured ones, and reports
+ * mean, standard deviation, min, median and max of its metric. --json writes the results to a file,
+ * --compare reads such a file back and flags scenarios that got worse by more than --tolerance percent.
+ *
+ * Scenarios, --filter runs those whose name contains the text:
+ *   init/VARIANT                  TN_VM_Init, ms
+ *   keccak                        keccak1600 over MEMORY_SIZE bytes as in init, MB/s
+ *   execute/VARIANT               VM steps on one thread, Msteps/s
+ *   final/jh, blake, groestl      final hash over a finished state, MB/s
+ *   latency/VARIANT               one whole hash (init, run, finalize) as DeviceCPU runs it, ms
+ *   scaling/threads-T             T threads hashing whole hashes, hashes/s, for T = 1..--max-threads
+ *   batch/DEVICE/uniform/N        N copies of one state run as one batch, hashes/s
+ *   batch/DEVICE/divergent/N      N states of different inputs, hashes/s
+ *
+ * Batches run on the CPU, and on OpenCL and CUDA when tn-bench is built with them.
+ */
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPU.h"
+#include "misc/StringTools.h"
+#include "net/Json.h"
+#ifdef TN_BENCH_OPENCL
+#include "opencl/TuringsNightmareCL.h"
+#endif
+#ifdef TN_BENCH_CUDA
+#include "cuda/TuringsNightmareCUDA.h"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "crypto/blake256.h"
+#include "crypto/groestl.h"
+#include "crypto/jh.h"
+}
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+	uint64_t seed = 1;
+	size_t warmup = 1;
+	size_t repeat = 5;
+	size_t input_size = 76;
+	size_t max_threads = 0;
+	size_t scaling_hashes = 4;
+	std::vector<size_t> batches = { 1, 8, 32 };
+	std::string filter;
+	std::string json;
+	std::string compare;
+	double tolerance = 5;
+	bool list = false;
+};
+
+struct Scenario {
+	std::string name;
+	std::string unit;
+	bool higher_is_better;
+	std::function<double(size_t repetition)> measure; // Metric of one repetition
+};
+
+// Runs a batch of states to the end, batch scenarios only need that of a device. DeviceCUDA has
+// nothing else, so it isn't a Device.
+typedef std::function<void(const size_t N, VM_State *states)> BatchRunner;
+
+struct Summary {
+	std::vector<double> samples;
+	double mean = 0, stddev = 0, min = 0, median = 0, max = 0;
+};
+
+static const char *variant_names[_TN_VARIANT_LAST] = { "original", "aes", "tree", "lanes", "words" };
+
+// Same input for the same seed and index, whatever ran before
+static std::string TN_Input(const Options& options, uint64_t index) {
+	std::seed_seq seq{ (uint32_t)options.seed, (uint32_t)(options.seed >> 32), (uint32_t)index, (uint32_t)(index >> 32) };
+	std::mt19937_64 rng(seq);
+	std::string input(options.input_size, 0);
+	for (auto &c : input) c = (char)rng();
+	return input;
+}
+
+static VM_State *TN_InitInput(const Options& options, uint64_t index, TN_Variant variant = TN_VARIANT_ORIGINAL) {
+	std::string input = TN_Input(options, index);
+	return TN_VM_Init(input.data(), input.size(), variant);
+}
+
+template<typename F> static double TN_Seconds(F f) {
+	auto start = Clock::now();
+	f();
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static Summary TN_Summarize(std::vector<double> samples) {
+	Summary s;
+	s.samples = samples;
+	if (samples.empty()) return s;
+
+	std::sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	for (double v : samples) s.mean += v;
+	s.mean /= n;
+	for (double v : samples) s.stddev += (v - s.mean) * (v - s.mean);
+	s.stddev = n > 1 ? std::sqrt(s.stddev / (n - 1)) : 0;
+	s.min = samples.front();
+	s.max = samples.back();
+	s.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+	return s;
+}
+
+static std::vector<Scenario> TN_Scenarios(const Options& options, std::vector<std::pair<std::string, BatchRunner>>& devices) {
+	std::vector<Scenario> scenarios;
+
+	for (int v = 0; v < _TN_VARIANT_LAST; ++v) {
+		TN_Variant variant = (TN_Variant)v;
+		scenarios.push_back({ std::string("init/") + variant_names[v], "ms", false, [&options, variant](size_t r) {
+			std::string input = TN_Input(options, r);
+			VM_State *state = nullptr;
+			double seconds = TN_Seconds([&] { state = TN_VM_Init(input.data(), input.size(), variant); });
+			delete state;
+			return seconds * 1e3;
+		} });
+	}
+
+	scenarios.push_back({ "keccak", "MB/s", true, [&options](size_t r) {
+		std::unique_ptr<VM_State> state(TN_InitInput(options, r));
+		uint8_t out[sizeof(state->hs.b)];
+		return MEMORY_SIZE / 1e6 / TN_Seconds([&] { keccak1600(state->memory, MEMORY_SIZE, out); });
+	} });
+
+	for (int v = 0; v < _TN_VARIANT_LAST; ++v) {
+		TN_Variant variant = (TN_Variant)v;
+		scenarios.push_back({ std::string("execute/") + variant_names[v], "Msteps/s", true, [&options, variant](size_t r) {
+			std::unique_ptr<VM_State> state(TN_InitInput(options, r, variant));
+			double seconds = TN_Seconds([&] { DeviceCPU().runSequential(state.get()); });
+			return state->step_counter / seconds / 1e6;
+		} });
+	}
+
+	// Over finished states, like TN_VM_Finalize sees them
+	const char *final_names[] = { "jh", "blake", "groestl" };
+	for (int f = 0; f < 3; ++f) {
+		scenarios.push_back({ std::string("final/") + final_names[f], "MB/s", true, [&options, f](size_t r) {
+			std::unique_ptr<VM_State> state(TN_InitInput(options, r));
+			DeviceCPU().runSequential(state.get());
+			const uint8_t *data = (const uint8_t*)state.get();
+			uint8_t out[HASH_SIZE];
+			double seconds = TN_Seconds([&] {
+				if (f == 0) jh_hash(HASH_SIZE * 8, data, 8 * VM_STATE_HASHED_SIZE, out);
+				else if (f == 1) blake256_hash(out, data, VM_STATE_HASHED_SIZE);
+				else groestl(data, 8 * VM_STATE_HASHED_SIZE, out);
+			});
+			return VM_STATE_HASHED_SIZE / 1e6 / seconds;
+		} });
+	}
+
+	for (int v = 0; v < _TN_VARIANT_LAST; ++v) {
+		TN_Variant variant = (TN_Variant)v;
+		scenarios.push_back({ std::string("latency/") + variant_names[v], "ms", false, [&options, variant](size_t r) {
+			std::string input = TN_Input(options, r);
+			char hash[HASH_SIZE];
+			return 1e3 * TN_Seconds([&] {
+				VM_State *state = TN_VM_Init(input.data(), input.size(), variant);
+				DeviceCPU().run(1, state);
+				TN_VM_Finalize(state, hash);
+			});
+		} });
+	}
+
+	size_t max_threads = options.max_threads ? options.max_threads : std::max(1u, std::thread::hardware_concurrency());
+	for (size_t threads = 1; threads <= max_threads; ++threads) {
+		scenarios.push_back({ "scaling/threads-" + std::to_string(threads), "hashes/s", true, [&options, threads](size_t r) {
+			size_t total = threads * options.scaling_hashes;
+			std::atomic<size_t> next(0);
+			double seconds = TN_Seconds([&] {
+				std::vector<std::thread> workers;
+				for (size_t t = 0; t < threads; ++t) {
+					workers.emplace_back([&] {
+						char hash[HASH_SIZE];
+						for (size_t i; (i = next++) < total;) {
+							VM_State *state = TN_InitInput(options, r * total + i);
+							DeviceCPU().runSequential(state);
+							TN_VM_Finalize(state, hash);
+						}
+					});
+				}
+				for (auto &w : workers) w.join();
+			});
+			return total / seconds;
+		} });
+	}
+
+	for (auto &device : devices) {
+		for (bool divergent : { false, true }) {
+			for (size_t N : options.batches) {
+				std::string name = "batch/" + device.first + (divergent ? "/divergent/" : "/uniform/") + std::to_string(N);
+				BatchRunner run = device.second;
+				scenarios.push_back({ name, "hashes/s", true, [&options, run, divergent, N](size_t r) {
+					std::vector<VM_State> states(N);
+					for (size_t i = 0; i < N; ++i) {
+						std::unique_ptr<VM_State> state(TN_InitInput(options, divergent ? r * N + i : r));
+						states[i] = *state;
+					}
+					return N / TN_Seconds([&] { run(N, states.data()); });
+				} });
+			}
+		}
+	}
+
+	return scenarios;
+}
+
+static JsonValue TN_ToJson(const Scenario& scenario, const Summary& summary) {
+	JsonValue::Array samples(summary.samples.begin(), summary.samples.end());
+	return JsonValue::object()
+		.set("name", scenario.name)
+		.set("unit", scenario.unit)
+		.set("higher_is_better", scenario.higher_is_better)
+		.set("samples", samples)
+		.set("mean", summary.mean)
+		.set("stddev", summary.stddev)
+		.set("min", summary.min)
+		.set("median", summary.median)
+		.set("max", summary.max);
+}
+
+static JsonValue TN_ReadJson(const std::string& path) {
+	std::ifstream file(path);
+	if (!file) throw std::runtime_error("Could not open " + path);
+	std::stringstream text;
+	text << file.rdbuf();
+	return JsonValue::parse(text.str());
+}
+
+static void TN_Usage() {
+	std::cout << "Usage: tn-bench [options]" << std::endl
+		<< "  --seed N            input seed (default 1)" << std::endl
+		<< "  --warmup N          unmeasured repetitions per scenario (default 1)" << std::endl
+		<< "  --repeat N          measured repetitions per scenario (default 5)" << std::endl
+		<< "  --input-size BYTES  (default 76)" << std::endl
+		<< "  --max-threads N     scaling up to N threads, 0 for all hardware threads (default 0)" << std::endl
+		<< "  --scaling-hashes N  hashes per thread of a scaling repetition (default 4)" << std::endl
+		<< "  --batches N,N,...   batch sizes (default 1,8,32)" << std::endl
+		<< "  --filter TEXT       only scenarios whose name contains TEXT" << std::endl
+		<< "  --list              print the scenario names and exit" << std::endl
+		<< "  --json PATH         write the results there" << std::endl
+		<< "  --compare PATH      results of an earlier --json, exit status 1 if a scenario got worse" << std::endl
+		<< "  --tolerance PERCENT how much worse a mean may get in --compare (default 5)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h") {
+				TN_Usage();
+				return 0;
+			}
+			if (arg == "--list") {
+				options.list = true;
+				continue;
+			}
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			std::string value = argv[++i];
+
+			if (arg == "--seed") options.seed = StringTools::fromString<uint64_t>(value);
+			else if (arg == "--warmup") options.warmup = StringTools::fromString<size_t>(value);
+			else if (arg == "--repeat") options.repeat = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--input-size") options.input_size = StringTools::fromString<size_t>(value);
+			else if (arg == "--max-threads") options.max_threads = StringTools::fromString<size_t>(value);
+			else if (arg == "--scaling-hashes") options.scaling_hashes = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--batches") options.batches = StringTools::fromDelimitedString<size_t>(value, ',');
+			else if (arg == "--filter") options.filter = value;
+			else if (arg == "--json") options.json = value;
+			else if (arg == "--compare") options.compare = value;
+			else if (arg == "--tolerance") options.tolerance = StringTools::fromString<double>(value);
+			else throw std::runtime_error("Unknown option " + arg);
+		}
+		if (options.input_size == 0 || options.input_size >= MEMORY_SIZE) throw std::runtime_error("--input-size has to be 1 to MEMORY_SIZE - 1");
+		for (size_t N : options.batches) {
+			if (N == 0) throw std::runtime_error("Batch sizes have to be at least 1");
+		}
+
+		DeviceCPU cpu;
+		std::vector<std::pair<std::string, BatchRunner>> devices = { { "cpu", [&cpu](const size_t N, VM_State *states) { cpu.run(N, states); } } };
+#ifdef TN_BENCH_OPENCL
+		std::unique_ptr<DeviceCL> cl;
+		if (!options.list) {
+			try {
+				cl.reset(new DeviceCL());
+				devices.push_back({ "opencl", [&cl](const size_t N, VM_State *states) { cl->run(N, states); } });
+			} catch (std::exception& e) {
+				std::cerr << "tn-bench: OpenCL batches skipped: " << e.what() << std::endl;
+			}
+		}
+#endif
+#ifdef TN_BENCH_CUDA
+		DeviceCUDA cuda;
+		devices.push_back({ "cuda", [&cuda](const size_t N, VM_State *states) { cuda.run(N, states); } });
+#endif
+
+		std::vector<Scenario> scenarios;
+		for (auto &scenario : TN_Scenarios(options, devices)) {
+			if (scenario.name.find(options.filter) != std::string::npos) scenarios.push_back(scenario);
+		}
+		if (options.list) {
+			for (auto &scenario : scenarios) std::cout << scenario.name << std::endl;
+			return 0;
+		}
+
+		JsonValue baseline;
+		if (!options.compare.empty()) baseline = TN_ReadJson(options.compare);
+
+		JsonValue::Array results;
+		size_t regressions = 0;
+		for (auto &scenario : scenarios) {
+			for (size_t r = 0; r < options.warmup; ++r) scenario.measure(r);
+			std::vector<double> samples;
+			for (size_t r = 0; r < options.repeat; ++r) samples.push_back(scenario.measure(r));
+			Summary summary = TN_Summarize(samples);
+			results.push_back(TN_ToJson(scenario, summary));
+
+			std::cout << std::left << std::setw(32) << scenario.name << std::right << std::setw(12) << summary.mean << " " << std::left
+				<< std::setw(8) << scenario.unit << std::right << " +- " << std::setw(9) << summary.stddev << "  (min " << summary.min
+				<< ", median " << summary.median << ", max " << summary.max << ")";
+
+			for (auto &old : baseline["scenarios"].isArray() ? baseline["scenarios"].asArray() : JsonValue::Array()) {
+				if (old["name"].asString() != scenario.name || old["mean"].asNumber() <= 0) continue;
+				// Positive is better, whichever way the metric goes
+				double change = (summary.mean / old["mean"].asNumber() - 1) * 100 * (scenario.higher_is_better ? 1 : -1);
+				bool regressed = change < -options.tolerance;
+				regressions += regressed;
+				std::cout << "  " << std::showpos << std::setprecision(3) << change << std::noshowpos << std::setprecision(6) << "%"
+					<< (regressed ? " REGRESSION" : "");
+			}
+			std::cout << std::endl;
+		}
+
+		if (!options.json.empty()) {
+			JsonValue document = JsonValue::object()
+				.set("tool", "tn-bench")
+				.set("seed", options.seed)
+				.set("warmup", (uint64_t)options.warmup)
+				.set("repeat", (uint64_t)options.repeat)
+				.set("input_size", (uint64_t)options.input_size)
+				.set("hardware_threads", (uint64_t)std::thread::hardware_concurrency())
+#ifdef __VERSION__
+				.set("compiler", __VERSION__)
+#endif
+#ifdef NDEBUG
+				.set("assertions", false)
+#else
+				.set("assertions", true)
+#endif
+				.set("scenarios", results);
+
+			std::ofstream file(options.json);
+			file << document.dump() << std::endl;
+			if (!file) throw std::runtime_error("Could not write " + options.json);
+		}
+
+		if (regressions) {
+			std::cerr << "tn-bench: " << regressions << " scenarios more than " << options.tolerance << "% worse than " << options.compare << std::endl;
+			return 1;
+		}
+	} catch (std::exception& e) {
+		std::cerr << "tn-bench: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,597 @@
+/*
+ * tn-coordinator: splits a pool's jobs across tn-miner processes by nonce range.
+ *
+ * Logs in to the pool (--pool) as a single miner and serves tn-miner workers on --listen. Every
+ * worker gets the current job with a nonce range of its own, sized to last about --lease seconds
+ * at the hashrate the worker reports every second, and its next range before the last one runs
+ * out. Ranges never overlap: a worker that leaves gives back what it had not started of its
+ * ranges and later assignments draw from those first, so joining and leaving rebalances the
+ * search. As its last report can be a second old, what it may have started since (a margin of
+ * TN_RECLAIM_MARGIN_S at its hashrate) is dropped rather than handed out twice. Reported hashrates
+ * are capped at TN_MAX_HASHRATE and no range is larger than a fair share of the nonces left, so one
+ * worker can't claim the whole nonce space. Shares are checked
+ * against the current job and relayed to the pool, a share the pool doesn't answer within
+ * --relay-timeout fails back to its worker.
+ *
+ * The worker protocol is stratum with two extensions: jobs carry range_id, nonce_start and
+ * nonce_end (another job message with the same job_id adds a range), and workers send "report"
+ * calls with their hashrate and progress (range_id and next_nonce).
+ */
+
+#include "TuringsNightmare.h"
+#include "misc/StringTools.h"
+#include "net/Json.h"
+#include "net/Socket.h"
+#include "net/Stratum.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+
+typedef std::chrono::steady_clock Clock;
+
+#define TN_NONCE_SPACE (1ull << 32)
+// Progress a departed worker may have made past its last report (tn-miner reports every second)
+#define TN_RECLAIM_MARGIN_S 2
+// Worker reports above this are taken as this, far beyond what a TN miner reaches
+#define TN_MAX_HASHRATE 1e7
+
+struct Options {
+	std::string pool = "127.0.0.1:3333";
+	std::string user = "tn-coordinator";
+	std::string pass = "x";
+	std::string listen = "127.0.0.1:3334";
+	double lease = 10;
+	uint64_t min_range = 16;
+	double relay_timeout = 30;
+	double print_interval = 10;
+};
+
+struct NonceRange {
+	uint64_t id;
+	uint64_t start, end;
+};
+
+struct Worker : std::enable_shared_from_this<Worker> {
+	Worker(uint64_t id, int fd) : id(id), socket(fd) {}
+
+	uint64_t id;
+	LineSocket socket;
+	bool logged_in = false;
+	std::string agent;
+
+	// Lines queued with the coordinator's mutex held, sent in order by one thread at a time without it
+	std::deque<std::string> outbox;
+	bool sending = false;
+
+	std::deque<NonceRange> ranges; // Assigned and not yet started, oldest first
+	uint64_t next_range = 0;
+	double hashrate = 0;
+	uint64_t hashes = 0;
+	uint64_t accepted = 0, rejected = 0;
+};
+
+// A worker's share waiting for the pool's answer
+struct Relayed {
+	uint64_t worker;
+	JsonValue id;
+	Clock::time_point sent;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void TN_OnSignal(int) {
+	stop_requested = 1;
+}
+
+class Coordinator {
+public:
+	explicit Coordinator(const Options& options) : options(options), pool(options.pool), listener(TN_Listen(options.listen)) {
+		TN_SetNonBlocking(listener);
+	}
+
+	~Coordinator() {
+		pool.shutdown();
+		if (pool_thread.joinable()) pool_thread.join();
+		for (auto &t : threads) t.second.join();
+		TN_CloseSocket(listener);
+	}
+
+	void login();
+	void run();
+
+private:
+	void receivePool();
+	void handlePool(const JsonValue& message);
+	void serve(std::shared_ptr<Worker> worker);
+	void handle(Worker& worker, const JsonValue& request);
+
+	// Sends what was queued for the workers and the pool, called without mutex
+	void deliver();
+	void deliver(const std::shared_ptr<Worker>& worker);
+	// Joins the threads of workers that left
+	void reap();
+
+	// Called with mutex held
+	void queue(Worker& worker, const JsonValue& message);
+	void queuePool(const JsonValue& message);
+	void expireRelayed();
+	void setJob(const JsonValue& params);
+	uint64_t available() const;
+	bool allocate(uint64_t size, NonceRange& range);
+	void assign(Worker& worker);
+	void reclaim(Worker& worker);
+	void progress(Worker& worker, const JsonValue& params);
+	JsonValue jobParams(const NonceRange& range) const;
+	void status();
+
+	void reply(Worker& worker, const JsonValue& id, const JsonValue& result);
+	void fail(Worker& worker, const JsonValue& id, const std::string& message);
+
+	const Options options;
+	LineSocket pool;
+	int listener;
+	std::thread pool_thread;
+	std::map<uint64_t, std::thread> threads; // By worker, only touched by run()
+	std::atomic<bool> pool_closed{ false };
+	std::mutex pool_send_mutex;
+
+	std::mutex mutex; // Guards everything below, nothing is sent with it held
+	std::vector<std::shared_ptr<Worker>> ready; // Workers with queued lines
+	std::vector<std::string> pool_outbox;
+	std::vector<uint64_t> finished; // Workers whose thread is done
+	std::string session;
+	JsonValue job; // Pool's current job, null before login
+	uint64_t next_fresh = 0; // Nonces from here up were never handed out for the job
+	std::deque<std::pair<uint64_t, uint64_t>> returned; // Given back by workers that left
+	bool exhausted = false;
+
+	std::map<uint64_t, std::shared_ptr<Worker>> workers;
+	uint64_t next_worker = 1;
+	std::map<uint64_t, Relayed> relayed; // By pool request id
+	uint64_t next_pool_id = 2; // 1 is the login
+	uint64_t accepted = 0, rejected = 0, stale = 0, unanswered = 0;
+};
+
+JsonValue Coordinator::jobParams(const NonceRange& range) const {
+	return JsonValue::object()
+		.set("blob", job["blob"])
+		.set("job_id", job["job_id"])
+		.set("target", job["target"])
+		.set("variant", job["variant"].isNull() ? JsonValue(0) : job["variant"])
+		.set("range_id", range.id)
+		.set("nonce_start", range.start)
+		.set("nonce_end", range.end);
+}
+
+// Nonces of the current job not assigned to any worker
+uint64_t Coordinator::available() const {
+	uint64_t nonces = next_fresh < TN_NONCE_SPACE ? TN_NONCE_SPACE - next_fresh : 0;
+	for (auto &r : returned) nonces += r.second - r.first;
+	return nonces;
+}
+
+bool Coordinator::allocate(uint64_t size, NonceRange& range) {
+	if (!returned.empty()) {
+		auto &r = returned.front();
+		range.start = r.first;
+		range.end = std::min(r.second, r.first + size);
+		r.first = range.end;
+		if (r.first == r.second) returned.pop_front();
+		return true;
+	}
+
+	if (next_fresh >= TN_NONCE_SPACE) {
+		if (!exhausted) std::cerr << "Nonce space of job " << job["job_id"].dump() << " exhausted" << std::endl;
+		exhausted = true;
+		return false;
+	}
+	range.start = next_fresh;
+	range.end = std::min<uint64_t>(TN_NONCE_SPACE, next_fresh + size);
+	next_fresh = range.end;
+	return true;
+}
+
+// Hands the worker its next range, sized to last the lease at its last reported hashrate but at most
+// its share of the nonces left
+void Coordinator::assign(Worker& worker) {
+	if (job.isNull() || !worker.logged_in) return;
+
+	size_t logged_in = 0;
+	for (auto &w : workers) logged_in += w.second->logged_in;
+	uint64_t share = available() / std::max<size_t>(1, logged_in);
+
+	NonceRange range;
+	// Capped as a double, the product need not fit a uint64_t
+	uint64_t size = std::max(options.min_range, (uint64_t)std::min<double>(share, worker.hashrate * options.lease));
+	if (!allocate(size, range)) return;
+	range.id = worker.next_range++;
+	worker.ranges.push_back(range);
+
+	queue(worker, JsonValue::object().set("jsonrpc", "2.0").set("method", "job").set("params", jobParams(range)));
+}
+
+void Coordinator::reclaim(Worker& worker) {
+	// Skips what it may have started after its last report, those nonces are lost rather than hashed twice
+	uint64_t margin = std::max(options.min_range, (uint64_t)(worker.hashrate * TN_RECLAIM_MARGIN_S));
+	for (auto &r : worker.ranges) {
+		uint64_t skip = std::min(margin, r.end - r.start);
+		margin -= skip;
+		if (r.start + skip < r.end) returned.emplace_back(r.start + skip, r.end);
+	}
+	worker.ranges.clear();
+}
+
+void Coordinator::setJob(const JsonValue& params) {
+	job = params;
+	next_fresh = 0;
+	returned.clear();
+	exhausted = false;
+
+	for (auto &w : workers) {
+		w.second->ranges.clear();
+		assign(*w.second);
+	}
+}
+
+// Drops the ranges the worker is done with and trims the one it is in
+void Coordinator::progress(Worker& worker, const JsonValue& params) {
+	if (params["job_id"].isString() && job["job_id"].isString() && params["job_id"].asString() != job["job_id"].asString()) return;
+	uint64_t range_id = params["range_id"].asUInt();
+
+	while (!worker.ranges.empty() && worker.ranges.front().id < range_id) worker.ranges.pop_front();
+	if (!worker.ranges.empty() && worker.ranges.front().id == range_id && params["next_nonce"].isNumber()) {
+		NonceRange& r = worker.ranges.front();
+		r.start = std::min(r.end, std::max(r.start, params["next_nonce"].asUInt()));
+	}
+
+	uint64_t remaining = 0;
+	for (auto &r : worker.ranges) remaining += r.end - r.start;
+	if (remaining == 0 || remaining < worker.hashrate * options.lease / 2) assign(worker);
+}
+
+void Coordinator::reply(Worker& worker, const JsonValue& id, const JsonValue& result) {
+	queue(worker, JsonValue::object().set("id", id).set("jsonrpc", "2.0").set("error", JsonValue()).set("result", result));
+}
+
+void Coordinator::fail(Worker& worker, const JsonValue& id, const std::string& message) {
+	JsonValue error = JsonValue::object().set("code", -1).set("message", message);
+	queue(worker, JsonValue::object().set("id", id).set("jsonrpc", "2.0").set("error", error).set("result", JsonValue()));
+}
+
+void Coordinator::queue(Worker& worker, const JsonValue& message) {
+	if (worker.outbox.empty()) ready.push_back(worker.shared_from_this());
+	worker.outbox.push_back(message.dump());
+}
+
+void Coordinator::queuePool(const JsonValue& message) {
+	pool_outbox.push_back(message.dump());
+}
+
+void Coordinator::deliver() {
+	std::vector<std::shared_ptr<Worker>> workers_ready;
+	std::vector<std::string> to_pool;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		workers_ready.swap(ready);
+		to_pool.swap(pool_outbox);
+	}
+
+	if (!to_pool.empty()) {
+		// Concurrent deliveries may reorder shares, the pool doesn't care
+		std::lock_guard<std::mutex> lock(pool_send_mutex);
+		try {
+			for (auto &line : to_pool) pool.send(line);
+		} catch (std::exception& e) {
+			// The pool thread notices the closed connection
+			std::cerr << "Could not relay to the pool: " << e.what() << std::endl;
+		}
+	}
+	for (auto &w : workers_ready) deliver(w);
+}
+
+// One thread sends a worker's lines at a time, so they arrive in the order they were queued
+void Coordinator::deliver(const std::shared_ptr<Worker>& worker) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (worker->sending) return; // Whoever is sending takes the new lines too
+	worker->sending = true;
+	while (!worker->outbox.empty()) {
+		std::string line = std::move(worker->outbox.front());
+		worker->outbox.pop_front();
+		lock.unlock();
+		bool sent = true;
+		try {
+			worker->socket.send(line);
+		} catch (std::exception&) {
+			sent = false;
+		}
+		lock.lock();
+		if (!sent) {
+			// Closed, its thread reclaims the ranges
+			worker->outbox.clear();
+			worker->socket.shutdown();
+		}
+	}
+	worker->sending = false;
+}
+
+void Coordinator::expireRelayed() {
+	Clock::time_point deadline = Clock::now() - std::chrono::microseconds((int64_t)(options.relay_timeout * 1e6));
+	for (auto it = relayed.begin(); it != relayed.end();) {
+		if (it->second.sent > deadline) {
+			++it;
+			continue;
+		}
+		unanswered++;
+		auto w = workers.find(it->second.worker);
+		if (w != workers.end()) {
+			w->second->rejected++;
+			fail(*w->second, it->second.id, "Pool did not answer");
+		}
+		it = relayed.erase(it);
+	}
+}
+
+void Coordinator::reap() {
+	std::vector<uint64_t> done;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done.swap(finished);
+	}
+	for (uint64_t id : done) {
+		auto t = threads.find(id);
+		t->second.join();
+		threads.erase(t);
+	}
+}
+
+void Coordinator::handle(Worker& worker, const JsonValue& request) {
+	const JsonValue& id = request["id"];
+	const JsonValue& params = request["params"];
+	const std::string method = request["method"].isString() ? request["method"].asString() : "";
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (method == "login") {
+		worker.logged_in = true;
+		worker.agent = params["agent"].isString() ? params["agent"].asString() : "";
+
+		NonceRange range = {};
+		JsonValue result = JsonValue::object().set("id", std::to_string(worker.id)).set("status", "OK");
+		if (!job.isNull() && allocate(options.min_range, range)) {
+			range.id = worker.next_range++;
+			worker.ranges.push_back(range);
+			result.set("job", jobParams(range));
+		}
+		return reply(worker, id, result);
+	}
+	if (!worker.logged_in) return fail(worker, id, "Unauthenticated");
+
+	if (method == "report") {
+		worker.hashes = params["hashes"].isNumber() ? params["hashes"].asUInt() : worker.hashes;
+		// std::max keeps 0 for NaN
+		worker.hashrate = params["hashrate"].isNumber() ? std::min(TN_MAX_HASHRATE, std::max(0.0, params["hashrate"].asNumber())) : worker.hashrate;
+		if (params["range_id"].isNumber()) progress(worker, params);
+		return reply(worker, id, JsonValue::object().set("status", "OK"));
+	}
+
+	if (method == "submit") {
+		if (job.isNull() || !params["job_id"].isString() || params["job_id"].asString() != job["job_id"].asString()) {
+			stale++;
+			worker.rejected++;
+			return fail(worker, id, "Stale job");
+		}
+
+		uint64_t pool_id = next_pool_id++;
+		relayed[pool_id] = Relayed{ worker.id, id, Clock::now() };
+		JsonValue share = JsonValue::object()
+			.set("id", session)
+			.set("job_id", params["job_id"])
+			.set("nonce", params["nonce"])
+			.set("result", params["result"]);
+		queuePool(JsonValue::object().set("id", pool_id).set("jsonrpc", "2.0").set("method", "submit").set("params", share));
+		return;
+	}
+
+	fail(worker, id, "Unknown method");
+}
+
+void Coordinator::login() {
+	JsonValue params = JsonValue::object().set("login", options.user).set("pass", options.pass).set("agent", "tn-coordinator/1.0");
+	pool.send(JsonValue::object().set("id", 1).set("jsonrpc", "2.0").set("method", "login").set("params", params).dump());
+
+	std::string line;
+	for (;;) {
+		if (!pool.receive(line)) throw std::runtime_error("Pool closed the connection during login.");
+		JsonValue response = JsonValue::parse(line);
+		if (!response["id"].isNumber() || response["id"].asNumber() != 1) continue;
+
+		if (!response["error"].isNull()) throw std::runtime_error("Login failed: " + response["error"]["message"].dump());
+		std::lock_guard<std::mutex> lock(mutex);
+		session = response["result"]["id"].isString() ? response["result"]["id"].asString() : "";
+		if (response["result"]["job"].isObject()) setJob(response["result"]["job"]);
+		break;
+	}
+	deliver();
+
+	pool_thread = std::thread(&Coordinator::receivePool, this);
+}
+
+void Coordinator::handlePool(const JsonValue& message) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (message["method"].isString()) {
+		if (message["method"].asString() == "job") setJob(message["params"]);
+		return;
+	}
+
+	// Numbers too large for asUInt can't be ours
+	if (!message["id"].isNumber() || !(message["id"].asNumber() >= 0 && message["id"].asNumber() < next_pool_id)) return;
+	auto it = relayed.find(message["id"].asUInt());
+	if (it == relayed.end()) return; // Answered late, after it timed out
+	Relayed r = it->second;
+	relayed.erase(it);
+
+	bool ok = message["error"].isNull();
+	if (ok) accepted++;
+	else rejected++;
+
+	auto w = workers.find(r.worker);
+	if (w == workers.end()) return; // Left meanwhile
+	if (ok) w->second->accepted++;
+	else w->second->rejected++;
+	queue(*w->second, JsonValue::object().set("id", r.id).set("jsonrpc", "2.0").set("error", message["error"]).set("result", message["result"]));
+}
+
+void Coordinator::receivePool() {
+	try {
+		std::string line;
+		while (pool.receive(line)) {
+			if (line.empty()) continue;
+			handlePool(JsonValue::parse(line));
+			deliver();
+		}
+	} catch (std::exception& e) {
+		if (!stop_requested) std::cerr << "Pool connection: " << e.what() << std::endl;
+	}
+	pool_closed = true;
+}
+
+void Coordinator::serve(std::shared_ptr<Worker> worker) {
+	try {
+		std::string line;
+		while (worker->socket.receive(line)) {
+			if (line.empty()) continue;
+			handle(*worker, JsonValue::parse(line));
+			deliver();
+		}
+	} catch (std::exception& e) {
+		if (!stop_requested) std::cerr << "Worker " << worker->id << ": " << e.what() << std::endl;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		reclaim(*worker);
+		workers.erase(worker->id);
+		worker->outbox.clear();
+		std::cout << "Worker " << worker->id << " left after " << worker->hashes << " hashes, " << worker->accepted << " shares accepted" << std::endl;
+
+		// Hand the returned nonces to the remaining workers right away
+		for (auto &w : workers) if (w.second->ranges.empty()) assign(*w.second);
+	}
+	deliver();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	finished.push_back(worker->id);
+}
+
+void Coordinator::status() {
+	double hashrate = 0;
+	for (auto &w : workers) hashrate += w.second->hashrate;
+	std::cout << workers.size() << " workers, " << hashrate << " H/s, shares " << accepted << " accepted, " << rejected
+		<< " rejected, " << stale << " stale, " << unanswered << " unanswered, " << next_fresh << " nonces handed out" << std::endl;
+	for (auto &w : workers) {
+		uint64_t remaining = 0;
+		for (auto &r : w.second->ranges) remaining += r.end - r.start;
+		std::cout << "  worker " << w.first << " " << w.second->agent << ": " << w.second->hashrate << " H/s, "
+			<< w.second->ranges.size() << " ranges with " << remaining << " nonces left" << std::endl;
+	}
+}
+
+void Coordinator::run() {
+	std::cout << "Serving workers on " << options.listen << std::endl;
+	Clock::time_point next_print = Clock::now() + std::chrono::microseconds((int64_t)(options.print_interval * 1e6));
+
+	while (!stop_requested && !pool_closed) {
+		pollfd fd = { listener, POLLIN, 0 };
+		poll(&fd, 1, 100);
+
+		int client;
+		while ((client = TN_Accept(listener)) >= 0) {
+			std::lock_guard<std::mutex> lock(mutex);
+			auto worker = std::make_shared<Worker>(next_worker++, client);
+			workers[worker->id] = worker;
+			threads[worker->id] = std::thread(&Coordinator::serve, this, worker);
+		}
+		if (client == TN_ACCEPT_EXHAUSTED) {
+			std::cerr << "Could not accept: " << strerror(errno) << ", pausing for " << TN_ACCEPT_BACKOFF_MS << " ms" << std::endl;
+			std::this_thread::sleep_for(std::chrono::milliseconds(TN_ACCEPT_BACKOFF_MS));
+		}
+		reap();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			expireRelayed();
+			if (options.print_interval > 0 && Clock::now() >= next_print) {
+				status();
+				next_print = Clock::now() + std::chrono::microseconds((int64_t)(options.print_interval * 1e6));
+			}
+		}
+		deliver();
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto &w : workers) w.second->socket.shutdown();
+}
+
+static void TN_Usage() {
+	std::cout << "Usage: tn-coordinator [options]" << std::endl
+		<< "  --pool ADDRESS           pool host:port or unix:/path (default 127.0.0.1:3333)" << std::endl
+		<< "  --user NAME              pool login (default tn-coordinator)" << std::endl
+		<< "  --pass PASSWORD          (default x)" << std::endl
+		<< "  --listen ADDRESS         for workers, host:port or unix:/path (default 127.0.0.1:3334)" << std::endl
+		<< "  --lease SECONDS          work per range at the worker's hashrate (default 10)" << std::endl
+		<< "  --min-range N            smallest range, also for new workers (default 16)" << std::endl
+		<< "  --relay-timeout SECONDS  longest a share waits for the pool's answer (default 30)" << std::endl
+		<< "  --print-interval SECONDS status interval, 0 disables (default 10)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h") {
+				TN_Usage();
+				return 0;
+			}
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			std::string value = argv[++i];
+
+			if (arg == "--pool") options.pool = value;
+			else if (arg == "--user") options.user = value;
+			else if (arg == "--pass") options.pass = value;
+			else if (arg == "--listen") options.listen = value;
+			else if (arg == "--lease") options.lease = StringTools::fromString<double>(value);
+			else if (arg == "--min-range") options.min_range = std::max<uint64_t>(1, StringTools::fromString<uint64_t>(value));
+			else if (arg == "--relay-timeout") options.relay_timeout = StringTools::fromString<double>(value);
+			else if (arg == "--print-interval") options.print_interval = StringTools::fromString<double>(value);
+			else throw std::runtime_error("Unknown option " + arg);
+		}
+
+		signal(SIGINT, TN_OnSignal);
+		signal(SIGTERM, TN_OnSignal);
+		signal(SIGPIPE, SIG_IGN);
+
+		Coordinator coordinator(options);
+		coordinator.login();
+		coordinator.run();
+	} catch (std::exception& e) {
+		std::cerr << "tn-coordinator: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
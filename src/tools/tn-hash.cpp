@@ -0,0 +1,422 @@
+/*
+ * tn-hash: hashes a file of inputs, e.g. to re-verify the blocks of a chain.
+ *
+ * The input file is memory mapped and either hex (one blob per line, blank lines skipped) or
+ * binary (records of a 4 byte little endian length followed by the blob). Inputs go to a
+ * DeviceCPUAsync pool of --threads workers in blocks, two blocks at a time, straight from the
+ * mapping (hex is decoded into a buffer per block that is reused), so their states are finalized
+ * together and recycled through TN_SetStateCache instead of allocating 1 MB per input. Inputs of
+ * MEMORY_SIZE bytes or more are streamed (TN_VM_StreamInit) piece by piece on the main thread.
+ * The hashes are written as hex lines in input order as soon as they are ready.
+ *
+ * With --check every hex line is "<blob> <hash>" and the output is OK or FAIL per line instead,
+ * the exit status is 1 if any input failed.
+ */
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPU.h"
+#include "cpu/TuringsNightmareCPUAsync.h"
+#include "misc/StringTools.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Inputs per worker thread in a block, the pool works on one block while the next is queued
+#define TN_HASH_BLOCK_PER_THREAD 64
+// Decoded bytes fed to TN_VM_StreamUpdate at a time for inputs too long for TN_VM_Init
+#define TN_HASH_STREAM_CHUNK (64 * 1024)
+
+struct Options {
+	std::string input;
+	std::string output;
+	bool binary = false;
+	bool check = false;
+	size_t threads = 0;
+	TN_Variant variant = TN_VARIANT_ORIGINAL;
+};
+
+// Where an input is in the mapping
+struct Record {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t expected_offset; // --check hash hex
+	uint64_t expected_size;
+};
+
+enum ResultState { RESULT_EMPTY, RESULT_HASHED, RESULT_INVALID };
+
+struct Result {
+	TN_Hash hash;
+	ResultState state = RESULT_EMPTY;
+};
+
+// Inputs of a block submitted together, kept until all of them are written
+struct Block {
+	std::vector<char> decoded;
+	std::vector<const char*> inputs;
+	std::vector<size_t> sizes;
+	std::vector<size_t> records; // Record index of each input
+};
+
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& path) {
+		fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			throw std::runtime_error("Could not stat " + path + ": " + strerror(errno));
+		}
+		if (!S_ISREG(st.st_mode)) {
+			close(fd);
+			throw std::runtime_error(path + " is not a regular file, it has to be mapped");
+		}
+		size = st.st_size;
+		if (size == 0) return;
+
+		data = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error("Could not map " + path + ": " + strerror(errno));
+		}
+		madvise((void*)data, size, MADV_SEQUENTIAL);
+	}
+
+	~MappedFile() {
+		if (size) munmap((void*)data, size);
+		close(fd);
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char *data = nullptr;
+	size_t size = 0;
+
+private:
+	int fd;
+};
+
+static bool TN_IsSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static std::vector<Record> TN_IndexHex(const MappedFile& file, bool check) {
+	std::vector<Record> records;
+	for (size_t pos = 0; pos < file.size;) {
+		const char *line = file.data + pos;
+		const char *newline = (const char*)memchr(line, '\n', file.size - pos);
+		size_t length = newline ? newline - line : file.size - pos;
+		pos += length + 1;
+
+		size_t begin = 0, end = length;
+		while (begin < end && TN_IsSpace(line[begin])) begin++;
+		while (end > begin && TN_IsSpace(line[end - 1])) end--;
+		if (begin == end) continue;
+
+		Record r = { (uint64_t)(line - file.data) + begin, end - begin, 0, 0 };
+		if (check) {
+			// Blob, whitespace, expected hash
+			size_t split = begin;
+			while (split < end && !TN_IsSpace(line[split])) split++;
+			size_t hash = split;
+			while (hash < end && TN_IsSpace(line[hash])) hash++;
+			r.size = split - begin;
+			r.expected_offset = (line - file.data) + hash;
+			r.expected_size = end - hash;
+		}
+		records.push_back(r);
+	}
+	return records;
+}
+
+static std::vector<Record> TN_IndexBinary(const MappedFile& file) {
+	std::vector<Record> records;
+	for (size_t pos = 0; pos < file.size;) {
+		if (file.size - pos < 4) throw std::runtime_error("Truncated length prefix at offset " + std::to_string(pos));
+		const uint8_t *p = (const uint8_t*)file.data + pos;
+		uint64_t size = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint64_t)p[3] << 24);
+		pos += 4;
+		if (size > file.size - pos) throw std::runtime_error("Truncated record at offset " + std::to_string(pos - 4));
+
+		records.push_back(Record{ pos, size, 0, 0 });
+		pos += size;
+	}
+	return records;
+}
+
+// Decodes into out, which is only grown, returns false on invalid hex
+static bool TN_DecodeHex(const char *hex, size_t size, std::vector<char>& out) {
+	if (size % 2) return false;
+	if (out.size() < size / 2) out.resize(size / 2);
+	return StringTools::fromHex(hex, size, out.data());
+}
+
+static size_t TN_PowerOfTwo(size_t n) {
+	size_t size = 2;
+	while (size < n) size *= 2;
+	return size;
+}
+
+class BatchHasher {
+public:
+	BatchHasher(const Options& options, const MappedFile& file, const std::vector<Record>& records, FILE *out)
+		: options(options), file(file), records(records), out(out),
+		threads(options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency())),
+		block_size(threads * TN_HASH_BLOCK_PER_THREAD),
+		async(threads, TN_PowerOfTwo(2 * block_size)) {
+		// Enough for every worker's state and a finalize group waiting for its last ones
+		TN_SetStateCache(threads + TN_ASYNC_FINALIZE_GROUP);
+		results.resize(2 * block_size);
+	}
+
+	~BatchHasher() {
+		TN_SetStateCache(0);
+	}
+
+	// Writes the results in order as they come, returns the number of invalid or failed inputs
+	uint64_t write();
+
+private:
+	// Hands the next block_size records to the pool, hashing the long ones right here
+	void submit(Block& block);
+	void hashLong(const Record& record, Result& result);
+	void finish(size_t index, const TN_Hash& hash, std::exception_ptr error);
+
+	const Options& options;
+	const MappedFile& file;
+	const std::vector<Record>& records;
+	FILE *out;
+	const size_t threads, block_size;
+	DeviceCPUAsync async;
+	DeviceCPU cpu; // For the long inputs
+	std::vector<char> buffer;
+	size_t submitted = 0;
+
+	std::mutex mutex; // Guards results
+	std::condition_variable ready;
+	std::vector<Result> results; // Ring of the two blocks after the last written input
+};
+
+void BatchHasher::submit(Block& block) {
+	size_t first = submitted, last = std::min(records.size(), submitted + block_size);
+	submitted = last;
+
+	// Decoded sizes first, so the inputs don't move while the buffer grows
+	size_t decoded = 0;
+	for (size_t i = first; i < last; ++i) {
+		if (!options.binary && records[i].size / 2 < MEMORY_SIZE) decoded += records[i].size / 2;
+	}
+	if (block.decoded.size() < decoded) block.decoded.resize(decoded);
+
+	block.inputs.clear();
+	block.sizes.clear();
+	block.records.clear();
+	decoded = 0;
+	for (size_t i = first; i < last; ++i) {
+		const Record& record = records[i];
+		Result result;
+		result.state = RESULT_INVALID;
+
+		const char *input = file.data + record.offset;
+		size_t size = options.binary ? record.size : record.size / 2;
+		if (size >= MEMORY_SIZE) {
+			hashLong(record, result);
+		} else if (size > 0 && (options.binary || TN_DecodeHex(input, record.size, buffer))) {
+			if (!options.binary) {
+				memcpy(block.decoded.data() + decoded, buffer.data(), size);
+				input = block.decoded.data() + decoded;
+				decoded += size;
+			}
+			block.inputs.push_back(input);
+			block.sizes.push_back(size);
+			block.records.push_back(i);
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		results[i % results.size()] = result;
+	}
+
+	if (block.inputs.empty()) return;
+	async.submitBatch(block.inputs.size(), block.inputs.data(), block.sizes.data(), [this, &block](size_t k, const TN_Hash& hash, std::exception_ptr error) {
+		finish(block.records[k], hash, error);
+	}, options.variant);
+}
+
+void BatchHasher::hashLong(const Record& record, Result& result) {
+	const char *input = file.data + record.offset;
+	if (!options.binary && record.size % 2) return;
+
+	VM_Stream *stream = TN_VM_StreamInit(options.variant);
+	if (options.binary) {
+		TN_VM_StreamUpdate(stream, input, record.size);
+	} else {
+		for (size_t pos = 0; pos < record.size; pos += 2 * TN_HASH_STREAM_CHUNK) {
+			size_t length = std::min<size_t>(2 * TN_HASH_STREAM_CHUNK, record.size - pos);
+			if (!TN_DecodeHex(input + pos, length, buffer)) {
+				delete stream->state;
+				delete stream;
+				return;
+			}
+			TN_VM_StreamUpdate(stream, buffer.data(), length / 2);
+		}
+	}
+
+	VM_State *state = TN_VM_StreamFinal(stream);
+	cpu.runSequential(state);
+	TN_VM_Finalize(state, result.hash.data());
+	result.state = RESULT_HASHED;
+}
+
+void BatchHasher::finish(size_t index, const TN_Hash& hash, std::exception_ptr error) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Result& result = results[index % results.size()];
+	result.hash = hash;
+	result.state = error ? RESULT_INVALID : RESULT_HASHED;
+	ready.notify_one();
+}
+
+uint64_t BatchHasher::write() {
+	uint64_t failed = 0;
+	char line[2 * HASH_SIZE + 2];
+	std::vector<char> expected;
+
+	Block blocks[2];
+	submit(blocks[0]);
+	submit(blocks[1]);
+
+	for (size_t i = 0; i < records.size(); ++i) {
+		Result result;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			Result& slot = results[i % results.size()];
+			if (slot.state == RESULT_EMPTY) {
+				// Let the output catch up while waiting
+				lock.unlock();
+				fflush(out);
+				lock.lock();
+				ready.wait(lock, [&] { return slot.state != RESULT_EMPTY; });
+			}
+			result = slot;
+			slot.state = RESULT_EMPTY;
+		}
+		// All of its block is done, its buffers take the block after the next
+		if ((i + 1) % block_size == 0 && submitted < records.size()) submit(blocks[(i / block_size) % 2]);
+
+		if (result.state == RESULT_INVALID) {
+			failed++;
+			fputs("invalid\n", out);
+		} else if (options.check) {
+			const Record& record = records[i];
+			bool matches = record.expected_size == 2 * HASH_SIZE && TN_DecodeHex(file.data + record.expected_offset, record.expected_size, expected) &&
+				memcmp(expected.data(), result.hash.data(), HASH_SIZE) == 0;
+			if (!matches) failed++;
+			fputs(matches ? "OK\n" : "FAIL\n", out);
+		} else {
+			for (size_t b = 0; b < HASH_SIZE; ++b) {
+				static const char digits[] = "0123456789abcdef";
+				line[2 * b] = digits[(uint8_t)result.hash[b] >> 4];
+				line[2 * b + 1] = digits[(uint8_t)result.hash[b] & 15];
+			}
+			line[2 * HASH_SIZE] = '\n';
+			fwrite(line, 1, 2 * HASH_SIZE + 1, out);
+		}
+	}
+	fflush(out);
+	return failed;
+}
+
+static void TN_Usage() {
+	std::cout << "Usage: tn-hash [options] FILE" << std::endl
+		<< "  --binary         FILE holds 4 byte little endian length prefixed blobs, not hex lines" << std::endl
+		<< "  --check          hex lines are \"<blob> <hash>\", print OK or FAIL per line" << std::endl
+		<< "  --output PATH    write results there instead of stdout" << std::endl
+		<< "  --threads N      hashing threads, 0 for all hardware threads (default 0)" << std::endl
+		<< "  --variant N      TN variant (default 0)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h") {
+				TN_Usage();
+				return 0;
+			}
+			if (arg == "--binary") {
+				options.binary = true;
+				continue;
+			}
+			if (arg == "--check") {
+				options.check = true;
+				continue;
+			}
+			if (arg.compare(0, 2, "--") != 0) {
+				if (!options.input.empty()) throw std::runtime_error("Only one input file can be given");
+				options.input = arg;
+				continue;
+			}
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			std::string value = argv[++i];
+
+			if (arg == "--output") options.output = value;
+			else if (arg == "--threads") options.threads = StringTools::fromString<size_t>(value);
+			else if (arg == "--variant") {
+				unsigned variant = StringTools::fromString<unsigned>(value);
+				if (variant >= _TN_VARIANT_LAST) throw std::runtime_error("Unknown variant " + value);
+				options.variant = (TN_Variant)variant;
+			}
+			else throw std::runtime_error("Unknown option " + arg);
+		}
+		if (options.input.empty()) {
+			TN_Usage();
+			return 1;
+		}
+		if (options.binary && options.check) throw std::runtime_error("--check needs hex input");
+
+		MappedFile file(options.input);
+		std::vector<Record> records = options.binary ? TN_IndexBinary(file) : TN_IndexHex(file, options.check);
+
+		FILE *out = stdout;
+		if (!options.output.empty()) {
+			out = fopen(options.output.c_str(), "wb");
+			if (!out) throw std::runtime_error("Could not create " + options.output + ": " + strerror(errno));
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		uint64_t failed;
+		{
+			BatchHasher hasher(options, file, records, out);
+			failed = hasher.write();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (out != stdout) fclose(out);
+
+		std::cerr << "Hashed " << records.size() << " inputs in " << seconds << "s: " << records.size() / seconds << " hashes/s";
+		if (failed) std::cerr << ", " << failed << (options.check ? " failed" : " invalid");
+		std::cerr << std::endl;
+		return failed ? 1 : 0;
+	} catch (std::exception& e) {
+		std::cerr << "tn-hash: " << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,497 @@
+/*
+ * tn-miner: stratum CPU miner.
+ *
+ * Logs in to a CryptoNote style stratum pool, searches nonces of the current job on --threads
+ * worker threads and submits the shares meeting the job target. A new job cancels the hashes still
+ * running on the old one, so every worker moves to it within TN_CANCEL_CHECK_STEPS steps instead
+ * of finishing a hash the pool would reject as stale.
+ *
+ * Prints the hashrate every --print-interval seconds and on exit the job-to-first-hash latency
+ * (job received until its first hash is done) and the share submit lag (share found until the
+ * pool answered). tn-mockpool serves jobs locally for end-to-end runs.
+ *
+ * Connected to tn-coordinator, jobs come with nonce ranges: only those nonces are searched, more
+ * ranges of the same job are queued behind them, and the hashrate and progress are reported every
+ * TN_REPORT_INTERVAL_MS so the coordinator can size and hand out the next range in time.
+ *
+ * Finished states are collected across the workers and finalized --finalize-group at a time with
+ * TN_VM_FinalizeBatch, which hashes states of the same final algorithm in SIMD lanes. With the default
+ * of one per thread a share waits about one hash longer; a worker running out of nonces finalizes
+ * whatever was collected.
+ */
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPU.h"
+#include "misc/StringTools.h"
+#include "net/Json.h"
+#include "net/Socket.h"
+#include "net/Stratum.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+#define TN_REPORT_INTERVAL_MS 1000
+
+struct Options {
+	std::string connect = "127.0.0.1:3333";
+	std::string user = "tn-miner";
+	std::string pass = "x";
+	size_t threads = 0;
+	double duration = 0; // 0 runs until interrupted
+	double print_interval = 10;
+	size_t finalize_group = 0; // 0 uses the thread count
+};
+
+struct NonceRange {
+	uint64_t id;
+	uint64_t start, end;
+};
+
+struct Job {
+	std::string id;
+	std::string blob;
+	uint64_t target;
+	TN_Variant variant;
+	Clock::time_point received;
+	CancelToken cancel; // Triggered when the next job arrives
+	std::atomic<uint32_t> next_nonce{ 0 };
+	std::atomic<bool> hashed{ false };
+
+	// Assigned by tn-coordinator, nonces then only come from these (guarded by the miner's job_mutex)
+	bool ranged = false;
+	std::deque<NonceRange> ranges;
+	uint64_t last_range = 0;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void TN_OnSignal(int) {
+	stop_requested = 1;
+}
+
+static double TN_Milliseconds(Clock::duration d) {
+	return std::chrono::duration<double, std::milli>(d).count();
+}
+
+static double TN_Percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) return 0;
+	size_t index = std::min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()));
+	return sorted[index];
+}
+
+class Miner {
+public:
+	explicit Miner(const Options& options) : options(options), socket(options.connect) {}
+	~Miner() { stop(); }
+
+	void login();
+	void run();
+	void report();
+
+private:
+	void worker();
+	// Adds a finished state, finalizes the collected ones when the group is full or flush is set
+	void finalize(const std::shared_ptr<Job>& job, uint32_t nonce, VM_State *state, bool flush);
+	void receive();
+	void stop();
+
+	void setJob(const JsonValue& params);
+	void submit(const std::shared_ptr<Job>& job, uint32_t nonce, const TN_Hash& hash, Clock::time_point found);
+	void handle(const JsonValue& message);
+	void reportProgress(double hashrate);
+
+	const Options options;
+	LineSocket socket;
+	std::mutex send_mutex;
+	std::string session;
+	std::atomic<bool> disconnected{ false };
+
+	std::mutex job_mutex;
+	std::condition_variable job_changed;
+	std::shared_ptr<Job> job;
+	bool stopping = false;
+
+	std::vector<std::thread> workers;
+	std::thread receiver;
+
+	struct Finished {
+		std::shared_ptr<Job> job;
+		uint32_t nonce;
+		VM_State *state;
+	};
+	std::mutex finalize_mutex;
+	std::vector<Finished> finished; // Waiting to be finalized
+	size_t finalize_group = 1;
+
+	std::mutex stats_mutex; // Guards everything below
+	uint64_t next_id = 2; // 1 is the login
+	std::map<uint64_t, Clock::time_point> submitted; // Found time of shares waiting for the pool
+	std::vector<double> first_hash_ms, submit_lag_ms;
+	uint64_t jobs = 0, accepted = 0, rejected = 0;
+	std::atomic<uint64_t> hashes{ 0 }, abandoned{ 0 };
+	Clock::time_point started;
+};
+
+void Miner::login() {
+	JsonValue params = JsonValue::object().set("login", options.user).set("pass", options.pass).set("agent", "tn-miner/1.0");
+	socket.send(JsonValue::object().set("id", 1).set("jsonrpc", "2.0").set("method", "login").set("params", params).dump());
+
+	std::string line;
+	for (;;) {
+		if (!socket.receive(line)) throw std::runtime_error("Pool closed the connection during login.");
+		JsonValue response = JsonValue::parse(line);
+		if (!response["id"].isNumber() || response["id"].asNumber() != 1) continue;
+
+		if (!response["error"].isNull()) throw std::runtime_error("Login failed: " + response["error"]["message"].dump());
+		const JsonValue& result = response["result"];
+		session = result["id"].isString() ? result["id"].asString() : "";
+		setJob(result["job"]);
+		return;
+	}
+}
+
+void Miner::setJob(const JsonValue& params) {
+	NonceRange range = {};
+	bool ranged = params["nonce_start"].isNumber();
+	if (ranged) {
+		range.id = params["range_id"].asUInt();
+		range.start = params["nonce_start"].asUInt();
+		range.end = std::min<uint64_t>(params["nonce_end"].asUInt(), 1ull << 32);
+
+		// Another range of the current job, keep going
+		std::lock_guard<std::mutex> lock(job_mutex);
+		if (job && job->ranged && job->id == params["job_id"].asString()) {
+			if (range.start < range.end) job->ranges.push_back(range);
+			job->last_range = range.id;
+			job_changed.notify_all();
+			return;
+		}
+	}
+
+	auto next = std::make_shared<Job>();
+	next->received = Clock::now();
+	next->id = params["job_id"].asString();
+	next->target = TN_StratumTarget(params["target"].asString());
+	next->variant = TN_VARIANT_ORIGINAL;
+	if (params["variant"].isNumber()) {
+		if (params["variant"].asNumber() < 0 || params["variant"].asNumber() >= _TN_VARIANT_LAST) throw std::runtime_error("Job has an unknown variant.");
+		next->variant = (TN_Variant)params["variant"].asUInt();
+	}
+
+	std::vector<uint8_t> blob;
+	if (!StringTools::fromHex(params["blob"].asString(), blob) || blob.size() < TN_STRATUM_NONCE_OFFSET + 4 || blob.size() >= MEMORY_SIZE) {
+		throw std::runtime_error("Job has an invalid blob.");
+	}
+	next->blob.assign(blob.begin(), blob.end());
+
+	if (ranged) {
+		next->ranged = true;
+		if (range.start < range.end) next->ranges.push_back(range);
+		next->last_range = range.id;
+	}
+
+	std::shared_ptr<Job> previous;
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		previous = job;
+		job = next;
+	}
+	if (previous) previous->cancel.cancel();
+	job_changed.notify_all();
+	// Shares of the replaced job only count if they get in right away
+	if (previous) finalize(nullptr, 0, nullptr, true);
+
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	jobs++;
+}
+
+void Miner::worker() {
+	DeviceCPU cpu;
+	// One worker per core already
+	TN_SetThreadTreeThreads(1);
+
+	for (;;) {
+		std::shared_ptr<Job> current;
+		uint32_t nonce;
+		{
+			// A ranged job without nonces left idles until the coordinator sends more
+			std::unique_lock<std::mutex> lock(job_mutex);
+			auto ready = [this] { return stopping || (job && (!job->ranged || !job->ranges.empty())); };
+			if (!ready()) {
+				// Nothing to do for now, don't hold back the shares collected so far
+				lock.unlock();
+				finalize(nullptr, 0, nullptr, true);
+				lock.lock();
+				job_changed.wait(lock, ready);
+			}
+			if (stopping) return;
+			current = job;
+
+			if (current->ranged) {
+				NonceRange& range = current->ranges.front();
+				nonce = (uint32_t)range.start++;
+				if (range.start == range.end) current->ranges.pop_front();
+			} else {
+				nonce = current->next_nonce++;
+			}
+		}
+
+		std::string input = TN_StratumBlob(current->blob, nonce);
+		VM_State *state = TN_VM_Init(input.c_str(), input.length(), current->variant);
+		if (!cpu.runSequential(state, &current->cancel)) {
+			// Replaced by a newer job (or stopping), free the scratchpad before starting on it
+			delete state;
+			abandoned++;
+			continue;
+		}
+
+		finalize(current, nonce, state, false);
+	}
+}
+
+void Miner::finalize(const std::shared_ptr<Job>& job, uint32_t nonce, VM_State *state, bool flush) {
+	std::vector<Finished> group;
+	{
+		std::lock_guard<std::mutex> lock(finalize_mutex);
+		if (state) finished.push_back(Finished{ job, nonce, state });
+		if (finished.size() < finalize_group && !flush) return;
+		group.swap(finished);
+	}
+	if (group.empty()) return;
+
+	std::vector<VM_State*> states;
+	for (auto &f : group) states.push_back(f.state);
+	std::vector<char> out(group.size() * HASH_SIZE);
+	TN_VM_FinalizeBatch(states.size(), states.data(), out.data());
+	Clock::time_point found = Clock::now();
+	hashes += group.size();
+
+	for (size_t i = 0; i < group.size(); ++i) {
+		TN_Hash hash;
+		memcpy(hash.data(), out.data() + i * HASH_SIZE, HASH_SIZE);
+		if (!group[i].job->hashed.exchange(true)) {
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			first_hash_ms.push_back(TN_Milliseconds(found - group[i].job->received));
+		}
+		if (TN_StratumMeetsTarget(hash, group[i].job->target)) submit(group[i].job, group[i].nonce, hash, found);
+	}
+}
+
+void Miner::submit(const std::shared_ptr<Job>& job, uint32_t nonce, const TN_Hash& hash, Clock::time_point found) {
+	JsonValue params = JsonValue::object()
+		.set("id", session)
+		.set("job_id", job->id)
+		.set("nonce", TN_StratumNonceHex(nonce))
+		.set("result", StringTools::toHex(hash.data(), HASH_SIZE));
+
+	std::lock_guard<std::mutex> lock(send_mutex);
+	uint64_t id;
+	{
+		std::lock_guard<std::mutex> stats_lock(stats_mutex);
+		id = next_id++;
+		submitted[id] = found;
+	}
+
+	try {
+		socket.send(JsonValue::object().set("id", id).set("jsonrpc", "2.0").set("method", "submit").set("params", params).dump());
+	} catch (std::exception& e) {
+		std::cerr << "Could not submit share: " << e.what() << std::endl;
+	}
+}
+
+void Miner::handle(const JsonValue& message) {
+	if (message["method"].isString()) {
+		if (message["method"].asString() == "job") setJob(message["params"]);
+		return;
+	}
+
+	if (!message["id"].isNumber()) return;
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	auto it = submitted.find(message["id"].asUInt());
+	if (it == submitted.end()) return;
+
+	submit_lag_ms.push_back(TN_Milliseconds(Clock::now() - it->second));
+	submitted.erase(it);
+
+	if (message["error"].isNull()) {
+		accepted++;
+	} else {
+		rejected++;
+		std::cout << "Share rejected: " << message["error"]["message"].dump() << std::endl;
+	}
+}
+
+// Progress is the range the next nonce comes from and that nonce, or the range expected next when idle
+void Miner::reportProgress(double hashrate) {
+	JsonValue params = JsonValue::object().set("id", session).set("hashes", (uint64_t)hashes).set("hashrate", hashrate);
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		if (!job || !job->ranged) return;
+		params.set("job_id", job->id);
+		if (job->ranges.empty()) {
+			params.set("range_id", job->last_range + 1);
+		} else {
+			params.set("range_id", job->ranges.front().id).set("next_nonce", job->ranges.front().start);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(send_mutex);
+	uint64_t id;
+	{
+		std::lock_guard<std::mutex> stats_lock(stats_mutex);
+		id = next_id++;
+	}
+	socket.send(JsonValue::object().set("id", id).set("jsonrpc", "2.0").set("method", "report").set("params", params).dump());
+}
+
+void Miner::receive() {
+	try {
+		std::string line;
+		while (socket.receive(line)) {
+			if (!line.empty()) handle(JsonValue::parse(line));
+		}
+	} catch (std::exception& e) {
+		if (!stop_requested) std::cerr << "Pool connection: " << e.what() << std::endl;
+	}
+	disconnected = true;
+}
+
+void Miner::stop() {
+	{
+		std::lock_guard<std::mutex> lock(job_mutex);
+		stopping = true;
+		if (job) job->cancel.cancel();
+	}
+	job_changed.notify_all();
+	for (auto &t : workers) t.join();
+	workers.clear();
+	for (auto &f : finished) delete f.state;
+	finished.clear();
+
+	socket.shutdown();
+	if (receiver.joinable()) receiver.join();
+}
+
+void Miner::run() {
+	size_t threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+	finalize_group = options.finalize_group ? options.finalize_group : threads;
+	std::cout << "Mining on " << threads << " threads" << std::endl;
+
+	started = Clock::now();
+	receiver = std::thread(&Miner::receive, this);
+	for (size_t i = 0; i < threads; ++i) workers.emplace_back(&Miner::worker, this);
+
+	Clock::time_point end = started + std::chrono::microseconds((int64_t)(options.duration * 1e6));
+	Clock::time_point next_print = started + std::chrono::microseconds((int64_t)(options.print_interval * 1e6));
+	uint64_t last_hashes = 0, last_report_hashes = 0;
+	Clock::time_point last_print = started, last_report = started;
+
+	while (!stop_requested && !disconnected && (options.duration <= 0 || Clock::now() < end)) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+		Clock::time_point now = Clock::now();
+		if (now - last_report >= std::chrono::milliseconds(TN_REPORT_INTERVAL_MS)) {
+			uint64_t total = hashes;
+			try {
+				reportProgress((total - last_report_hashes) / std::chrono::duration<double>(now - last_report).count());
+			} catch (std::exception& e) {
+				std::cerr << "Could not report progress: " << e.what() << std::endl;
+			}
+			last_report_hashes = total;
+			last_report = now;
+		}
+
+		if (options.print_interval > 0 && now >= next_print) {
+			uint64_t total = hashes;
+			double seconds = std::chrono::duration<double>(now - last_print).count();
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			std::cout << "Hashrate " << (total - last_hashes) / seconds << " H/s, shares " << accepted << " accepted, "
+				<< rejected << " rejected" << std::endl;
+			last_hashes = total;
+			last_print = now;
+			next_print = now + std::chrono::microseconds((int64_t)(options.print_interval * 1e6));
+		}
+	}
+
+	stop();
+}
+
+void Miner::report() {
+	double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	std::sort(first_hash_ms.begin(), first_hash_ms.end());
+	std::sort(submit_lag_ms.begin(), submit_lag_ms.end());
+
+	std::cout << "Mined " << seconds << "s: " << hashes << " hashes, " << hashes / seconds << " H/s, "
+		<< abandoned << " hashes abandoned on job switches" << std::endl;
+	std::cout << "Jobs " << jobs << ", shares " << accepted << " accepted, " << rejected << " rejected, "
+		<< submitted.size() << " unanswered" << std::endl;
+	std::cout << "Job to first hash ms: p50 " << TN_Percentile(first_hash_ms, 50) << ", p90 " << TN_Percentile(first_hash_ms, 90)
+		<< ", max " << (first_hash_ms.empty() ? 0 : first_hash_ms.back()) << std::endl;
+	std::cout << "Share submit lag ms: p50 " << TN_Percentile(submit_lag_ms, 50) << ", p90 " << TN_Percentile(submit_lag_ms, 90)
+		<< ", max " << (submit_lag_ms.empty() ? 0 : submit_lag_ms.back()) << std::endl;
+}
+
+static void TN_Usage() {
+	std::cout << "Usage: tn-miner [options]" << std::endl
+		<< "  --connect ADDRESS        pool host:port or unix:/path (default 127.0.0.1:3333)" << std::endl
+		<< "  --user NAME              login (default tn-miner)" << std::endl
+		<< "  --pass PASSWORD          (default x)" << std::endl
+		<< "  --threads N              mining threads, 0 for all hardware threads (default 0)" << std::endl
+		<< "  --duration SECONDS       stop after this long, 0 runs until interrupted (default 0)" << std::endl
+		<< "  --print-interval SECONDS hashrate report interval, 0 disables (default 10)" << std::endl
+		<< "  --finalize-group N       states finalized together, 0 for the thread count (default 0)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h") {
+				TN_Usage();
+				return 0;
+			}
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			std::string value = argv[++i];
+
+			if (arg == "--connect") options.connect = value;
+			else if (arg == "--user") options.user = value;
+			else if (arg == "--pass") options.pass = value;
+			else if (arg == "--threads") options.threads = StringTools::fromString<size_t>(value);
+			else if (arg == "--duration") options.duration = StringTools::fromString<double>(value);
+			else if (arg == "--print-interval") options.print_interval = StringTools::fromString<double>(value);
+			else if (arg == "--finalize-group") options.finalize_group = StringTools::fromString<size_t>(value);
+			else throw std::runtime_error("Unknown option " + arg);
+		}
+
+		signal(SIGINT, TN_OnSignal);
+		signal(SIGTERM, TN_OnSignal);
+		signal(SIGPIPE, SIG_IGN);
+
+		Miner miner(options);
+		miner.login();
+		miner.run();
+		miner.report();
+	} catch (std::exception& e) {
+		std::cerr << "tn-miner: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,356 @@
+/*
+ * tn-mockpool: local stratum pool for running tn-miner without network access.
+ *
+ * Every connection gets its own random blob for each job and a new job every --job-interval
+ * seconds. Shares are checked (current job, duplicate nonce, hash and target) before they are
+ * answered, so the miner's submit lag includes verification like on a real pool. Prints the
+ * shares of a connection when it closes, with the job-to-first-share latency (job sent until
+ * the first valid share for it came back).
+ */
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPUAsync.h"
+#include "misc/StringTools.h"
+#include "net/Json.h"
+#include "net/Socket.h"
+#include "net/Stratum.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+	std::string listen = "127.0.0.1:3333";
+	uint64_t difficulty = 8;
+	double job_interval = 5;
+	size_t blob_size = 76;
+	TN_Variant variant = TN_VARIANT_ORIGINAL;
+	bool verify = true;
+};
+
+struct ShareCounters {
+	uint64_t accepted = 0, stale = 0, duplicate = 0, invalid = 0, low = 0;
+
+	void add(const ShareCounters& o) {
+		accepted += o.accepted;
+		stale += o.stale;
+		duplicate += o.duplicate;
+		invalid += o.invalid;
+		low += o.low;
+	}
+};
+
+struct Session {
+	Session(uint64_t id, int fd) : id(id), socket(fd), rng(id * 7919 + Clock::now().time_since_epoch().count()) {}
+
+	uint64_t id;
+	LineSocket socket;
+	bool logged_in = false;
+
+	std::mutex mutex; // Guards sending and everything below, shared with the job thread
+	uint64_t job_number = 0;
+	std::string job_id, blob;
+	Clock::time_point job_sent;
+	bool job_shared = false;
+	std::set<uint32_t> nonces;
+	std::mt19937_64 rng;
+
+	ShareCounters shares;
+	std::vector<double> first_share_ms;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void TN_OnSignal(int) {
+	stop_requested = 1;
+}
+
+static double TN_Percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) return 0;
+	size_t index = std::min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()));
+	return sorted[index];
+}
+
+class MockPool {
+public:
+	explicit MockPool(const Options& options) : options(options), target_hex(TN_StratumTargetHex(options.difficulty)),
+		target(TN_StratumTarget(target_hex)), listener(TN_Listen(options.listen)) {
+		TN_SetNonBlocking(listener);
+		std::cout << "Listening on " << options.listen << ", difficulty " << options.difficulty << std::endl;
+	}
+
+	~MockPool() {
+		for (auto &t : threads) t.join();
+		TN_CloseSocket(listener);
+	}
+
+	void run();
+	void report();
+
+private:
+	void serve(std::shared_ptr<Session> session);
+	JsonValue newJob(Session& session); // Called with session mutex held
+	void handle(Session& session, const JsonValue& request);
+	void submit(Session& session, const JsonValue& id, const JsonValue& params);
+	void close(Session& session);
+
+	static void reply(Session& session, const JsonValue& id, const JsonValue& result);
+	static void fail(Session& session, const JsonValue& id, const std::string& message);
+
+	const Options options;
+	const std::string target_hex;
+	const uint64_t target;
+	int listener;
+	std::vector<std::thread> threads;
+
+	std::mutex mutex; // Guards everything below
+	std::map<uint64_t, std::shared_ptr<Session>> sessions;
+	uint64_t next_session = 1;
+	ShareCounters totals;
+	std::vector<double> first_share_ms;
+};
+
+JsonValue MockPool::newJob(Session& session) {
+	std::vector<uint8_t> blob(options.blob_size);
+	for (auto &b : blob) b = (uint8_t)session.rng();
+
+	session.job_id = std::to_string(session.id) + "-" + std::to_string(++session.job_number);
+	session.blob.assign(blob.begin(), blob.end());
+	session.job_sent = Clock::now();
+	session.job_shared = false;
+	session.nonces.clear();
+
+	return JsonValue::object()
+		.set("blob", StringTools::toHex(blob.data(), blob.size()))
+		.set("job_id", session.job_id)
+		.set("target", target_hex)
+		.set("id", std::to_string(session.id))
+		.set("variant", (uint64_t)options.variant);
+}
+
+void MockPool::reply(Session& session, const JsonValue& id, const JsonValue& result) {
+	session.socket.send(JsonValue::object().set("id", id).set("jsonrpc", "2.0").set("error", JsonValue()).set("result", result).dump());
+}
+
+void MockPool::fail(Session& session, const JsonValue& id, const std::string& message) {
+	JsonValue error = JsonValue::object().set("code", -1).set("message", message);
+	session.socket.send(JsonValue::object().set("id", id).set("jsonrpc", "2.0").set("error", error).set("result", JsonValue()).dump());
+}
+
+void MockPool::submit(Session& session, const JsonValue& id, const JsonValue& params) {
+	std::string blob;
+	uint32_t nonce;
+	TN_Hash claimed;
+	{
+		std::lock_guard<std::mutex> lock(session.mutex);
+		size_t size;
+		if (!params["nonce"].isString() || !params["result"].isString() ||
+			!StringTools::fromHex(params["result"].asString(), claimed.data(), HASH_SIZE, size) || size != HASH_SIZE ||
+			!StringTools::podFromHex(params["nonce"].asString(), nonce)) {
+			session.shares.invalid++;
+			return fail(session, id, "Malformed share");
+		}
+		nonce = TN_StratumNonce(params["nonce"].asString());
+
+		if (!params["job_id"].isString() || params["job_id"].asString() != session.job_id) {
+			session.shares.stale++;
+			return fail(session, id, "Stale job");
+		}
+		if (!session.nonces.insert(nonce).second) {
+			session.shares.duplicate++;
+			return fail(session, id, "Duplicate share");
+		}
+		blob = session.blob;
+	}
+
+	// Verify without holding the session, a new job may be sent meanwhile
+	TN_Hash hash = claimed;
+	if (options.verify) {
+		DeviceCPU cpu;
+		std::exception_ptr error = TN_HashInput(cpu, TN_StratumBlob(blob, nonce), options.variant, nullptr, hash);
+		if (error) std::rethrow_exception(error);
+	}
+
+	std::lock_guard<std::mutex> lock(session.mutex);
+	if (hash != claimed) {
+		session.shares.invalid++;
+		return fail(session, id, "Incorrect hash");
+	}
+	if (!TN_StratumMeetsTarget(hash, target)) {
+		session.shares.low++;
+		return fail(session, id, "Low difficulty share");
+	}
+
+	session.shares.accepted++;
+	if (!session.job_shared && session.blob == blob) {
+		session.job_shared = true;
+		session.first_share_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - session.job_sent).count());
+	}
+	reply(session, id, JsonValue::object().set("status", "OK"));
+}
+
+void MockPool::handle(Session& session, const JsonValue& request) {
+	const JsonValue& id = request["id"];
+	const std::string method = request["method"].isString() ? request["method"].asString() : "";
+
+	if (method == "login") {
+		std::lock_guard<std::mutex> lock(session.mutex);
+		JsonValue job = newJob(session);
+		session.logged_in = true;
+		return reply(session, id, JsonValue::object().set("id", std::to_string(session.id)).set("job", job).set("status", "OK"));
+	}
+	if (!session.logged_in) {
+		std::lock_guard<std::mutex> lock(session.mutex);
+		return fail(session, id, "Unauthenticated");
+	}
+	if (method == "submit") return submit(session, id, request["params"]);
+	if (method == "keepalived") {
+		std::lock_guard<std::mutex> lock(session.mutex);
+		return reply(session, id, JsonValue::object().set("status", "KEEPALIVED"));
+	}
+
+	std::lock_guard<std::mutex> lock(session.mutex);
+	fail(session, id, "Unknown method");
+}
+
+void MockPool::serve(std::shared_ptr<Session> session) {
+	try {
+		std::string line;
+		while (session->socket.receive(line)) {
+			if (!line.empty()) handle(*session, JsonValue::parse(line));
+		}
+	} catch (std::exception& e) {
+		if (!stop_requested) std::cerr << "Connection " << session->id << ": " << e.what() << std::endl;
+	}
+	close(*session);
+}
+
+void MockPool::close(Session& session) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!sessions.erase(session.id)) return;
+
+	std::lock_guard<std::mutex> session_lock(session.mutex);
+	const ShareCounters& s = session.shares;
+	std::cout << "Connection " << session.id << " closed: " << s.accepted << " accepted, " << s.stale << " stale, "
+		<< s.duplicate << " duplicate, " << s.invalid << " invalid, " << s.low << " low difficulty" << std::endl;
+	totals.add(s);
+	first_share_ms.insert(first_share_ms.end(), session.first_share_ms.begin(), session.first_share_ms.end());
+}
+
+void MockPool::run() {
+	Clock::time_point next_job = Clock::now() + std::chrono::microseconds((int64_t)(options.job_interval * 1e6));
+
+	while (!stop_requested) {
+		pollfd fd = { listener, POLLIN, 0 };
+		poll(&fd, 1, 50);
+
+		int client;
+		while ((client = TN_Accept(listener)) >= 0) {
+			std::lock_guard<std::mutex> lock(mutex);
+			auto session = std::make_shared<Session>(next_session++, client);
+			sessions[session->id] = session;
+			threads.emplace_back(&MockPool::serve, this, session);
+		}
+		if (client == TN_ACCEPT_EXHAUSTED) {
+			std::cerr << "Could not accept: " << strerror(errno) << ", pausing for " << TN_ACCEPT_BACKOFF_MS << " ms" << std::endl;
+			std::this_thread::sleep_for(std::chrono::milliseconds(TN_ACCEPT_BACKOFF_MS));
+		}
+
+		if (options.job_interval > 0 && Clock::now() >= next_job) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto &s : sessions) {
+				std::lock_guard<std::mutex> session_lock(s.second->mutex);
+				if (!s.second->logged_in) continue;
+				try {
+					JsonValue job = newJob(*s.second);
+					s.second->socket.send(JsonValue::object().set("jsonrpc", "2.0").set("method", "job").set("params", job).dump());
+				} catch (std::exception&) {
+					// Closed, its thread cleans up
+				}
+			}
+			next_job = Clock::now() + std::chrono::microseconds((int64_t)(options.job_interval * 1e6));
+		}
+	}
+
+	// Unblock the connection threads, they close their sessions
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto &s : sessions) s.second->socket.shutdown();
+}
+
+void MockPool::report() {
+	for (auto &t : threads) t.join();
+	threads.clear();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::sort(first_share_ms.begin(), first_share_ms.end());
+	std::cout << "Shares: " << totals.accepted << " accepted, " << totals.stale << " stale, " << totals.duplicate << " duplicate, "
+		<< totals.invalid << " invalid, " << totals.low << " low difficulty" << std::endl;
+	std::cout << "Job to first share ms: p50 " << TN_Percentile(first_share_ms, 50) << ", p90 " << TN_Percentile(first_share_ms, 90)
+		<< ", max " << (first_share_ms.empty() ? 0 : first_share_ms.back()) << " (" << first_share_ms.size() << " jobs)" << std::endl;
+}
+
+static void TN_Usage() {
+	std::cout << "Usage: tn-mockpool [options]" << std::endl
+		<< "  --listen ADDRESS        host:port or unix:/path (default 127.0.0.1:3333)" << std::endl
+		<< "  --difficulty N          share difficulty (default 8)" << std::endl
+		<< "  --job-interval SECONDS  new job every SECONDS, 0 never (default 5)" << std::endl
+		<< "  --blob-size BYTES       (default 76)" << std::endl
+		<< "  --variant N             TN variant of the jobs (default 0)" << std::endl
+		<< "  --verify 0|1            hash submitted shares (default 1)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h") {
+				TN_Usage();
+				return 0;
+			}
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			std::string value = argv[++i];
+
+			if (arg == "--listen") options.listen = value;
+			else if (arg == "--difficulty") options.difficulty = std::max<uint64_t>(1, StringTools::fromString<uint64_t>(value));
+			else if (arg == "--job-interval") options.job_interval = StringTools::fromString<double>(value);
+			else if (arg == "--blob-size") options.blob_size = std::max<size_t>(TN_STRATUM_NONCE_OFFSET + 4, StringTools::fromString<size_t>(value));
+			else if (arg == "--variant") {
+				unsigned variant = StringTools::fromString<unsigned>(value);
+				if (variant >= _TN_VARIANT_LAST) throw std::runtime_error("Unknown variant " + value);
+				options.variant = (TN_Variant)variant;
+			}
+			else if (arg == "--verify") options.verify = StringTools::fromString<int>(value) != 0;
+			else throw std::runtime_error("Unknown option " + arg);
+		}
+
+		signal(SIGINT, TN_OnSignal);
+		signal(SIGTERM, TN_OnSignal);
+		signal(SIGPIPE, SIG_IGN);
+
+		MockPool pool(options);
+		pool.run();
+		pool.report();
+	} catch (std::exception& e) {
+		std::cerr << "tn-mockpool: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
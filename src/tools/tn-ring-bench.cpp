@@ -0,0 +1,180 @@
+/*
+ * tn-ring-bench: request latency through the shared memory HashRing (tn-ringd) against
+ * JSON-RPC over a socket (tn-verifyd).
+ *
+ * Every --threads client thread sends --requests requests one at a time, cycling through --blobs
+ * distinct blobs. A warmup pass hashes each blob once (and checks both paths agree), so with
+ * both servers started with --cache the measured round trips are transport, serialization and
+ * the cache lookup rather than TN hashing. Start tn-verifyd with --batch-wait-us 0, else its
+ * batching delay is part of every socket round trip.
+ */
+
+#include "TuringsNightmare.h"
+#include "ipc/HashRing.h"
+#include "misc/StringTools.h"
+#include "net/Json.h"
+#include "net/Socket.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+	std::string ring;
+	std::string socket;
+	size_t requests = 10000;
+	size_t blobs = 16;
+	size_t blob_size = 76;
+	size_t threads = 1;
+};
+
+// One client's way of hashing a blob, bound to its own connection
+typedef std::function<TN_Hash(const std::string& blob)> HashFunction;
+typedef std::function<HashFunction()> ClientFactory;
+
+static double TN_Percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) return 0;
+	size_t index = std::min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()));
+	return sorted[index];
+}
+
+static HashFunction TN_RingClient(HashRing& ring) {
+	return [&ring](const std::string& blob) {
+		// Written straight into the slot, the worker hashes it there
+		char *buffer;
+		uint64_t ticket = ring.acquire(buffer);
+		memcpy(buffer, blob.data(), blob.size());
+		ring.submit(ticket, blob.size());
+
+		TN_Hash hash;
+		ring.wait(ticket, hash);
+		return hash;
+	};
+}
+
+static HashFunction TN_SocketClient(const std::string& address) {
+	auto socket = std::make_shared<LineSocket>(address);
+	auto id = std::make_shared<uint64_t>(0);
+	return [socket, id](const std::string& blob) {
+		JsonValue call = JsonValue::object()
+			.set("jsonrpc", "2.0")
+			.set("id", (*id)++)
+			.set("method", "compute_hash")
+			.set("params", JsonValue::object().set("blob", StringTools::toHex(blob.data(), blob.size())));
+		socket->send(call.dump());
+
+		std::string line;
+		if (!socket->receive(line)) throw std::runtime_error("Server closed the connection.");
+		JsonValue response = JsonValue::parse(line);
+		if (!response["error"].isNull()) throw std::runtime_error("Server error: " + response["error"].dump());
+
+		TN_Hash hash;
+		size_t size;
+		if (!StringTools::fromHex(response["result"]["hash"].asString(), hash.data(), HASH_SIZE, size) || size != HASH_SIZE) {
+			throw std::runtime_error("Malformed hash in response.");
+		}
+		return hash;
+	};
+}
+
+static void TN_Measure(const char *name, const ClientFactory& factory, const Options& options, const std::vector<std::string>& blobs) {
+	std::vector<std::vector<double>> latencies(options.threads);
+	std::vector<std::thread> threads;
+
+	auto start = Clock::now();
+	for (size_t t = 0; t < options.threads; ++t) {
+		threads.emplace_back([&, t] {
+			HashFunction hash = factory();
+			latencies[t].reserve(options.requests);
+			for (size_t i = 0; i < options.requests; ++i) {
+				auto sent = Clock::now();
+				hash(blobs[(i + t) % blobs.size()]);
+				latencies[t].push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+			}
+		});
+	}
+	for (auto &t : threads) t.join();
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	std::vector<double> all;
+	for (auto &l : latencies) all.insert(all.end(), l.begin(), l.end());
+	std::sort(all.begin(), all.end());
+
+	std::cout << name << ": " << all.size() / seconds << " requests/s, latency us p50 " << TN_Percentile(all, 50)
+		<< ", p90 " << TN_Percentile(all, 90) << ", p99 " << TN_Percentile(all, 99)
+		<< ", max " << (all.empty() ? 0 : all.back()) << std::endl;
+}
+
+static void TN_Usage() {
+	std::cout << "Usage: tn-ring-bench [options]" << std::endl
+		<< "  --ring ADDRESS      tn-ringd unix:/path" << std::endl
+		<< "  --socket ADDRESS    tn-verifyd host:port or unix:/path" << std::endl
+		<< "  --requests N        per thread (default 10000)" << std::endl
+		<< "  --blobs N           distinct blobs (default 16)" << std::endl
+		<< "  --blob-size BYTES   (default 76)" << std::endl
+		<< "  --threads N         concurrent clients (default 1)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h") {
+				TN_Usage();
+				return 0;
+			}
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			std::string value = argv[++i];
+
+			if (arg == "--ring") options.ring = value;
+			else if (arg == "--socket") options.socket = value;
+			else if (arg == "--requests") options.requests = StringTools::fromString<size_t>(value);
+			else if (arg == "--blobs") options.blobs = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--blob-size") options.blob_size = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--threads") options.threads = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else throw std::runtime_error("Unknown option " + arg);
+		}
+		if (options.ring.empty() && options.socket.empty()) throw std::runtime_error("Nothing to measure, give --ring and/or --socket");
+
+		std::mt19937_64 rng(1);
+		std::vector<std::string> blobs(options.blobs);
+		for (auto &b : blobs) {
+			b.resize(options.blob_size);
+			for (auto &c : b) c = (char)rng();
+		}
+
+		std::unique_ptr<HashRing> ring;
+		if (!options.ring.empty()) {
+			ring = HashRing::connect(options.ring);
+			if (options.blob_size > ring->slotSize()) throw std::runtime_error("--blob-size is larger than the ring slots");
+		}
+
+		// Warmup, both paths must give the same hashes
+		HashFunction ring_hash = ring ? TN_RingClient(*ring) : nullptr;
+		HashFunction socket_hash = options.socket.empty() ? nullptr : TN_SocketClient(options.socket);
+		for (auto &b : blobs) {
+			TN_Hash a = ring_hash ? ring_hash(b) : TN_Hash();
+			TN_Hash c = socket_hash ? socket_hash(b) : TN_Hash();
+			if (ring_hash && socket_hash && a != c) throw std::runtime_error("Ring and socket disagree on a hash");
+		}
+
+		if (ring) TN_Measure("ring", [&] { return TN_RingClient(*ring); }, options, blobs);
+		if (!options.socket.empty()) TN_Measure("socket", [&] { return TN_SocketClient(options.socket); }, options, blobs);
+	} catch (std::exception& e) {
+		std::cerr << "tn-ring-bench: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
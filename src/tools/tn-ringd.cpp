@@ -0,0 +1,158 @@
+/*
+ * tn-ringd: TN hashing worker process serving a shared memory HashRing.
+ *
+ * Creates the ring and hands its memfd to every client connecting to the --listen Unix socket,
+ * the connection is only used for that. --threads workers take requests from the ring, copy the
+ * inputs out of the shared slots and hash them, with --cache inputs hashed before are answered
+ * from the ResultCache.
+ */
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPU.h"
+#include "cache/ResultCache.h"
+#include "ipc/HashRing.h"
+#include "misc/StringTools.h"
+#include "net/Socket.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+
+struct Options {
+	std::string listen = "unix:/tmp/tn-ring.sock";
+	size_t threads = 0;
+	size_t slots = 256;
+	size_t slot_size = 4096;
+	std::string cache;
+	size_t cache_capacity = 256 * 1024;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void TN_OnSignal(int) {
+	stop_requested = 1;
+}
+
+// The slot stays writable by the client, so each request is copied out first and only the copy is
+// looked up, hashed and cached: a client rewriting its slot can't get one input's hash stored under another
+static void TN_RingWorker(HashRing& ring, ResultCache *cache) {
+	DeviceCPU cpu;
+	// One worker per core already
+	TN_SetThreadTreeThreads(1);
+	std::vector<char> request(ring.slotSize());
+	uint64_t ticket;
+	const char *slot;
+	size_t size;
+	TN_Variant variant;
+
+	while (ring.take(ticket, slot, size, variant)) {
+		memcpy(request.data(), slot, size);
+		const char *input = request.data();
+
+		TN_Hash hash;
+		if (cache && cache->lookup(input, size, variant, hash)) {
+			ring.complete(ticket, &hash);
+			continue;
+		}
+
+		try {
+			VM_State *state = TN_VM_Init(input, size, variant);
+			cpu.runSequential(state);
+			TN_VM_Finalize(state, hash.data());
+		} catch (std::exception&) {
+			ring.complete(ticket, nullptr);
+			continue;
+		}
+
+		if (cache) cache->insert(input, size, variant, hash);
+		ring.complete(ticket, &hash);
+	}
+}
+
+static void TN_Usage() {
+	std::cout << "Usage: tn-ringd [options]" << std::endl
+		<< "  --listen ADDRESS     unix:/path clients get the ring from (default unix:/tmp/tn-ring.sock)" << std::endl
+		<< "  --threads N          hashing threads, 0 for all hardware threads (default 0)" << std::endl
+		<< "  --slots N            ring slots, a power of two (default 256)" << std::endl
+		<< "  --slot-size BYTES    largest input (default 4096)" << std::endl
+		<< "  --cache PATH         persistent result cache file" << std::endl
+		<< "  --cache-capacity N   cache entries (default 262144)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h") {
+				TN_Usage();
+				return 0;
+			}
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			std::string value = argv[++i];
+
+			if (arg == "--listen") options.listen = value;
+			else if (arg == "--threads") options.threads = StringTools::fromString<size_t>(value);
+			else if (arg == "--slots") options.slots = StringTools::fromString<size_t>(value);
+			else if (arg == "--slot-size") options.slot_size = StringTools::fromString<size_t>(value);
+			else if (arg == "--cache") options.cache = value;
+			else if (arg == "--cache-capacity") options.cache_capacity = StringTools::fromString<size_t>(value);
+			else throw std::runtime_error("Unknown option " + arg);
+		}
+		if (options.listen.compare(0, 5, "unix:") != 0) throw std::runtime_error("--listen must be a unix:/path address");
+
+		signal(SIGINT, TN_OnSignal);
+		signal(SIGTERM, TN_OnSignal);
+		signal(SIGPIPE, SIG_IGN);
+
+		HashRing ring(options.slots, options.slot_size);
+		std::unique_ptr<ResultCache> cache;
+		if (!options.cache.empty()) cache.reset(new ResultCache(options.cache, options.cache_capacity));
+
+		int listener = TN_Listen(options.listen);
+		TN_SetNonBlocking(listener);
+		std::cout << "Serving a " << ring.slots() << " x " << ring.slotSize() << " byte ring on " << options.listen << std::endl;
+
+		size_t threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < threads; ++i) workers.emplace_back(TN_RingWorker, std::ref(ring), cache.get());
+
+		while (!stop_requested) {
+			pollfd fd = { listener, POLLIN, 0 };
+			poll(&fd, 1, 100);
+
+			int client;
+			while ((client = TN_Accept(listener)) >= 0) {
+				try {
+					TN_SendFd(client, ring.handle());
+				} catch (std::exception& e) {
+					std::cerr << "Could not hand out the ring: " << e.what() << std::endl;
+				}
+				TN_CloseSocket(client);
+			}
+			if (client == TN_ACCEPT_EXHAUSTED) {
+				std::cerr << "Could not accept: " << strerror(errno) << ", pausing for " << TN_ACCEPT_BACKOFF_MS << " ms" << std::endl;
+				std::this_thread::sleep_for(std::chrono::milliseconds(TN_ACCEPT_BACKOFF_MS));
+			}
+		}
+
+		ring.stop();
+		for (auto &t : workers) t.join();
+		TN_CloseSocket(listener);
+	} catch (std::exception& e) {
+		std::cerr << "tn-ringd: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * tn-verifyd-load: load generator for tn-verifyd.
+ *
+ * Opens --connections connections, each keeping --window requests outstanding for --duration
+ * seconds, then reports throughput and latency percentiles. --duplicates sets the percentage of
+ * requests that reuse one of a few blobs, to exercise coalescing and the result cache.
+ */
+
+#include "misc/StringTools.h"
+#include "net/Json.h"
+#include "net/Socket.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct Options {
+	std::string connect = "127.0.0.1:9860";
+	size_t connections = 4;
+	size_t window = 8;
+	double duration = 10;
+	bool verify = false;
+	size_t blob_size = 76;
+	unsigned duplicates = 0;
+};
+
+struct Worker {
+	std::vector<double> latencies_ms;
+	uint64_t errors = 0;
+};
+
+static std::string TN_RandomHex(std::mt19937_64& rng, size_t bytes) {
+	std::vector<uint8_t> data(bytes);
+	for (auto &b : data) b = (uint8_t)rng();
+	return StringTools::toHex(data.data(), data.size());
+}
+
+static void TN_LoadConnection(const Options& options, size_t index, Worker& worker) {
+	typedef std::chrono::steady_clock Clock;
+
+	std::mt19937_64 rng(index * 7919 + 1);
+	std::vector<std::string> shared;
+	for (size_t i = 0; i < 4; ++i) {
+		std::mt19937_64 shared_rng(i);
+		shared.push_back(TN_RandomHex(shared_rng, options.blob_size));
+	}
+	const std::string zero_hash(64, '0');
+
+	LineSocket socket(options.connect);
+	std::unordered_map<uint64_t, Clock::time_point> sent;
+	uint64_t next_id = 0;
+
+	auto request = [&]() {
+		std::string blob = rng() % 100 < options.duplicates ? shared[rng() % shared.size()] : TN_RandomHex(rng, options.blob_size);
+		JsonValue params = JsonValue::object().set("blob", blob);
+		if (options.verify) params.set("hash", zero_hash);
+
+		uint64_t id = next_id++;
+		JsonValue call = JsonValue::object()
+			.set("jsonrpc", "2.0")
+			.set("id", id)
+			.set("method", options.verify ? "verify_hash" : "compute_hash")
+			.set("params", params);
+		sent[id] = Clock::now();
+		socket.send(call.dump());
+	};
+
+	Clock::time_point end = Clock::now() + std::chrono::microseconds((int64_t)(options.duration * 1e6));
+	for (size_t i = 0; i < options.window; ++i) request();
+
+	std::string line;
+	while (!sent.empty() && socket.receive(line)) {
+		JsonValue response = JsonValue::parse(line);
+		auto it = sent.find(response["id"].asUInt());
+		if (it == sent.end()) throw std::runtime_error("Response to unknown request: " + line);
+
+		Clock::time_point now = Clock::now();
+		worker.latencies_ms.push_back(std::chrono::duration<double, std::milli>(now - it->second).count());
+		if (response.has("error")) worker.errors++;
+		sent.erase(it);
+
+		if (now < end) request();
+	}
+}
+
+static double TN_Percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) return 0;
+	size_t index = std::min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()));
+	return sorted[index];
+}
+
+static void TN_Usage() {
+	std::cout << "Usage: tn-verifyd-load [options]" << std::endl
+		<< "  --connect ADDRESS   host:port or unix:/path (default 127.0.0.1:9860)" << std::endl
+		<< "  --connections N     concurrent connections (default 4)" << std::endl
+		<< "  --window N          outstanding requests per connection (default 8)" << std::endl
+		<< "  --duration SECONDS  (default 10)" << std::endl
+		<< "  --method NAME       compute_hash or verify_hash (default compute_hash)" << std::endl
+		<< "  --blob-size BYTES   (default 76)" << std::endl
+		<< "  --duplicates PCT    requests reusing one of 4 shared blobs (default 0)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h") {
+				TN_Usage();
+				return 0;
+			}
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			std::string value = argv[++i];
+
+			if (arg == "--connect") options.connect = value;
+			else if (arg == "--connections") options.connections = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--window") options.window = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--duration") options.duration = StringTools::fromString<double>(value);
+			else if (arg == "--method") options.verify = value == "verify_hash";
+			else if (arg == "--blob-size") options.blob_size = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--duplicates") options.duplicates = std::min(100u, StringTools::fromString<unsigned>(value));
+			else throw std::runtime_error("Unknown option " + arg);
+		}
+
+		std::vector<Worker> workers(options.connections);
+		std::vector<std::thread> threads;
+		std::atomic<bool> failed(false);
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < options.connections; ++i) {
+			threads.emplace_back([&, i] {
+				try {
+					TN_LoadConnection(options, i, workers[i]);
+				} catch (std::exception& e) {
+					std::cerr << "Connection " << i << ": " << e.what() << std::endl;
+					failed = true;
+				}
+			});
+		}
+		for (auto &t : threads) t.join();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::vector<double> latencies;
+		uint64_t errors = 0;
+		for (auto &w : workers) {
+			latencies.insert(latencies.end(), w.latencies_ms.begin(), w.latencies_ms.end());
+			errors += w.errors;
+		}
+		std::sort(latencies.begin(), latencies.end());
+
+		std::cout << latencies.size() << " requests (" << errors << " errors) in " << seconds << "s: "
+			<< latencies.size() / seconds << " requests/s" << std::endl;
+		std::cout << "Latency ms: p50 " << TN_Percentile(latencies, 50) << ", p90 " << TN_Percentile(latencies, 90)
+			<< ", p99 " << TN_Percentile(latencies, 99) << ", max " << (latencies.empty() ? 0 : latencies.back()) << std::endl;
+
+		LineSocket socket(options.connect);
+		socket.send("{\"jsonrpc\":\"2.0\",\"id\":0,\"method\":\"stats\"}");
+		std::string line;
+		if (socket.receive(line)) std::cout << "Server stats: " << JsonValue::parse(line)["result"].dump() << std::endl;
+
+		return failed ? 1 : 0;
+	} catch (std::exception& e) {
+		std::cerr << "tn-verifyd-load: " << e.what() << std::endl;
+		return 1;
+	}
+}
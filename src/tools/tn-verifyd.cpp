@@ -0,0 +1,581 @@
+/*
+ * tn-verifyd: JSON-RPC share verification server.
+ *
+ * Newline delimited JSON-RPC 2.0 over TCP and/or Unix sockets, one request or a JSON-RPC batch
+ * array per line:
+ *   compute_hash {"blob": hex, "variant": n}             -> {"hash": hex}
+ *   verify_hash  {"blob": hex, "hash": hex, "variant": n} -> {"valid": bool}
+ *   stats                                                -> counters
+ * params may also be positional: [blob] or [blob, hash]. Requests without an id are notifications,
+ * they are carried out and counted but never answered.
+ *
+ * One I/O thread reads requests from all connections and collects them into batches, flushed
+ * when --batch calls are pending or the oldest has waited --batch-wait-us. A batch answers what
+ * it can from the result cache, hashes every distinct blob once (also joining blobs already in
+ * flight from earlier batches) and each response is sent as soon as its hash is done. Once
+ * --max-inflight calls are pending the server stops reading from sockets, so clients are slowed
+ * down by TCP flow control instead of queueing without bound.
+ */
+
+#include "TuringsNightmare.h"
+#include "cpu/TuringsNightmareCPUAsync.h"
+#include "cache/ResultCache.h"
+#include "misc/StringTools.h"
+#include "net/Json.h"
+#include "net/Socket.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define RPC_PARSE_ERROR -32700
+#define RPC_INVALID_REQUEST -32600
+#define RPC_METHOD_NOT_FOUND -32601
+#define RPC_INVALID_PARAMS -32602
+#define RPC_INTERNAL_ERROR -32603
+
+// Longest accepted request line, a JSON-RPC batch of hex blobs
+#define MAX_LINE (16 * 1024 * 1024)
+
+struct Options {
+	std::vector<std::string> listen;
+	size_t threads = 0;
+	size_t batch = 64;
+	uint64_t batch_wait_us = 200;
+	size_t max_inflight = 4096;
+	size_t max_conn_inflight = 1024;
+	std::string cache;
+	size_t cache_capacity = 256 * 1024;
+};
+
+// Responses of a JSON-RPC batch array are sent together
+struct Group {
+	JsonValue::Array responses;
+	std::vector<bool> notifications; // Calls left out of the responses
+	size_t remaining;
+};
+
+struct Call {
+	uint64_t conn;
+	JsonValue id;
+	bool notification; // No id, nothing is sent back
+	bool verify;
+	std::string blob;
+	TN_Hash expected;
+	TN_Variant variant;
+	std::shared_ptr<Group> group;
+	size_t index; // In group
+};
+
+struct Connection {
+	int fd;
+	std::string in, out;
+	size_t inflight = 0;
+	bool eof = false;
+};
+
+struct Outgoing {
+	uint64_t conn;
+	std::string line; // Empty if only notifications completed
+	size_t calls; // Completed calls the line answers
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void TN_OnSignal(int) {
+	stop_requested = 1;
+}
+
+class VerifyServer {
+public:
+	explicit VerifyServer(const Options& options) : options(options), async(new DeviceCPUAsync(options.threads, TN_QueueSize(options.max_inflight))) {
+		if (!options.cache.empty()) cache.reset(new ResultCache(options.cache, options.cache_capacity));
+
+		if (pipe(wake) != 0) throw std::runtime_error("Could not create wakeup pipe.");
+		TN_SetNonBlocking(wake[0]);
+		TN_SetNonBlocking(wake[1]);
+
+		for (auto &address : options.listen) {
+			int fd = TN_Listen(address);
+			TN_SetNonBlocking(fd);
+			listeners.push_back(fd);
+			std::cout << "Listening on " << address << std::endl;
+		}
+	}
+
+	~VerifyServer() {
+		// Finish hashing first, completions still use the members below
+		async.reset();
+
+		for (int fd : listeners) TN_CloseSocket(fd);
+		for (auto &c : connections) TN_CloseSocket(c.second.fd);
+		close(wake[0]);
+		close(wake[1]);
+	}
+
+	void run();
+
+private:
+	static size_t TN_QueueSize(size_t n) {
+		size_t size = 2;
+		while (size < n) size *= 2;
+		return size;
+	}
+
+	bool overloaded() const { return inflight >= options.max_inflight; }
+
+	void handleLine(uint64_t conn, const std::string& line);
+	void handleCall(uint64_t conn, const JsonValue& request, std::shared_ptr<Group> group, size_t index);
+	JsonValue stats();
+	void flush();
+	void onHash(const std::string& key, const TN_Hash& hash, std::exception_ptr error);
+
+	// Called with mutex held
+	void complete(const Call& call, const JsonValue& response);
+	void sendNow(uint64_t conn, const JsonValue& response);
+	void deliver();
+
+	static JsonValue result(const JsonValue& id, const JsonValue& value);
+	static JsonValue error(const JsonValue& id, int code, const std::string& message);
+
+	const Options options;
+	std::unique_ptr<DeviceCPUAsync> async;
+	std::unique_ptr<ResultCache> cache;
+
+	int wake[2];
+	std::vector<int> listeners;
+	std::map<uint64_t, Connection> connections;
+	uint64_t next_conn = 1;
+
+	std::vector<Call> pending; // Current batch
+	std::chrono::steady_clock::time_point pending_since;
+	std::chrono::steady_clock::time_point accept_paused_until; // Out of descriptors until then
+	size_t inflight = 0; // Calls read but not answered, only touched by the I/O thread
+
+	std::mutex mutex; // Guards everything below, shared with the hashing workers
+	std::unordered_map<std::string, std::vector<Call>> hashing; // Distinct blobs being hashed and the calls waiting for them
+	std::vector<Outgoing> outgoing;
+
+	uint64_t stat_requests = 0, stat_notifications = 0, stat_batches = 0, stat_batched_calls = 0, stat_hashes = 0, stat_joined = 0, stat_cached = 0;
+};
+
+JsonValue VerifyServer::result(const JsonValue& id, const JsonValue& value) {
+	return JsonValue::object().set("jsonrpc", "2.0").set("id", id).set("result", value);
+}
+
+JsonValue VerifyServer::error(const JsonValue& id, int code, const std::string& message) {
+	return JsonValue::object().set("jsonrpc", "2.0").set("id", id).set("error", JsonValue::object().set("code", code).set("message", message));
+}
+
+void VerifyServer::sendNow(uint64_t conn, const JsonValue& response) {
+	outgoing.push_back(Outgoing{ conn, response.dump(), 0 });
+}
+
+void VerifyServer::complete(const Call& call, const JsonValue& response) {
+	if (!call.group) {
+		outgoing.push_back(Outgoing{ call.conn, call.notification ? std::string() : response.dump(), 1 });
+		return;
+	}
+
+	Group& group = *call.group;
+	group.responses[call.index] = response;
+	if (--group.remaining) return;
+
+	// A batch of notifications only is not answered at all
+	JsonValue::Array responses;
+	for (size_t i = 0; i < group.responses.size(); ++i) {
+		if (!group.notifications[i]) responses.push_back(std::move(group.responses[i]));
+	}
+	outgoing.push_back(Outgoing{ call.conn, responses.empty() ? std::string() : JsonValue(responses).dump(), group.responses.size() });
+}
+
+void VerifyServer::handleLine(uint64_t conn, const std::string& line) {
+	JsonValue request;
+	try {
+		request = JsonValue::parse(line);
+	} catch (std::exception& e) {
+		std::lock_guard<std::mutex> lock(mutex);
+		sendNow(conn, error(JsonValue(), RPC_PARSE_ERROR, e.what()));
+		return;
+	}
+
+	if (!request.isArray()) {
+		handleCall(conn, request, nullptr, 0);
+		return;
+	}
+
+	if (request.size() == 0) {
+		std::lock_guard<std::mutex> lock(mutex);
+		sendNow(conn, error(JsonValue(), RPC_INVALID_REQUEST, "Empty batch"));
+		return;
+	}
+
+	auto group = std::make_shared<Group>();
+	group->responses.resize(request.size());
+	group->notifications.resize(request.size());
+	for (size_t i = 0; i < request.size(); ++i) group->notifications[i] = request[i].isObject() && !request[i].has("id");
+	group->remaining = request.size();
+	for (size_t i = 0; i < request.size(); ++i) handleCall(conn, request[i], group, i);
+}
+
+void VerifyServer::handleCall(uint64_t conn, const JsonValue& request, std::shared_ptr<Group> group, size_t index) {
+	Call call;
+	call.conn = conn;
+	call.id = request["id"];
+	call.notification = request.isObject() && !request.has("id");
+	call.group = group;
+	call.index = index;
+
+	connections[conn].inflight++;
+	inflight++;
+	stat_requests++;
+	if (call.notification) stat_notifications++;
+
+	auto fail = [&](int code, const std::string& message) {
+		std::lock_guard<std::mutex> lock(mutex);
+		complete(call, error(call.id, code, message));
+	};
+
+	try {
+		if (!request.isObject() || !request["method"].isString()) return fail(RPC_INVALID_REQUEST, "Invalid request");
+
+		const std::string& method = request["method"].asString();
+		const JsonValue& params = request["params"];
+
+		if (method == "stats") {
+			JsonValue s = stats();
+			std::lock_guard<std::mutex> lock(mutex);
+			complete(call, result(call.id, s));
+			return;
+		}
+		if (method != "compute_hash" && method != "verify_hash") return fail(RPC_METHOD_NOT_FOUND, "Method not found");
+
+		call.verify = method == "verify_hash";
+		const JsonValue& blob = params.isArray() ? params[0] : params["blob"];
+		const JsonValue& hash = params.isArray() ? params[1] : params["hash"];
+		const JsonValue& variant = params.isArray() ? JsonValue() : params["variant"];
+
+		std::vector<uint8_t> bytes;
+		if (!blob.isString() || !StringTools::fromHex(blob.asString(), bytes) || bytes.empty() || bytes.size() >= MEMORY_SIZE) {
+			return fail(RPC_INVALID_PARAMS, "blob must be a non-empty hex string");
+		}
+		call.blob.assign(bytes.begin(), bytes.end());
+
+		if (call.verify) {
+			size_t size;
+			if (!hash.isString() || !StringTools::fromHex(hash.asString(), call.expected.data(), HASH_SIZE, size) || size != HASH_SIZE) {
+				return fail(RPC_INVALID_PARAMS, "hash must be 32 bytes of hex");
+			}
+		}
+
+		call.variant = TN_VARIANT_ORIGINAL;
+		if (!variant.isNull()) {
+			// asUInt would throw on fractions, NaN never compares true
+			if (!variant.isNumber() || !(variant.asNumber() >= 0 && variant.asNumber() < _TN_VARIANT_LAST) ||
+				variant.asNumber() != std::floor(variant.asNumber())) {
+				return fail(RPC_INVALID_PARAMS, "Unknown variant");
+			}
+			call.variant = (TN_Variant)variant.asUInt();
+		}
+	} catch (std::exception& e) {
+		// Whatever slipped through answers this call instead of taking down the daemon
+		return fail(RPC_INTERNAL_ERROR, e.what());
+	}
+
+	if (pending.empty()) pending_since = std::chrono::steady_clock::now();
+	pending.push_back(std::move(call));
+	if (pending.size() >= options.batch) flush();
+}
+
+JsonValue VerifyServer::stats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	JsonValue s = JsonValue::object()
+		.set("requests", stat_requests)
+		.set("notifications", stat_notifications)
+		.set("inflight", (uint64_t)inflight)
+		.set("connections", (uint64_t)connections.size())
+		.set("batches", stat_batches)
+		.set("average_batch", stat_batches ? (double)stat_batched_calls / stat_batches : 0.0)
+		.set("hashes", stat_hashes)
+		.set("joined", stat_joined)
+		.set("cached", stat_cached);
+	if (cache) {
+		ResultCacheStats c = cache->stats();
+		s.set("cache", JsonValue::object().set("hits", c.hits).set("misses", c.misses).set("evictions", c.evictions).set("capacity", (uint64_t)c.capacity));
+	}
+	return s;
+}
+
+static std::string TN_CallKey(const Call& call) {
+	return std::string(1, (char)call.variant) + call.blob;
+}
+
+static JsonValue TN_CallResult(const Call& call, const TN_Hash& hash) {
+	if (call.verify) return JsonValue::object().set("valid", hash == call.expected);
+	return JsonValue::object().set("hash", StringTools::toHex(hash.data(), HASH_SIZE));
+}
+
+void VerifyServer::flush() {
+	std::vector<Call> batch;
+	batch.swap(pending);
+
+	std::vector<std::pair<std::string, Call>> submit;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stat_batches++;
+		stat_batched_calls += batch.size();
+
+		for (auto &call : batch) {
+			TN_Hash hash;
+			if (cache && cache->lookup(call.blob, call.variant, hash)) {
+				stat_cached++;
+				complete(call, result(call.id, TN_CallResult(call, hash)));
+				continue;
+			}
+
+			std::string key = TN_CallKey(call);
+			auto waiting = hashing.find(key);
+			if (waiting != hashing.end()) {
+				stat_joined++;
+				waiting->second.push_back(std::move(call));
+				continue;
+			}
+
+			stat_hashes++;
+			submit.emplace_back(key, call);
+			hashing[key].push_back(std::move(call));
+		}
+	}
+
+	// One batch per variant, so the states are finalized together
+	for (int v = 0; v < _TN_VARIANT_LAST; ++v) {
+		auto keys = std::make_shared<std::vector<std::string>>();
+		std::vector<std::string> blobs;
+		for (auto &s : submit) {
+			if (s.second.variant != v) continue;
+			keys->push_back(s.first);
+			blobs.push_back(s.second.blob);
+		}
+		if (blobs.empty()) continue;
+		try {
+			async->submitBatch(blobs, [this, keys](size_t index, const TN_Hash& hash, std::exception_ptr error) { onHash((*keys)[index], hash, error); },
+				(TN_Variant)v);
+		} catch (...) {
+			// Nothing of the batch was submitted, its calls fail like a failed hash
+			for (auto &key : *keys) onHash(key, TN_Hash(), std::current_exception());
+		}
+	}
+
+	deliver();
+}
+
+void VerifyServer::onHash(const std::string& key, const TN_Hash& hash, std::exception_ptr e) {
+	if (cache && !e) cache->insert(key.substr(1), (TN_Variant)key[0], hash);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto waiting = hashing.find(key);
+		for (auto &call : waiting->second) {
+			if (e) complete(call, error(call.id, RPC_INTERNAL_ERROR, "Hashing failed"));
+			else complete(call, result(call.id, TN_CallResult(call, hash)));
+		}
+		hashing.erase(waiting);
+	}
+
+	char byte = 0;
+	if (write(wake[1], &byte, 1) < 0) {
+		// Pipe full, the I/O thread is woken already
+	}
+}
+
+// Moves finished responses to their connections, on the I/O thread
+void VerifyServer::deliver() {
+	std::vector<Outgoing> done;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done.swap(outgoing);
+	}
+
+	for (auto &o : done) {
+		inflight -= o.calls;
+		auto conn = connections.find(o.conn);
+		if (conn == connections.end()) continue; // Closed meanwhile
+		conn->second.inflight -= o.calls;
+		if (o.line.empty()) continue;
+		conn->second.out += o.line;
+		conn->second.out += '\n';
+	}
+}
+
+void VerifyServer::run() {
+	std::vector<pollfd> fds;
+	std::vector<uint64_t> fd_conn;
+
+	while (!stop_requested) {
+		fds.clear();
+		fd_conn.clear();
+
+		fds.push_back(pollfd{ wake[0], POLLIN, 0 });
+		fd_conn.push_back(0);
+		bool accepting = std::chrono::steady_clock::now() >= accept_paused_until;
+		for (int fd : listeners) {
+			fds.push_back(pollfd{ fd, (short)(overloaded() || !accepting ? 0 : POLLIN), 0 });
+			fd_conn.push_back(0);
+		}
+		for (auto &c : connections) {
+			short events = 0;
+			if (!c.second.eof && !overloaded() && c.second.inflight < options.max_conn_inflight) events |= POLLIN;
+			if (!c.second.out.empty()) events |= POLLOUT;
+			fds.push_back(pollfd{ c.second.fd, events, 0 });
+			fd_conn.push_back(c.first);
+		}
+
+		// Sleep until the oldest pending call has waited long enough to be flushed, or accepting resumes
+		timespec timeout, *ptimeout = nullptr;
+		int64_t left = -1;
+		if (!pending.empty()) {
+			auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - pending_since).count();
+			left = std::max<int64_t>(0, (int64_t)options.batch_wait_us - waited);
+		}
+		if (!accepting) {
+			auto paused = std::chrono::duration_cast<std::chrono::microseconds>(accept_paused_until - std::chrono::steady_clock::now()).count();
+			left = left < 0 ? std::max<int64_t>(0, paused) : std::min<int64_t>(left, std::max<int64_t>(0, paused));
+		}
+		if (left >= 0) {
+			timeout.tv_sec = left / 1000000;
+			timeout.tv_nsec = (left % 1000000) * 1000;
+			ptimeout = &timeout;
+		}
+
+		int ready = ppoll(fds.data(), fds.size(), ptimeout, nullptr);
+		if (ready < 0 && errno != EINTR) throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
+
+		if (ready > 0) {
+			if (fds[0].revents & POLLIN) {
+				char drain[256];
+				while (read(wake[0], drain, sizeof(drain)) > 0) {}
+			}
+
+			for (size_t i = 1; i <= listeners.size(); ++i) {
+				if (!(fds[i].revents & POLLIN)) continue;
+				int fd;
+				while ((fd = TN_Accept(fds[i].fd)) >= 0) {
+					TN_SetNonBlocking(fd);
+					connections[next_conn++].fd = fd;
+				}
+				if (fd == TN_ACCEPT_EXHAUSTED) {
+					// The listener stays readable, stop polling it for a while instead of spinning
+					std::cerr << "Could not accept: " << strerror(errno) << ", pausing for " << TN_ACCEPT_BACKOFF_MS << " ms" << std::endl;
+					accept_paused_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(TN_ACCEPT_BACKOFF_MS);
+					break;
+				}
+			}
+
+			for (size_t i = 1 + listeners.size(); i < fds.size(); ++i) {
+				auto it = connections.find(fd_conn[i]);
+				Connection& c = it->second;
+				bool closed = (fds[i].revents & (POLLERR | POLLNVAL)) != 0;
+
+				if (!closed && (fds[i].revents & (POLLIN | POLLHUP))) {
+					char chunk[65536];
+					ssize_t n = recv(c.fd, chunk, sizeof(chunk), 0);
+					if (n > 0) c.in.append(chunk, n);
+					else if (n == 0) c.eof = true;
+					else if (errno != EAGAIN && errno != EINTR) closed = true;
+
+					for (size_t newline; (newline = c.in.find('\n')) != std::string::npos;) {
+						std::string line = c.in.substr(0, newline);
+						c.in.erase(0, newline + 1);
+						if (!line.empty() && line.back() == '\r') line.pop_back();
+						if (!line.empty()) handleLine(it->first, line);
+					}
+					if (c.in.size() > MAX_LINE) closed = true;
+				}
+				if (c.eof && (fds[i].revents & POLLHUP)) closed = true; // Can't answer either
+
+				if (!closed && (fds[i].revents & POLLOUT)) {
+					ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+					if (n > 0) c.out.erase(0, n);
+					else if (n < 0 && errno != EAGAIN && errno != EINTR) closed = true;
+				}
+
+				// A client that finished sending still gets its outstanding answers
+				if (closed || (c.eof && c.inflight == 0 && c.out.empty())) {
+					TN_CloseSocket(c.fd);
+					connections.erase(it);
+				}
+			}
+		}
+
+		if (!pending.empty()) {
+			auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - pending_since).count();
+			if ((uint64_t)waited >= options.batch_wait_us) flush();
+		}
+		deliver();
+	}
+}
+
+static void TN_Usage() {
+	std::cout << "Usage: tn-verifyd [options]" << std::endl
+		<< "  --listen ADDRESS        host:port or unix:/path, may be repeated (default 127.0.0.1:9860)" << std::endl
+		<< "  --threads N             hashing threads, 0 for all hardware threads (default 0)" << std::endl
+		<< "  --batch N               calls per batch (default 64)" << std::endl
+		<< "  --batch-wait-us N       longest a call waits for its batch to fill (default 200)" << std::endl
+		<< "  --max-inflight N        stop reading requests beyond this many pending calls (default 4096)" << std::endl
+		<< "  --max-conn-inflight N   same, per connection (default 1024)" << std::endl
+		<< "  --cache PATH            persistent result cache file" << std::endl
+		<< "  --cache-capacity N      cache entries (default 262144)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "--help" || arg == "-h") {
+				TN_Usage();
+				return 0;
+			}
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			std::string value = argv[++i];
+
+			if (arg == "--listen") options.listen.push_back(value);
+			else if (arg == "--threads") options.threads = StringTools::fromString<size_t>(value);
+			else if (arg == "--batch") options.batch = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--batch-wait-us") options.batch_wait_us = StringTools::fromString<uint64_t>(value);
+			else if (arg == "--max-inflight") options.max_inflight = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--max-conn-inflight") options.max_conn_inflight = std::max<size_t>(1, StringTools::fromString<size_t>(value));
+			else if (arg == "--cache") options.cache = value;
+			else if (arg == "--cache-capacity") options.cache_capacity = StringTools::fromString<size_t>(value);
+			else throw std::runtime_error("Unknown option " + arg);
+		}
+		if (options.listen.empty()) options.listen.push_back("127.0.0.1:9860");
+
+		signal(SIGINT, TN_OnSignal);
+		signal(SIGTERM, TN_OnSignal);
+		signal(SIGPIPE, SIG_IGN);
+
+		VerifyServer server(options);
+		server.run();
+	} catch (std::exception& e) {
+		std::cerr << "tn-verifyd: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}